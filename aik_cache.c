@@ -0,0 +1,256 @@
+/*
+ * Cache decoded public AIKs for repeated verifications.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_OPENSSL_RSA_LIB
+#include <dirent.h>
+#include <openssl/sha.h>
+
+#define BLOBSIZE (1 << 10)
+
+/* An entry is on a hash chain and on a list ordered by last use. */
+struct aik_entry {
+  BYTE digest[SHA_DIGEST_LENGTH]; /* SHA-1 of the DER encoded key */
+  BYTE *blob;			/* Decoded TPM_PUBKEY */
+  UINT32 blobLen;
+  struct pubkey *key;		/* Key prepared for verification */
+  struct aik_entry *next;	/* Hash chain */
+  struct aik_entry *newer;
+  struct aik_entry *older;
+};
+
+struct aik_cache {
+  struct aik_entry **buckets;
+  size_t mask;			/* Number of buckets less one */
+  size_t limit;			/* Most entries held */
+  struct aik_entry *newest;
+  struct aik_entry *oldest;
+  struct aik_cache_stats stats;
+};
+
+/* Creates a cache that holds at most limit keys. */
+struct aik_cache *aik_cache_new(size_t limit)
+{
+  if (limit == 0)
+    limit = 1;
+  size_t nbuckets = 16;		/* Keep load factor under one */
+  while (nbuckets < limit)
+    nbuckets <<= 1;
+  struct aik_cache *cache = calloc(1, sizeof *cache);
+  if (!cache)
+    return NULL;
+  cache->buckets = calloc(nbuckets, sizeof *cache->buckets);
+  if (!cache->buckets) {
+    free(cache);
+    return NULL;
+  }
+  cache->mask = nbuckets - 1;
+  cache->limit = limit;
+  return cache;
+}
+
+static void entry_free(struct aik_entry *e)
+{
+  pubkey_free(e->key);
+  free(e->blob);
+  free(e);
+}
+
+void aik_cache_free(struct aik_cache *cache)
+{
+  if (!cache)
+    return;
+  struct aik_entry *e = cache->newest;
+  while (e) {
+    struct aik_entry *older = e->older;
+    entry_free(e);
+    e = older;
+  }
+  free(cache->buckets);
+  free(cache);
+}
+
+/* The digest is uniformly distributed, so its prefix is a hash. */
+static struct aik_entry **bucket(struct aik_cache *cache, BYTE *digest)
+{
+  size_t h;
+  memcpy(&h, digest, sizeof h);
+  return &cache->buckets[h & cache->mask];
+}
+
+static void unlink_lru(struct aik_cache *cache, struct aik_entry *e)
+{
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    cache->newest = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    cache->oldest = e->newer;
+}
+
+static void push_lru(struct aik_cache *cache, struct aik_entry *e)
+{
+  e->newer = NULL;
+  e->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = e;
+  else
+    cache->oldest = e;
+  cache->newest = e;
+}
+
+static void evict(struct aik_cache *cache)
+{
+  struct aik_entry *e = cache->oldest;
+  struct aik_entry **p = bucket(cache, e->digest);
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  unlink_lru(cache, e);
+  entry_free(e);
+  cache->stats.entries--;
+  cache->stats.evictions++;
+}
+
+/* Returns the prepared key for a DER encoded public AIK, decoding it
+   on a miss, and optionally its TPM_PUBKEY blob.  The results remain
+   valid until the next lookup.  Returns NULL on error. */
+struct pubkey *aik_cache_lookup(struct aik_cache *cache,
+				BYTE *der, UINT32 derLen,
+				BYTE **blob, UINT32 *blobLen)
+{
+  BYTE digest[SHA_DIGEST_LENGTH];
+  SHA1(der, derLen, digest);
+  struct aik_entry **head = bucket(cache, digest);
+  struct aik_entry *e;
+  for (e = *head; e; e = e->next)
+    if (!memcmp(e->digest, digest, sizeof digest))
+      break;
+
+  if (e) {
+    cache->stats.hits++;
+    if (cache->newest != e) {
+      unlink_lru(cache, e);
+      push_lru(cache, e);
+    }
+  }
+  else {
+    cache->stats.misses++;
+    BYTE buf[BLOBSIZE];
+    UINT32 bufLen = sizeof buf;
+    if (pubkey_decode(der, derLen, buf, &bufLen))
+      return NULL;
+    e = calloc(1, sizeof *e);
+    if (!e || !(e->blob = malloc(bufLen))) {
+      free(e);
+      fprintf(stderr, "Out of memory\n");
+      return NULL;
+    }
+    memcpy(e->blob, buf, bufLen);
+    e->blobLen = bufLen;
+    e->key = pubkey_new(buf, bufLen);
+    if (!e->key) {
+      entry_free(e);
+      return NULL;
+    }
+    memcpy(e->digest, digest, sizeof digest);
+    if (cache->stats.entries >= cache->limit)
+      evict(cache);
+    head = bucket(cache, digest);
+    e->next = *head;
+    *head = e;
+    push_lru(cache, e);
+    cache->stats.entries++;
+  }
+
+  if (blob)
+    *blob = e->blob;
+  if (blobLen)
+    *blobLen = e->blobLen;
+  return e->key;
+}
+
+/* Loads every DER encoded public key file in a directory.  Returns
+   the number of files that could not be loaded. */
+int aik_cache_preload(struct aik_cache *cache, const char *dirname)
+{
+  DIR *dir = opendir(dirname);
+  if (!dir) {
+    fprintf(stderr, "Cannot open directory %s\n", dirname);
+    return 1;
+  }
+  int failed = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (*ent->d_name == '.')	/* Skip hidden files, . and .. */
+      continue;
+    char name[FILENAME_MAX];
+    snprintf(name, sizeof name, "%s/%s", dirname, ent->d_name);
+    BYTE der[BLOBSIZE];
+    UINT32 derLen;
+    if (file_read(name, der, sizeof der, &derLen)
+	|| !aik_cache_lookup(cache, der, derLen, NULL, NULL)) {
+      fprintf(stderr, "Cannot load public key %s\n", name);
+      failed++;
+    }
+  }
+  closedir(dir);
+  /* Preloading is not a use of the cache */
+  cache->stats.hits = cache->stats.misses = 0;
+  return failed;
+}
+
+void aik_cache_get_stats(struct aik_cache *cache,
+			 struct aik_cache_stats *stats)
+{
+  *stats = cache->stats;
+}
+
+#else
+
+struct aik_cache *aik_cache_new(size_t limit)
+{
+  fprintf(stderr, "Public key cache not available\n");
+  return NULL;			/* Always fail without OpenSSL */
+}
+
+void aik_cache_free(struct aik_cache *cache)
+{
+}
+
+struct pubkey *aik_cache_lookup(struct aik_cache *cache,
+				BYTE *der, UINT32 derLen,
+				BYTE **blob, UINT32 *blobLen)
+{
+  return NULL;
+}
+
+int aik_cache_preload(struct aik_cache *cache, const char *dirname)
+{
+  return 1;
+}
+
+void aik_cache_get_stats(struct aik_cache *cache,
+			 struct aik_cache_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+}
+
+#endif
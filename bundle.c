@@ -0,0 +1,132 @@
+/*
+ * Encode and decode quote bundles.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* A bundle holds the pieces of one attestation, which otherwise are
+   separate uuid, nonce, quote, hash and pcrvals files.  Numbers are
+   big-endian.  A bundle is
+
+     header:   "TQBN", version, length of the bundle, number of sections
+     sections: type, length, data
+
+   where the length of the bundle includes its header.  Sections of
+   unknown types are skipped, so later versions can add sections.
+   Since each bundle carries its length, bundles can be concatenated
+   into one file, and a reader finds each bundle and each section by
+   walking the lengths, without copying any data. */
+
+#define MAGIC "TQBN"
+#define BUNDLEVERSION 1
+#define HEADERSIZE 16
+#define SECTIONSIZE 8		/* Section type and length */
+
+static UINT32 get_uint32(const BYTE *p)
+{
+  return (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3];
+}
+
+static void put_uint32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* Makes a bundle of the sections present in b.  Returns a malloc'd
+   buffer, or NULL on error. */
+BYTE *bundle_encode(const struct bundle *b, UINT32 *len)
+{
+  UINT32 size = HEADERSIZE, nsections = 0;
+  unsigned i;
+  for (i = 1; i < BUNDLE_NSECTIONS; i++)
+    if (b->data[i]) {
+      size += SECTIONSIZE + b->len[i];
+      nsections++;
+    }
+  BYTE *buf = malloc(size);
+  if (!buf) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  memcpy(buf, MAGIC, 4);
+  put_uint32(buf + 4, BUNDLEVERSION);
+  put_uint32(buf + 8, size);
+  put_uint32(buf + 12, nsections);
+  BYTE *p = buf + HEADERSIZE;
+  for (i = 1; i < BUNDLE_NSECTIONS; i++)
+    if (b->data[i]) {
+      put_uint32(p, i);
+      put_uint32(p + 4, b->len[i]);
+      memcpy(p + SECTIONSIZE, b->data[i], b->len[i]);
+      p += SECTIONSIZE + b->len[i];
+    }
+  *len = size;
+  return buf;
+}
+
+/* Finds the sections of the bundle at the start of buf, which holds
+   len bytes.  The sections point into buf, and absent ones are
+   NULL.  Sets used to the length of the bundle, where the next one
+   starts.  Returns nonzero when buf does not start with a well-formed
+   bundle. */
+int bundle_parse(BYTE *buf, size_t len, struct bundle *b, size_t *used)
+{
+  memset(b, 0, sizeof *b);
+  if (len < HEADERSIZE || memcmp(buf, MAGIC, 4)) {
+    fprintf(stderr, "Not a quote bundle\n");
+    return 1;
+  }
+  if (get_uint32(buf + 4) != BUNDLEVERSION) {
+    fprintf(stderr, "Unsupported quote bundle version %u\n",
+	    get_uint32(buf + 4));
+    return 1;
+  }
+  UINT32 size = get_uint32(buf + 8);
+  UINT32 nsections = get_uint32(buf + 12);
+  if (size < HEADERSIZE || size > len) {
+    fprintf(stderr, "Truncated quote bundle\n");
+    return 1;
+  }
+  BYTE *p = buf + HEADERSIZE, *end = buf + size;
+  UINT32 i;
+  for (i = 0; i < nsections; i++) {
+    if (end - p < SECTIONSIZE
+	|| (UINT32)(end - p - SECTIONSIZE) < get_uint32(p + 4)) {
+      fprintf(stderr, "Quote bundle section overruns the bundle\n");
+      return 1;
+    }
+    UINT32 type = get_uint32(p), slen = get_uint32(p + 4);
+    if (type > 0 && type < BUNDLE_NSECTIONS) {
+      if (b->data[type]) {
+	fprintf(stderr, "Duplicate quote bundle section %u\n", type);
+	return 1;
+      }
+      b->data[type] = p + SECTIONSIZE;
+      b->len[type] = slen;
+    }
+    p += SECTIONSIZE + slen;
+  }
+  if (p != end) {
+    fprintf(stderr, "Quote bundle length mismatch\n");
+    return 1;
+  }
+  *used = size;
+  return 0;
+}
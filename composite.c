@@ -0,0 +1,289 @@
+/*
+ * Compute PCR composite hashes, reusing the work shared with the
+ * previous one.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* Checks that the selection in pv fits in selectSize bytes. */
+static int check_select(const struct pcrvals *pv, UINT16 selectSize)
+{
+  if (selectSize > PCRVALS_SELECTSIZE) {
+    fprintf(stderr, "Cannot handle the selection size of %u\n",
+	    selectSize);
+    return 1;
+  }
+  UINT32 i;
+  for (i = selectSize; i < PCRVALS_SELECTSIZE; i++)
+    if (pv->select[i]) {
+      fprintf(stderr, "Specified PCRs exceed supported PCRs in hash\n");
+      return 1;
+    }
+  return 0;
+}
+
+#if defined HAVE_OPENSSL_RSA_LIB
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+/* The composite hash is the SHA-1 of a TPM_PCR_COMPOSITE: the
+   selection, the size of the values, and the selected values in
+   increasing PCR order.  Hashes computed one after another often
+   differ only in the last few values, so the builder keeps a copy of
+   the SHA-1 state after each piece, and resumes from the longest
+   prefix shared with the previous hash. */
+
+#define AFTER_SELECT 0		/* State after the selection */
+#define AFTER_SIZE 1		/* State after the size of the values */
+#define AFTER(k) (AFTER_SIZE + (k)) /* State after k values */
+
+struct composite {
+  int valid;			/* Non-zero once a hash is computed */
+  UINT16 selectSize;
+  BYTE select[PCRVALS_SELECTSIZE];
+  BYTE value[PCRVALS_NPCRS][PCRVALS_VALUESIZE]; /* Values in order */
+  SHA_CTX state[AFTER(PCRVALS_NPCRS) + 1];
+  BYTE digest[PCRVALS_VALUESIZE];
+  struct composite_stats stats;
+};
+
+struct composite *composite_new(void)
+{
+  struct composite *c = calloc(1, sizeof *c);
+  if (!c)
+    fprintf(stderr, "Out of memory\n");
+  return c;
+}
+
+void composite_free(struct composite *c)
+{
+  free(c);
+}
+
+/* Computes the composite hash of the values selected in pv, using
+   the first selectSize bytes of its selection. */
+int composite_hash(struct composite *c, const struct pcrvals *pv,
+		   UINT16 selectSize, BYTE *digest)
+{
+  if (check_select(pv, selectSize))
+    return 1;
+
+  /* Values in the order they are hashed */
+  const BYTE *value[PCRVALS_NPCRS];
+  UINT32 i, n = 0;
+  for (i = 0; i < 8 * selectSize; i++)
+    if (pv->select[i / 8] & 1 << (i % 8))
+      value[n++] = pv->value[i];
+
+  c->stats.hashes++;
+  UINT32 k = 0;			/* Values shared with the last hash */
+  if (c->valid && c->selectSize == selectSize
+      && !memcmp(c->select, pv->select, selectSize)) {
+    for (; k < n; k++)
+      if (memcmp(c->value[k], value[k], PCRVALS_VALUESIZE))
+	break;
+    c->stats.resumed += k;
+    if (k == n) {
+      memcpy(digest, c->digest, sizeof c->digest);
+      return 0;
+    }
+  }
+  else {
+    BYTE header[2 + PCRVALS_SELECTSIZE + 4];
+    UINT32 size = n * PCRVALS_VALUESIZE;
+    header[0] = selectSize >> 8;
+    header[1] = selectSize;
+    memcpy(header + 2, pv->select, selectSize);
+    SHA1_Init(&c->state[AFTER_SELECT]);
+    SHA1_Update(&c->state[AFTER_SELECT], header, 2 + selectSize);
+    c->state[AFTER_SIZE] = c->state[AFTER_SELECT];
+    header[0] = size >> 24;
+    header[1] = size >> 16;
+    header[2] = size >> 8;
+    header[3] = size;
+    SHA1_Update(&c->state[AFTER_SIZE], header, 4);
+    c->selectSize = selectSize;
+    memset(c->select, 0, sizeof c->select);
+    memcpy(c->select, pv->select, selectSize);
+    c->valid = 1;
+  }
+
+  /* Hash the values that differ, keeping the state after each */
+  for (i = k; i < n; i++) {
+    c->state[AFTER(i + 1)] = c->state[AFTER(i)];
+    SHA1_Update(&c->state[AFTER(i + 1)], value[i], PCRVALS_VALUESIZE);
+    memcpy(c->value[i], value[i], PCRVALS_VALUESIZE);
+  }
+  c->stats.values += n - k;
+  SHA_CTX final = c->state[AFTER(n)];
+  SHA1_Final(c->digest, &final);
+  memcpy(digest, c->digest, sizeof c->digest);
+  return 0;
+}
+
+void composite_get_stats(struct composite *c, struct composite_stats *stats)
+{
+  *stats = c->stats;
+}
+
+#else
+
+struct composite *composite_new(void)
+{
+  fprintf(stderr, "Composite hashes require OpenSSL.\n");
+  return NULL;
+}
+
+void composite_free(struct composite *c)
+{
+}
+
+int composite_hash(struct composite *c, const struct pcrvals *pv,
+		   UINT16 selectSize, BYTE *digest)
+{
+  return 1;
+}
+
+void composite_get_stats(struct composite *c, struct composite_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+}
+
+#endif
+
+/* Offsets in a TPM_QUOTE_INFO2 blob */
+#define QI2_SELECTSIZE 26	/* After the tag, fixed and nonce */
+#define QI2_SELECT 28
+
+/* Finds the selection size of the quote info of a quote or a quote
+   2, where its composite hash is, and for a quote 2, where its
+   selection is. */
+static int info_layout(const BYTE *info, UINT32 infoLen,
+		       UINT16 *selectSize, UINT32 *select, UINT32 *digest)
+{
+  if (infoLen >= sizeof(TPM_QUOTE_INFO)
+      && !memcmp(info + 4, "QUOT", 4)) {
+    *selectSize = 2;		/* Set only select size */
+    *select = 0;
+    *digest = infoLen - PCRVALS_VALUESIZE - sizeof(TPM_NONCE);
+    return 0;
+  }
+  if (infoLen >= QI2_SELECT && !memcmp(info + 2, "QUT2", 4)) {
+    *selectSize = info[QI2_SELECTSIZE] << 8 | info[QI2_SELECTSIZE + 1];
+    *select = QI2_SELECT;
+    *digest = QI2_SELECT + *selectSize + 1; /* After the locality */
+    if (*digest + PCRVALS_VALUESIZE <= infoLen)
+      return 0;
+  }
+  return 1;
+}
+
+/* Gets the selection size of the quote info of a quote or a quote 2.
+   Returns nonzero when it is neither. */
+int quote_info_select_size(const BYTE *info, UINT32 infoLen,
+			   UINT16 *selectSize)
+{
+  UINT32 select, digest;
+  return info_layout(info, infoLen, selectSize, &select, &digest);
+}
+
+/* Updates the quote info of a quote or a quote 2, as read from an
+   old hash, with new PCR values.  A quote 2 also gets the new
+   selection. */
+int quote_info_update(BYTE *info, UINT32 infoLen, struct composite *c,
+		      const struct pcrvals *pv)
+{
+  UINT16 selectSize;
+  UINT32 select, digest;
+  if (info_layout(info, infoLen, &selectSize, &select, &digest)) {
+    fprintf(stderr, "Hash format error\n");
+    return 1;
+  }
+  if (composite_hash(c, pv, selectSize, info + digest))
+    return 1;
+  if (select)
+    memcpy(info + select, pv->select, selectSize);
+  return 0;
+}
+
+/* The largest TPM_PCR_COMPOSITE: the selection, the size of the
+   values, and the values. */
+#define COMPOSITESIZE \
+  (2 + PCRVALS_SELECTSIZE + 4 + PCRVALS_NPCRS * PCRVALS_VALUESIZE)
+
+/* Lays out the TPM_PCR_COMPOSITE of the values selected in pv, and
+   returns its length. */
+static UINT32 composite_layout(BYTE *buf, const struct pcrvals *pv,
+			       UINT16 selectSize)
+{
+  UINT32 i, len = 2 + selectSize + 4;
+  buf[0] = selectSize >> 8;
+  buf[1] = selectSize;
+  memcpy(buf + 2, pv->select, selectSize);
+  for (i = 0; i < 8 * selectSize; i++)
+    if (pv->select[i / 8] & 1 << (i % 8)) {
+      memcpy(buf + len, pv->value[i], PCRVALS_VALUESIZE);
+      len += PCRVALS_VALUESIZE;
+    }
+  UINT32 size = len - (2 + selectSize + 4);
+  buf[2 + selectSize] = size >> 24;
+  buf[2 + selectSize + 1] = size >> 16;
+  buf[2 + selectSize + 2] = size >> 8;
+  buf[2 + selectSize + 3] = size;
+  return len;
+}
+
+/* Updates n copies of the same quote info, each with its own PCR
+   values, as quote_info_update does.  The composite hashes are
+   computed together by sha1_multi, which pays off when the values
+   share nothing a composite hash builder could resume from.  Sets
+   result[i] to nonzero when info[i] could not be updated, and returns
+   nonzero when any could not. */
+int quote_info_update_multi(BYTE **info, UINT32 infoLen,
+			    const struct pcrvals **pv, size_t n, int *result)
+{
+  UINT16 selectSize;
+  UINT32 select, digest;
+  size_t i;
+  if (info_layout(info[0], infoLen, &selectSize, &select, &digest)) {
+    fprintf(stderr, "Hash format error\n");
+    for (i = 0; i < n; i++)
+      result[i] = 1;
+    return 1;
+  }
+  int bad = 0;
+  size_t done;
+  for (done = 0; done < n; done += SHA1_LANES) {
+    BYTE buf[SHA1_LANES][COMPOSITESIZE];
+    struct sha1_msg msgs[SHA1_LANES];
+    size_t m = 0;
+    for (i = done; i < n && i < done + SHA1_LANES; i++) {
+      result[i] = check_select(pv[i], selectSize);
+      if (result[i]) {
+	bad = 1;
+	continue;
+      }
+      msgs[m].data = buf[m];
+      msgs[m].len = composite_layout(buf[m], pv[i], selectSize);
+      msgs[m].digest = info[i] + digest;
+      m++;
+      if (select)
+	memcpy(info[i] + select, pv[i]->select, selectSize);
+    }
+    sha1_multi(msgs, m);
+  }
+  return bad;
+}
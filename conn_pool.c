@@ -0,0 +1,398 @@
+/*
+ * Keep connected TSS contexts for remote hosts.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_PTHREAD_H && defined HAVE_ICONV_H
+#include <time.h>
+#include <pthread.h>
+
+#define NBUCKETS 256		/* Hash buckets for host names */
+
+/* A connected context.  While checked out, a connection holds a
+   reference to its pool, so that it can be returned after the pool
+   is freed. */
+struct conn {
+  struct conn_host *host;
+  TSS_HCONTEXT hContext;
+  time_t used;			/* When last returned to the pool */
+  struct conn *next;		/* On its host's idle list */
+};
+
+/* The idle connections to one host, most recently used first. */
+struct conn_host {
+  char *name;
+  TSS_UNICODE *wname;		/* Name as given to the TSS */
+  struct conn *idle;
+  struct conn_host *next;	/* Hash chain */
+};
+
+struct conn_pool {
+  pthread_mutex_t lock;
+  unsigned refs;		/* The owner and checked out connections */
+  int closing;			/* Freed by its owner */
+  unsigned idle;		/* Seconds before closing an idle context */
+  unsigned check;		/* Seconds idle before a health check */
+  time_t swept;			/* When idle contexts were last closed */
+  struct conn_host *buckets[NBUCKETS];
+  struct conn_pool_stats stats;
+};
+
+static time_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static unsigned hash(const char *s)
+{
+  unsigned h = 5381;
+  while (*s)
+    h = h * 33 + (unsigned char)*s++;
+  return h % NBUCKETS;
+}
+
+/* Creates a pool that closes contexts left idle for idle seconds,
+   and checks the health of contexts idle for check seconds before
+   handing them out. */
+struct conn_pool *conn_pool_new(unsigned idle, unsigned check)
+{
+  struct conn_pool *pool = calloc(1, sizeof *pool);
+  if (!pool)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->refs = 1;
+  pool->idle = idle;
+  pool->check = check;
+  pool->swept = now();
+  return pool;
+}
+
+static int connect_host(struct conn_host *host, TSS_HCONTEXT *hContext)
+{
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, hContext);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+  rc = TRACE(Tspi_Context_Connect, *hContext, host->wname);
+  if (rc != TSS_SUCCESS)
+    return tidy(*hContext, tss_err(rc, "connecting"));
+  return 0;
+}
+
+/* Makes a cheap round trip to the host's TSS core services.  Returns
+   nonzero only when the connection has been lost. */
+static int lost(TSS_HCONTEXT hContext)
+{
+  TSS_HTPM hTPM;
+  TSS_RESULT rc = TRACE(Tspi_Context_GetTpmObject, hContext, &hTPM);
+  if (rc == TSS_SUCCESS) {
+    UINT32 len;
+    BYTE *version;
+    rc = TRACE(Tspi_TPM_GetCapability, hTPM, TSS_TPMCAP_VERSION, 0, NULL,
+	       &len, &version);
+    if (rc == TSS_SUCCESS)
+      Tspi_Context_FreeMemory(hContext, version);
+  }
+  return tss_connection_lost(rc);
+}
+
+/* Replaces a lost context.  Returns nonzero when the host cannot be
+   reached, in which case the old context is closed. */
+static int reconnect(struct conn_pool *pool, struct conn *conn)
+{
+  tidy(conn->hContext, 0);
+  int rc = connect_host(conn->host, &conn->hContext);
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.reconnects++;
+  pthread_mutex_unlock(&pool->lock);
+  return rc;
+}
+
+/* Frees a connection that is not on an idle list.  Call with the
+   lock held. */
+static void conn_close(struct conn_pool *pool, struct conn *conn)
+{
+  tidy(conn->hContext, 0);
+  free(conn);
+  pool->stats.live--;
+}
+
+/* Removes the contexts left idle too long, and returns them for
+   closing once the lock is released.  Call with the lock held. */
+static struct conn *sweep(struct conn_pool *pool, time_t t)
+{
+  struct conn *stale = NULL;
+  pool->swept = t;
+  unsigned i;
+  for (i = 0; i < NBUCKETS; i++) {
+    struct conn_host *host;
+    for (host = pool->buckets[i]; host; host = host->next) {
+      struct conn **p = &host->idle;
+      while (*p && t - (*p)->used < pool->idle)
+	p = &(*p)->next;
+      while (*p) {		/* The rest are older */
+	struct conn *conn = *p;
+	*p = conn->next;
+	conn->next = stale;
+	stale = conn;
+	pool->stats.live--;
+	pool->stats.evictions++;
+      }
+    }
+  }
+  return stale;
+}
+
+static void close_all(struct conn *conn)
+{
+  while (conn) {
+    struct conn *next = conn->next;
+    tidy(conn->hContext, 0);
+    free(conn);
+    conn = next;
+  }
+}
+
+static struct conn_host *find_host(struct conn_pool *pool, const char *name)
+{
+  struct conn_host **head = &pool->buckets[hash(name)];
+  struct conn_host *host;
+  for (host = *head; host; host = host->next)
+    if (!strcmp(host->name, name))
+      return host;
+  host = calloc(1, sizeof *host);
+  if (!host || !(host->name = strdup(name))) {
+    free(host);
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  host->wname = (TSS_UNICODE *)toutf16le(host->name);
+  if (!host->wname) {
+    fprintf(stderr, "Cannot convert %s to UTF-16LE\n", name);
+    free(host->name);
+    free(host);
+    return NULL;
+  }
+  host->next = *head;
+  *head = host;
+  return host;
+}
+
+/* Checks out a connected context for a host, connecting when no idle
+   one is available.  Returns NULL on error. */
+struct conn *conn_pool_get(struct conn_pool *pool, const char *name)
+{
+  time_t t = now();
+  pthread_mutex_lock(&pool->lock);
+  struct conn *stale = t != pool->swept ? sweep(pool, t) : NULL;
+  struct conn_host *host = find_host(pool, name);
+  if (!host) {
+    pthread_mutex_unlock(&pool->lock);
+    close_all(stale);
+    return NULL;
+  }
+  struct conn *conn = host->idle;
+  if (conn) {
+    host->idle = conn->next;
+    pool->stats.hits++;
+  }
+  else {
+    conn = calloc(1, sizeof *conn);
+    if (!conn) {
+      pthread_mutex_unlock(&pool->lock);
+      close_all(stale);
+      fprintf(stderr, "Out of memory\n");
+      return NULL;
+    }
+    conn->host = host;
+    pool->stats.misses++;
+  }
+  pool->refs++;
+  pthread_mutex_unlock(&pool->lock);
+  close_all(stale);
+
+  /* Connect or check outside the lock, as both are round trips */
+  int fresh = !conn->hContext;
+  int failed;
+  if (fresh)
+    failed = connect_host(host, &conn->hContext);
+  else if (t - conn->used >= pool->check && lost(conn->hContext))
+    failed = reconnect(pool, conn);
+  else
+    failed = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  if (failed) {
+    free(conn);
+    pool->refs--;
+    if (!fresh)
+      pool->stats.live--;
+  }
+  else if (fresh)
+    pool->stats.live++;
+  pthread_mutex_unlock(&pool->lock);
+  return failed ? NULL : conn;
+}
+
+TSS_HCONTEXT conn_context(struct conn *conn)
+{
+  return conn->hContext;
+}
+
+static void pool_destroy(struct conn_pool *pool)
+{
+  unsigned i;
+  for (i = 0; i < NBUCKETS; i++) {
+    struct conn_host *host = pool->buckets[i];
+    while (host) {
+      struct conn_host *next = host->next;
+      while (host->idle) {
+	struct conn *conn = host->idle;
+	host->idle = conn->next;
+	conn_close(pool, conn);
+      }
+      free(host->wname);
+      free(host->name);
+      free(host);
+      host = next;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/* Returns a context to the pool.  When the caller's use of it failed,
+   its connection is checked, and replaced if lost.  The caller must
+   free any objects it created in the context. */
+void conn_pool_put(struct conn_pool *pool, struct conn *conn, int failed)
+{
+  if (failed && lost(conn->hContext) && reconnect(pool, conn)) {
+    pthread_mutex_lock(&pool->lock);
+    free(conn);
+    pool->stats.live--;
+  }
+  else {
+    conn->used = now();
+    pthread_mutex_lock(&pool->lock);
+    if (pool->closing)
+      conn_close(pool, conn);
+    else {
+      conn->next = conn->host->idle;
+      conn->host->idle = conn;
+    }
+  }
+  if (--pool->refs == 0)
+    pool_destroy(pool);
+  else
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Closes the contexts left idle too long.  Contexts are also closed
+   as the pool is used. */
+void conn_pool_evict(struct conn_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  struct conn *stale = sweep(pool, now());
+  pthread_mutex_unlock(&pool->lock);
+  close_all(stale);
+}
+
+void conn_pool_get_stats(struct conn_pool *pool,
+			 struct conn_pool_stats *stats)
+{
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Keeps a pool from being destroyed when its owner frees it, until
+   the matching conn_pool_release. */
+void conn_pool_hold(struct conn_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->refs++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void conn_pool_release(struct conn_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (--pool->refs == 0)
+    pool_destroy(pool);
+  else
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Closes the idle contexts.  Contexts still checked out are closed
+   when they are returned. */
+void conn_pool_free(struct conn_pool *pool)
+{
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->closing = 1;
+  pthread_mutex_unlock(&pool->lock);
+  conn_pool_release(pool);
+}
+
+#else
+
+struct conn_pool *conn_pool_new(unsigned idle, unsigned check)
+{
+  fprintf(stderr, "Connection pools not supported on this platform.\n");
+  return NULL;
+}
+
+struct conn *conn_pool_get(struct conn_pool *pool, const char *name)
+{
+  return NULL;
+}
+
+TSS_HCONTEXT conn_context(struct conn *conn)
+{
+  return 0;
+}
+
+void conn_pool_put(struct conn_pool *pool, struct conn *conn, int failed)
+{
+}
+
+void conn_pool_evict(struct conn_pool *pool)
+{
+}
+
+void conn_pool_get_stats(struct conn_pool *pool,
+			 struct conn_pool_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+}
+
+void conn_pool_hold(struct conn_pool *pool)
+{
+}
+
+void conn_pool_release(struct conn_pool *pool)
+{
+}
+
+void conn_pool_free(struct conn_pool *pool)
+{
+}
+
+#endif
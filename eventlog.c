@@ -0,0 +1,326 @@
+/*
+ * Read measurement logs and replay them into PCR values.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* The firmware log, binary_bios_measurements, is a sequence of
+
+     PCR index, event type, SHA-1 digest, event size, event data
+
+   and IMA's binary_runtime_measurements is a sequence of
+
+     PCR index, template hash, template name size, template name,
+     template data size, template data
+
+   where the sizes are four bytes.  The legacy "ima" template has no
+   data size, its data being a file digest, a name size and a name.
+   Numbers are little-endian, as IMA writes them on x86, or anywhere
+   with ima_canonical_fmt.  Logs hold millions of events, so they are
+   read one event at a time into a buffer that grows only when an
+   event is larger than any before it. */
+
+#define EV_NO_ACTION 3		/* BIOS events that extend nothing */
+#define SPECID "Spec ID Event03"	/* Starts a crypto agile log */
+#define TEMPLATESIZE 16		/* Longest IMA template name, plus one */
+#define IMA_TEMPLATE "ima"
+#define MAXDATA (1 << 24)	/* Larger events are taken as garbage */
+
+struct eventlog_reader {
+  FILE *in;
+  const char *name;		/* Used in error messages */
+  enum eventlog_format format;
+  unsigned long nevents;	/* Events returned so far */
+  char template[TEMPLATESIZE];
+  BYTE *data;
+  size_t size;			/* Space at data */
+};
+
+struct eventlog_reader *eventlog_reader_new(FILE *in, const char *name,
+					    enum eventlog_format format)
+{
+  struct eventlog_reader *r = calloc(1, sizeof *r);
+  if (!r) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  r->in = in;
+  r->name = name;
+  r->format = format;
+  return r;
+}
+
+void eventlog_reader_free(struct eventlog_reader *r)
+{
+  if (r) {
+    free(r->data);
+    free(r);
+  }
+}
+
+static UINT32 get_le32(const BYTE *p)
+{
+  return (UINT32)p[3] << 24 | (UINT32)p[2] << 16
+    | (UINT32)p[1] << 8 | (UINT32)p[0];
+}
+
+/* Reads n bytes.  Returns -1 when the input ends before the first
+   byte and at_start is set, since that is the end of the log. */
+static int get(struct eventlog_reader *r, void *buf, size_t n, int at_start)
+{
+  size_t got = fread(buf, 1, n, r->in);
+  if (got == n)
+    return 0;
+  if (ferror(r->in)) {
+    fprintf(stderr, "Error on file read\n");
+    return 1;
+  }
+  if (got == 0 && at_start)
+    return -1;
+  fprintf(stderr, "%s:  event %lu is truncated\n", r->name, r->nevents + 1);
+  return 1;
+}
+
+/* Makes room for len bytes of event data after the first have. */
+static int reserve(struct eventlog_reader *r, size_t have, UINT32 len)
+{
+  if (len > MAXDATA - have) {
+    fprintf(stderr, "%s:  event %lu is too large\n",
+	    r->name, r->nevents + 1);
+    return 1;
+  }
+  if (have + len <= r->size)
+    return 0;
+  size_t size = 2 * r->size > have + len ? 2 * r->size : have + len;
+  BYTE *data = realloc(r->data, size);
+  if (!data) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  r->data = data;
+  r->size = size;
+  return 0;
+}
+
+static int next_bios(struct eventlog_reader *r, struct eventlog_event *ev)
+{
+  BYTE header[4 + 4 + PCRVALS_VALUESIZE + 4];
+  int rc = get(r, header, sizeof header, 1);
+  if (rc)
+    return rc;
+  ev->pcr = get_le32(header);
+  ev->type = get_le32(header + 4);
+  memcpy(ev->digest, header + 8, PCRVALS_VALUESIZE);
+  ev->dataLen = get_le32(header + 8 + PCRVALS_VALUESIZE);
+  if (reserve(r, 0, ev->dataLen) || get(r, r->data, ev->dataLen, 0))
+    return 1;
+  ev->extends = ev->type != EV_NO_ACTION;
+  ev->template = NULL;
+  ev->data = r->data;
+  if (r->nevents == 0 && !ev->extends
+      && ev->dataLen >= sizeof SPECID
+      && !memcmp(ev->data, SPECID, sizeof SPECID)) {
+    fprintf(stderr, "%s:  crypto agile logs are not supported\n",
+	    r->name);
+    return 1;
+  }
+  return 0;
+}
+
+static int next_ima(struct eventlog_reader *r, struct eventlog_event *ev)
+{
+  BYTE header[4 + PCRVALS_VALUESIZE + 4];
+  int rc = get(r, header, sizeof header, 1);
+  if (rc)
+    return rc;
+  ev->pcr = get_le32(header);
+  ev->type = 0;
+  memcpy(ev->digest, header + 4, PCRVALS_VALUESIZE);
+  UINT32 nameLen = get_le32(header + 4 + PCRVALS_VALUESIZE);
+  if (nameLen >= TEMPLATESIZE) {
+    fprintf(stderr, "%s:  event %lu has a bad template name\n",
+	    r->name, r->nevents + 1);
+    return 1;
+  }
+  if (get(r, r->template, nameLen, 0))
+    return 1;
+  r->template[nameLen] = 0;
+
+  BYTE size[4];
+  if (strcmp(r->template, IMA_TEMPLATE)) {
+    if (get(r, size, sizeof size, 0))
+      return 1;
+    ev->dataLen = get_le32(size);
+    if (reserve(r, 0, ev->dataLen) || get(r, r->data, ev->dataLen, 0))
+      return 1;
+  }
+  else {			/* Digest, name size and name */
+    UINT32 have = PCRVALS_VALUESIZE + sizeof size;
+    if (reserve(r, 0, have) || get(r, r->data, have, 0))
+      return 1;
+    UINT32 len = get_le32(r->data + PCRVALS_VALUESIZE);
+    if (reserve(r, have, len) || get(r, r->data + have, len, 0))
+      return 1;
+    ev->dataLen = have + len;
+  }
+  ev->extends = 1;
+  ev->template = r->template;
+  ev->data = r->data;
+
+  /* A violation is logged with a zero hash, but extends all ones, so
+     that no real measurement can hide it. */
+  BYTE zero[PCRVALS_VALUESIZE] = { 0 };
+  if (!memcmp(ev->digest, zero, PCRVALS_VALUESIZE))
+    memset(ev->digest, 0xff, PCRVALS_VALUESIZE);
+  return 0;
+}
+
+/* Reads the next event.  The template name and data point into the
+   reader, and are good until the next event is read.  Returns -1 at
+   the end of the log, and nonzero on error. */
+int eventlog_next(struct eventlog_reader *r, struct eventlog_event *ev)
+{
+  int rc = r->format == EVENTLOG_IMA ? next_ima(r, ev) : next_bios(r, ev);
+  if (rc == 0)
+    r->nevents++;
+  return rc;
+}
+
+/* Replay
+
+   Each event extends a PCR: its new value is the SHA-1 of its old
+   value and the event digest.  Extends of one PCR must be done in
+   order, but those of different PCRs are independent, so digests are
+   queued per PCR, and each round hashes the next digest of every PCR
+   with one waiting together with sha1_multi.  The firmware extends
+   PCRs 0 to 7 in turn, so its log fills several lanes; an IMA log
+   extends only PCR 10, and gains only when read alongside another
+   log. */
+
+#define REPLAY_DEPTH 64		/* Digests queued per PCR */
+#define EXTENDSIZE (2 * PCRVALS_VALUESIZE)
+
+struct replay {
+  BYTE value[PCRVALS_NPCRS][PCRVALS_VALUESIZE];
+  BYTE extended[PCRVALS_SELECTSIZE]; /* PCRs extended at least once */
+  UINT32 queued[PCRVALS_NPCRS];
+  BYTE queue[PCRVALS_NPCRS][REPLAY_DEPTH][PCRVALS_VALUESIZE];
+  struct replay_stats stats;
+};
+
+/* Makes a replay that starts from the values a version 1.2 TPM has
+   after power on without a dynamic launch: PCRs 17 to 22 hold all
+   ones, and the others zero. */
+struct replay *replay_new(void)
+{
+  struct replay *rp = calloc(1, sizeof *rp);
+  if (!rp) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  UINT32 i;
+  for (i = 17; i <= 22 && i < PCRVALS_NPCRS; i++)
+    memset(rp->value[i], 0xff, PCRVALS_VALUESIZE);
+  return rp;
+}
+
+void replay_free(struct replay *rp)
+{
+  free(rp);
+}
+
+/* Does the queued extends. */
+static void flush(struct replay *rp)
+{
+  UINT32 active[PCRVALS_NPCRS];
+  size_t nactive = 0;
+  UINT32 i, k;
+  for (i = 0; i < PCRVALS_NPCRS; i++)
+    if (rp->queued[i])
+      active[nactive++] = i;
+  for (k = 0; nactive > 0; k++) {
+    BYTE buf[PCRVALS_NPCRS][EXTENDSIZE];
+    struct sha1_msg msgs[PCRVALS_NPCRS];
+    size_t n, j, m = 0;
+    for (j = n = 0; j < nactive; j++) {
+      UINT32 pcr = active[j];
+      memcpy(buf[n], rp->value[pcr], PCRVALS_VALUESIZE);
+      memcpy(buf[n] + PCRVALS_VALUESIZE, rp->queue[pcr][k],
+	     PCRVALS_VALUESIZE);
+      msgs[n].data = buf[n];
+      msgs[n].len = EXTENDSIZE;
+      msgs[n].digest = rp->value[pcr];
+      n++;
+      if (rp->queued[pcr] > k + 1)
+	active[m++] = pcr;	/* Still has digests after this round */
+    }
+    sha1_multi(msgs, n);
+    rp->stats.rounds++;
+    nactive = m;
+  }
+  memset(rp->queued, 0, sizeof rp->queued);
+}
+
+/* Extends a PCR with a digest. */
+int replay_extend(struct replay *rp, UINT32 pcr, const BYTE *digest)
+{
+  if (pcr >= PCRVALS_NPCRS) {
+    fprintf(stderr, "PCR %u is out of range\n", pcr);
+    return 1;
+  }
+  memcpy(rp->queue[pcr][rp->queued[pcr]], digest, PCRVALS_VALUESIZE);
+  rp->extended[pcr / 8] |= 1 << (pcr % 8);
+  rp->stats.extends++;
+  if (++rp->queued[pcr] == REPLAY_DEPTH)
+    flush(rp);
+  return 0;
+}
+
+/* Extends the PCR of an event, unless the event extends nothing. */
+int replay_event(struct replay *rp, const struct eventlog_event *ev)
+{
+  return ev->extends ? replay_extend(rp, ev->pcr, ev->digest) : 0;
+}
+
+/* Puts the values of the given PCRs, or when npcrs is zero, of the
+   PCRs extended so far, into pv. */
+int replay_values(struct replay *rp, const UINT32 *pcrs, UINT32 npcrs,
+		  struct pcrvals *pv)
+{
+  flush(rp);
+  memset(pv, 0, sizeof *pv);
+  if (npcrs == 0)
+    memcpy(pv->select, rp->extended, PCRVALS_SELECTSIZE);
+  UINT32 i;
+  for (i = 0; i < npcrs; i++) {
+    if (pcrs[i] >= PCRVALS_NPCRS) {
+      fprintf(stderr, "PCR %u is out of range\n", pcrs[i]);
+      return 1;
+    }
+    pv->select[pcrs[i] / 8] |= 1 << (pcrs[i] % 8);
+  }
+  for (i = 0; i < PCRVALS_NPCRS; i++)
+    if (pv->select[i / 8] & 1 << (i % 8)) {
+      memcpy(pv->value[i], rp->value[i], PCRVALS_VALUESIZE);
+      pv->npcrs++;
+    }
+  return 0;
+}
+
+void replay_get_stats(struct replay *rp, struct replay_stats *stats)
+{
+  *stats = rp->stats;
+}
@@ -0,0 +1,374 @@
+/*
+ * Quote many remote hosts concurrently.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_PTHREAD_H && defined HAVE_ICONV_H
+#include <time.h>
+#include <pthread.h>
+
+/* State shared by the coordinator and the host threads.  A thread
+   that times out is abandoned rather than cancelled, since a TSS
+   call cannot be interrupted, so the state is freed by whichever of
+   them finishes last. */
+struct fan {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;	/* A host finished */
+  unsigned refs;
+  struct fan_host *finished;	/* Finished hosts not yet reported */
+  TSS_UUID uuid;
+  BYTE *nonce;
+  UINT32 nonceLen;
+  UINT32 *pcrs;
+  UINT32 npcrs;
+  struct conn_pool *pool;	/* Source of contexts, or NULL */
+};
+
+struct fan_host {
+  struct fan *fan;
+  char *name;			/* Copy of the host name, which the
+				   caller may free if abandoned */
+  struct fanquote_result result;
+  struct timespec deadline;
+  int abandoned;		/* Reported as timed out */
+  struct fan_host *next;	/* On the finished list */
+};
+
+static struct fan *fan_new(TSS_UUID uuid, BYTE *nonce, UINT32 nonceLen,
+			   UINT32 *pcrs, UINT32 npcrs)
+{
+  struct fan *fan = calloc(1, sizeof *fan);
+  if (!fan)
+    return NULL;
+  fan->nonce = malloc(nonceLen + 1);
+  fan->pcrs = malloc(npcrs * sizeof *pcrs + 1);
+  if (!fan->nonce || !fan->pcrs) {
+    free(fan->nonce);
+    free(fan->pcrs);
+    free(fan);
+    return NULL;
+  }
+  memcpy(fan->nonce, nonce, nonceLen);
+  fan->nonceLen = nonceLen;
+  memcpy(fan->pcrs, pcrs, npcrs * sizeof *pcrs);
+  fan->npcrs = npcrs;
+  fan->uuid = uuid;
+  fan->refs = 1;
+  pthread_mutex_init(&fan->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fan->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  return fan;
+}
+
+/* Drops a reference to the shared state.  Call with the lock held. */
+static void fan_release(struct fan *fan)
+{
+  int last = --fan->refs == 0;
+  pthread_mutex_unlock(&fan->lock);
+  if (!last)
+    return;
+  pthread_mutex_destroy(&fan->lock);
+  pthread_cond_destroy(&fan->changed);
+  if (fan->pool)
+    conn_pool_release(fan->pool);
+  free(fan->nonce);
+  free(fan->pcrs);
+  free(fan);
+}
+
+static void host_free(struct fan_host *h)
+{
+  free(h->result.data);
+  free(h->result.sig);
+  free(h->name);
+  free(h);
+}
+
+static UINT32 usec_between(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000
+    + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static BYTE *copy(BYTE *src, UINT32 len)
+{
+  BYTE *dst = malloc(len + 1);
+  if (dst)
+    memcpy(dst, src, len);
+  return dst;
+}
+
+/* Quotes with a connected context. */
+static int quote_context(struct fan *fan, TSS_HCONTEXT hContext,
+			 struct fanquote_result *r)
+{
+  struct quote_session *session =
+    quote_session_open(hContext, 0, fan->uuid, fan->pcrs, fan->npcrs);
+  if (!session)
+    return 1;
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = fan->nonceLen;
+  valid.rgbExternalData = fan->nonce;
+  int failed = quote_session_quote(session, &valid);
+  if (!failed) {
+    r->data = copy(valid.rgbData, valid.ulDataLength);
+    r->dataLen = valid.ulDataLength;
+    r->sig = copy(valid.rgbValidationData, valid.ulValidationDataLength);
+    r->sigLen = valid.ulValidationDataLength;
+    failed = !r->data || !r->sig;
+    Tspi_Context_FreeMemory(hContext, valid.rgbData);
+    Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
+  }
+  quote_session_close(session);
+  return failed;
+}
+
+/* Connects to one host, or takes a connection from the pool, and
+   quotes it. */
+static int quote_host(struct fan *fan, char *name, struct fanquote_result *r)
+{
+  if (fan->pool) {
+    struct conn *conn = conn_pool_get(fan->pool, name);
+    if (!conn)
+      return 1;
+    int failed = quote_context(fan, conn_context(conn), r);
+    conn_pool_put(fan->pool, conn, failed);
+    return failed;
+  }
+
+  TSS_UNICODE *host = (TSS_UNICODE *)toutf16le(name);
+  if (!host) {
+    fprintf(stderr, "Cannot convert %s to UTF-16LE\n", name);
+    return 1;
+  }
+  TSS_HCONTEXT hContext;
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
+  if (rc != TSS_SUCCESS) {
+    free(host);
+    return tss_err(rc, "creating context");
+  }
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
+  free(host);
+  if (rc != TSS_SUCCESS)
+    return tidy(hContext, tss_err(rc, "connecting"));
+  return tidy(hContext, quote_context(fan, hContext, r));
+}
+
+static void *host_main(void *arg)
+{
+  struct fan_host *h = arg;
+  struct fan *fan = h->fan;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  h->result.status =
+    quote_host(fan, h->name, &h->result) ? FANQUOTE_FAILED : FANQUOTE_OK;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  h->result.usec = usec_between(&start, &end);
+
+  pthread_mutex_lock(&fan->lock);
+  if (h->abandoned)
+    host_free(h);
+  else {
+    h->next = fan->finished;
+    fan->finished = h;
+    pthread_cond_signal(&fan->changed);
+  }
+  fan_release(fan);
+  return NULL;
+}
+
+static int start_host(struct fan *fan, const char *name, unsigned timeout,
+		      struct fan_host **running)
+{
+  struct fan_host *h = calloc(1, sizeof *h);
+  if (!h || !(h->name = strdup(name))) {
+    free(h);
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  h->fan = fan;
+  h->result.host = name;
+  clock_gettime(CLOCK_MONOTONIC, &h->deadline);
+  h->deadline.tv_sec += timeout / 1000;
+  h->deadline.tv_nsec += (timeout % 1000) * 1000000;
+  if (h->deadline.tv_nsec >= 1000000000) {
+    h->deadline.tv_sec++;
+    h->deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  pthread_mutex_lock(&fan->lock);
+  fan->refs++;
+  int rc = pthread_create(&thread, &attr, host_main, h);
+  if (rc)
+    fan->refs--;
+  pthread_mutex_unlock(&fan->lock);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    fprintf(stderr, "Cannot create thread for %s\n", name);
+    host_free(h);
+    return 1;
+  }
+  *running = h;
+  return 0;
+}
+
+static int expired(struct timespec *deadline, struct timespec *now)
+{
+  return now->tv_sec > deadline->tv_sec
+    || (now->tv_sec == deadline->tv_sec
+	&& now->tv_nsec >= deadline->tv_nsec);
+}
+
+/* Quotes each of the hosts with the AIK registered under the UUID,
+   with at most parallel quotes in progress.  A host that takes more
+   than timeout milliseconds, when timeout is not zero, is reported
+   as timed out, and no longer counts against the parallelism limit.
+   The done function is called from the calling thread once for each
+   host, in order of completion.  When pool is not NULL, contexts
+   are taken from it and returned to it.  Returns the number of hosts not
+   successfully quoted. */
+size_t fanquote(const char **hosts, size_t nhosts, TSS_UUID uuid,
+		BYTE *nonce, UINT32 nonceLen, UINT32 *pcrs, UINT32 npcrs,
+		unsigned parallel, unsigned timeout, struct conn_pool *pool,
+		fanquote_done *done, void *arg)
+{
+  if (parallel == 0)
+    parallel = 1;
+  if (parallel > nhosts)
+    parallel = nhosts;
+  struct fan_host **running = calloc(parallel + 1, sizeof *running);
+  struct fan *fan = fan_new(uuid, nonce, nonceLen, pcrs, npcrs);
+  if (fan && pool) {
+    conn_pool_hold(pool);	/* Until abandoned hosts finish */
+    fan->pool = pool;
+  }
+  if (!running || !fan) {
+    fprintf(stderr, "Out of memory\n");
+    free(running);
+    if (fan) {
+      pthread_mutex_lock(&fan->lock);
+      fan_release(fan);
+    }
+    return nhosts;
+  }
+
+  size_t next = 0, failures = 0;
+  unsigned nrunning = 0;
+  while (next < nhosts || nrunning > 0) {
+    while (nrunning < parallel && next < nhosts) {
+      const char *name = hosts[next++];
+      if (!start_host(fan, name, timeout, &running[nrunning])) {
+	nrunning++;
+	continue;
+      }
+      struct fanquote_result r;
+      memset(&r, 0, sizeof r);
+      r.host = name;
+      r.status = FANQUOTE_FAILED;
+      r.arg = arg;
+      done(&r);
+      failures++;
+    }
+    if (nrunning == 0)
+      continue;
+
+    /* Wait for a host to finish or for the earliest deadline */
+    pthread_mutex_lock(&fan->lock);
+    unsigned i, first = 0;
+    for (i = 1; i < nrunning; i++)
+      if (expired(&running[first]->deadline, &running[i]->deadline))
+	first = i;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (!fan->finished
+	   && (!timeout || !expired(&running[first]->deadline, &now))) {
+      if (timeout)
+	pthread_cond_timedwait(&fan->changed, &fan->lock,
+			       &running[first]->deadline);
+      else
+	pthread_cond_wait(&fan->changed, &fan->lock);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    struct fan_host *finished = fan->finished;
+    fan->finished = NULL;
+
+    /* Abandon the hosts that have run out of time */
+    struct fanquote_result expiredResults[nrunning];
+    unsigned nexpired = 0;
+    for (i = 0; i < nrunning; ) {
+      struct fan_host *h = running[i];
+      struct fan_host *f;
+      for (f = finished; f && f != h; f = f->next);
+      if (f || (timeout && expired(&h->deadline, &now))) {
+	if (!f) {
+	  h->abandoned = 1;
+	  struct fanquote_result *r = &expiredResults[nexpired++];
+	  memset(r, 0, sizeof *r);
+	  r->host = h->result.host;
+	  r->status = FANQUOTE_TIMEOUT;
+	  r->usec = timeout * 1000;
+	}
+	running[i] = running[--nrunning];
+      }
+      else
+	i++;
+    }
+    pthread_mutex_unlock(&fan->lock);
+
+    /* Report without holding the lock */
+    for (i = 0; i < nexpired; i++) {
+      expiredResults[i].arg = arg;
+      done(&expiredResults[i]);
+      failures++;
+    }
+    while (finished) {
+      struct fan_host *h = finished;
+      finished = h->next;
+      h->result.arg = arg;
+      done(&h->result);
+      if (h->result.status != FANQUOTE_OK)
+	failures++;
+      host_free(h);
+    }
+  }
+
+  free(running);
+  pthread_mutex_lock(&fan->lock);
+  fan_release(fan);
+  return failures;
+}
+
+#else
+
+size_t fanquote(const char **hosts, size_t nhosts, TSS_UUID uuid,
+		BYTE *nonce, UINT32 nonceLen, UINT32 *pcrs, UINT32 npcrs,
+		unsigned parallel, unsigned timeout, struct conn_pool *pool,
+		fanquote_done *done, void *arg)
+{
+  fprintf(stderr, "Concurrent remote quotes not supported "
+	  "on this platform.\n");
+  return nhosts;
+}
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Read and write whole files and framed record streams.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+#if defined HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* The tools read and write small files, such as keys, nonces and
+   hashes, and in batch mode, many of them.  Each is read with one
+   read() into a buffer of its exact size, rather than through stdio,
+   and larger files are mapped.  Outputs are written with one write()
+   to a temporary file that is renamed over the output, so a reader
+   never sees a partial file.  The name - means standard input or
+   output. */
+
+#define MAPSIZE (1 << 16)	/* Smallest file that is mapped */
+#define READSIZE (1 << 16)	/* Reads from pipes and record streams */
+#define FRAME_MAXFIELD (1 << 24) /* Largest field of a framed record */
+
+static int is_std(const char *name)
+{
+  return !strcmp(name, "-");
+}
+
+/* Reads from fd until end of file into buf, which holds size bytes.
+   Returns the number of bytes read, or -1 on error.  Stops early when
+   the buffer fills, in which case the caller decides what more
+   means. */
+static ssize_t read_all(int fd, BYTE *buf, size_t size)
+{
+  size_t n = 0;
+  while (n < size) {
+    ssize_t got = read(fd, buf + n, size - n);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return -1;
+    if (got == 0)
+      break;
+    n += got;
+  }
+  return n;
+}
+
+static int write_all(int fd, const BYTE *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t put = write(fd, buf, len);
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put <= 0)
+      return 1;
+    buf += put;
+    len -= put;
+  }
+  return 0;
+}
+
+/* Reads a pipe, growing the buffer as it goes. */
+static int load_stream(int fd, struct file_data *f)
+{
+  size_t size = READSIZE;
+  f->data = malloc(size);
+  f->len = 0;
+  while (f->data) {
+    ssize_t got = read_all(fd, f->data + f->len, size - f->len);
+    if (got < 0)
+      return 1;
+    f->len += got;
+    if (f->len < size)
+      return 0;
+    BYTE *more = realloc(f->data, 2 * size);
+    if (!more)
+      break;
+    f->data = more;
+    size *= 2;
+  }
+  free(f->data);
+  f->data = NULL;
+  fprintf(stderr, "Out of memory\n");
+  return 1;
+}
+
+/* Loads a whole file, of any size.  The data may be changed in
+   place; the changes are private.  Returns nonzero on error. */
+int file_load(const char *name, struct file_data *f)
+{
+  memset(f, 0, sizeof *f);
+  int fd = is_std(name) ? STDIN_FILENO : open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", name);
+    return 1;
+  }
+  struct stat st;
+  int bad;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+    bad = load_stream(fd, f);
+#if defined HAVE_SYS_MMAN_H
+  else if (st.st_size >= MAPSIZE
+	   && (f->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+    f->len = st.st_size;
+    f->mapped = 1;
+    bad = 0;
+  }
+#endif
+  else {
+    /* One more byte than the size notices a file that grew */
+    f->data = malloc(st.st_size + 1);
+    ssize_t got = f->data ? read_all(fd, f->data, st.st_size + 1) : -1;
+    f->len = got;
+    bad = got < 0 || (size_t)got > (size_t)st.st_size;
+  }
+  if (fd != STDIN_FILENO)
+    close(fd);
+  if (bad) {
+    file_unload(f);
+    fprintf(stderr, "Cannot read %s\n", name);
+  }
+  return bad;
+}
+
+void file_unload(struct file_data *f)
+{
+#if defined HAVE_SYS_MMAN_H
+  if (f->mapped)
+    munmap(f->data, f->len);
+  else
+#endif
+    free(f->data);
+  memset(f, 0, sizeof *f);
+}
+
+/* Reads a file into buf, which holds size bytes.  A file too large
+   for the buffer is an error rather than being cut short. */
+int file_read(const char *name, BYTE *buf, UINT32 size, UINT32 *len)
+{
+  int fd = is_std(name) ? STDIN_FILENO : open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", name);
+    return 1;
+  }
+  BYTE extra;
+  ssize_t got = read_all(fd, buf, size);
+  ssize_t more = got == size ? read_all(fd, &extra, 1) : 0;
+  if (fd != STDIN_FILENO)
+    close(fd);
+  if (got < 0 || more < 0) {
+    fprintf(stderr, "Cannot read %s\n", name);
+    return 1;
+  }
+  if (more > 0) {
+    fprintf(stderr, "%s is larger than %u bytes\n", name, size);
+    return 1;
+  }
+  *len = got;
+  return 0;
+}
+
+/* Makes the name of the temporary file an output is written to.  The
+   counter keeps the names of outputs written at once by different
+   threads, or to the same name, apart. */
+static char *temp_name(const char *name)
+{
+  static unsigned long count;
+  unsigned long n = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+  size_t len = strlen(name) + 48;
+  char *tmp = malloc(len);
+  if (tmp)
+    snprintf(tmp, len, "%s.%ld.%lu.tmp", name, (long)getpid(), n);
+  else
+    fprintf(stderr, "Out of memory\n");
+  return tmp;
+}
+
+/* Creates the temporary file for an output.  Returns -1 on error. */
+static int create_temp(const char *name, char **tmp)
+{
+  if (is_std(name)) {
+    *tmp = NULL;
+    return STDOUT_FILENO;
+  }
+  if (!(*tmp = temp_name(name)))
+    return -1;
+  int fd = open(*tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", name);
+    free(*tmp);
+  }
+  return fd;
+}
+
+/* Closes the temporary file of an output, and renames it over the
+   output unless bad is set. */
+static int commit_temp(const char *name, int fd, char *tmp, int bad)
+{
+  if (tmp) {			/* Standard output stays open */
+    bad |= close(fd) != 0;
+    if (!bad && rename(tmp, name))
+      bad = 1;
+    if (bad)
+      unlink(tmp);
+    free(tmp);
+  }
+  if (bad)
+    fprintf(stderr, "Cannot write %s\n", name);
+  return bad;
+}
+
+/* Writes a whole file, replacing it only once all of it is
+   written. */
+int file_write(const char *name, const void *data, size_t len)
+{
+  char *tmp;
+  int fd = create_temp(name, &tmp);
+  if (fd < 0)
+    return 1;
+  return commit_temp(name, fd, tmp, write_all(fd, data, len));
+}
+
+/* Framed records are sequences of fields, each a four byte
+   big-endian length followed by that many bytes.  The reader keeps a
+   large buffer that the fields of a record point into, so records
+   are neither copied nor read a field at a time. */
+struct frame_reader {
+  int fd;
+  BYTE *buf;
+  size_t size;
+  size_t start;			/* Start of the unread data */
+  size_t end;			/* End of the data */
+  int eof;
+};
+
+struct frame_reader *frame_reader_new(int fd)
+{
+  struct frame_reader *r = calloc(1, sizeof *r);
+  if (r && !(r->buf = malloc(READSIZE))) {
+    free(r);
+    r = NULL;
+  }
+  if (!r) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  r->fd = fd;
+  r->size = READSIZE;
+  return r;
+}
+
+void frame_reader_free(struct frame_reader *r)
+{
+  if (r) {
+    free(r->buf);
+    free(r);
+  }
+}
+
+/* Makes sure need bytes are buffered after the start.  Returns -1
+   when the input ends first. */
+static int frame_fill(struct frame_reader *r, size_t need)
+{
+  while (r->end - r->start < need) {
+    if (r->eof)
+      return -1;
+    if (r->start + need > r->size) {
+      memmove(r->buf, r->buf + r->start, r->end - r->start);
+      r->end -= r->start;
+      r->start = 0;
+    }
+    if (need > r->size) {
+      size_t size = r->size;
+      while (size < need)
+	size *= 2;
+      BYTE *more = realloc(r->buf, size);
+      if (!more) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+      }
+      r->buf = more;
+      r->size = size;
+    }
+    ssize_t got = read(r->fd, r->buf + r->end, r->size - r->end);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0) {
+      fprintf(stderr, "Error on record read\n");
+      return 1;
+    }
+    if (got == 0)
+      r->eof = 1;
+    r->end += got;
+  }
+  return 0;
+}
+
+static UINT32 get_uint32(const BYTE *p)
+{
+  return (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3];
+}
+
+/* Reads a record of n fields.  The fields point into the reader's
+   buffer, and may be changed in place until the next call.  Returns
+   -1 on a clean end of input before the first field. */
+int frame_read(struct frame_reader *r, unsigned n,
+	       BYTE **field, UINT32 *len)
+{
+  size_t off[n];
+  size_t need = 0;
+  unsigned i;
+  for (i = 0; i < n; i++) {
+    int rc = frame_fill(r, need + 4);
+    if (rc < 0 && i == 0 && r->end == r->start)
+      return -1;
+    if (rc) {
+      if (rc < 0)
+	fprintf(stderr, "Truncated record\n");
+      return 1;
+    }
+    len[i] = get_uint32(r->buf + r->start + need);
+    if (len[i] > FRAME_MAXFIELD) {
+      fprintf(stderr, "Record field of %u bytes too large\n", len[i]);
+      return 1;
+    }
+    off[i] = need + 4;
+    need += 4 + len[i];
+    if ((rc = frame_fill(r, need))) {
+      if (rc < 0)
+	fprintf(stderr, "Truncated record\n");
+      return 1;
+    }
+  }
+  for (i = 0; i < n; i++)
+    field[i] = r->buf + r->start + off[i];
+  r->start += need;
+  return 0;
+}
+
+/* The writer gathers records in a buffer, and writes it out when it
+   fills.  A named output is written to a temporary file that
+   replaces it when the writer is closed. */
+struct frame_writer {
+  int fd;
+  char *name;
+  char *tmp;			/* NULL for standard output */
+  BYTE *buf;
+  size_t len;
+  int failed;
+};
+
+struct frame_writer *frame_writer_open(const char *name)
+{
+  struct frame_writer *w = calloc(1, sizeof *w);
+  if (w && (!(w->buf = malloc(READSIZE)) || !(w->name = strdup(name)))) {
+    free(w->buf);
+    free(w);
+    w = NULL;
+  }
+  if (!w) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  if ((w->fd = create_temp(name, &w->tmp)) < 0) {
+    free(w->name);
+    free(w->buf);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+static int frame_flush(struct frame_writer *w)
+{
+  if (!w->failed && write_all(w->fd, w->buf, w->len))
+    w->failed = 1;
+  w->len = 0;
+  return w->failed;
+}
+
+static void frame_put(struct frame_writer *w, const void *data, size_t len)
+{
+  if (w->len + len > READSIZE && frame_flush(w))
+    return;
+  if (len > READSIZE) {		/* Too big to gather */
+    if (write_all(w->fd, data, len))
+      w->failed = 1;
+    return;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+/* Adds a record of n fields.  Returns nonzero once a write has
+   failed. */
+int frame_write(struct frame_writer *w, unsigned n,
+		const BYTE **field, const UINT32 *len)
+{
+  unsigned i;
+  for (i = 0; i < n; i++) {
+    BYTE prefix[4];
+    prefix[0] = len[i] >> 24;
+    prefix[1] = len[i] >> 16;
+    prefix[2] = len[i] >> 8;
+    prefix[3] = len[i];
+    frame_put(w, prefix, sizeof prefix);
+    frame_put(w, field[i], len[i]);
+  }
+  return w->failed;
+}
+
+/* Writes out what is gathered and closes the output, which replaces
+   the named file only when every write succeeded. */
+int frame_writer_close(struct frame_writer *w)
+{
+  frame_flush(w);
+  int bad = commit_temp(w->name, w->fd, w->tmp, w->failed);
+  free(w->name);
+  free(w->buf);
+  free(w);
+  return bad;
+}
@@ -0,0 +1,303 @@
+/*
+ * Look up expected quote info in a golden database.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_OPENSSL_RSA_LIB
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#if defined HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* A golden database maps the SHA-1 of an AIK's DER encoded public
+   key, or of a machine class name, to the quote info a quote is
+   expected to sign.  Numbers are big-endian.  The file is
+
+     header:    "TQGD", version, number of entries, number of templates
+     entries:   key[20], template number, sorted by key
+     templates: length, info[GOLDEN_INFOSIZE]
+
+   Many keys usually share one template, and each is stored once.
+   The file is mapped read-only, so verifiers share its pages, and a
+   lookup is a binary search that touches a few pages. */
+
+#define MAGIC "TQGD"
+#define DBVERSION 1
+#define HEADERSIZE 16
+#define ENTRYSIZE (SHA_DIGEST_LENGTH + 4)
+#define TEMPLATESIZE (4 + GOLDEN_INFOSIZE)
+
+struct golden {
+  BYTE *base;
+  size_t size;
+  int mapped;			/* Non-zero when base is mapped */
+  UINT32 nentries;
+  UINT32 ntemplates;
+  BYTE *entries;
+  BYTE *templates;
+};
+
+static UINT32 get_uint32(const BYTE *p)
+{
+  return (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3];
+}
+
+static void put_uint32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void golden_key(const BYTE *data, UINT32 len, BYTE *key)
+{
+  SHA1(data, len, key);
+}
+
+static BYTE *load(int fd, size_t size, int *mapped)
+{
+#if defined HAVE_SYS_MMAN_H
+  void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base != MAP_FAILED) {
+    *mapped = 1;
+    return base;
+  }
+#endif
+  *mapped = 0;
+  BYTE *buf = malloc(size);
+  if (!buf)
+    return NULL;
+  size_t n = 0;
+  while (n < size) {
+    ssize_t got = read(fd, buf + n, size - n);
+    if (got <= 0) {
+      free(buf);
+      return NULL;
+    }
+    n += got;
+  }
+  return buf;
+}
+
+/* Opens a golden database.  Returns NULL on error. */
+struct golden *golden_open(const char *name)
+{
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", name);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < HEADERSIZE) {
+    close(fd);
+    fprintf(stderr, "%s is not a golden database\n", name);
+    return NULL;
+  }
+  struct golden *db = calloc(1, sizeof *db);
+  if (!db) {
+    close(fd);
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  db->size = st.st_size;
+  db->base = load(fd, db->size, &db->mapped);
+  close(fd);
+  if (!db->base) {
+    free(db);
+    fprintf(stderr, "Cannot read %s\n", name);
+    return NULL;
+  }
+
+  db->nentries = get_uint32(db->base + 8);
+  db->ntemplates = get_uint32(db->base + 12);
+  db->entries = db->base + HEADERSIZE;
+  db->templates = db->entries + (size_t)db->nentries * ENTRYSIZE;
+  if (memcmp(db->base, MAGIC, 4) || get_uint32(db->base + 4) != DBVERSION
+      || db->size != HEADERSIZE + (size_t)db->nentries * ENTRYSIZE
+      + (size_t)db->ntemplates * TEMPLATESIZE) {
+    fprintf(stderr, "%s is not a golden database\n", name);
+    golden_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+void golden_close(struct golden *db)
+{
+  if (!db)
+    return;
+#if defined HAVE_SYS_MMAN_H
+  if (db->mapped)
+    munmap(db->base, db->size);
+  else
+#endif
+    free(db->base);
+  free(db);
+}
+
+/* Finds the quote info expected for a key made by golden_key.  The
+   info points into the database, and must be copied before a nonce
+   is set in it.  Returns nonzero when the key is absent. */
+int golden_lookup(struct golden *db, const BYTE *key,
+		  const BYTE **info, UINT32 *infoLen)
+{
+  UINT32 lo = 0, hi = db->nentries;
+  while (lo < hi) {
+    UINT32 mid = lo + (hi - lo) / 2;
+    const BYTE *e = db->entries + (size_t)mid * ENTRYSIZE;
+    int cmp = memcmp(key, e, SHA_DIGEST_LENGTH);
+    if (cmp > 0)
+      lo = mid + 1;
+    else if (cmp < 0)
+      hi = mid;
+    else {
+      UINT32 t = get_uint32(e + SHA_DIGEST_LENGTH);
+      if (t >= db->ntemplates)
+	break;
+      const BYTE *p = db->templates + (size_t)t * TEMPLATESIZE;
+      UINT32 len = get_uint32(p);
+      if (len > GOLDEN_INFOSIZE)
+	break;
+      *info = p + 4;
+      *infoLen = len;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int entry_compar(const void *a, const void *b)
+{
+  const struct golden_entry *x = a;
+  const struct golden_entry *y = b;
+  return memcmp(x->key, y->key, SHA_DIGEST_LENGTH);
+}
+
+static int info_compar(const void *a, const void *b)
+{
+  const struct golden_entry *x = *(const struct golden_entry **)a;
+  const struct golden_entry *y = *(const struct golden_entry **)b;
+  if (x->infoLen != y->infoLen)
+    return x->infoLen < y->infoLen ? -1 : 1;
+  return memcmp(x->info, y->info, x->infoLen);
+}
+
+/* Writes a golden database holding the given entries, which are
+   sorted in place.  The file is replaced as a whole by file_write,
+   so verifiers that have the old one open keep a consistent copy. */
+int golden_write(const char *name, struct golden_entry *entries, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (entries[i].infoLen > GOLDEN_INFOSIZE) {
+      fprintf(stderr, "Quote info of %u bytes too large\n",
+	      entries[i].infoLen);
+      return 1;
+    }
+  qsort(entries, n, sizeof *entries, entry_compar);
+  for (i = 1; i < n; i++)
+    if (!entry_compar(&entries[i - 1], &entries[i])) {
+      fprintf(stderr, "Duplicate key in golden database\n");
+      return 1;
+    }
+
+  /* Number the distinct templates */
+  struct golden_entry **byinfo = malloc(n * sizeof *byinfo + 1);
+  UINT32 *number = malloc(n * sizeof *number + 1);
+  if (!byinfo || !number) {
+    free(byinfo);
+    free(number);
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < n; i++)
+    byinfo[i] = &entries[i];
+  qsort(byinfo, n, sizeof *byinfo, info_compar);
+  UINT32 ntemplates = 0;
+  for (i = 0; i < n; i++) {
+    if (i == 0 || info_compar(&byinfo[i - 1], &byinfo[i]))
+      ntemplates++;
+    number[byinfo[i] - entries] = ntemplates - 1;
+  }
+
+  size_t size = HEADERSIZE + n * ENTRYSIZE + ntemplates * TEMPLATESIZE;
+  BYTE *buf = calloc(1, size);
+  if (!buf) {
+    fprintf(stderr, "Out of memory\n");
+    free(byinfo);
+    free(number);
+    return 1;
+  }
+  BYTE *p = buf;
+  memcpy(p, MAGIC, 4);
+  put_uint32(p + 4, DBVERSION);
+  put_uint32(p + 8, n);
+  put_uint32(p + 12, ntemplates);
+  p += HEADERSIZE;
+  for (i = 0; i < n; i++, p += ENTRYSIZE) {
+    memcpy(p, entries[i].key, SHA_DIGEST_LENGTH);
+    put_uint32(p + SHA_DIGEST_LENGTH, number[i]);
+  }
+  for (i = 0; i < n; i++) {
+    if (i > 0 && !info_compar(&byinfo[i - 1], &byinfo[i]))
+      continue;
+    put_uint32(p, byinfo[i]->infoLen);
+    memcpy(p + 4, byinfo[i]->info, byinfo[i]->infoLen);
+    p += TEMPLATESIZE;
+  }
+  int bad = file_write(name, buf, size);
+  free(buf);
+  free(byinfo);
+  free(number);
+  return bad;
+}
+
+#else
+
+void golden_key(const BYTE *data, UINT32 len, BYTE *key)
+{
+  memset(key, 0, GOLDEN_KEYSIZE);
+}
+
+struct golden *golden_open(const char *name)
+{
+  fprintf(stderr, "Golden databases require OpenSSL.\n");
+  return NULL;
+}
+
+void golden_close(struct golden *db)
+{
+}
+
+int golden_lookup(struct golden *db, const BYTE *key,
+		  const BYTE **info, UINT32 *infoLen)
+{
+  return 1;
+}
+
+int golden_write(const char *name, struct golden_entry *entries, size_t n)
+{
+  fprintf(stderr, "Golden databases require OpenSSL.\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * Read and write PCR values in hex.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* AVX2 is used when the processor has it, even when the compiler was
+   not asked to generate AVX2 code. */
+#if defined HAVE_IMMINTRIN_H && defined __GNUC__ && defined __x86_64__
+#include <immintrin.h>
+#define HEX_AVX2
+#endif
+
+#define READSIZE (1 << 16)	/* Bytes of pcrvals read at a time */
+#define LINESIZE (1 << 12)	/* Longest pcrvals line */
+
+/* Value of each hex digit, or 0xff */
+static const BYTE digit[256] = {
+#define X 0xff
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+#undef X
+};
+
+static int decode_scalar(BYTE *dst, const BYTE *src, size_t n)
+{
+  BYTE bad = 0;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    BYTE hi = digit[src[2 * i]];
+    BYTE lo = digit[src[2 * i + 1]];
+    bad |= hi | lo;
+    dst[i] = hi << 4 | lo;
+  }
+  return (bad & 0xf0) != 0;
+}
+
+#if defined __SSE2__
+
+/* Decodes 16 hex digits into 8 bytes.  Digits are classified by
+   range, so that a character outside them, including one with its
+   high bit set, leaves a lane invalid. */
+static int decode_sse2(BYTE *dst, const BYTE *src)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)src);
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i num = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+			      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  if (_mm_movemask_epi8(_mm_or_si128(num, alpha)) != 0xffff)
+    return 1;
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  __m128i a = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+  __m128i nib = _mm_or_si128(_mm_and_si128(num, d), _mm_and_si128(alpha, a));
+  /* Each 16-bit lane holds the high nibble in its low byte */
+  __m128i hi = _mm_and_si128(_mm_slli_epi16(nib, 4), _mm_set1_epi16(0xf0));
+  __m128i lo = _mm_srli_epi16(nib, 8);
+  __m128i bytes = _mm_or_si128(hi, lo);
+  _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(bytes, bytes));
+  return 0;
+}
+
+#endif
+
+#if defined HEX_AVX2
+
+/* Decodes 32 hex digits into 16 bytes, as decode_sse2 does. */
+__attribute__((target("avx2")))
+static int decode_avx2(BYTE *dst, const BYTE *src)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i *)src);
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i num =
+    _mm256_andnot_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('9')),
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)));
+  __m256i alpha =
+    _mm256_andnot_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('f')),
+			_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)));
+  if (_mm256_movemask_epi8(_mm256_or_si256(num, alpha)) != -1)
+    return 1;
+  __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+  __m256i a = _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10));
+  __m256i nib = _mm256_or_si256(_mm256_and_si256(num, d),
+				_mm256_and_si256(alpha, a));
+  __m256i hi = _mm256_and_si256(_mm256_slli_epi16(nib, 4),
+				_mm256_set1_epi16(0xf0));
+  __m256i lo = _mm256_srli_epi16(nib, 8);
+  __m256i bytes = _mm256_or_si256(hi, lo);
+  /* Packing works within each 128-bit half, so gather the halves */
+  __m256i packed = _mm256_packus_epi16(bytes, bytes);
+  packed = _mm256_permute4x64_epi64(packed, 0x08);
+  _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+  return 0;
+}
+
+#endif
+
+/* Decodes n bytes from 2n hex digits in either case.  Returns
+   nonzero when a character is not a hex digit. */
+int hex_decode(BYTE *dst, const char *src, size_t n)
+{
+  const BYTE *s = (const BYTE *)src;
+#if defined HEX_AVX2
+  if (n >= 16 && __builtin_cpu_supports("avx2"))
+    for (; n >= 16; n -= 16, dst += 16, s += 32)
+      if (decode_avx2(dst, s))
+	return 1;
+#endif
+#if defined __SSE2__
+  for (; n >= 8; n -= 8, dst += 8, s += 16)
+    if (decode_sse2(dst, s))
+      return 1;
+#endif
+  return decode_scalar(dst, s, n);
+}
+
+/* Encodes n bytes as 2n upper case hex digits, without a trailing
+   null. */
+void hex_encode(char *dst, const BYTE *src, size_t n)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i;
+  for (i = 0; i < n; i++) {
+    dst[2 * i] = hex[src[i] >> 4];
+    dst[2 * i + 1] = hex[src[i] & 0xf];
+  }
+}
+
+/* Writes one line of a pcrvals file. */
+int pcrvals_write(FILE *out, UINT32 pcr, const BYTE *value, UINT32 len)
+{
+  char line[16 + 2 * PCRVALS_VALUESIZE + 2];
+  if (len > PCRVALS_VALUESIZE)
+    return 1;
+  int n = snprintf(line, sizeof line, "%u=", pcr);
+  hex_encode(line + n, value, len);
+  n += 2 * len;
+  line[n++] = '\n';
+  return fwrite(line, 1, n, out) != (size_t)n;
+}
+
+static int is_space(int c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n'
+    || c == '\v' || c == '\f';
+}
+
+/* Parses an index=value line.  As with strtoul, white space may
+   precede the index, and anything may separate it from the equal
+   sign.  White space may precede the value, and anything that is
+   not a hex digit may follow it. */
+static int parse_line(struct pcrvals *pv, const char *name,
+		      const char *line, const char *end)
+{
+  const char *p = line;
+  while (p < end && is_space(*p))
+    p++;
+  if (p == end || *p < '0' || *p > '9') {
+    fprintf(stderr, "%s:  cannot read PCR index\n", name);
+    return 1;
+  }
+  unsigned long pcr = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    if (pcr < 100000000)	/* Larger is out of range anyway */
+      pcr = 10 * pcr + (*p - '0');
+  if (pcr >= PCRVALS_NPCRS) {
+    fprintf(stderr, "%s:  out of range PCR %lu\n", name, pcr);
+    return 1;
+  }
+
+  /* Ensure there are no duplicate PCR specifications, as it would
+     cause npcrs to be too large, and corrupt the hash
+     computation. */
+  if (pv->select[pcr / 8] & 1 << (pcr % 8)) {
+    fprintf(stderr, "%s:  PCR %lu already specified\n", name, pcr);
+    return 1;
+  }
+  pv->select[pcr / 8] |= 1 << (pcr % 8);
+  pv->npcrs++;
+
+  p = memchr(p, '=', end - p);
+  if (p)
+    for (p++; p < end && is_space(*p); p++);
+  if (!p || end - p < 2 * PCRVALS_VALUESIZE
+      || hex_decode(pv->value[pcr], p, PCRVALS_VALUESIZE)
+      || (end - p > 2 * PCRVALS_VALUESIZE
+	  && digit[(BYTE)p[2 * PCRVALS_VALUESIZE]] != 0xff)) {
+    fprintf(stderr, "%s:  ill-formed entry for PCR %lu\n", name, pcr);
+    return 1;
+  }
+  return 0;
+}
+
+static int is_blank(const char *line, const char *end)
+{
+  for (; line < end; line++)
+    if (!is_space(*line))
+      return 0;
+  return 1;
+}
+
+/* Reads pcrvals in large blocks rather than a line at a time.  When
+   the input holds several documents, they are separated by blank
+   lines. */
+struct pcrvals_reader {
+  FILE *in;
+  const char *name;		/* Used in error messages */
+  int multi;			/* Non-zero for several documents */
+  int eof;
+  int ndocs;			/* Documents returned so far */
+  char *buf;
+  char *line;			/* Start of the next line in buf */
+  char *end;			/* End of the data in buf */
+};
+
+struct pcrvals_reader *pcrvals_reader_new(FILE *in, const char *name,
+					  int multi)
+{
+  struct pcrvals_reader *r = calloc(1, sizeof *r);
+  if (r)
+    r->buf = malloc(READSIZE + LINESIZE);
+  if (!r || !r->buf) {
+    free(r);
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  r->in = in;
+  r->name = name;
+  r->multi = multi;
+  r->line = r->end = r->buf;
+  return r;
+}
+
+void pcrvals_reader_free(struct pcrvals_reader *r)
+{
+  if (r) {
+    free(r->buf);
+    free(r);
+  }
+}
+
+/* Moves the partial line to the start of the buffer, and reads more
+   after it.  Returns -1 at the end of input. */
+static int fill(struct pcrvals_reader *r)
+{
+  size_t have = r->end - r->line;
+  if (have > LINESIZE) {
+    fprintf(stderr, "%s:  line too long\n", r->name);
+    return 1;
+  }
+  memmove(r->buf, r->line, have);
+  r->line = r->buf;
+  r->end = r->buf + have;
+  size_t got = fread(r->end, 1, READSIZE, r->in);
+  if (got == 0) {
+    if (ferror(r->in)) {
+      fprintf(stderr, "Error on file read\n");
+      return 1;
+    }
+    r->eof = 1;
+    return -1;
+  }
+  r->end += got;
+  return 0;
+}
+
+/* Reads the next document.  Returns -1 when there are no more.  A
+   single document input always has one document, which may be
+   empty. */
+int pcrvals_next(struct pcrvals_reader *r, struct pcrvals *pv)
+{
+  if (!r->multi && r->ndocs > 0)
+    return -1;
+  memset(pv, 0, sizeof *pv);
+  int nlines = 0;
+  for (;;) {
+    char *nl = memchr(r->line, '\n', r->end - r->line);
+    char *line = r->line;
+    if (nl)
+      r->line = nl + 1;
+    else if (!r->eof) {
+      int rc = fill(r);
+      if (rc > 0)
+	return rc;
+      continue;
+    }
+    else if (line < r->end) { /* Last line has no newline */
+      nl = r->end;
+      r->line = r->end;
+    }
+    else
+      break;
+    if (r->multi && is_blank(line, nl)) {
+      if (nlines > 0)
+	break;
+      continue;
+    }
+    if (parse_line(pv, r->name, line, nl))
+      return 1;
+    nlines++;
+  }
+  if (r->multi && nlines == 0)
+    return -1;
+  r->ndocs++;
+  return 0;
+}
+
+/* Reads index=value lines, as written by tpm_getpcrhash and
+   tpm_getquote -p.  Errors are reported using the given name for the
+   input. */
+int pcrvals_read(FILE *in, const char *name, struct pcrvals *pv)
+{
+  struct pcrvals_reader *r = pcrvals_reader_new(in, name, 0);
+  if (!r)
+    return 1;
+  int rc = pcrvals_next(r, pv);
+  pcrvals_reader_free(r);
+  return rc;
+}
+
+/* Parses a single document of index=value lines held in memory. */
+int pcrvals_parse(const char *buf, size_t len, const char *name,
+		  struct pcrvals *pv)
+{
+  memset(pv, 0, sizeof *pv);
+  const char *end = buf + len;
+  while (buf < end) {
+    const char *nl = memchr(buf, '\n', end - buf);
+    if (!nl)
+      nl = end;
+    if (parse_line(pv, name, buf, nl))
+      return 1;
+    buf = nl + 1;
+  }
+  return 0;
+}
@@ -11,43 +11,55 @@
 #include "config.h"
 #endif
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 
-/* Load a key and register it under the given UUID. */
-int loadkey(TSS_HCONTEXT hContext,
-	    BYTE *blob, UINT32 blobLen,
-	    TSS_UUID uuid)
+/* Load the SRK, and set its secret to the well known secret. */
+int load_srk(TSS_HCONTEXT hContext, TSS_HKEY *hSRK)
 {
-  /* Get SRK */
   TSS_UUID SRK_UUID = TSS_UUID_SRK;
-  TSS_HKEY hSRK;
   TSS_RESULT rc;
-  rc = Tspi_Context_LoadKeyByUUID(hContext, TSS_PS_TYPE_SYSTEM,
-				  SRK_UUID, &hSRK);
+  rc = TRACE(Tspi_Context_LoadKeyByUUID, hContext, TSS_PS_TYPE_SYSTEM,
+	     SRK_UUID, hSRK);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "loading SRK");
 
   TSS_HPOLICY hSrkPolicy;
-  rc = Tspi_GetPolicyObject(hSRK, TSS_POLICY_USAGE, &hSrkPolicy);
+  rc = TRACE(Tspi_GetPolicyObject, *hSRK, TSS_POLICY_USAGE, &hSrkPolicy);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "getting SRK policy");
 
   BYTE srkSecret[] = TSS_WELL_KNOWN_SECRET;
-  rc = Tspi_Policy_SetSecret(hSrkPolicy, TSS_SECRET_MODE_SHA1,
-			     sizeof srkSecret, srkSecret);
+  rc = TRACE(Tspi_Policy_SetSecret, hSrkPolicy, TSS_SECRET_MODE_SHA1,
+	     sizeof srkSecret, srkSecret);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "setting SRK secret");
 
+  return 0;
+}
+
+/* Load a key and register it under the given UUID. */
+int loadkey(TSS_HCONTEXT hContext,
+	    BYTE *blob, UINT32 blobLen,
+	    TSS_UUID uuid)
+{
+  /* Get SRK */
+  TSS_UUID SRK_UUID = TSS_UUID_SRK;
+  TSS_HKEY hSRK;
+  if (load_srk(hContext, &hSRK))
+    return 1;
+
+  TSS_RESULT rc;
   TSS_HKEY hAIK;		/* AIK handle */
-  rc = Tspi_Context_LoadKeyByBlob(hContext, hSRK, blobLen, blob, &hAIK);
+  rc = TRACE(Tspi_Context_LoadKeyByBlob, hContext, hSRK, blobLen, blob, &hAIK);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "loading key blob");
 
   /* Register the key in persistant storage */
-  rc = Tspi_Context_RegisterKey(hContext, hAIK, TSS_PS_TYPE_SYSTEM,
-				uuid, TSS_PS_TYPE_SYSTEM, SRK_UUID);
+  rc = TRACE(Tspi_Context_RegisterKey, hContext, hAIK, TSS_PS_TYPE_SYSTEM,
+	     uuid, TSS_PS_TYPE_SYSTEM, SRK_UUID);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "registering a key");
 
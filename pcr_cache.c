@@ -0,0 +1,324 @@
+/*
+ * Cache PCR values that only change when a measurement log grows.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* Reading a PCR is a TPM command, but the firmware PCRs 0-7 do not
+   change after boot, and PCR 10 changes only as IMA adds to its
+   measurement list.  The kernel exports both logs in securityfs, so
+   a cached value stays good while its log has not grown and the
+   machine has not rebooted.  Each log has a generation counter,
+   bumped when the log changes, and an entry is good only while it
+   has the generation of its log.  Logs are measured before PCRs are
+   read, so a value read after an extend it missed in the log is
+   dropped the next time the log is measured.  Other PCRs may be
+   extended by anyone without a trace, so they are always read.
+
+   A cache kept in a file also remembers which quote command the TPM
+   supports, so that a version 1.1 TPM is not sent TPM_Quote2 on
+   every run. */
+
+#ifndef SECURITYFS
+#define SECURITYFS "/sys/kernel/security"
+#endif
+#define PCR_CACHE_ENV "TPM_QUOTE_PCR_CACHE"
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define BOOTIDSIZE 48
+#define NOLOG ((UINT64)-1)	/* Size of a missing log */
+
+static const struct {
+  const char *name;		/* As written in the cache file */
+  const char *path;
+  const char *count;		/* File counting the entries, if any */
+  UINT32 first, last;		/* PCRs the log measures */
+} logs[] = {
+  { "bios", SECURITYFS "/tpm0/binary_bios_measurements", NULL, 0, 7 },
+  { "ima", SECURITYFS "/ima/ascii_runtime_measurements",
+    SECURITYFS "/ima/runtime_measurements_count", 10, 10 }
+};
+#define NLOGS (sizeof logs / sizeof logs[0])
+
+struct pcr_cache {
+  char *name;			/* File the cache is kept in, or NULL */
+  int dirty;			/* Changed since read from the file */
+  int validated;		/* Logs measured at least once */
+  enum quote_mode mode;		/* Quote command the TPM supports */
+  char boot[BOOTIDSIZE];
+  UINT64 logSize[NLOGS];
+  UINT64 generation[NLOGS];
+  struct {
+    UINT64 generation;		/* Zero when empty */
+    BYTE value[PCRVALS_VALUESIZE];
+  } entry[PCRVALS_NPCRS];
+  struct pcr_cache_stats stats;
+};
+
+/* Returns the log measuring a PCR, or -1 if none does. */
+static int log_of(UINT32 pcr)
+{
+  unsigned i;
+  for (i = 0; i < NLOGS; i++)
+    if (pcr >= logs[i].first && pcr <= logs[i].last)
+      return i;
+  return -1;
+}
+
+/* Measures a log by its number of entries when the kernel counts
+   them, and otherwise by its length.  Securityfs files report no
+   size, so the log is read through. */
+static UINT64 log_size(unsigned i)
+{
+  FILE *f;
+  if (logs[i].count && (f = fopen(logs[i].count, "r"))) {
+    unsigned long long n;
+    int ok = fscanf(f, "%llu", &n) == 1;
+    fclose(f);
+    if (ok)
+      return n;
+  }
+  if (!(f = fopen(logs[i].path, "r")))
+    return NOLOG;
+  UINT64 size = 0;
+  BYTE buf[1 << 14];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+    size += n;
+  fclose(f);
+  return size;
+}
+
+/* Reads the kernel's boot id, which is - when there is none. */
+static void read_boot_id(char *boot)
+{
+  memset(boot, 0, BOOTIDSIZE);
+  FILE *f = fopen(BOOT_ID, "r");
+  if (f) {
+    if (!fgets(boot, BOOTIDSIZE, f))
+      *boot = 0;
+    boot[strcspn(boot, " \n")] = 0;
+    fclose(f);
+  }
+  if (!*boot)
+    strcpy(boot, "-");
+}
+
+/* Reads a cache file, leaving the cache empty when the file is
+   missing or malformed. */
+static void load(struct pcr_cache *c)
+{
+  FILE *f = fopen(c->name, "r");
+  if (!f)
+    return;
+  char line[256];
+  int bad = 0;
+  while (!bad && fgets(line, sizeof line, f)) {
+    char word[16], hex[2 * PCRVALS_VALUESIZE + 1];
+    unsigned long long size, generation;
+    unsigned pcr;
+    unsigned i;
+    if (sscanf(line, "boot %47s", c->boot) == 1)
+      continue;
+    if (sscanf(line, "mode %15s", word) == 1) {
+      if (!strcmp(word, quote_mode_name(QUOTE_MODE_QUOTE2)))
+	c->mode = QUOTE_MODE_QUOTE2;
+      else if (!strcmp(word, quote_mode_name(QUOTE_MODE_LEGACY)))
+	c->mode = QUOTE_MODE_LEGACY;
+      continue;
+    }
+    if (sscanf(line, "log %15s %llu %llu", word, &size, &generation) == 3) {
+      for (i = 0; i < NLOGS && strcmp(word, logs[i].name); i++);
+      if (i < NLOGS) {
+	c->logSize[i] = size;
+	c->generation[i] = generation;
+      }
+      continue;
+    }
+    if (sscanf(line, "pcr %u %llu %40s", &pcr, &generation, hex) == 3
+	&& pcr < PCRVALS_NPCRS && strlen(hex) == 2 * PCRVALS_VALUESIZE
+	&& !hex_decode(c->entry[pcr].value, hex, PCRVALS_VALUESIZE)) {
+      c->entry[pcr].generation = generation;
+      continue;
+    }
+    bad = 1;
+  }
+  fclose(f);
+  if (bad) {
+    fprintf(stderr, "Ignoring malformed PCR cache %s\n", c->name);
+    memset(c->boot, 0, sizeof c->boot);
+    memset(c->entry, 0, sizeof c->entry);
+    c->mode = QUOTE_MODE_UNKNOWN;
+  }
+}
+
+/* Opens a cache kept in the named file, or when name is NULL, one
+   kept only in memory.  A missing file makes an empty cache.  The
+   logs are measured on the first read. */
+struct pcr_cache *pcr_cache_open(const char *name)
+{
+  struct pcr_cache *c = calloc(1, sizeof *c);
+  if (!c || (name && !(c->name = strdup(name)))) {
+    free(c);
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  unsigned i;
+  for (i = 0; i < NLOGS; i++) {
+    c->logSize[i] = NOLOG;
+    c->generation[i] = 1;
+  }
+  if (name)
+    load(c);
+  return c;
+}
+
+/* Opens the cache kept in the file named by TPM_QUOTE_PCR_CACHE.
+   Returns NULL when the variable is not set. */
+struct pcr_cache *pcr_cache_default(void)
+{
+  const char *name = getenv(PCR_CACHE_ENV);
+  return name && *name ? pcr_cache_open(name) : NULL;
+}
+
+/* Measures the logs, and drops the values of the PCRs whose log has
+   changed, or all of them after a reboot.  Call before a group of
+   reads, so that the values reflect every extend already logged. */
+void pcr_cache_validate(struct pcr_cache *c)
+{
+  char boot[BOOTIDSIZE];
+  read_boot_id(boot);
+  int rebooted = strcmp(boot, c->boot) != 0;
+  if (rebooted) {
+    memcpy(c->boot, boot, sizeof boot);
+    c->dirty = 1;
+  }
+  unsigned i;
+  for (i = 0; i < NLOGS; i++) {
+    UINT64 size = log_size(i);
+    if (rebooted || size != c->logSize[i]) {
+      c->logSize[i] = size;
+      c->generation[i]++;
+      c->stats.invalidations++;
+      c->dirty = 1;
+    }
+  }
+  c->validated = 1;
+}
+
+/* Gets the value of a PCR from the cache, or when it is not there,
+   from the TPM. */
+int pcr_cache_read(struct pcr_cache *c, TSS_HCONTEXT hContext,
+		   TSS_HTPM hTPM, UINT32 pcr, BYTE *value)
+{
+  if (!c->validated)
+    pcr_cache_validate(c);
+  int log = pcr < PCRVALS_NPCRS ? log_of(pcr) : -1;
+  if (log >= 0 && c->entry[pcr].generation == c->generation[log]) {
+    memcpy(value, c->entry[pcr].value, PCRVALS_VALUESIZE);
+    c->stats.hits++;
+    return 0;
+  }
+  c->stats.misses++;
+  UINT32 len;
+  BYTE *tpmValue;
+  TSS_RESULT rc = TRACE(Tspi_TPM_PcrRead, hTPM, pcr, &len, &tpmValue);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "reading PCR");
+  int bad = len != PCRVALS_VALUESIZE;
+  if (bad)
+    fprintf(stderr, "Unexpected PCR value size %u\n", len);
+  else
+    memcpy(value, tpmValue, len);
+  Tspi_Context_FreeMemory(hContext, tpmValue);
+  if (!bad && log >= 0) {
+    memcpy(c->entry[pcr].value, value, PCRVALS_VALUESIZE);
+    c->entry[pcr].generation = c->generation[log];
+    c->dirty = 1;
+  }
+  return bad;
+}
+
+/* Drops the value of a PCR, as after extending it. */
+void pcr_cache_invalidate(struct pcr_cache *c, UINT32 pcr)
+{
+  if (pcr < PCRVALS_NPCRS && c->entry[pcr].generation) {
+    c->entry[pcr].generation = 0;
+    c->stats.invalidations++;
+    c->dirty = 1;
+  }
+}
+
+/* Returns the quote command the TPM was found to support, which is
+   QUOTE_MODE_UNKNOWN until one is set. */
+enum quote_mode pcr_cache_mode(struct pcr_cache *c)
+{
+  return c->mode;
+}
+
+void pcr_cache_set_mode(struct pcr_cache *c, enum quote_mode mode)
+{
+  if (mode != c->mode) {
+    c->mode = mode;
+    c->dirty = 1;
+  }
+}
+
+void pcr_cache_get_stats(struct pcr_cache *c, struct pcr_cache_stats *stats)
+{
+  *stats = c->stats;
+}
+
+/* Writes the cache back to its file when it has changed, and frees
+   it.  Returns nonzero when the file cannot be written. */
+int pcr_cache_close(struct pcr_cache *c)
+{
+  if (!c)
+    return 0;
+  int bad = 0;
+  if (c->name && c->dirty) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out) {
+      fprintf(stderr, "Out of memory\n");
+      bad = 1;
+    }
+    else {
+      if (*c->boot)		/* Unset until validated */
+	fprintf(out, "boot %s\n", c->boot);
+      if (c->mode != QUOTE_MODE_UNKNOWN)
+	fprintf(out, "mode %s\n", quote_mode_name(c->mode));
+      unsigned i;
+      for (i = 0; i < NLOGS; i++)
+	fprintf(out, "log %s %llu %llu\n", logs[i].name,
+		(unsigned long long)c->logSize[i],
+		(unsigned long long)c->generation[i]);
+      for (i = 0; i < PCRVALS_NPCRS; i++)
+	if (c->entry[i].generation) {
+	  char hex[2 * PCRVALS_VALUESIZE + 1];
+	  hex_encode(hex, c->entry[i].value, PCRVALS_VALUESIZE);
+	  hex[2 * PCRVALS_VALUESIZE] = 0;
+	  fprintf(out, "pcr %u %llu %s\n", i,
+		  (unsigned long long)c->entry[i].generation, hex);
+	}
+      bad = fclose(out) != 0 || file_write(c->name, buf, len);
+      free(buf);
+    }
+  }
+  free(c->name);
+  free(c);
+  return bad;
+}
@@ -0,0 +1,186 @@
+/*
+ * Verify quote signatures with OpenSSL instead of the TSS.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* Decodes a DER encoded public key, as written by tpm_mkaik, into
+   a TPM_PUBKEY blob.  On input, *blobLen is the size of blob. */
+int pubkey_decode(BYTE *der, UINT32 derLen, BYTE *blob, UINT32 *blobLen)
+{
+  UINT32 blobType;
+  TSS_RESULT rc =
+    TRACE(Tspi_DecodeBER_TssBlob, derLen, der, &blobType, blobLen, blob);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "decoding public key");
+  if (blobType !=  TSS_BLOB_TYPE_PUBKEY) {
+    fprintf(stderr, "Error while decoding public key, got wrong blob type\n");
+    return 1;
+  }
+  return 0;
+}
+
+#if defined HAVE_OPENSSL_RSA_LIB
+
+/* The RSA_* interface is deprecated in OpenSSL 3.0, but it is the
+   only one shared by all the versions in use. */
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/bn.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+struct pubkey {
+  RSA *rsa;
+};
+
+/* Reads a big-endian UINT32 from a blob, advancing the offset. */
+static int unload_uint32(BYTE *blob, UINT32 blobLen,
+			 UINT32 *offset, UINT32 *value)
+{
+  if (*offset > blobLen || blobLen - *offset < 4)
+    return 1;
+  BYTE *p = blob + *offset;
+  *value = (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3];
+  *offset += 4;
+  return 0;
+}
+
+/* Parses a TPM_PUBKEY blob, as produced by Tspi_DecodeBER_TssBlob,
+   into an RSA public key.  Returns NULL on error. */
+struct pubkey *pubkey_new(BYTE *blob, UINT32 blobLen)
+{
+  UINT32 offset = 0;
+  UINT32 algorithmID, parmSize, keyLength, numPrimes, exponentSize;
+
+  /* TPM_KEY_PARMS */
+  if (unload_uint32(blob, blobLen, &offset, &algorithmID)
+      || algorithmID != TPM_ALG_RSA) {
+    fprintf(stderr, "Public key is not an RSA key\n");
+    return NULL;
+  }
+  offset += 4;			/* Skip encScheme and sigScheme */
+  if (unload_uint32(blob, blobLen, &offset, &parmSize)
+      || blobLen - offset < parmSize
+      || unload_uint32(blob, blobLen, &offset, &keyLength)
+      || unload_uint32(blob, blobLen, &offset, &numPrimes)
+      || unload_uint32(blob, blobLen, &offset, &exponentSize)
+      || blobLen - offset < exponentSize) {
+    fprintf(stderr, "Public key parameters ill-formed\n");
+    return NULL;
+  }
+  BYTE *exponent = blob + offset;
+  offset += exponentSize;
+
+  /* TPM_STORE_PUBKEY */
+  if (unload_uint32(blob, blobLen, &offset, &keyLength)
+      || keyLength == 0 || blobLen - offset < keyLength) {
+    fprintf(stderr, "Public key modulus ill-formed\n");
+    return NULL;
+  }
+  BYTE *modulus = blob + offset;
+
+  /* An empty exponent means the default of 2^16 + 1 */
+  BYTE defaultExponent[] = { 0x01, 0x00, 0x01 };
+  if (exponentSize == 0) {
+    exponent = defaultExponent;
+    exponentSize = sizeof defaultExponent;
+  }
+
+  struct pubkey *key = malloc(sizeof *key);
+  BIGNUM *n = BN_bin2bn(modulus, keyLength, NULL);
+  BIGNUM *e = BN_bin2bn(exponent, exponentSize, NULL);
+  RSA *rsa = RSA_new();
+  if (!key || !n || !e || !rsa) {
+    fprintf(stderr, "Out of memory\n");
+    goto fail;
+  }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  rsa->n = n;
+  rsa->e = e;
+#else
+  if (!RSA_set0_key(rsa, n, e, NULL)) {
+    fprintf(stderr, "Cannot set public key\n");
+    goto fail;
+  }
+#endif
+  key->rsa = rsa;
+  return key;
+
+ fail:
+  free(key);
+  BN_free(n);
+  BN_free(e);
+  RSA_free(rsa);
+  return NULL;
+}
+
+void pubkey_free(struct pubkey *key)
+{
+  if (!key)
+    return;
+  RSA_free(key->rsa);
+  free(key);
+}
+
+/* Checks a PKCS#1 v1.5 SHA-1 signature over the quote info, the
+   data signed by TPM_Quote and TPM_Quote2. */
+int pubkey_verify(struct pubkey *key, BYTE *data, UINT32 dataLen,
+		  BYTE *sig, UINT32 sigLen)
+{
+  BYTE digest[SHA_DIGEST_LENGTH];
+  SHA1(data, dataLen, digest);
+  return pubkey_verify_digest(key, digest, sig, sigLen);
+}
+
+/* Checks a signature given the SHA-1 digest of the quote info, as
+   computed for many quotes at once by sha1_multi. */
+int pubkey_verify_digest(struct pubkey *key, BYTE *digest,
+			 BYTE *sig, UINT32 sigLen)
+{
+  if (RSA_verify(NID_sha1, digest, SHA_DIGEST_LENGTH,
+		 sig, sigLen, key->rsa) != 1) {
+    fprintf(stderr, "Error while verifying signature\n");
+    return 1;
+  }
+  return 0;
+}
+
+#else
+
+struct pubkey *pubkey_new(BYTE *blob, UINT32 blobLen)
+{
+  fprintf(stderr, "OpenSSL signature checking not available\n");
+  return NULL;			/* Always fail without OpenSSL */
+}
+
+void pubkey_free(struct pubkey *key)
+{
+}
+
+int pubkey_verify(struct pubkey *key, BYTE *data, UINT32 dataLen,
+		  BYTE *sig, UINT32 sigLen)
+{
+  return 1;
+}
+
+int pubkey_verify_digest(struct pubkey *key, BYTE *digest,
+			 BYTE *sig, UINT32 sigLen)
+{
+  return 1;
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "tpm_quote.h"
 
 #if defined HAVE_TSS_12_LIB
@@ -51,137 +52,442 @@
 
     #endif
 
-    static int  _quote2(TSS_HCONTEXT hContext,
-                        TSS_HKEY hAIK,
-                        TSS_HTPM hTPM,
-                        UINT32 *pcrs, UINT32 npcrs,
-                        TSS_VALIDATION *valid)
+    static int  _pcrs2(TSS_HCONTEXT hContext,
+                       UINT32 *pcrs, UINT32 npcrs,
+                       TSS_HPCRS *hPCRs)
     {
         TSS_RESULT  rc;
-        TSS_HPCRS   hPCRs;
         UINT32 i;
-        BYTE *versionInfo;
-        UINT32 versionInfoLen;
-        
-        rc = Tspi_Context_CreateObject( hContext, 
-                                        TSS_OBJECT_TYPE_PCRS, TSS_PCRS_STRUCT_INFO_SHORT, 
-                                        &hPCRs );
+
+        rc = TRACE(Tspi_Context_CreateObject, hContext,
+                   TSS_OBJECT_TYPE_PCRS, TSS_PCRS_STRUCT_INFO_SHORT,
+                   hPCRs);
         if (rc != TSS_SUCCESS)
             return tss_err(rc, "creating PCR mask object");
 
         for (i = 0; i < npcrs; i++) {    
-            rc = Tspi_PcrComposite_SelectPcrIndexEx(hPCRs, pcrs[i],
-					                                TSS_PCRS_DIRECTION_RELEASE);
+            rc = TRACE(Tspi_PcrComposite_SelectPcrIndexEx, *hPCRs, pcrs[i],
+                       TSS_PCRS_DIRECTION_RELEASE);
             if (rc != TSS_SUCCESS)
                 return tss_err(rc, "creating PCR mask");
         }
 
-        rc = Tspi_TPM_Quote2(hTPM, hAIK, FALSE, hPCRs, valid,
-		                     &versionInfoLen, &versionInfo);
+        return 0;
+    }
+
+    static TSS_RESULT _quote2(TSS_HKEY hAIK,
+                              TSS_HTPM hTPM,
+                              TSS_HPCRS hPCRs,
+                              TSS_VALIDATION *valid)
+    {
+        TSS_RESULT  rc;
+        BYTE *versionInfo;
+        UINT32 versionInfoLen;
+
+        rc = TRACE(Tspi_TPM_Quote2, hTPM, hAIK, FALSE, hPCRs, valid,
+                   &versionInfoLen, &versionInfo);
         show_hash_offset(valid);
-        if (rc != TSS_SUCCESS)
-            return tss_err(rc, "performing quote");
+        return rc;
+    }
 
-        return 0;
+    /* The mode a session starts in, before any quote is made. */
+    static enum quote_mode _default_mode(void)
+    {
+        return QUOTE_MODE_UNKNOWN;
     }
     
 #else
     
-    static int _quote2( TSS_HCONTEXT hContext,
-                        TSS_HKEY hAIK,
-                        TSS_HTPM hTPM,
-                        UINT32 *pcrs, UINT32 npcrs,
-                        TSS_VALIDATION *valid)
+    static int  _pcrs2(TSS_HCONTEXT hContext,
+                       UINT32 *pcrs, UINT32 npcrs,
+                       TSS_HPCRS *hPCRs)
     {
         (void)hContext;
-        (void)hAIK;
-        (void)hTPM;
         (void)pcrs;
         (void)npcrs;
+        (void)hPCRs;
+
+        return -1;              /* Quote2 unsupported */
+    }
+
+    static TSS_RESULT _quote2(TSS_HKEY hAIK,
+                              TSS_HTPM hTPM,
+                              TSS_HPCRS hPCRs,
+                              TSS_VALIDATION *valid)
+    {
+        (void)hAIK;
+        (void)hTPM;
+        (void)hPCRs;
         (void)valid;
 
-        fprintf(stderr, "Error quote2 not supported (!defined HAVE_TSS_12_LIB).\n");
-        return 1;
+        return TSP_ERROR(TSS_E_NOTIMPL);
+    }
+
+    static enum quote_mode _default_mode(void)
+    {
+        return QUOTE_MODE_LEGACY;
     }
     
 #endif
 
-static int  _quote_legacy(  TSS_HCONTEXT hContext,
-                            TSS_HKEY hAIK,
-                            TSS_HTPM hTPM,
+static int  _pcrs_legacy(   TSS_HCONTEXT hContext,
                             UINT32 *pcrs, UINT32 npcrs,
-                            TSS_VALIDATION *valid)
+                            TSS_HPCRS *hPCRs)
 {
     TSS_RESULT  rc;
-    TSS_HPCRS   hPCRs;
     UINT32 i;
 
-    rc = Tspi_Context_CreateObject( hContext, 
-                                    TSS_OBJECT_TYPE_PCRS, TSS_PCRS_STRUCT_INFO,
-                                    &hPCRs );
+    rc = TRACE(Tspi_Context_CreateObject, hContext,
+               TSS_OBJECT_TYPE_PCRS, TSS_PCRS_STRUCT_INFO, hPCRs);
     if (rc != TSS_SUCCESS)
         return tss_err(rc, "creating PCR mask object");
 
     for (i = 0; i < npcrs; i++) {
-        rc = Tspi_PcrComposite_SelectPcrIndex(hPCRs, pcrs[i]);
+        rc = TRACE(Tspi_PcrComposite_SelectPcrIndex, *hPCRs, pcrs[i]);
         if (rc != TSS_SUCCESS)
             return tss_err(rc, "creating PCR mask");
     }
 
-    rc = Tspi_TPM_Quote(hTPM, hAIK, hPCRs, valid);
+    return 0;
+}
+
+static int  _quote_legacy(  TSS_HKEY hAIK,
+                            TSS_HTPM hTPM,
+                            TSS_HPCRS hPCRs,
+                            TSS_VALIDATION *valid)
+{
+    TSS_RESULT rc = TRACE(Tspi_TPM_Quote, hTPM, hAIK, hPCRs, valid);
     if (rc != TSS_SUCCESS)
         return tss_err(rc, "performing quote");
     
     return 0;
 }
 
-/* Returns a TPM quote in the TSS validation struct.  The nonce used
-   by the quote is passed in via the struct. */
-int quote(TSS_HCONTEXT hContext, TSS_UUID uuid,
-	      UINT32 *pcrs, UINT32 npcrs,
-	      TSS_VALIDATION *valid)
+static int uint32_compar(const void *a, const void *b)
 {
-    TSS_RESULT rc;
-    
-    /* Get TPM handle */
-    TSS_HTPM hTPM;		/* TPM handle */
-    rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
-    if (rc != TSS_SUCCESS)
-        return tss_err(rc, "getting TPM object");
+    UINT32 x = *(UINT32 *) a;
+    UINT32 y = *(UINT32 *) b;
+    return x < y ? -1 : x > y;
+}
 
-    /* Get SRK */
-    TSS_UUID SRK_UUID = TSS_UUID_SRK;
-    TSS_HKEY hSRK;
+/* A quote session holds everything needed to quote a fixed set of
+   PCRs with one AIK, so that each quote costs only the quote
+   command.  The PCR composite objects are built when first used,
+   and so is the choice of quote command.  Sessions for several PCR
+   sets may share one loaded AIK. */
+struct quote_session {
+    TSS_HCONTEXT hContext;
+    enum quote_mode mode;
+    TSS_HTPM hTPM;
+    TSS_HKEY hSRK;		/* Loaded by the session, or zero */
+    TSS_HKEY hAIK;
+    int ownAIK;			/* Non-zero when loaded by the session */
+    TSS_HPCRS hPCRs2;		/* Selection for Quote2, or zero */
+    TSS_HPCRS hPCRsLegacy;	/* Selection for Quote, or zero */
+    int quoted;			/* hPCRsLegacy holds quoted values */
+    struct pcr_cache *cache;	/* Read PCRs through, or NULL */
+    UINT32 npcrs;
+    UINT32 pcrs[1];		/* Extended to npcrs entries */
+};
 
-    rc = Tspi_Context_LoadKeyByUUID(hContext, TSS_PS_TYPE_SYSTEM,
-		          SRK_UUID, &hSRK);
+/* Loads the AIK registered under the given UUID.  The SRK must
+   already be loaded with its secret set, as done by load_srk. */
+int quote_load_aik(TSS_HCONTEXT hContext, TSS_UUID uuid, TSS_HKEY *hAIK)
+{
+    TSS_RESULT rc = TRACE(Tspi_Context_LoadKeyByUUID, hContext,
+                          TSS_PS_TYPE_SYSTEM, uuid, hAIK);
     if (rc != TSS_SUCCESS)
-        return tss_err(rc, "loading SRK");
+        return tss_err(rc, "loading AIK");
+    return 0;
+}
 
-    TSS_HPOLICY hSrkPolicy;
-    rc = Tspi_GetPolicyObject(hSRK, TSS_POLICY_USAGE, &hSrkPolicy);
-    if (rc != TSS_SUCCESS)
-        return tss_err(rc, "getting SRK policy");
+/* Makes a session with its TPM handle, but no keys. */
+static struct quote_session *session_new(TSS_HCONTEXT hContext,
+                                         UINT32 *pcrs, UINT32 npcrs)
+{
+    struct quote_session *session =
+        calloc(1, sizeof *session + npcrs * sizeof *pcrs);
+    if (!session) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    session->hContext = hContext;
+    session->mode = _default_mode();
+    session->npcrs = npcrs;
+    memcpy(session->pcrs, pcrs, npcrs * sizeof *pcrs);
+    qsort(session->pcrs, npcrs, sizeof *pcrs, uint32_compar);
 
-    BYTE srkSecret[] = TSS_WELL_KNOWN_SECRET;
-    rc = Tspi_Policy_SetSecret(hSrkPolicy, TSS_SECRET_MODE_SHA1,
-	             sizeof srkSecret, srkSecret);
-    if (rc != TSS_SUCCESS)
-        return tss_err(rc, "setting SRK secret");
+    /* Get TPM handle */
+    TSS_RESULT rc = TRACE(Tspi_Context_GetTpmObject, hContext, &session->hTPM);
+    if (rc != TSS_SUCCESS) {
+        tss_err(rc, "getting TPM object");
+        quote_session_close(session);
+        return NULL;
+    }
+    return session;
+}
 
-    /* Get AIK */
-    TSS_HKEY hAIK;		/* AIK handle */
-    rc = Tspi_Context_LoadKeyByUUID(hContext, TSS_PS_TYPE_SYSTEM,
-		          uuid, &hAIK);
-    if (rc != TSS_SUCCESS)
-        return tss_err(rc, "loading AIK");
+/* Opens a session for quoting the given PCRs with the AIK registered
+   under the UUID.  hSRK is the SRK as loaded by load_srk, which the
+   caller keeps open for the life of the session, or zero to have the
+   session load it.  Returns NULL on error. */
+struct quote_session *quote_session_open(TSS_HCONTEXT hContext,
+                                         TSS_HKEY hSRK, TSS_UUID uuid,
+                                         UINT32 *pcrs, UINT32 npcrs)
+{
+    struct quote_session *session = session_new(hContext, pcrs, npcrs);
+    if (!session)
+        return NULL;
 
-    /* Get quote */
-    if( 0!= _quote2(  hContext, hAIK, hTPM, pcrs, npcrs, valid) ){
-        fprintf(stderr, "\t... failling back to legacy quote command\n");
-        return _quote_legacy(   hContext, hAIK, hTPM, pcrs, npcrs, valid);
+    /* Get SRK and AIK */
+    if ((!hSRK && load_srk(hContext, &session->hSRK))
+        || quote_load_aik(hContext, uuid, &session->hAIK)) {
+        quote_session_close(session);
+        return NULL;
     }
+    session->ownAIK = 1;
+    return session;
+}
+
+/* Opens a session for quoting the given PCRs with an AIK already
+   loaded by quote_load_aik.  The caller closes the AIK after the
+   session, so that sessions for other PCRs can share it. */
+struct quote_session *quote_session_open_aik(TSS_HCONTEXT hContext,
+                                             TSS_HKEY hAIK,
+                                             UINT32 *pcrs, UINT32 npcrs)
+{
+    struct quote_session *session = session_new(hContext, pcrs, npcrs);
+    if (session)
+        session->hAIK = hAIK;
+    return session;
+}
 
+/* Makes a quote with TPM_Quote2.  Sets unsupported when the TPM or
+   the TSS does not implement the command, which is not reported. */
+static int session_quote2(struct quote_session *session,
+                          TSS_VALIDATION *valid, int *unsupported)
+{
+    session->quoted = 0;
+    *unsupported = 0;
+    if (!session->hPCRs2) {
+        int prc = _pcrs2(session->hContext, session->pcrs, session->npcrs,
+                         &session->hPCRs2);
+        if (prc) {
+            session->hPCRs2 = 0;
+            *unsupported = prc < 0;
+            return 1;
+        }
+    }
+    TSS_RESULT rc = _quote2(session->hAIK, session->hTPM, session->hPCRs2,
+                            valid);
+    if (rc == TSS_SUCCESS)
+        return 0;
+    *unsupported = rc == TPM_E_BAD_ORDINAL
+        || (ERROR_LAYER(rc) == TSS_LAYER_TSP
+            && ERROR_CODE(rc) == TSS_E_NOTIMPL);
+    if (!*unsupported)
+        tss_err(rc, "performing quote");
+    return 1;
+}
+
+/* TPM_Quote returns the quoted PCR composite, and the TSS stores
+   its values in the composite object. */
+static int session_quote_legacy(struct quote_session *session,
+                                TSS_VALIDATION *valid)
+{
+    if (!session->hPCRsLegacy
+        && _pcrs_legacy(session->hContext, session->pcrs, session->npcrs,
+                        &session->hPCRsLegacy)) {
+        session->hPCRsLegacy = 0;
+        return 1;
+    }
+    session->quoted = 0 == _quote_legacy(session->hAIK, session->hTPM,
+                                         session->hPCRsLegacy, valid);
+    return !session->quoted;
+}
+
+/* Returns a TPM quote in the TSS validation struct.  The nonce used
+   by the quote is passed in via the struct.  The first quote of a
+   session tries TPM_Quote2, and uses TPM_Quote only when the TPM
+   rejects TPM_Quote2 as an unknown command.  The mode found is kept
+   in the session's PCR cache, if any, so that later runs on a
+   version 1.1 TPM go straight to TPM_Quote. */
+int quote_session_quote(struct quote_session *session,
+                        TSS_VALIDATION *valid)
+{
+    int unsupported;
+    if (session->mode == QUOTE_MODE_UNKNOWN && session->cache)
+        session->mode = pcr_cache_mode(session->cache);
+
+    switch (session->mode) {
+    case QUOTE_MODE_QUOTE2:
+        return session_quote2(session, valid, &unsupported);
+    case QUOTE_MODE_LEGACY:
+        return session_quote_legacy(session, valid);
+    default:
+        break;
+    }
+
+    if (0 == session_quote2(session, valid, &unsupported))
+        session->mode = QUOTE_MODE_QUOTE2;
+    else if (!unsupported)
+        return 1;
+    else {
+        fprintf(stderr, "TPM_Quote2 is not supported; "
+                "using the legacy quote command\n");
+        if (session_quote_legacy(session, valid))
+            return 1;
+        session->mode = QUOTE_MODE_LEGACY;
+    }
+    if (session->cache)
+        pcr_cache_set_mode(session->cache, session->mode);
     return 0;
 }
 
+/* Returns the quote command used by a session, which is
+   QUOTE_MODE_UNKNOWN until the first quote succeeds, or
+   QUOTE_MODE_LEGACY when the TSS lacks TPM_Quote2. */
+enum quote_mode quote_session_mode(struct quote_session *session)
+{
+    return session->mode;
+}
+
+/* Sets the quote command used by a session, so that sessions for a
+   TPM whose mode is known need not probe it again. */
+void quote_session_set_mode(struct quote_session *session,
+                            enum quote_mode mode)
+{
+    session->mode = mode == QUOTE_MODE_UNKNOWN ? _default_mode() : mode;
+}
+
+/* Has the session read PCR values through a cache, which the caller
+   closes after the session. */
+void quote_session_set_pcr_cache(struct quote_session *session,
+                                 struct pcr_cache *cache)
+{
+    session->cache = cache;
+}
+
+/* Writes the values of the session's PCRs as lines of the form
+   index=value in increasing index order.  After a legacy quote,
+   the values are the ones signed by the quote, and are written
+   without further TPM commands.  Otherwise, each PCR is read, and
+   may have been extended since the quote was made.  With a PCR
+   cache, values that cannot have changed are not read again. */
+int quote_session_pcrvals(struct quote_session *session, FILE *out)
+{
+    UINT32 i;
+    if (!session->quoted && session->cache)
+        pcr_cache_validate(session->cache);
+    for (i = 0; i < session->npcrs; i++) {
+        UINT32 pcr = session->pcrs[i];
+        if (i > 0 && pcr == session->pcrs[i - 1])
+            continue;
+        UINT32 len;
+        BYTE *value;
+        TSS_RESULT rc;
+        if (!session->quoted && session->cache) {
+            BYTE cached[PCRVALS_VALUESIZE];
+            if (pcr_cache_read(session->cache, session->hContext,
+                               session->hTPM, pcr, cached))
+                return 1;
+            if (pcrvals_write(out, pcr, cached, sizeof cached)) {
+                fprintf(stderr, "Cannot write value of PCR %u\n", pcr);
+                return 1;
+            }
+            continue;
+        }
+        if (session->quoted)
+            rc = TRACE(Tspi_PcrComposite_GetPcrValue, session->hPCRsLegacy,
+                       pcr, &len, &value);
+        else
+            rc = TRACE(Tspi_TPM_PcrRead, session->hTPM, pcr, &len, &value);
+        if (rc != TSS_SUCCESS)
+            return tss_err(rc, "reading PCR");
+        int bad = pcrvals_write(out, pcr, value, len);
+        Tspi_Context_FreeMemory(session->hContext, value);
+        if (bad) {
+            fprintf(stderr, "Cannot write value of PCR %u\n", pcr);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Puts the values of the session's PCRs in a malloc'd buffer. */
+int quote_session_get_pcrvals(struct quote_session *session,
+                              char **buf, size_t *len)
+{
+    *buf = NULL;
+    *len = 0;
+    FILE *out = open_memstream(buf, len);
+    if (!out) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int bad = quote_session_pcrvals(session, out);
+    bad |= fclose(out) != 0;
+    if (bad) {
+        free(*buf);
+        *buf = NULL;
+    }
+    return bad;
+}
+
+/* Saves the values of the session's PCRs in the named file, which is
+   replaced only once they are all written. */
+int quote_session_save_pcrvals(struct quote_session *session,
+                               const char *name)
+{
+    char *buf;
+    size_t len;
+    if (quote_session_get_pcrvals(session, &buf, &len))
+        return 1;
+    int bad = file_write(name, buf, len);
+    free(buf);
+    return bad;
+}
+
+const char *quote_mode_name(enum quote_mode mode)
+{
+    switch (mode) {
+    case QUOTE_MODE_QUOTE2:
+        return "quote2";
+    case QUOTE_MODE_LEGACY:
+        return "legacy";
+    default:
+        return "unknown";
+    }
+}
+
+/* Releases the objects held by a session, but not its context. */
+void quote_session_close(struct quote_session *session)
+{
+    if (!session)
+        return;
+    TSS_HCONTEXT hContext = session->hContext;
+    if (session->hPCRs2)
+        TRACE(Tspi_Context_CloseObject, hContext, session->hPCRs2);
+    if (session->hPCRsLegacy)
+        TRACE(Tspi_Context_CloseObject, hContext, session->hPCRsLegacy);
+    if (session->hAIK && session->ownAIK)
+        TRACE(Tspi_Context_CloseObject, hContext, session->hAIK);
+    if (session->hSRK)
+        TRACE(Tspi_Context_CloseObject, hContext, session->hSRK);
+    free(session);
+}
+
+/* Returns a TPM quote in the TSS validation struct.  The nonce used
+   by the quote is passed in via the struct. */
+int quote(TSS_HCONTEXT hContext, TSS_UUID uuid,
+	      UINT32 *pcrs, UINT32 npcrs,
+	      TSS_VALIDATION *valid)
+{
+    struct quote_session *session =
+        quote_session_open(hContext, 0, uuid, pcrs, npcrs);
+    if (!session)
+        return 1;
+    int rc = quote_session_quote(session, valid);
+    quote_session_close(session);
+    return rc;
+}
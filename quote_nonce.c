@@ -11,7 +11,9 @@
 #include "config.h"
 #endif
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 
@@ -31,3 +33,136 @@ TPM_NONCE *quote_nonce(BYTE *info)
     return &qi->externalData;
   return NULL;
 }
+
+/* Inserts a nonce into provisioned signed data, so that it matches
+   the data signed by a quote made with the nonce. */
+int quote_set_nonce(BYTE *info, UINT32 infoLen, BYTE *nonce, UINT32 nonceLen)
+{
+  /* The tags are read before the layout they name is known, so the
+     shortest info whose nonce can be found is checked first. */
+  if (infoLen < offsetof(TPM_QUOTE_INFO2, externalData)
+      + sizeof(TPM_NONCE)) {
+    fprintf(stderr, "Hash wrong size\n");
+    return 1;
+  }
+  TPM_NONCE *infoNonce = quote_nonce(info);
+  if (!infoNonce) {
+    fprintf(stderr, "Hash format error\n");
+    return 1;
+  }
+  if ((BYTE *)(infoNonce + 1) > info + infoLen) {
+    fprintf(stderr, "Hash wrong size\n");
+    return 1;
+  }
+  if (nonceLen != sizeof(TPM_NONCE)) {
+    fprintf(stderr, "Nonce wrong size\n");
+    return 1;
+  }
+  memcpy(infoNonce, nonce, sizeof(TPM_NONCE));
+  return 0;
+}
+
+/* Nonces from several quote requests can share one quote, whose
+   nonce is then the root of a Merkle tree with the nonces as leaves.
+   Each requester gets the path from its nonce to the root.  A step
+   of a path is a byte that is 1 when the sibling is on the left,
+   followed by the sibling.  A node is the SHA-1 of a one byte and its
+   two children, and a node without a sibling moves up unchanged.  So
+   the root of a single nonce is the nonce itself, its path is empty,
+   and a quote made for one request is verified as before. */
+
+#define NODE_PREFIX 1
+#define NODESIZE sizeof(TPM_NONCE)
+
+/* Computes the root of the tree over n nonces, stored one after
+   another, and the path of each, which holds up to NONCE_MAXPATH
+   bytes. */
+int nonce_tree(const BYTE *nonces, size_t n, BYTE *root,
+	       BYTE *paths, UINT32 *pathLens)
+{
+  if (n == 0 || n > (size_t)1 << NONCE_MAXSTEPS) {
+    fprintf(stderr, "Cannot aggregate %lu nonces\n", (unsigned long)n);
+    return 1;
+  }
+  BYTE *level = malloc(n * NODESIZE);
+  size_t *pos = malloc(n * sizeof *pos);
+  BYTE (*msg)[1 + 2 * NODESIZE] = malloc((n / 2 + 1) * sizeof *msg);
+  struct sha1_msg *msgs = malloc((n / 2 + 1) * sizeof *msgs);
+  if (!level || !pos || !msg || !msgs) {
+    free(level);
+    free(pos);
+    free(msg);
+    free(msgs);
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  memcpy(level, nonces, n * NODESIZE);
+  size_t i, m = n;
+  for (i = 0; i < n; i++) {
+    pos[i] = i;
+    pathLens[i] = 0;
+  }
+  while (m > 1) {
+    size_t j, pairs = m / 2;
+    for (i = 0; i < n; i++) {
+      size_t p = pos[i];
+      if ((p ^ 1) < m) {
+	BYTE *step = paths + i * NONCE_MAXPATH + pathLens[i];
+	step[0] = p & 1;
+	memcpy(step + 1, level + (p ^ 1) * NODESIZE, NODESIZE);
+	pathLens[i] += NONCE_STEPSIZE;
+      }
+      pos[i] = p / 2;
+    }
+    for (j = 0; j < pairs; j++) {
+      msg[j][0] = NODE_PREFIX;
+      memcpy(msg[j] + 1, level + 2 * j * NODESIZE, 2 * NODESIZE);
+      msgs[j].data = msg[j];
+      msgs[j].len = sizeof msg[j];
+      msgs[j].digest = level + j * NODESIZE;
+    }
+    sha1_multi(msgs, pairs);
+    if (m % 2)
+      memmove(level + pairs * NODESIZE, level + (m - 1) * NODESIZE,
+	      NODESIZE);
+    m = pairs + m % 2;
+  }
+  memcpy(root, level, NODESIZE);
+  free(level);
+  free(pos);
+  free(msg);
+  free(msgs);
+  return 0;
+}
+
+/* Recomputes the root of a tree from a nonce and its path. */
+int nonce_path_root(const BYTE *nonce, UINT32 nonceLen,
+		    const BYTE *path, UINT32 pathLen, BYTE *root)
+{
+  if (nonceLen != NODESIZE) {
+    fprintf(stderr, "Nonce wrong size\n");
+    return 1;
+  }
+  if (pathLen % NONCE_STEPSIZE || pathLen > NONCE_MAXPATH) {
+    fprintf(stderr, "Nonce path format error\n");
+    return 1;
+  }
+  BYTE node[NODESIZE];
+  memcpy(node, nonce, NODESIZE);
+  for (; pathLen > 0; path += NONCE_STEPSIZE, pathLen -= NONCE_STEPSIZE) {
+    BYTE msg[1 + 2 * NODESIZE];
+    msg[0] = NODE_PREFIX;
+    if (path[0]) {
+      memcpy(msg + 1, path + 1, NODESIZE);
+      memcpy(msg + 1 + NODESIZE, node, NODESIZE);
+    }
+    else {
+      memcpy(msg + 1, node, NODESIZE);
+      memcpy(msg + 1 + NODESIZE, path + 1, NODESIZE);
+    }
+    struct sha1_msg m = { msg, sizeof msg, node };
+    sha1_multi(&m, 1);
+  }
+  memcpy(root, node, NODESIZE);
+  return 0;
+}
@@ -0,0 +1,646 @@
+/*
+ * Schedule TPM commands on a thread that owns the TPM.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* A quote worker takes jobs from its queues and makes them one at a
+   time, since a TPM performs one command at a time.  There is a queue
+   for each priority, and a job is taken from the most urgent queue
+   that has one, so attestation a verifier waits for goes ahead of
+   background provisioning.  A PCR read, or a key load for the same
+   UUID and blob, submitted while an identical job is queued becomes
+   a twin of it, and is answered by its command.  Each AIK is loaded
+   by its UUID once, when first quoted with, and is shared by every
+   later quote with it, whatever its PCRs, until a key is loaded under
+   the UUID or a quote with it fails.  So quotes with one AIK, queued
+   or not, make a single LoadKeyByUUID call.  Jobs are submitted
+   without blocking, and completed jobs are handed back on the
+   caller's thread by quote_worker_complete, so an event loop polls
+   the worker's file descriptor along with its sockets, and never
+   waits for the TPM.  Without threads, jobs are made as they are
+   submitted, and are handed back in the same way. */
+
+#define NAIKS 64		/* Most AIKs kept loaded */
+#define NSESSIONS 64		/* Most quote sessions kept open */
+
+struct quote_worker {
+  TSS_HCONTEXT hContext;	/* Used only by the worker */
+  TSS_HTPM hTPM;		/* Zero until needed */
+  TSS_HKEY hSRK;		/* Zero until needed */
+  int ownSRK;			/* Non-zero when loaded by the worker */
+  struct pcr_cache *pcrs;	/* Values of PCRs read */
+  quote_done *done;
+  /* Loaded AIKs by UUID, shared by the sessions for each PCR
+     selection.  When a table is full, the slot to reuse is chosen
+     round robin. */
+  struct {
+    TSS_UUID uuid;
+    TSS_HKEY hAIK;
+  } aiks[NAIKS];
+  unsigned naiks;
+  unsigned nextaik;
+  /* Open sessions by AIK UUID and PCR selection */
+  struct {
+    TSS_UUID uuid;
+    UINT32 pcrs[QUOTED_MAXPCRS];
+    UINT32 npcrs;
+    struct quote_session *session;
+  } sessions[NSESSIONS];
+  unsigned nsessions;
+  unsigned nextsession;
+  /* The quote command the TPM supports, once a quote has succeeded */
+  enum quote_mode mode;
+  struct quote_job *queue[QUOTE_NPRIORITIES]; /* Jobs submitted */
+  struct quote_job **queueTail[QUOTE_NPRIORITIES];
+  unsigned long depth;		/* Jobs queued, less twins */
+  struct quote_worker_stats stats;
+  struct quote_job *completed;	/* Jobs made but not handed back */
+  struct quote_job **completedTail;
+  int signal[2];		/* A byte is written per command made */
+#if defined HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_mutex_t lock;		/* Guards the queues and stop */
+  pthread_cond_t more;		/* Signaled on submission and stop */
+  int stop;
+#endif
+};
+
+#if defined HAVE_PTHREAD_H
+#define LOCK(w) pthread_mutex_lock(&(w)->lock)
+#define UNLOCK(w) pthread_mutex_unlock(&(w)->lock)
+#else
+#define LOCK(w)
+#define UNLOCK(w)
+#endif
+
+static UINT32 usec_since(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000
+    + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static UINT64 usec_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (UINT64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned bucket(UINT64 v)
+{
+  unsigned i = 0;
+  while (v && i < QUOTE_HISTSIZE - 1) {
+    v >>= 1;
+    i++;
+  }
+  return i;
+}
+
+/* Forget a session after a failure, so that it is reopened. */
+static void drop_session(struct quote_worker *w, int i)
+{
+  quote_session_close(w->sessions[i].session);
+  w->sessions[i] = w->sessions[--w->nsessions];
+  if (w->nextsession >= w->nsessions)
+    w->nextsession = 0;
+}
+
+/* Closes an AIK and the sessions that use it. */
+static void drop_aik(struct quote_worker *w, unsigned i)
+{
+  unsigned j = w->nsessions;
+  while (j-- > 0)
+    if (!memcmp(&w->sessions[j].uuid, &w->aiks[i].uuid,
+		sizeof w->aiks[i].uuid))
+      drop_session(w, j);
+  TRACE(Tspi_Context_CloseObject, w->hContext, w->aiks[i].hAIK);
+  w->aiks[i] = w->aiks[--w->naiks];
+  if (w->nextaik >= w->naiks)
+    w->nextaik = 0;
+}
+
+/* Closes the AIK loaded under a UUID, if any. */
+static void drop_uuid(struct quote_worker *w, TSS_UUID *uuid)
+{
+  unsigned i;
+  for (i = 0; i < w->naiks; i++)
+    if (!memcmp(&w->aiks[i].uuid, uuid, sizeof *uuid)) {
+      drop_aik(w, i);
+      return;
+    }
+}
+
+/* Gets the AIK registered under a UUID, loading it, and the SRK,
+   only when not already loaded. */
+static int find_aik(struct quote_worker *w, TSS_UUID *uuid, TSS_HKEY *hAIK)
+{
+  unsigned i;
+  for (i = 0; i < w->naiks; i++)
+    if (!memcmp(&w->aiks[i].uuid, uuid, sizeof *uuid)) {
+      *hAIK = w->aiks[i].hAIK;
+      LOCK(w);
+      w->stats.aikShared++;
+      UNLOCK(w);
+      return 0;
+    }
+  if (!w->hSRK) {
+    if (load_srk(w->hContext, &w->hSRK)) {
+      w->hSRK = 0;
+      return 1;
+    }
+    w->ownSRK = 1;
+  }
+  if (quote_load_aik(w->hContext, *uuid, hAIK))
+    return 1;
+  LOCK(w);
+  w->stats.aikLoads++;
+  UNLOCK(w);
+  if (w->naiks == NAIKS) {
+    drop_aik(w, w->nextaik);
+    w->nextaik = (w->nextaik + 1) % NAIKS;
+  }
+  w->aiks[w->naiks].uuid = *uuid;
+  w->aiks[w->naiks++].hAIK = *hAIK;
+  return 0;
+}
+
+/* Returns the index of the session for a job, opening it as needed,
+   or -1 on error. */
+static int find_session(struct quote_worker *w, struct quote_job *job)
+{
+  unsigned i;
+  for (i = 0; i < w->nsessions; i++)
+    if (w->sessions[i].npcrs == job->npcrs
+	&& !memcmp(&w->sessions[i].uuid, &job->uuid, sizeof job->uuid)
+	&& !memcmp(w->sessions[i].pcrs, job->pcrs,
+		   job->npcrs * sizeof *job->pcrs)) {
+      LOCK(w);
+      w->stats.aikShared++;
+      UNLOCK(w);
+      return i;
+    }
+
+  TSS_HKEY hAIK;
+  if (find_aik(w, &job->uuid, &hAIK))
+    return -1;
+  struct quote_session *session =
+    quote_session_open_aik(w->hContext, hAIK, job->pcrs, job->npcrs);
+  if (!session)
+    return -1;
+  quote_session_set_mode(session, w->mode);
+  if (w->nsessions < NSESSIONS)
+    i = w->nsessions++;
+  else {
+    i = w->nextsession;
+    w->nextsession = (w->nextsession + 1) % NSESSIONS;
+    quote_session_close(w->sessions[i].session);
+  }
+  w->sessions[i].uuid = job->uuid;
+  memcpy(w->sessions[i].pcrs, job->pcrs, job->npcrs * sizeof *job->pcrs);
+  w->sessions[i].npcrs = job->npcrs;
+  w->sessions[i].session = session;
+  return i;
+}
+
+/* Makes the quote of a job, copying it out of TSS memory. */
+static void make_quote(struct quote_worker *w, struct quote_job *job)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int i = find_session(w, job);
+  job->setupUsec = usec_since(&start);
+  job->tpmUsec = 0;
+  if (i < 0)
+    return;
+
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = job->nonceLen;
+  valid.rgbExternalData = job->nonce;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int failed = quote_session_quote(w->sessions[i].session, &valid);
+  job->tpmUsec = usec_since(&start);
+  if (failed) {
+    drop_uuid(w, &job->uuid);	/* And its sessions */
+    w->mode = QUOTE_MODE_UNKNOWN;
+    job->mode = w->mode;
+    return;
+  }
+  w->mode = job->mode = quote_session_mode(w->sessions[i].session);
+  job->data = malloc(valid.ulDataLength + 1);
+  job->sig = malloc(valid.ulValidationDataLength + 1);
+  if (job->data && job->sig) {
+    memcpy(job->data, valid.rgbData, valid.ulDataLength);
+    job->dataLen = valid.ulDataLength;
+    memcpy(job->sig, valid.rgbValidationData, valid.ulValidationDataLength);
+    job->sigLen = valid.ulValidationDataLength;
+    job->result = 0;
+  }
+  else {
+    fprintf(stderr, "Out of memory\n");
+    free(job->data);
+    free(job->sig);
+    job->data = job->sig = NULL;
+  }
+  Tspi_Context_FreeMemory(w->hContext, valid.rgbData);
+  Tspi_Context_FreeMemory(w->hContext, valid.rgbValidationData);
+}
+
+static int get_tpm(struct quote_worker *w)
+{
+  if (w->hTPM)
+    return 0;
+  TSS_RESULT rc = TRACE(Tspi_Context_GetTpmObject, w->hContext, &w->hTPM);
+  if (rc != TSS_SUCCESS) {
+    w->hTPM = 0;
+    return tss_err(rc, "getting TPM object");
+  }
+  return 0;
+}
+
+/* Reads the PCRs of a job, one value after another.  Values that
+   cannot have changed since they were last read come from the
+   worker's PCR cache. */
+static void make_pcrread(struct quote_worker *w, struct quote_job *job)
+{
+  if (get_tpm(w))
+    return;
+  job->data = malloc(job->npcrs * PCRVALS_VALUESIZE + 1);
+  if (!job->data) {
+    fprintf(stderr, "Out of memory\n");
+    return;
+  }
+  pcr_cache_validate(w->pcrs);
+  UINT32 i;
+  for (i = 0; i < job->npcrs; i++) {
+    if (pcr_cache_read(w->pcrs, w->hContext, w->hTPM, job->pcrs[i],
+		       job->data + job->dataLen))
+      break;
+    job->dataLen += PCRVALS_VALUESIZE;
+  }
+  job->result = i < job->npcrs;
+}
+
+/* Loads the key blob of a job under its UUID.  The AIK loaded under
+   the UUID, and the sessions using it, are dropped, as the key is
+   replaced. */
+static void make_loadkey(struct quote_worker *w, struct quote_job *job)
+{
+  job->result = loadkey(w->hContext, job->blob, job->blobLen, job->uuid);
+  drop_uuid(w, &job->uuid);
+}
+
+static void make_random(struct quote_worker *w, struct quote_job *job)
+{
+  if (get_tpm(w))
+    return;
+  BYTE *random;
+  TSS_RESULT rc = TRACE(Tspi_TPM_GetRandom, w->hTPM, job->randomLen,
+			&random);
+  if (rc != TSS_SUCCESS) {
+    tss_err(rc, "getting random bytes");
+    return;
+  }
+  job->data = malloc(job->randomLen + 1);
+  if (job->data) {
+    memcpy(job->data, random, job->randomLen);
+    job->dataLen = job->randomLen;
+    job->result = 0;
+  }
+  else
+    fprintf(stderr, "Out of memory\n");
+  Tspi_Context_FreeMemory(w->hContext, random);
+}
+
+/* Makes the command of a job. */
+static void make(struct quote_worker *w, struct quote_job *job)
+{
+  struct timespec start;
+  job->data = job->sig = NULL;
+  job->dataLen = job->sigLen = 0;
+  job->result = 1;
+  job->mode = w->mode;
+  job->setupUsec = 0;
+  switch (job->type) {
+  case QUOTE_JOB_QUOTE:
+    make_quote(w, job);
+    return;
+  case QUOTE_JOB_PCRREAD:
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    make_pcrread(w, job);
+    break;
+  case QUOTE_JOB_LOADKEY:
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    make_loadkey(w, job);
+    break;
+  case QUOTE_JOB_RANDOM:
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    make_random(w, job);
+    break;
+  default:
+    fprintf(stderr, "Unknown quote worker job type %d\n", job->type);
+    return;
+  }
+  job->tpmUsec = usec_since(&start);
+}
+
+/* Gives the twins of a made job copies of its outputs. */
+static void answer_twins(struct quote_job *job)
+{
+  struct quote_job *twin;
+  for (twin = job->twins; twin; twin = twin->twins) {
+    twin->result = job->result;
+    twin->mode = job->mode;
+    twin->setupUsec = job->setupUsec;
+    twin->tpmUsec = job->tpmUsec;
+    twin->sig = NULL;
+    twin->sigLen = 0;
+    twin->dataLen = job->dataLen;
+    twin->data = NULL;
+    if (job->data && !(twin->data = malloc(job->dataLen + 1))) {
+      fprintf(stderr, "Out of memory\n");
+      twin->result = 1;
+      twin->dataLen = 0;
+    }
+    else if (job->data)
+      memcpy(twin->data, job->data, job->dataLen);
+  }
+}
+
+/* Moves a made job and its twins to the completed list, and wakes
+   the caller. */
+static void finish(struct quote_worker *w, struct quote_job *job)
+{
+  answer_twins(job);
+  LOCK(w);
+  struct quote_job *twin;
+  for (twin = job; twin; twin = twin->twins) {
+    twin->next = NULL;
+    *w->completedTail = twin;
+    w->completedTail = &twin->next;
+  }
+  UNLOCK(w);
+  BYTE b = 0;
+  while (write(w->signal[1], &b, 1) < 0 && errno == EINTR);
+}
+
+/* Records how long a job and its twins waited. */
+static void started(struct quote_worker *w, struct quote_job *job)
+{
+  UINT64 now = usec_now();
+  for (; job; job = job->twins) {
+    job->waitUsec = now - job->queued;
+    w->stats.wait[job->priority][bucket(job->waitUsec)]++;
+  }
+}
+
+#if defined HAVE_PTHREAD_H
+/* Makes queued jobs until stopped with an empty queue. */
+static void *worker_main(void *arg)
+{
+  struct quote_worker *w = arg;
+  for (;;) {
+    LOCK(w);
+    struct quote_job *job = NULL;
+    for (;;) {
+      unsigned p;
+      for (p = 0; p < QUOTE_NPRIORITIES && !job; p++)
+	if ((job = w->queue[p]) && !(w->queue[p] = job->next))
+	  w->queueTail[p] = &w->queue[p];
+      if (job || w->stop)
+	break;
+      pthread_cond_wait(&w->more, &w->lock);
+    }
+    if (job) {
+      w->depth--;
+      started(w, job);
+    }
+    UNLOCK(w);
+    if (!job)
+      return NULL;
+    make(w, job);
+    finish(w, job);
+  }
+}
+#endif
+
+/* Creates a worker that makes quotes with a connected context, which
+   the caller must not use until the worker is freed.  hSRK is the
+   SRK as loaded by load_srk, which the caller closes after the
+   worker, or zero to have the worker load it when first needed.  The
+   done function is called by quote_worker_complete as each job is
+   handed back.  Returns NULL on error. */
+struct quote_worker *quote_worker_new(TSS_HCONTEXT hContext,
+				      TSS_HKEY hSRK, quote_done *done)
+{
+  struct quote_worker *w = calloc(1, sizeof *w);
+  if (!w) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  w->hContext = hContext;
+  w->hSRK = hSRK;
+  w->done = done;
+  if (!(w->pcrs = pcr_cache_open(NULL))) {
+    free(w);
+    return NULL;
+  }
+  w->mode = QUOTE_MODE_UNKNOWN;
+  unsigned p;
+  for (p = 0; p < QUOTE_NPRIORITIES; p++)
+    w->queueTail[p] = &w->queue[p];
+  w->completedTail = &w->completed;
+  if (pipe(w->signal)) {
+    fprintf(stderr, "Cannot create quote worker pipe\n");
+    pcr_cache_close(w->pcrs);
+    free(w);
+    return NULL;
+  }
+  fcntl(w->signal[0], F_SETFL, O_NONBLOCK);
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->more, NULL);
+  if (pthread_create(&w->thread, NULL, worker_main, w)) {
+    fprintf(stderr, "Cannot create quote thread\n");
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->more);
+    close(w->signal[0]);
+    close(w->signal[1]);
+    pcr_cache_close(w->pcrs);
+    free(w);
+    return NULL;
+  }
+#endif
+  return w;
+}
+
+/* Returns non-zero when b can be answered by the command of a. */
+static int same_command(struct quote_job *a, struct quote_job *b)
+{
+  if (a->type != b->type)
+    return 0;
+  switch (a->type) {
+  case QUOTE_JOB_PCRREAD:
+    return a->npcrs == b->npcrs
+      && !memcmp(a->pcrs, b->pcrs, a->npcrs * sizeof *a->pcrs);
+  case QUOTE_JOB_LOADKEY:
+    return !memcmp(&a->uuid, &b->uuid, sizeof a->uuid)
+      && a->blobLen == b->blobLen && !memcmp(a->blob, b->blob, a->blobLen);
+  default:			/* Quotes and random bytes differ */
+    return 0;
+  }
+}
+
+#if defined HAVE_PTHREAD_H
+/* Makes a job the twin of an identical queued job, moving that job
+   up to the job's queue when the job is more urgent.  Returns zero
+   when there is no such job. */
+static int coalesce(struct quote_worker *w, struct quote_job *job)
+{
+  unsigned p;
+  for (p = 0; p < QUOTE_NPRIORITIES; p++) {
+    struct quote_job **prev, *queued;
+    for (prev = &w->queue[p]; (queued = *prev); prev = &queued->next) {
+      if (!same_command(queued, job))
+	continue;
+      job->twins = queued->twins;
+      queued->twins = job;
+      w->stats.coalesced++;
+      if (job->priority < p) {
+	if (!(*prev = queued->next))
+	  w->queueTail[p] = prev;
+	queued->next = NULL;
+	*w->queueTail[job->priority] = queued;
+	w->queueTail[job->priority] = &queued->next;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+/* Queues a job without waiting for the TPM.  The job, and the PCRs,
+   nonce and blob it points to, must stay valid until it is handed
+   back. */
+int quote_worker_submit(struct quote_worker *w, struct quote_job *job)
+{
+  if (job->npcrs > QUOTED_MAXPCRS) {
+    fprintf(stderr, "Too many PCRs for the quote worker\n");
+    return 1;
+  }
+  if ((unsigned)job->priority >= QUOTE_NPRIORITIES) {
+    fprintf(stderr, "Bad quote worker priority %d\n", job->priority);
+    return 1;
+  }
+  job->next = job->twins = NULL;
+  job->queued = usec_now();
+  LOCK(w);
+  w->stats.jobs[job->priority]++;
+  w->stats.depth[bucket(w->depth)]++;
+#if defined HAVE_PTHREAD_H
+  if (!coalesce(w, job)) {
+    *w->queueTail[job->priority] = job;
+    w->queueTail[job->priority] = &job->next;
+    w->depth++;
+    pthread_cond_signal(&w->more);
+  }
+  UNLOCK(w);
+#else
+  started(w, job);
+  make(w, job);
+  finish(w, job);
+#endif
+  return 0;
+}
+
+/* Returns a file descriptor that is readable when jobs are ready to
+   be handed back. */
+int quote_worker_fd(struct quote_worker *w)
+{
+  return w->signal[0];
+}
+
+/* Hands back the completed jobs without blocking, calling the done
+   function for each, and returns how many there were. */
+size_t quote_worker_complete(struct quote_worker *w)
+{
+  BYTE buf[256];
+  while (read(w->signal[0], buf, sizeof buf) > 0);
+  LOCK(w);
+  struct quote_job *job = w->completed;
+  w->completed = NULL;
+  w->completedTail = &w->completed;
+  UNLOCK(w);
+  size_t n = 0;
+  while (job) {
+    struct quote_job *next = job->next;
+    if (w->done)
+      w->done(job);
+    job = next;
+    n++;
+  }
+  return n;
+}
+
+/* Copies the histograms of the worker. */
+void quote_worker_get_stats(struct quote_worker *w,
+			    struct quote_worker_stats *stats)
+{
+  LOCK(w);
+  *stats = w->stats;
+  UNLOCK(w);
+}
+
+/* Makes the queued jobs, hands back every job, and then stops the
+   worker.  The context is left open. */
+void quote_worker_free(struct quote_worker *w)
+{
+  if (!w)
+    return;
+#if defined HAVE_PTHREAD_H
+  LOCK(w);
+  w->stop = 1;
+  pthread_cond_signal(&w->more);
+  UNLOCK(w);
+  pthread_join(w->thread, NULL);
+#endif
+  quote_worker_complete(w);
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->more);
+#endif
+  while (w->naiks > 0)
+    drop_aik(w, w->naiks - 1);	/* And the sessions */
+  while (w->nsessions > 0)
+    quote_session_close(w->sessions[--w->nsessions].session);
+  if (w->ownSRK)
+    TRACE(Tspi_Context_CloseObject, w->hContext, w->hSRK);
+  close(w->signal[0]);
+  close(w->signal[1]);
+  pcr_cache_close(w->pcrs);
+  free(w);
+}
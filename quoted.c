@@ -0,0 +1,343 @@
+/*
+ * Exchange messages with the quote daemon.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_SYS_UN_H
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Messages are sequences of big-endian UINT32s and byte strings
+   preceded by their length.  A request is the command type, its
+   priority, the UUID of the AIK or of the key loaded in its file
+   format, the nonce of a quote or the key blob loaded, and the PCR
+   numbers quoted or read.  A reply is the status, the setup and TPM
+   times in microseconds, the signed data or the PCR values read, the
+   signature, and the path from the nonce to the root of the nonces
+   the quote was made for.  The daemon parses requests from, and
+   encodes replies into, buffers of its own, so that a slow client
+   never blocks it. */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const BYTE *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Returns -1 when the peer closes the connection before any byte
+   is read. */
+static int read_all(int fd, void *buf, size_t len)
+{
+  BYTE *p = buf;
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, p + got, len - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 && got == 0)
+      return -1;
+    if (n <= 0)
+      return 1;
+    got += n;
+  }
+  return 0;
+}
+
+static int write_uint32(int fd, UINT32 v)
+{
+  BYTE b[4] = { v >> 24, v >> 16, v >> 8, v };
+  return write_all(fd, b, sizeof b);
+}
+
+static int read_uint32(int fd, UINT32 *v)
+{
+  BYTE b[4];
+  int rc = read_all(fd, b, sizeof b);
+  if (rc)
+    return rc;
+  *v = (UINT32)b[0] << 24 | (UINT32)b[1] << 16
+    | (UINT32)b[2] << 8 | (UINT32)b[3];
+  return 0;
+}
+
+static UINT32 get_uint32(const BYTE *b)
+{
+  return (UINT32)b[0] << 24 | (UINT32)b[1] << 16
+    | (UINT32)b[2] << 8 | (UINT32)b[3];
+}
+
+static BYTE *put_uint32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+static BYTE *put_bytes(BYTE *p, const BYTE *data, UINT32 len)
+{
+  p = put_uint32(p, len);
+  memcpy(p, data, len);
+  return p + len;
+}
+
+int quoted_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "Socket name %s too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr)) {
+    fprintf(stderr, "Cannot connect to %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int quoted_write_request(int fd, struct quoted_request *req)
+{
+  if (write_uint32(fd, req->type)
+      || write_uint32(fd, req->priority)
+      || write_all(fd, &req->uuid, sizeof req->uuid)
+      || write_uint32(fd, req->dataLen)
+      || write_all(fd, req->data, req->dataLen)
+      || write_uint32(fd, req->npcrs))
+    return 1;
+  UINT32 i;
+  for (i = 0; i < req->npcrs; i++)
+    if (write_uint32(fd, req->pcrs[i]))
+      return 1;
+  return 0;
+}
+
+/* Parses the request at the start of buf, which holds len bytes, and
+   sets used to its length.  Returns -1 when buf holds only the start
+   of a request, and 1 when the request is malformed. */
+int quoted_parse_request(const BYTE *buf, size_t len,
+			 struct quoted_request *req, size_t *used)
+{
+  size_t pos = 8;
+  if (len < pos)
+    return -1;
+  req->type = get_uint32(buf);
+  req->priority = get_uint32(buf + 4);
+  if (req->type > QUOTE_JOB_LOADKEY || req->priority >= QUOTE_NPRIORITIES)
+    return 1;
+  if (len < pos + sizeof req->uuid + 4)
+    return -1;
+  memcpy(&req->uuid, buf + pos, sizeof req->uuid);
+  pos += sizeof req->uuid;
+  req->dataLen = get_uint32(buf + pos);
+  pos += 4;
+  if (req->dataLen > sizeof req->data)
+    return 1;
+  if (len < pos + req->dataLen + 4)
+    return -1;
+  memcpy(req->data, buf + pos, req->dataLen);
+  pos += req->dataLen;
+  req->npcrs = get_uint32(buf + pos);
+  pos += 4;
+  if (req->npcrs > QUOTED_MAXPCRS)
+    return 1;
+  if (len < pos + 4 * req->npcrs)
+    return -1;
+  UINT32 i;
+  for (i = 0; i < req->npcrs; i++, pos += 4)
+    req->pcrs[i] = get_uint32(buf + pos);
+  *used = pos;
+  return 0;
+}
+
+/* Encodes a reply into a malloc'd buffer of len bytes. */
+BYTE *quoted_encode_reply(struct quoted_reply *rep, size_t *len)
+{
+  size_t size = 6 * 4 + rep->dataLen + rep->sigLen + rep->pathLen;
+  BYTE *buf = malloc(size);
+  if (!buf) {
+    fprintf(stderr, "Out of memory\n");
+    return NULL;
+  }
+  BYTE *p = put_uint32(buf, rep->status);
+  p = put_uint32(p, rep->setupUsec);
+  p = put_uint32(p, rep->tpmUsec);
+  p = put_bytes(p, rep->data, rep->dataLen);
+  p = put_bytes(p, rep->sig, rep->sigLen);
+  put_bytes(p, rep->path, rep->pathLen);
+  *len = size;
+  return buf;
+}
+
+/* The signed data and signature are malloc'd. */
+int quoted_read_reply(int fd, struct quoted_reply *rep)
+{
+  rep->data = rep->sig = NULL;
+  if (read_uint32(fd, &rep->status)
+      || read_uint32(fd, &rep->setupUsec)
+      || read_uint32(fd, &rep->tpmUsec)
+      || read_uint32(fd, &rep->dataLen)
+      || rep->dataLen > QUOTED_MAXDATA
+      || !(rep->data = malloc(rep->dataLen + 1))
+      || read_all(fd, rep->data, rep->dataLen)
+      || read_uint32(fd, &rep->sigLen)
+      || rep->sigLen > QUOTED_MAXDATA
+      || !(rep->sig = malloc(rep->sigLen + 1))
+      || read_all(fd, rep->sig, rep->sigLen)
+      || read_uint32(fd, &rep->pathLen)
+      || rep->pathLen > sizeof rep->path
+      || read_all(fd, rep->path, rep->pathLen)) {
+    free(rep->data);
+    free(rep->sig);
+    rep->data = rep->sig = NULL;
+    fprintf(stderr, "Error while reading reply from quote daemon\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* Sends a request to the daemon on path and reads its reply. */
+int quoted_call(const char *path, struct quoted_request *req,
+		struct quoted_reply *rep)
+{
+  int fd = quoted_connect(path);
+  if (fd < 0)
+    return 1;
+  int rc = quoted_write_request(fd, req) || quoted_read_reply(fd, rep);
+  close(fd);
+  return rc;
+}
+
+static int uint32_compar(const void *a, const void *b)
+{
+  UINT32 x = *(const UINT32 *)a;
+  UINT32 y = *(const UINT32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Has the daemon on path read the PCRs, and saves their values in
+   the named file as index=value lines, in increasing index order
+   like a quote session's. */
+int quoted_save_pcrvals(const char *path, enum quote_priority priority,
+			const UINT32 *pcrs, UINT32 npcrs, const char *name)
+{
+  static struct quoted_request req;
+  if (npcrs > QUOTED_MAXPCRS) {
+    fprintf(stderr, "Request too large for the quote daemon\n");
+    return 1;
+  }
+  memset(&req, 0, sizeof req);
+  req.type = QUOTE_JOB_PCRREAD;
+  req.priority = priority;
+  memcpy(req.pcrs, pcrs, npcrs * sizeof *pcrs);
+  qsort(req.pcrs, npcrs, sizeof *req.pcrs, uint32_compar);
+  UINT32 i, n = 0;
+  for (i = 0; i < npcrs; i++)
+    if (n == 0 || req.pcrs[i] != req.pcrs[n - 1])
+      req.pcrs[n++] = req.pcrs[i];
+  req.npcrs = n;
+
+  struct quoted_reply rep;
+  if (quoted_call(path, &req, &rep))
+    return 1;
+  int bad = 0;
+  if (rep.status || rep.dataLen != n * PCRVALS_VALUESIZE) {
+    fprintf(stderr, "Quote daemon failed to read the PCRs\n");
+    bad = 1;
+  }
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = bad ? NULL : open_memstream(&buf, &len);
+  if (!bad && !out) {
+    fprintf(stderr, "Out of memory\n");
+    bad = 1;
+  }
+  for (i = 0; !bad && i < n; i++)
+    if (pcrvals_write(out, req.pcrs[i], rep.data + i * PCRVALS_VALUESIZE,
+		      PCRVALS_VALUESIZE)) {
+      fprintf(stderr, "Cannot write value of PCR %u\n", req.pcrs[i]);
+      bad = 1;
+    }
+  if (out)
+    bad |= fclose(out) != 0;
+  if (!bad)
+    bad = file_write(name, buf, len);
+  free(buf);
+  free(rep.data);
+  free(rep.sig);
+  return bad;
+}
+
+#else
+
+int quoted_connect(const char *path)
+{
+  fprintf(stderr, "Quote daemon not supported on this platform.\n");
+  return -1;
+}
+
+int quoted_write_request(int fd, struct quoted_request *req)
+{
+  return 1;
+}
+
+int quoted_parse_request(const BYTE *buf, size_t len,
+			 struct quoted_request *req, size_t *used)
+{
+  return 1;
+}
+
+BYTE *quoted_encode_reply(struct quoted_reply *rep, size_t *len)
+{
+  return NULL;
+}
+
+int quoted_read_reply(int fd, struct quoted_reply *rep)
+{
+  return 1;
+}
+
+int quoted_call(const char *path, struct quoted_request *req,
+		struct quoted_reply *rep)
+{
+  return quoted_connect(path) < 0;
+}
+
+int quoted_save_pcrvals(const char *path, enum quote_priority priority,
+			const UINT32 *pcrs, UINT32 npcrs, const char *name)
+{
+  return quoted_connect(path) < 0;
+}
+
+#endif
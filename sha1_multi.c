@@ -0,0 +1,483 @@
+/*
+ * Hash many short messages with SHA-1 at once.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+/* Quote info and PCR composites are a block or a few long, so one
+   message at a time leaves most of a vector unit idle.  Instead, the
+   message schedule and rounds of 4, 8 or 16 messages run side by side
+   in the lanes of SSE2, AVX2 or AVX-512 registers.  Processors with
+   the SHA extensions hash one message faster than that, and are used
+   for groups too small to fill the lanes.  The kernel is chosen when
+   first needed. */
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined HAVE_IMMINTRIN_H && defined __GNUC__ && defined __x86_64__
+#include <immintrin.h>
+#define SHA1_X86
+#endif
+
+#define BLOCKSIZE 64
+
+/* A message, as a sequence of blocks.  Whole blocks are read from
+   the message, and the padded remainder from the tail. */
+struct lane {
+  const BYTE *data;
+  UINT32 full;			/* Whole blocks in data */
+  UINT32 nblocks;		/* Blocks including the padding */
+  BYTE tail[2 * BLOCKSIZE];
+};
+
+static const BYTE zero_block[BLOCKSIZE];
+
+static void lane_init(struct lane *l, const BYTE *data, UINT32 len)
+{
+  UINT32 rem = len % BLOCKSIZE;
+  l->data = data;
+  l->full = len / BLOCKSIZE;
+  l->nblocks = l->full + (rem + 9 > BLOCKSIZE ? 2 : 1);
+  UINT32 end = (l->nblocks - l->full) * BLOCKSIZE;
+  memcpy(l->tail, data + l->full * BLOCKSIZE, rem);
+  l->tail[rem] = 0x80;
+  memset(l->tail + rem + 1, 0, end - rem - 1);
+  unsigned long long bits = (unsigned long long)len * 8;
+  int i;
+  for (i = 0; i < 8; i++)
+    l->tail[end - 1 - i] = bits >> (8 * i);
+}
+
+static const BYTE *lane_block(const struct lane *l, UINT32 b)
+{
+  if (b < l->full)
+    return l->data + b * BLOCKSIZE;
+  if (b < l->nblocks)
+    return l->tail + (b - l->full) * BLOCKSIZE;
+  return zero_block;
+}
+
+static UINT32 load_be32(const BYTE *p)
+{
+  return (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3];
+}
+
+static void store_be32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static const UINT32 initial[5] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const UINT32 round_k[4] = {
+  0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+};
+
+/* One message at a time */
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+static void block_scalar(UINT32 *h, const BYTE *p)
+{
+  UINT32 w[16];
+  UINT32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  int t;
+  for (t = 0; t < 80; t++) {
+    UINT32 f;
+    if (t < 16)
+      w[t] = load_be32(p + 4 * t);
+    else {
+      UINT32 x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15]
+	^ w[t & 15];
+      w[t & 15] = ROL(x, 1);
+    }
+    if (t < 20)
+      f = d ^ (b & (c ^ d));
+    else if (t < 40 || t >= 60)
+      f = b ^ c ^ d;
+    else
+      f = (b & c) | (d & (b | c));
+    UINT32 tmp = ROL(a, 5) + f + e + round_k[t / 20] + w[t & 15];
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = tmp;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+#if defined SHA1_X86
+
+/* The SHA extensions do four rounds per instruction, and derive the
+   message schedule four words at a time. */
+__attribute__((target("sha,sse4.1")))
+static void block_shani(UINT32 *h, const BYTE *p)
+{
+  const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL,
+				      0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),
+				   0x1b);
+  __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+  __m128i abcd_save = abcd, e_save = e0;
+  __m128i w[4], e = e0, prev = abcd;
+  int i;
+  for (i = 0; i < 4; i++)
+    w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)),
+			    swap);
+  for (i = 0; i < 20; i++) {
+    if (i == 0)
+      e = _mm_add_epi32(e, w[0]);
+    else
+      e = _mm_sha1nexte_epu32(prev, w[i & 3]);
+    prev = abcd;
+    switch (i / 5) {		/* The function must be a constant */
+    case 0:
+      abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+      break;
+    case 1:
+      abcd = _mm_sha1rnds4_epu32(abcd, e, 1);
+      break;
+    case 2:
+      abcd = _mm_sha1rnds4_epu32(abcd, e, 2);
+      break;
+    default:
+      abcd = _mm_sha1rnds4_epu32(abcd, e, 3);
+      break;
+    }
+    if (i < 16) {		/* Words for four groups ahead */
+      __m128i x = _mm_sha1msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+      x = _mm_xor_si128(x, w[(i + 2) & 3]);
+      w[i & 3] = _mm_sha1msg2_epu32(x, w[(i + 3) & 3]);
+    }
+  }
+  e = _mm_sha1nexte_epu32(prev, e_save);
+  abcd = _mm_add_epi32(abcd, abcd_save);
+  _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+  h[4] = _mm_extract_epi32(e, 3);
+}
+
+#endif
+
+/* Many messages at a time.  The state of lane j is h[i * SHA1_LANES
+   + j] for i from 0 to 4, and a lane whose mask is zero keeps its
+   state. */
+
+#if defined __SSE2__
+
+#define ROL4(x, n) \
+  _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+static void block_sse2(UINT32 *h, const BYTE *const *p, const UINT32 *mask)
+{
+  __m128i s[5], v[5], w[16];
+  int i, t;
+  for (i = 0; i < 5; i++)
+    s[i] = v[i] = _mm_loadu_si128((const __m128i *)(h + i * SHA1_LANES));
+  for (t = 0; t < 80; t++) {
+    __m128i f, b = v[1], c = v[2], d = v[3];
+    if (t < 16)
+      w[t] = _mm_set_epi32(load_be32(p[3] + 4 * t), load_be32(p[2] + 4 * t),
+			   load_be32(p[1] + 4 * t), load_be32(p[0] + 4 * t));
+    else {
+      __m128i x = _mm_xor_si128(_mm_xor_si128(w[(t - 3) & 15],
+					      w[(t - 8) & 15]),
+				_mm_xor_si128(w[(t - 14) & 15], w[t & 15]));
+      w[t & 15] = ROL4(x, 1);
+    }
+    if (t < 20)
+      f = _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)));
+    else if (t < 40 || t >= 60)
+      f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+    else
+      f = _mm_or_si128(_mm_and_si128(b, c),
+		       _mm_and_si128(d, _mm_or_si128(b, c)));
+    __m128i k = _mm_set1_epi32(round_k[t / 20]);
+    __m128i tmp = _mm_add_epi32(_mm_add_epi32(ROL4(v[0], 5), f),
+				_mm_add_epi32(_mm_add_epi32(v[4], k),
+					      w[t & 15]));
+    v[4] = d;
+    v[3] = c;
+    v[2] = ROL4(b, 30);
+    v[1] = v[0];
+    v[0] = tmp;
+  }
+  __m128i m = _mm_loadu_si128((const __m128i *)mask);
+  for (i = 0; i < 5; i++)
+    _mm_storeu_si128((__m128i *)(h + i * SHA1_LANES),
+		     _mm_add_epi32(s[i], _mm_and_si128(v[i], m)));
+}
+
+#endif
+
+#if defined SHA1_X86
+
+#define ROL8(x, n) \
+  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void block_avx2(UINT32 *h, const BYTE *const *p, const UINT32 *mask)
+{
+  __m256i s[5], v[5], w[16];
+  int i, j, t;
+  for (i = 0; i < 5; i++)
+    s[i] = v[i] = _mm256_loadu_si256((const __m256i *)(h + i * SHA1_LANES));
+  for (t = 0; t < 80; t++) {
+    __m256i f, b = v[1], c = v[2], d = v[3];
+    if (t < 16) {
+      UINT32 x[8];
+      for (j = 0; j < 8; j++)
+	x[j] = load_be32(p[j] + 4 * t);
+      w[t] = _mm256_loadu_si256((const __m256i *)x);
+    }
+    else {
+      __m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15],
+						    w[(t - 8) & 15]),
+				   _mm256_xor_si256(w[(t - 14) & 15],
+						    w[t & 15]));
+      w[t & 15] = ROL8(x, 1);
+    }
+    if (t < 20)
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+    else if (t < 40 || t >= 60)
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+    else
+      f = _mm256_or_si256(_mm256_and_si256(b, c),
+			  _mm256_and_si256(d, _mm256_or_si256(b, c)));
+    __m256i tmp =
+      _mm256_add_epi32(_mm256_add_epi32(ROL8(v[0], 5), f),
+		       _mm256_add_epi32(_mm256_add_epi32(v[4], w[t & 15]),
+					_mm256_set1_epi32(round_k[t / 20])));
+    v[4] = d;
+    v[3] = c;
+    v[2] = ROL8(b, 30);
+    v[1] = v[0];
+    v[0] = tmp;
+  }
+  __m256i m = _mm256_loadu_si256((const __m256i *)mask);
+  for (i = 0; i < 5; i++)
+    _mm256_storeu_si256((__m256i *)(h + i * SHA1_LANES),
+			_mm256_add_epi32(s[i], _mm256_and_si256(v[i], m)));
+}
+
+/* AVX-512 has rotates, and computes each round function with one
+   ternary logic instruction. */
+__attribute__((target("avx512f")))
+static void block_avx512(UINT32 *h, const BYTE *const *p, const UINT32 *mask)
+{
+  __m512i s[5], v[5], w[16];
+  int i, j, t;
+  for (i = 0; i < 5; i++)
+    s[i] = v[i] = _mm512_loadu_si512(h + i * SHA1_LANES);
+  for (t = 0; t < 80; t++) {
+    __m512i f, b = v[1], c = v[2], d = v[3];
+    if (t < 16) {
+      UINT32 x[16];
+      for (j = 0; j < 16; j++)
+	x[j] = load_be32(p[j] + 4 * t);
+      w[t] = _mm512_loadu_si512(x);
+    }
+    else {
+      __m512i x = _mm512_ternarylogic_epi32(w[(t - 3) & 15], w[(t - 8) & 15],
+					    w[(t - 14) & 15], 0x96);
+      w[t & 15] = _mm512_rol_epi32(_mm512_xor_si512(x, w[t & 15]), 1);
+    }
+    if (t < 20)
+      f = _mm512_ternarylogic_epi32(b, c, d, 0xca); /* b ? c : d */
+    else if (t < 40 || t >= 60)
+      f = _mm512_ternarylogic_epi32(b, c, d, 0x96); /* Parity */
+    else
+      f = _mm512_ternarylogic_epi32(b, c, d, 0xe8); /* Majority */
+    __m512i tmp =
+      _mm512_add_epi32(_mm512_add_epi32(_mm512_rol_epi32(v[0], 5), f),
+		       _mm512_add_epi32(_mm512_add_epi32(v[4], w[t & 15]),
+					_mm512_set1_epi32(round_k[t / 20])));
+    v[4] = d;
+    v[3] = c;
+    v[2] = _mm512_rol_epi32(b, 30);
+    v[1] = v[0];
+    v[0] = tmp;
+  }
+  __m512i m = _mm512_loadu_si512(mask);
+  for (i = 0; i < 5; i++)
+    _mm512_storeu_si512(h + i * SHA1_LANES,
+			_mm512_add_epi32(s[i], _mm512_and_si512(v[i], m)));
+}
+
+#endif
+
+typedef void single_fn(UINT32 *h, const BYTE *p);
+typedef void multi_fn(UINT32 *h, const BYTE *const *p, const UINT32 *mask);
+
+struct kernel {
+  const char *name;
+  unsigned lanes;		/* Messages hashed at once */
+  single_fn *single;		/* For groups that fill few lanes */
+  multi_fn *multi;
+};
+
+static struct kernel kernels[] = {
+  { "scalar", 1, block_scalar, NULL },
+#if defined SHA1_X86
+  { "shani", 1, block_shani, NULL },
+#endif
+#if defined __SSE2__
+  { "sse2", 4, block_scalar, block_sse2 },
+#endif
+#if defined SHA1_X86
+  { "avx2", 8, block_scalar, block_avx2 },
+  { "avx512", 16, block_scalar, block_avx512 },
+#endif
+};
+
+#define NKERNELS (sizeof kernels / sizeof *kernels)
+
+static struct kernel *current;
+
+static int supported(const struct kernel *k)
+{
+#if defined SHA1_X86
+  if (!strcmp(k->name, "shani"))
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+  if (!strcmp(k->name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if (!strcmp(k->name, "avx512"))
+    return __builtin_cpu_supports("avx512f");
+#endif
+  return 1;
+}
+
+/* Picks the widest kernel the processor supports.  When it has the
+   SHA extensions, they hash the messages that do not fill a group. */
+static struct kernel *pick(void)
+{
+  struct kernel *k = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  if (k)
+    return k;
+  struct kernel *best = &kernels[0];
+  single_fn *single = block_scalar;
+  size_t i;
+  for (i = 0; i < NKERNELS; i++)
+    if (supported(&kernels[i])) {
+      if (kernels[i].lanes == 1)
+	single = kernels[i].single;
+      if (kernels[i].lanes >= best->lanes)
+	best = &kernels[i];
+    }
+  static struct kernel chosen;
+  chosen = *best;
+  chosen.single = single;
+  __atomic_store_n(&current, &chosen, __ATOMIC_RELEASE);
+  return &chosen;
+}
+
+/* Selects a kernel by name, for benchmarks and tests, or restores
+   the automatic choice when name is NULL.  Returns nonzero when the
+   processor lacks the kernel. */
+int sha1_multi_set_kernel(const char *name)
+{
+  size_t i;
+  if (!name) {
+    __atomic_store_n(&current, NULL, __ATOMIC_RELEASE);
+    return 0;
+  }
+  for (i = 0; i < NKERNELS; i++)
+    if (!strcmp(kernels[i].name, name) && supported(&kernels[i])) {
+      __atomic_store_n(&current, &kernels[i], __ATOMIC_RELEASE);
+      return 0;
+    }
+  return 1;
+}
+
+const char *sha1_multi_kernel(void)
+{
+  return pick()->name;
+}
+
+static void hash_single(single_fn *single, struct sha1_msg *msg)
+{
+  struct lane l;
+  UINT32 h[5];
+  UINT32 b;
+  int i;
+  lane_init(&l, msg->data, msg->len);
+  memcpy(h, initial, sizeof h);
+  for (b = 0; b < l.nblocks; b++)
+    single(h, lane_block(&l, b));
+  for (i = 0; i < 5; i++)
+    store_be32(msg->digest + 4 * i, h[i]);
+}
+
+static void hash_group(struct kernel *k, struct sha1_msg *msgs, size_t n)
+{
+  struct lane l[SHA1_LANES];
+  UINT32 h[5 * SHA1_LANES];
+  UINT32 mask[SHA1_LANES];
+  const BYTE *p[SHA1_LANES];
+  UINT32 b, nblocks = 0;
+  size_t i, j;
+  for (j = 0; j < k->lanes; j++) {
+    if (j < n) {
+      lane_init(&l[j], msgs[j].data, msgs[j].len);
+      if (l[j].nblocks > nblocks)
+	nblocks = l[j].nblocks;
+    }
+    else
+      l[j].nblocks = l[j].full = 0;
+    for (i = 0; i < 5; i++)
+      h[i * SHA1_LANES + j] = initial[i];
+  }
+  for (b = 0; b < nblocks; b++) {
+    for (j = 0; j < k->lanes; j++) {
+      p[j] = lane_block(&l[j], b);
+      mask[j] = b < l[j].nblocks ? ~(UINT32)0 : 0;
+    }
+    k->multi(h, p, mask);
+  }
+  for (j = 0; j < n; j++)
+    for (i = 0; i < 5; i++)
+      store_be32(msgs[j].digest + 4 * i, h[i * SHA1_LANES + j]);
+}
+
+/* Puts the SHA-1 digest of each message in its digest field. */
+void sha1_multi(struct sha1_msg *msgs, size_t n)
+{
+  struct kernel *k = pick();
+  while (n > 0) {
+    size_t g = n < k->lanes ? n : k->lanes;
+    if (k->multi && (g > k->lanes / 2 || k->single == block_scalar))
+      hash_group(k, msgs, g);
+    else {
+      size_t i;
+      for (i = 0; i < g; i++)
+	hash_single(k->single, &msgs[i]);
+    }
+    msgs += g;
+    n -= g;
+  }
+}
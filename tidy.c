@@ -11,12 +11,13 @@
 #include "config.h"
 #endif
 #include <stddef.h>
+#include <stdio.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 /* Returns the code after freeing resources associated with a context */
 int tidy(TSS_HCONTEXT hContext, int code)
 {
   if (Tspi_Context_FreeMemory(hContext, NULL) != TSS_E_INVALID_HANDLE)
-    Tspi_Context_Close(hContext);
+    TRACE(Tspi_Context_Close, hContext);
   return code;
 }
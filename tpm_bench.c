@@ -0,0 +1,889 @@
+/*
+ * Time the hot paths of libtpm_quote.a, and print the results as JSON.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+
+#if defined HAVE_OPENSSL_RSA_LIB
+#include <stddef.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/bn.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#define SAMPLES 200		/* Default samples per benchmark */
+#define BUDGET 2.0		/* Most seconds spent on one benchmark */
+#define BATCHTIME 20e-6		/* Least seconds timed by one sample */
+#define MAXBATCH (1 << 20)
+#define INFOSIZE 52		/* TPM_QUOTE_INFO2 with three select bytes */
+#define LEGACYSIZE 48		/* TPM_QUOTE_INFO */
+#define PCRVALSIZE 20
+#define NPCRS 24
+#define BUFSIZE (1 << 10)
+#define HOSTNAME "attester-0042.example.com"
+
+/* Benchmarks return nonzero on failure. */
+typedef int bench_fn(void);
+
+static unsigned samples = SAMPLES;
+static const char *filter;	/* Run only names containing this */
+static int first = 1;		/* No benchmark printed yet */
+static int failures;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int double_compar(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Returns the p-th percentile of sorted samples, interpolating
+   between the nearest ranks. */
+static double percentile(double *t, unsigned n, double p)
+{
+  double rank = p / 100 * (n - 1);
+  unsigned i = rank;
+  if (i + 1 >= n)
+    return t[n - 1];
+  return t[i] + (rank - i) * (t[i + 1] - t[i]);
+}
+
+/* Times a benchmark, and prints its record.  Fast operations are
+   timed in batches, so that each sample is long enough to measure,
+   and each sample is the mean time of an operation in its batch. */
+static void measure(const char *name, bench_fn *fn)
+{
+  if (filter && !strstr(name, filter))
+    return;
+
+  /* Warm up, and find a batch size */
+  if (fn())
+    goto failed;
+  unsigned long batch;
+  double start;
+  for (batch = 1; batch < MAXBATCH; batch *= 2) {
+    unsigned long i;
+    start = now();
+    for (i = 0; i < batch; i++)
+      if (fn())
+	goto failed;
+    if (now() - start >= BATCHTIME)
+      break;
+  }
+
+  double *t = malloc(samples * sizeof *t);
+  if (!t) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  unsigned n;
+  double begin = now();
+  for (n = 0; n < samples; n++) {
+    unsigned long i;
+    start = now();
+    for (i = 0; i < batch; i++)
+      if (fn()) {
+	free(t);
+	goto failed;
+      }
+    double end = now();
+    t[n] = (end - start) / batch * 1e9;
+    if (end - begin > BUDGET && n >= 10) {
+      n++;
+      break;
+    }
+  }
+
+  qsort(t, n, sizeof *t, double_compar);
+  double sum = 0;
+  unsigned i;
+  for (i = 0; i < n; i++)
+    sum += t[i];
+  printf("%s\n    {\"name\": \"%s\", \"unit\": \"ns\", "
+	 "\"samples\": %u, \"batch\": %lu,\n"
+	 "     \"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+	 "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+	 first ? "" : ",", name, n, batch, t[0], sum / n,
+	 percentile(t, n, 50), percentile(t, n, 90),
+	 percentile(t, n, 99), t[n - 1]);
+  fflush(stdout);
+  first = 0;
+  free(t);
+  return;
+
+ failed:
+  fprintf(stderr, "Benchmark %s failed\n", name);
+  failures++;
+}
+
+/* Library functions */
+
+static BYTE info2[INFOSIZE];	/* Signed by Quote2 */
+static BYTE legacy[LEGACYSIZE];	/* Signed by Quote */
+static BYTE nonce[sizeof(TPM_NONCE)];
+
+static int bench_quote_nonce(void)
+{
+  return !quote_nonce(info2) || !quote_nonce(legacy);
+}
+
+static int bench_quote_set_nonce(void)
+{
+  return quote_set_nonce(info2, sizeof info2, nonce, sizeof nonce);
+}
+
+static char *pcr_args[NPCRS];
+
+static int bench_pcr_mask(void)
+{
+  UINT32 pcrs[NPCRS];
+  return pcr_mask(pcrs, NPCRS, pcr_args);
+}
+
+static int bench_toutf16le(void)
+{
+  char *wname = toutf16le(HOSTNAME);
+  if (!wname)
+    return 1;
+  free(wname);
+  return 0;
+}
+
+static char *wname;
+
+static int bench_utf16lelen(void)
+{
+  return utf16lelen(wname) != 2 * strlen(HOSTNAME);
+}
+
+/* Recomputes the composite hash of a quote from PCR values, as
+   tpm_updatepcrhash does: the selection, the size of the values,
+   and then each selected value. */
+static BYTE pcrSelect[3] = { 0xff, 0xff, 0xff };
+static BYTE pcrValue[NPCRS][PCRVALSIZE];
+
+static int bench_composite_hash(void)
+{
+  BYTE header[2 + sizeof pcrSelect + 4];
+  UINT32 size = NPCRS * PCRVALSIZE;
+  header[0] = 0;
+  header[1] = sizeof pcrSelect;
+  memcpy(header + 2, pcrSelect, sizeof pcrSelect);
+  header[5] = size >> 24;
+  header[6] = size >> 16;
+  header[7] = size >> 8;
+  header[8] = size;
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  SHA1_Update(&ctx, header, sizeof header);
+  UINT32 i, j, pcrind;
+  for (i = 0, pcrind = 0; i < sizeof pcrSelect; i++)
+    for (j = 1; j != (1 << 8); j <<= 1, pcrind++)
+      if (pcrSelect[i] & j)
+	SHA1_Update(&ctx, pcrValue[pcrind], PCRVALSIZE);
+  SHA1_Final(info2 + INFOSIZE - PCRVALSIZE, &ctx);
+  return 0;
+}
+
+/* The same hash with the library's composite hash builder, both
+   from scratch and when only the last value differs from the
+   previous hash, as in a batch made by tpm_updatepcrhash -m. */
+static struct composite *builder;
+static struct pcrvals composite_pv;
+
+static int bench_composite_cold(void)
+{
+  composite_pv.select[0] ^= 1;	/* Start over every time */
+  composite_pv.npcrs += composite_pv.select[0] & 1 ? 1 : -1;
+  return composite_hash(builder, &composite_pv, sizeof pcrSelect,
+			info2 + INFOSIZE - PCRVALSIZE);
+}
+
+static int bench_composite_resume(void)
+{
+  composite_pv.value[NPCRS - 1][0]++;
+  return composite_hash(builder, &composite_pv, sizeof pcrSelect,
+			info2 + INFOSIZE - PCRVALSIZE);
+}
+
+/* SHA1_LANES quote infos, and SHA1_LANES composites of all the PCRs,
+   hashed one at a time with OpenSSL, and together with sha1_multi as
+   the verify pool and tpm_updatepcrhash do. */
+#define COMPOSITESIZE (2 + sizeof pcrSelect + 4 + NPCRS * PCRVALSIZE)
+static BYTE laneData[SHA1_LANES][COMPOSITESIZE];
+static BYTE laneDigest[SHA1_LANES][PCRVALSIZE];
+static struct sha1_msg infoMsgs[SHA1_LANES];
+static struct sha1_msg compositeMsgs[SHA1_LANES];
+static const char *kernelNames[] = { "scalar", "shani", "sse2", "avx2",
+				     "avx512" };
+
+static int sha1_each(struct sha1_msg *msgs)
+{
+  unsigned i;
+  for (i = 0; i < SHA1_LANES; i++)
+    SHA1(msgs[i].data, msgs[i].len, msgs[i].digest);
+  return 0;
+}
+
+static int bench_sha1_info(void)
+{
+  return sha1_each(infoMsgs);
+}
+
+static int bench_sha1_composite(void)
+{
+  return sha1_each(compositeMsgs);
+}
+
+static int bench_sha1_multi_info(void)
+{
+  sha1_multi(infoMsgs, SHA1_LANES);
+  return 0;
+}
+
+static int bench_sha1_multi_composite(void)
+{
+  sha1_multi(compositeMsgs, SHA1_LANES);
+  return 0;
+}
+
+/* Parsing of PCR values, as written by tpm_getpcrhash.  The sscanf
+   versions are how tpm_updatepcrhash used to parse them, and are kept
+   for comparison. */
+
+static char pcrvals[NPCRS * (4 + 2 * PCRVALSIZE)];
+static size_t pcrvalsLen;
+
+static int bench_hex_decode_sscanf(void)
+{
+  const char *val = strchr(pcrvals, '=') + 1;
+  const char *endp;
+  for (endp = val; isxdigit((unsigned char)*endp); endp++);
+  if (endp - val != 2 * PCRVALSIZE)
+    return 1;
+  UINT32 j;
+  for (j = 0; val < endp; val += 2, j++) {
+    unsigned int byte;
+    if (sscanf(val, "%2x", &byte) != 1)
+      return 1;
+    pcrValue[0][j] = byte;
+  }
+  return 0;
+}
+
+static int bench_hex_decode(void)
+{
+  return hex_decode(pcrValue[0], strchr(pcrvals, '=') + 1, PCRVALSIZE);
+}
+
+static int bench_pcrvals_read_sscanf(void)
+{
+  FILE *in = fmemopen(pcrvals, pcrvalsLen, "r");
+  if (!in)
+    return 1;
+  BYTE select[sizeof pcrSelect];
+  memset(select, 0, sizeof select);
+  char line[BUFSIZE];
+  int bad = 0;
+  while (!bad && fgets(line, sizeof line, in)) {
+    char *endp;
+    unsigned int pcrind = strtoul(line, &endp, 10);
+    char *val = strchr(endp, '=');
+    if (endp == line || pcrind >= NPCRS
+	|| select[pcrind / 8] & 1 << (pcrind % 8) || !val) {
+      bad = 1;
+      break;
+    }
+    select[pcrind / 8] |= 1 << (pcrind % 8);
+    for (val++; isspace((unsigned char)*val); val++);
+    for (endp = val; isxdigit((unsigned char)*endp); endp++);
+    if (endp - val != 2 * PCRVALSIZE) {
+      bad = 1;
+      break;
+    }
+    UINT32 j;
+    for (j = 0; val < endp; val += 2, j++) {
+      unsigned int byte;
+      if (sscanf(val, "%2x", &byte) != 1) {
+	bad = 1;
+	break;
+      }
+      pcrValue[pcrind][j] = byte;
+    }
+  }
+  fclose(in);
+  return bad;
+}
+
+static int bench_pcrvals_read(void)
+{
+  FILE *in = fmemopen(pcrvals, pcrvalsLen, "r");
+  if (!in)
+    return 1;
+  struct pcrvals pv;
+  int bad = pcrvals_read(in, "pcrvals", &pv) || pv.npcrs != NPCRS;
+  fclose(in);
+  return bad;
+}
+
+/* Signature verification, as done by tpm_verifyquote */
+
+static BYTE der[BUFSIZE];	/* DER encoded public AIK */
+static UINT32 derLen;
+static BYTE signedInfo[INFOSIZE];
+static BYTE sig[BUFSIZE];
+static UINT32 sigLen;
+static struct aik_cache *cache;
+
+static BYTE *load_uint32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+/* Makes a DER encoded public key and a quote signed with it, as
+   tpm_mkaik and TPM_Quote2 would. */
+static int make_quote(void)
+{
+  RSA *rsa = RSA_new();
+  BIGNUM *e = BN_new();
+  if (!rsa || !e || !BN_set_word(e, RSA_F4)
+      || !RSA_generate_key_ex(rsa, 2048, e, NULL)) {
+    fprintf(stderr, "Cannot generate an RSA key\n");
+    return 1;
+  }
+  BN_free(e);
+
+  const BIGNUM *n;
+  RSA_get0_key(rsa, &n, NULL, NULL);
+  BYTE blob[BUFSIZE];
+  BYTE *p = load_uint32(blob, TPM_ALG_RSA);
+  *p++ = 0;			/* encScheme */
+  *p++ = TPM_ES_NONE;
+  *p++ = 0;			/* sigScheme */
+  *p++ = TPM_SS_RSASSAPKCS1v15_SHA1;
+  p = load_uint32(p, 12);	/* parmSize */
+  p = load_uint32(p, 2048);	/* keyLength */
+  p = load_uint32(p, 2);	/* numPrimes */
+  p = load_uint32(p, 0);	/* exponentSize */
+  p = load_uint32(p, BN_num_bytes(n));
+  p += BN_bn2bin(n, p);
+  derLen = sizeof der;
+  TSS_RESULT rc = Tspi_EncodeDER_TssBlob(p - blob, blob,
+					 TSS_BLOB_TYPE_PUBKEY, &derLen, der);
+  if (rc != TSS_SUCCESS) {
+    RSA_free(rsa);
+    return tss_err(rc, "encoding public key");
+  }
+
+  memcpy(signedInfo, info2, INFOSIZE);
+  memcpy(signedInfo + 6, nonce, sizeof nonce);
+  BYTE digest[SHA_DIGEST_LENGTH];
+  SHA1(signedInfo, INFOSIZE, digest);
+  unsigned int len;
+  int ok = RSA_sign(NID_sha1, digest, sizeof digest, sig, &len, rsa);
+  RSA_free(rsa);
+  sigLen = len;
+  return ok != 1;
+}
+
+/* Decodes the key for every quote, as without a key cache. */
+static int bench_verify_cold(void)
+{
+  BYTE blob[BUFSIZE];
+  UINT32 blobLen = sizeof blob;
+  if (pubkey_decode(der, derLen, blob, &blobLen))
+    return 1;
+  struct pubkey *key = pubkey_new(blob, blobLen);
+  if (!key)
+    return 1;
+  int rc = pubkey_verify(key, signedInfo, INFOSIZE, sig, sigLen);
+  pubkey_free(key);
+  return rc;
+}
+
+/* Looks the key up in a warm cache, sets the nonce in the
+   provisioned hash, and verifies. */
+static int bench_verify_cached(void)
+{
+  struct pubkey *key = aik_cache_lookup(cache, der, derLen, NULL, NULL);
+  if (!key)
+    return 1;
+  BYTE hash[INFOSIZE];
+  memcpy(hash, signedInfo, INFOSIZE);
+  if (quote_set_nonce(hash, INFOSIZE, nonce, sizeof nonce))
+    return 1;
+  return pubkey_verify(key, hash, INFOSIZE, sig, sigLen);
+}
+
+static int bench_aik_cache_lookup(void)
+{
+  return !aik_cache_lookup(cache, der, derLen, NULL, NULL);
+}
+
+#if defined HAVE_TPM_SIMULATOR
+
+/* End to end, against the simulated TPM */
+
+static TSS_HCONTEXT hContext;
+static TSS_UUID uuid;
+static UINT32 quotePcrs[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+#define NQUOTEPCRS (sizeof quotePcrs / sizeof *quotePcrs)
+static struct quote_session *session;
+static struct quote_session *legacySession;
+static FILE *devnull;
+
+/* Makes an AIK as tpm_mkaik does, and registers it as tpm_loadkey
+   does. */
+static int make_aik(void)
+{
+  TSS_RESULT rc = Tspi_Context_Create(&hContext);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+  rc = Tspi_Context_Connect(hContext, NULL);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "connecting");
+  TSS_HKEY hSRK;
+  if (load_srk(hContext, &hSRK))
+    return 1;
+  TSS_HTPM hTPM;
+  rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "getting TPM object");
+  TSS_HKEY hPCA, hAIK;
+  rc = Tspi_Context_CreateObject(hContext, TSS_OBJECT_TYPE_RSAKEY,
+				 TSS_KEY_TYPE_LEGACY|TSS_KEY_SIZE_2048,
+				 &hPCA);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating PCA object");
+  rc = Tspi_Context_CreateObject(hContext, TSS_OBJECT_TYPE_RSAKEY,
+				 TSS_KEY_TYPE_IDENTITY|TSS_KEY_SIZE_2048,
+				 &hAIK);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating AIK object");
+  BYTE lab[] = {};
+  BYTE *blob;
+  UINT32 blobLen;
+  rc = Tspi_TPM_CollateIdentityRequest(hTPM, hSRK, hPCA, 0, lab,
+				       hAIK, TSS_ALG_AES,
+				       &blobLen, &blob);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "generating new key");
+  Tspi_Context_FreeMemory(hContext, blob);
+  rc = Tspi_GetAttribData(hAIK, TSS_TSPATTRIB_KEY_BLOB,
+			  TSS_TSPATTRIB_KEYBLOB_BLOB, &blobLen, &blob);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "getting key blob");
+  if (RAND_bytes((BYTE *)&uuid, sizeof uuid) != 1)
+    return 1;
+  int failed = loadkey(hContext, blob, blobLen, uuid);
+  Tspi_Context_FreeMemory(hContext, blob);
+  return failed;
+}
+
+static int quote_once(struct quote_session *s)
+{
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = sizeof nonce;
+  valid.rgbExternalData = nonce;
+  if (quote_session_quote(s, &valid))
+    return 1;
+  Tspi_Context_FreeMemory(hContext, valid.rgbData);
+  Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
+  return 0;
+}
+
+static int bench_session_quote2(void)
+{
+  return quote_once(session);
+}
+
+static int bench_session_legacy(void)
+{
+  return quote_once(legacySession);
+}
+
+static int bench_session_pcrvals(void)
+{
+  return quote_session_pcrvals(session, devnull);
+}
+
+static int bench_load_aik(void)
+{
+  TSS_HKEY hAIK;
+  if (quote_load_aik(hContext, uuid, &hAIK))
+    return 1;
+  Tspi_Context_CloseObject(hContext, hAIK);
+  return 0;
+}
+
+/* One quote on an open connection, loading the keys each time. */
+static int bench_quote(void)
+{
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = sizeof nonce;
+  valid.rgbExternalData = nonce;
+  if (quote(hContext, uuid, quotePcrs, NQUOTEPCRS, &valid))
+    return 1;
+  Tspi_Context_FreeMemory(hContext, valid.rgbData);
+  Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
+  return 0;
+}
+
+/* Everything tpm_getquote does but file I/O. */
+static int bench_getquote(void)
+{
+  TSS_HCONTEXT h;
+  TSS_RESULT rc = Tspi_Context_Create(&h);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+  rc = Tspi_Context_Connect(h, NULL);
+  if (rc != TSS_SUCCESS)
+    return tidy(h, tss_err(rc, "connecting"));
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = sizeof nonce;
+  valid.rgbExternalData = nonce;
+  struct quote_session *s = quote_session_open(h, 0, uuid, quotePcrs,
+					       NQUOTEPCRS);
+  if (!s)
+    return tidy(h, 1);
+  int failed = quote_session_quote(s, &valid)
+    || quote_session_pcrvals(s, devnull);
+  quote_session_close(s);
+  return tidy(h, failed);
+}
+
+/* A quote worker with its own context, and the jobs handed back */
+static TSS_HCONTEXT workerContext;
+static struct quote_worker *worker;
+static size_t handedBack;
+static int jobsFailed;
+#define NTWINS 16		/* Identical PCR reads submitted at once */
+
+static void worker_done(struct quote_job *job)
+{
+  jobsFailed |= job->result;
+  free(job->data);
+  free(job->sig);
+  handedBack++;
+}
+
+/* Submits jobs to the worker, and waits for them to be handed back. */
+static int run_jobs(struct quote_job *jobs, size_t n)
+{
+  handedBack = 0;
+  jobsFailed = 0;
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (quote_worker_submit(worker, &jobs[i]))
+      return 1;
+  while (handedBack < n) {
+    struct pollfd fd = { quote_worker_fd(worker), POLLIN, 0 };
+    if (poll(&fd, 1, -1) < 0)
+      return 1;
+    quote_worker_complete(worker);
+  }
+  return jobsFailed;
+}
+
+/* A quote made through the worker. */
+static int bench_worker_quote(void)
+{
+  struct quote_job job;
+  memset(&job, 0, sizeof job);
+  job.uuid = uuid;
+  job.pcrs = quotePcrs;
+  job.npcrs = NQUOTEPCRS;
+  job.nonce = nonce;
+  job.nonceLen = sizeof nonce;
+  return run_jobs(&job, 1);
+}
+
+/* Identical PCR reads submitted together, which the worker answers
+   with the command of the first. */
+static int bench_worker_pcrread(void)
+{
+  struct quote_job jobs[NTWINS];
+  memset(jobs, 0, sizeof jobs);
+  unsigned i;
+  for (i = 0; i < NTWINS; i++) {
+    jobs[i].type = QUOTE_JOB_PCRREAD;
+    jobs[i].priority = QUOTE_PRIORITY_BACKGROUND;
+    jobs[i].pcrs = quotePcrs;
+    jobs[i].npcrs = NQUOTEPCRS;
+  }
+  return run_jobs(jobs, NTWINS);
+}
+
+static int start_worker(void)
+{
+  TSS_RESULT rc = Tspi_Context_Create(&workerContext);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+  rc = Tspi_Context_Connect(workerContext, NULL);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "connecting");
+  worker = quote_worker_new(workerContext, 0, worker_done);
+  return !worker;
+}
+
+/* Quotes and checks the signature, so that a broken quote path
+   fails the benchmarks rather than timing errors. */
+static int check_quote(struct quote_session *s)
+{
+  TSS_VALIDATION valid;
+  valid.ulExternalDataLength = sizeof nonce;
+  valid.rgbExternalData = nonce;
+  if (quote_session_quote(s, &valid))
+    return 1;
+  TSS_HKEY hAIK;
+  BYTE *blob;
+  UINT32 blobLen;
+  int failed = quote_load_aik(hContext, uuid, &hAIK)
+    || Tspi_GetAttribData(hAIK, TSS_TSPATTRIB_KEY_BLOB,
+			  TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
+			  &blobLen, &blob) != TSS_SUCCESS;
+  if (!failed) {
+    struct pubkey *key = pubkey_new(blob, blobLen);
+    failed = !key || pubkey_verify(key, valid.rgbData, valid.ulDataLength,
+				   valid.rgbValidationData,
+				   valid.ulValidationDataLength);
+    pubkey_free(key);
+    Tspi_Context_FreeMemory(hContext, blob);
+    Tspi_Context_CloseObject(hContext, hAIK);
+  }
+  Tspi_Context_FreeMemory(hContext, valid.rgbData);
+  Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
+  if (failed)
+    fprintf(stderr, "Simulated quote does not verify\n");
+  return failed;
+}
+
+static int setup_simulator(void)
+{
+  if (make_aik())
+    return 1;
+  devnull = fopen("/dev/null", "w");
+  if (!devnull) {
+    fprintf(stderr, "Cannot open /dev/null\n");
+    return 1;
+  }
+  session = quote_session_open(hContext, 0, uuid, quotePcrs, NQUOTEPCRS);
+  legacySession = quote_session_open(hContext, 0, uuid, quotePcrs,
+				     NQUOTEPCRS);
+  if (!session || !legacySession)
+    return 1;
+  quote_session_set_mode(legacySession, QUOTE_MODE_LEGACY);
+  return check_quote(session) || check_quote(legacySession);
+}
+
+static void run_simulator(void)
+{
+  if (setup_simulator()) {
+    fprintf(stderr, "Cannot set up the simulated TPM\n");
+    failures++;
+    return;
+  }
+  measure("sim_quote_session_quote2", bench_session_quote2);
+  measure("sim_quote_session_legacy", bench_session_legacy);
+  measure("sim_quote_session_pcrvals", bench_session_pcrvals);
+  measure("sim_quote_load_aik", bench_load_aik);
+  measure("sim_quote", bench_quote);
+  measure("sim_getquote", bench_getquote);
+  if (start_worker()) {
+    fprintf(stderr, "Cannot start the quote worker\n");
+    failures++;
+  }
+  else {
+    measure("sim_worker_quote", bench_worker_quote);
+    measure("sim_worker_pcrread_16", bench_worker_pcrread);
+    quote_worker_free(worker);
+  }
+  tidy(workerContext, 0);
+  quote_session_close(session);
+  quote_session_close(legacySession);
+  fclose(devnull);
+  tidy(hContext, 0);
+}
+
+#else
+
+static void run_simulator(void)
+{
+}
+
+#endif
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-n samples] [-f filter] [-hv]\n"
+    "Options:\n"
+    "\t-n samples\n"
+    "\t     Take at most samples timings of each benchmark (default %d)\n"
+    "\t-f filter\n"
+    "\t     Run only the benchmarks whose names contain filter\n"
+    "\t-h   Display command usage info\n"
+    "\t-v   Display command version info\n"
+    "\n"
+    "Prints the time taken by each benchmark as JSON.  When built with\n"
+    "the TPM simulator, the end-to-end benchmarks use the simulated\n"
+    "TPM, whose latency is set by TPM_SIM_LATENCY.\n";
+  fprintf(stderr, text, prog, SAMPLES);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:hv")) != -1) {
+    switch (opt) {
+    case 'n':
+      samples = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (argc != optind || samples == 0)
+    return usage(argv[0]);
+
+  /* Inputs shaped like the ones the tools see */
+  info2[1] = TPM_TAG_QUOTE_INFO2;
+  memcpy(info2 + 2, "QUT2", 4);
+  info2[27] = 3;		/* sizeOfSelect */
+  info2[28] = 0xff;		/* PCRs 0-7 */
+  info2[31] = TPM_LOC_ZERO;
+  memcpy(legacy, "\1\1\0\0QUOT", 8);
+  unsigned i;
+  for (i = 0; i < NPCRS; i++) {
+    char arg[4];
+    snprintf(arg, sizeof arg, "%u", i);
+    pcr_args[i] = strdup(arg);
+  }
+  wname = toutf16le(HOSTNAME);
+  cache = aik_cache_new(16);
+  if (RAND_bytes(nonce, sizeof nonce) != 1
+      || RAND_bytes(&pcrValue[0][0], sizeof pcrValue) != 1
+      || !wname || !cache || make_quote()) {
+    fprintf(stderr, "Cannot set up benchmarks\n");
+    return 1;
+  }
+  memcpy(composite_pv.select, pcrSelect, sizeof pcrSelect);
+  composite_pv.npcrs = NPCRS;
+  memcpy(composite_pv.value, pcrValue, sizeof pcrValue);
+  if (!(builder = composite_new()))
+    return 1;
+  for (i = 0; i < SHA1_LANES; i++) {
+    memcpy(laneData[i], info2, INFOSIZE);
+    laneData[i][INFOSIZE - 1] = i;
+    infoMsgs[i].data = laneData[i];
+    infoMsgs[i].len = INFOSIZE;
+    infoMsgs[i].digest = laneDigest[i];
+    compositeMsgs[i] = infoMsgs[i];
+    compositeMsgs[i].len = COMPOSITESIZE;
+  }
+  for (i = 0; i < NPCRS; i++) {
+    int n = sprintf(pcrvals + pcrvalsLen, "%u=", i);
+    hex_encode(pcrvals + pcrvalsLen + n, pcrValue[i], PCRVALSIZE);
+    pcrvalsLen += n + 2 * PCRVALSIZE;
+    pcrvals[pcrvalsLen++] = '\n';
+  }
+
+  printf("{\n  \"package\": \"%s\",\n  \"simulator\": %s,\n"
+	 "  \"benchmarks\": [", PACKAGE_STRING,
+#if defined HAVE_TPM_SIMULATOR
+	 "true"
+#else
+	 "false"
+#endif
+	 );
+  measure("quote_nonce", bench_quote_nonce);
+  measure("quote_set_nonce", bench_quote_set_nonce);
+  measure("pcr_mask", bench_pcr_mask);
+  measure("toutf16le", bench_toutf16le);
+  measure("utf16lelen", bench_utf16lelen);
+  measure("composite_hash", bench_composite_hash);
+  measure("composite_cold", bench_composite_cold);
+  measure("composite_resume", bench_composite_resume);
+  measure("sha1_info_x16", bench_sha1_info);
+  measure("sha1_multi_info_x16", bench_sha1_multi_info);
+  measure("sha1_composite_x16", bench_sha1_composite);
+  measure("sha1_multi_composite_x16", bench_sha1_multi_composite);
+  for (i = 0; i < sizeof kernelNames / sizeof *kernelNames; i++) {
+    char name[64];
+    if (sha1_multi_set_kernel(kernelNames[i]))
+      continue;
+    snprintf(name, sizeof name, "sha1_multi_info_x16_%s", kernelNames[i]);
+    measure(name, bench_sha1_multi_info);
+    snprintf(name, sizeof name, "sha1_multi_composite_x16_%s",
+	     kernelNames[i]);
+    measure(name, bench_sha1_multi_composite);
+  }
+  sha1_multi_set_kernel(NULL);
+  measure("hex_decode_sscanf", bench_hex_decode_sscanf);
+  measure("hex_decode", bench_hex_decode);
+  measure("pcrvals_read_sscanf", bench_pcrvals_read_sscanf);
+  measure("pcrvals_read", bench_pcrvals_read);
+  measure("aik_cache_lookup", bench_aik_cache_lookup);
+  measure("verify_cold", bench_verify_cold);
+  measure("verify_cached", bench_verify_cached);
+  run_simulator();
+  printf("\n  ]\n}\n");
+
+  aik_cache_free(cache);
+  composite_free(builder);
+  free(wname);
+  for (i = 0; i < NPCRS; i++)
+    free(pcr_args[i]);
+  if (failures) {
+    fprintf(stderr, "%d benchmarks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
+#else
+int main(void)
+{
+  fprintf(stderr, "Benchmarks not available.\n");
+  return 1;
+}
+#endif
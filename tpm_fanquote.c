@@ -0,0 +1,247 @@
+/*
+ * Quote a given set of PCRs on many remote hosts.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define HOSTSIZE 256		/* Longest host name */
+#define PARALLEL 64		/* Default quotes in progress */
+#define TIMEOUT 10000		/* Default milliseconds per host */
+#define IDLE 300		/* Seconds before closing an idle context */
+#define CHECK 30		/* Seconds idle before checking a context */
+
+/* Reads one host name per line, ignoring blank lines.  Returns a
+   NULL terminated malloc'd array of malloc'd names, or NULL on
+   error. */
+static char **read_hosts(const char *name, size_t *nhosts)
+{
+  struct file_data f;
+  if (file_load(name, &f))
+    return NULL;
+  size_t n = 0, size = 64;
+  char **hosts = malloc(size * sizeof *hosts);
+  const char *p = (const char *)f.data, *end = p + f.len;
+  int bad = !hosts;
+  while (!bad && p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *line = p;
+    size_t len = (nl ? nl : end) - p;
+    p += len + 1;
+    if (len > 0 && line[len - 1] == '\r')
+      len--;
+    while (len > 0 && (*line == ' ' || *line == '\t')) {
+      line++;
+      len--;
+    }
+    if (len == 0)
+      continue;
+    if (len > HOSTSIZE) {
+      fprintf(stderr, "Host name too long in %s\n", name);
+      bad = 1;
+      break;
+    }
+    if (n + 1 >= size) {
+      char **more = realloc(hosts, 2 * size * sizeof *hosts);
+      if (!more) {
+	bad = 1;
+	break;
+      }
+      hosts = more;
+      size *= 2;
+    }
+    if (!(hosts[n] = strndup(line, len)))
+      bad = 1;
+    else
+      n++;
+  }
+  file_unload(&f);
+  if (bad) {
+    if (hosts)
+      while (n > 0)
+	free(hosts[--n]);
+    free(hosts);
+    fprintf(stderr, "Cannot read host names from %s\n", name);
+    return NULL;
+  }
+  hosts[n] = NULL;
+  *nhosts = n;
+  return hosts;
+}
+
+static const char *status_name(enum fanquote_status status)
+{
+  switch (status) {
+  case FANQUOTE_OK:
+    return "ok";
+  case FANQUOTE_TIMEOUT:
+    return "timeout";
+  default:
+    return "failed";
+  }
+}
+
+/* Prints the record for a host as it completes, and saves its
+   signature in the output directory when there is one. */
+static void report(struct fanquote_result *r)
+{
+  const char *dir = r->arg;
+  enum fanquote_status status = r->status;
+  if (status == FANQUOTE_OK && dir) {
+    char name[FILENAME_MAX];
+    snprintf(name, sizeof name, "%s/%s", dir, r->host);
+    if (file_write(name, r->sig, r->sigLen))
+      status = FANQUOTE_FAILED;
+  }
+  printf("%s %s %u\n", r->host, status_name(status), r->usec);
+  fflush(stdout);
+}
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-j parallel] [-t milliseconds] [-o directory] "
+    "[-n rounds] [-hv] "
+    "uuid nonce hosts PCRS...\n"
+    "\tuuid\tFile containing uuid of AIK\n"
+    "\tnonce\tFile containing 20-byte nonce\n"
+    "\thosts\tFile containing one host name per line, or -\n"
+    "\tPCRS...\tList of PCR numbers to use in the quote\n"
+    "Options:\n"
+    "\t-j parallel\n"
+    "\t     Quote at most parallel hosts at a time (default %d)\n"
+    "\t-t milliseconds\n"
+    "\t     Give up on a host after milliseconds, or never when 0\n"
+    "\t     (default %d)\n"
+    "\t-o directory\n"
+    "\t     Store the signature of each host in a file named after\n"
+    "\t     the host in directory\n"
+    "\t-n rounds\n"
+    "\t     Quote every host rounds times, keeping connections open\n"
+    "\t     between rounds\n"
+    "\t-h   Display command usage info\n"
+    "\t-v   Display command version info\n"
+    "\n"
+    "Quotes every host concurrently, and prints a line with the host,\n"
+    "the result (ok, failed, or timeout), and the time taken in\n"
+    "microseconds as each host completes.\n";
+  fprintf(stderr, text, prog, PARALLEL, TIMEOUT);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  UINT32 pcrs[argc];
+
+  unsigned parallel = PARALLEL;
+  unsigned timeout = TIMEOUT;
+  const char *dir = NULL;	/* Non-null when saving signatures */
+  int rounds = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:t:o:n:hv")) != -1) {
+    switch (opt) {
+    case 'j':
+      parallel = atoi(optarg);
+      if (parallel < 1) {
+	fprintf(stderr, "Bad parallelism %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    case 'o':
+      dir = optarg;
+      break;
+    case 'n':
+      rounds = atoi(optarg);
+      if (rounds < 1) {
+	fprintf(stderr, "Bad number of rounds %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (argc < optind + 4)
+    return usage(argv[0]);
+
+  if (trace_init(argv[0]))
+    return 1;
+
+  const char *uuidname = argv[optind];
+  const char *noncename = argv[optind + 1];
+  const char *hostsname = argv[optind + 2];
+  UINT32 npcrs = argc - optind - 3;
+
+  if (pcr_mask(pcrs, npcrs, argv + optind + 3))
+    return 1;
+
+  TSS_UUID uuid;
+  UINT32 uuidLen;
+  if (file_read(uuidname, (BYTE *)&uuid, sizeof uuid, &uuidLen))
+    return 1;
+  if (uuidLen != sizeof uuid) {
+    fprintf(stderr, "Expecting a uuid of %zd bytes in %s\n",
+	    sizeof uuid, uuidname);
+    return 1;
+  }
+
+  struct file_data nonce;
+  if (file_load(noncename, &nonce))
+    return 1;
+
+  size_t nhosts;
+  char **hosts = read_hosts(hostsname, &nhosts);
+  if (!hosts)
+    return 1;
+
+  /* Connections are worth keeping only when hosts are quoted again */
+  struct conn_pool *pool = NULL;
+  if (rounds > 1 && !(pool = conn_pool_new(IDLE, CHECK)))
+    return 1;
+
+  size_t failures = 0;
+  int round;
+  for (round = 0; round < rounds; round++)
+    failures += fanquote((const char **)hosts, nhosts, uuid,
+			 nonce.data, nonce.len, pcrs, npcrs,
+			 parallel, timeout, pool, report, (void *)dir);
+
+  if (pool) {
+    struct conn_pool_stats stats;
+    conn_pool_get_stats(pool, &stats);
+    fprintf(stderr, "connections: %lu reused, %lu opened, "
+	    "%lu reconnected, %zu live\n", stats.hits, stats.misses,
+	    stats.reconnects, stats.live);
+    conn_pool_free(pool);
+  }
+
+  size_t i;
+  for (i = 0; i < nhosts; i++)
+    free(hosts[i]);
+  free(hosts);
+  return failures != 0;
+}
@@ -13,21 +13,50 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 
-static int uint32_compar(const void *a, const void *b)
+/* Obtains the signed data and the PCR values from tpm_quoted as
+   background requests, so that quotes verifiers wait for go first. */
+static int daemon_pcrhash(const char *path, TSS_UUID uuid,
+			  UINT32 *pcrs, UINT32 npcrs,
+			  const char *hashname, const char *pcrvals)
 {
-  UINT32 x = *(UINT32 *) a;
-  UINT32 y = *(UINT32 *) b;
-  return x - y;
+  static struct quoted_request req;
+  if (npcrs > QUOTED_MAXPCRS) {
+    fprintf(stderr, "Request too large for the quote daemon\n");
+    return 1;
+  }
+  req.type = QUOTE_JOB_QUOTE;
+  req.priority = QUOTE_PRIORITY_BACKGROUND;
+  req.uuid = uuid;
+  req.dataLen = sizeof(TPM_NONCE); /* Value of nonce does not matter */
+  memcpy(req.pcrs, pcrs, npcrs * sizeof *pcrs);
+  req.npcrs = npcrs;
+
+  struct quoted_reply rep;
+  if (quoted_call(path, &req, &rep))
+    return 1;
+  int rc;
+  if (rep.status) {
+    fprintf(stderr, "Quote daemon failed to make the quote\n");
+    rc = 1;
+  }
+  else
+    rc = file_write(hashname, rep.data, rep.dataLen)
+      || quoted_save_pcrvals(path, QUOTE_PRIORITY_BACKGROUND,
+			     pcrs, npcrs, pcrvals);
+  free(rep.data);
+  free(rep.sig);
+  return rc;
 }
 
 static int usage(const char *prog)
 {
   const char text[] =
-    "Usage: %s [-r host] [-hv] uuid hash pcrvals PCRS...\n"
+    "Usage: %s [-r host | -s socket] [-lhv] uuid hash pcrvals PCRS...\n"
     "\tuuid\tFile containing uuid of AIK\n"
     "\thash\tOutput file containing PCR hash\n"
     "\tpcrvals\tOutput file containing list of PCR values\n"
@@ -35,6 +64,11 @@ static int usage(const char *prog)
     "Options:\n"
     "\t-r host\n"
     "\t     Perform operation on remote host\n"
+    "\t-s socket\n"
+    "\t     Make the quote and read the PCRs with the quote daemon on\n"
+    "\t     socket, behind the quotes verifiers are waiting for\n"
+    "\t-l   Use the legacy quote command, so that the PCR values\n"
+    "\t     stored are the ones in the hash\n"
     "\t-h   Display command usage info\n"
     "\t-v   Display command version info\n"
     "\n"
@@ -49,8 +83,10 @@ int main(int argc, char **argv)
   UINT32 pcrs[argc];
 
   TSS_UNICODE *host = NULL; /* Non-null when connecting to a remote host */
+  const char *daemon = NULL;	/* Non-null when using tpm_quoted */
+  int legacy = 0;		/* Use TPM_Quote rather than TPM_Quote2 */
   int opt;
-  while ((opt = getopt(argc, argv, "r:hv")) != -1) {
+  while ((opt = getopt(argc, argv, "r:s:lhv")) != -1) {
     switch (opt) {
     case 'r':
 #if defined HAVE_ICONV_H
@@ -64,6 +100,12 @@ int main(int argc, char **argv)
       fprintf(stderr, "Remote requests not supported on this platform.\n");
       return 1;
 #endif
+    case 's':
+      daemon = optarg;
+      break;
+    case 'l':
+      legacy = 1;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -75,9 +117,12 @@ int main(int argc, char **argv)
     }
   }
 
-  if (argc < optind + 4)
+  if (argc < optind + 4 || (daemon && (host || legacy)))
     return usage(argv[0]);
 
+  if (trace_init(argv[0]))
+    return 1;
+
   const char *uuidname = argv[optind];
   const char *hashname = argv[optind + 1];
   const char *pcrvals = argv[optind + 2];
@@ -86,27 +131,26 @@ int main(int argc, char **argv)
   if (pcr_mask(pcrs, npcrs, argv + optind +  3))
     return 1;
 
-  FILE *in = fopen(uuidname, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", uuidname);
-    return 1;
-  }
-
   TSS_UUID uuid;
-  if (sizeof uuid != fread((void *)&uuid, 1, sizeof uuid, in)) {
+  UINT32 uuidLen;
+  if (file_read(uuidname, (BYTE *)&uuid, sizeof uuid, &uuidLen))
+    return 1;
+  if (uuidLen != sizeof uuid) {
     fprintf(stderr, "Expecting a uuid of %zd bytes in %s\n",
 	    sizeof uuid, uuidname);
     return 1;
   }
-  fclose(in);
+
+  if (daemon)
+    return daemon_pcrhash(daemon, uuid, pcrs, npcrs, hashname, pcrvals);
 
   /* Create context */
   TSS_HCONTEXT hContext;	/* Context handle */
-  TSS_RESULT rc = Tspi_Context_Create(&hContext);
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, host);
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
 
@@ -115,50 +159,34 @@ int main(int argc, char **argv)
   valid.ulExternalDataLength = sizeof nonce;
   valid.rgbExternalData = nonce;
 
-  if (quote(hContext, uuid, pcrs, npcrs, &valid))
+  struct quote_session *session =
+    quote_session_open(hContext, 0, uuid, pcrs, npcrs);
+  if (!session)
+    return tidy(hContext, 1);
+  if (legacy)
+    quote_session_set_mode(session, QUOTE_MODE_LEGACY);
+  struct pcr_cache *cache = host ? NULL : pcr_cache_default();
+  quote_session_set_pcr_cache(session, cache);
+  if (quote_session_quote(session, &valid)) {
+    quote_session_close(session);
+    pcr_cache_close(cache);
     return tidy(hContext, 1);
+  }
 
-  FILE *out = fopen(hashname, "wb");
-  if (!out) {
-    fprintf(stderr, "Cannot open %s\n", hashname);
+  if (file_write(hashname, valid.rgbData, valid.ulDataLength)) {
+    quote_session_close(session);
+    pcr_cache_close(cache);
     return tidy(hContext, 1);
   }
-  fwrite(valid.rgbData, 1, valid.ulDataLength, out);
-  fclose(out);
 
   Tspi_Context_FreeMemory(hContext, valid.rgbData);
   Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
 
   /* Save the selected PCR values in a file. */
 
-  /* Get TPM handle */
-  TSS_HTPM hTPM;		/* TPM handle */
-  rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "getting TPM object"));
-
-  out = fopen(pcrvals, "wb");
-  if (!out) {
-    fprintf(stderr, "Cannot open %s\n", pcrvals);
-    return tidy(hContext, 1);
-  }
-
-  qsort(pcrs, npcrs, sizeof pcrs[0], uint32_compar);
-
-  UINT32 i;
-  for (i = 0; i < npcrs; i++) {
-    UINT32 len;
-    BYTE *value;
-    rc = Tspi_TPM_PcrRead(hTPM, pcrs[i], &len, &value);
-    if (rc != TSS_SUCCESS)
-      return tidy(hContext, tss_err(rc, "reading PCR"));
-    fprintf(out, "%u=", pcrs[i]);
-    UINT32 j;
-    for (j = 0; j < len; j++)
-      fprintf(out, "%02X", value[j]);
-    fprintf(out, "\n");
-  }
-  fclose(out);
+  int failed = quote_session_save_pcrvals(session, pcrvals);
+  quote_session_close(session);
+  failed |= pcr_cache_close(cache);
 
-  return tidy(hContext, 0);
+  return tidy(hContext, failed);
 }
@@ -13,23 +13,108 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 
-#define NONCESIZE (1 << 10)
+/* Writes the quote, or with -b, a bundle holding the quote, the
+   signed quote info, the nonce, the uuid and when available, the PCR
+   values and the path from the nonce to the nonce quoted. */
+static int write_quote(const char *name, int bundled, TSS_UUID *uuid,
+		       BYTE *nonce, UINT32 nonceLen,
+		       BYTE *info, UINT32 infoLen, BYTE *sig, UINT32 sigLen,
+		       BYTE *path, UINT32 pathLen,
+		       struct quote_session *session)
+{
+  if (!bundled)
+    return file_write(name, sig, sigLen);
+  struct bundle b;
+  memset(&b, 0, sizeof b);
+  b.data[BUNDLE_UUID] = (BYTE *)uuid;
+  b.len[BUNDLE_UUID] = sizeof *uuid;
+  b.data[BUNDLE_NONCE] = nonce;
+  b.len[BUNDLE_NONCE] = nonceLen;
+  b.data[BUNDLE_INFO] = info;
+  b.len[BUNDLE_INFO] = infoLen;
+  b.data[BUNDLE_QUOTE] = sig;
+  b.len[BUNDLE_QUOTE] = sigLen;
+  if (pathLen > 0) {
+    b.data[BUNDLE_PATH] = path;
+    b.len[BUNDLE_PATH] = pathLen;
+  }
+  char *pcrvals = NULL;
+  size_t pcrvalsLen;
+  if (session) {
+    if (quote_session_get_pcrvals(session, &pcrvals, &pcrvalsLen))
+      return 1;
+    b.data[BUNDLE_PCRVALS] = (BYTE *)pcrvals;
+    b.len[BUNDLE_PCRVALS] = pcrvalsLen;
+  }
+  UINT32 len;
+  BYTE *buf = bundle_encode(&b, &len);
+  free(pcrvals);
+  if (!buf)
+    return 1;
+  int bad = file_write(name, buf, len);
+  free(buf);
+  return bad;
+}
 
-static int uint32_compar(const void *a, const void *b)
+/* Obtains the quote from tpm_quoted as an interactive request.  When
+   the daemon aggregated the nonce with others, the quote is for their
+   root, and the path from the nonce to the root goes in pathname or
+   in the bundle.  The PCR values, when wanted, are read by the daemon
+   after the quote. */
+static int daemon_quote(const char *path, TSS_UUID uuid,
+			BYTE *nonce, UINT32 nonceLen,
+			UINT32 *pcrs, UINT32 npcrs,
+			const char *quotename, int bundled,
+			const char *pathname, const char *pcrvals)
 {
-  UINT32 x = *(UINT32 *) a;
-  UINT32 y = *(UINT32 *) b;
-  return x - y;
+  static struct quoted_request req;
+  if (nonceLen > sizeof req.data || npcrs > QUOTED_MAXPCRS) {
+    fprintf(stderr, "Request too large for the quote daemon\n");
+    return 1;
+  }
+  req.type = QUOTE_JOB_QUOTE;
+  req.priority = QUOTE_PRIORITY_INTERACTIVE;
+  req.uuid = uuid;
+  memcpy(req.data, nonce, nonceLen);
+  req.dataLen = nonceLen;
+  memcpy(req.pcrs, pcrs, npcrs * sizeof *pcrs);
+  req.npcrs = npcrs;
+
+  struct quoted_reply rep;
+  if (quoted_call(path, &req, &rep))
+    return 1;
+  int rc;
+  if (rep.status) {
+    fprintf(stderr, "Quote daemon failed to make the quote\n");
+    rc = 1;
+  }
+  else if (rep.pathLen > 0 && !bundled && !pathname) {
+    fprintf(stderr, "The quote covers several nonces; "
+	    "use -a or -b to store the path\n");
+    rc = 1;
+  }
+  else
+    rc = write_quote(quotename, bundled, &uuid, nonce, nonceLen,
+		     rep.data, rep.dataLen, rep.sig, rep.sigLen,
+		     rep.path, rep.pathLen, NULL)
+      || (pathname && file_write(pathname, rep.path, rep.pathLen))
+      || (pcrvals && quoted_save_pcrvals(path, QUOTE_PRIORITY_INTERACTIVE,
+					 pcrs, npcrs, pcrvals));
+  free(rep.data);
+  free(rep.sig);
+  return rc;
 }
 
 static int usage(const char *prog)
 {
   const char text[] =
-    "Usage: %s [-r host] [-p pcrvals] [-hv] uuid nonce quote PCRS...\n"
+    "Usage: %s [-r host | -s socket] [-p pcrvals] [-a path] [-blhv] "
+    "uuid nonce quote PCRS...\n"
     "\tuuid\tFile containing uuid of AIK\n"
     "\tnonce\tFile containing 20-byte nonce\n"
     "\tquote\tOutput file\n"
@@ -37,8 +122,18 @@ static int usage(const char *prog)
     "Options:\n"
     "\t-r host\n"
     "\t     Perform operation on remote host\n"
+    "\t-s socket\n"
+    "\t     Request the quote from the quote daemon on socket\n"
     "\t-p pcrvals\n"
     "\t     Store PCR values is file pcrvals\n"
+    "\t-a path\n"
+    "\t     Store the path from the nonce to the nonce quoted in file\n"
+    "\t     path, which is empty unless tpm_quoted aggregated nonces\n"
+    "\t-b   Write a bundle holding the quote, the signed quote info,\n"
+    "\t     the nonce, the uuid, the PCR values and the nonce path\n"
+    "\t     to quote\n"
+    "\t-l   Use the legacy quote command, so that the PCR values\n"
+    "\t     stored are the ones signed by the quote\n"
     "\t-h   Display command usage info\n"
     "\t-v   Display command version info\n"
     "\n"
@@ -58,9 +153,13 @@ int main(int argc, char **argv)
 
   TSS_UNICODE *host = NULL; /* Non-null when connecting to a remote host */
   const char *pcrvals = NULL;	/* Non-null when saving the PCR values */
+  const char *daemon = NULL;	/* Non-null when using tpm_quoted */
+  int legacy = 0;		/* Use TPM_Quote rather than TPM_Quote2 */
+  int bundled = 0;		/* Write a bundle rather than the quote */
+  const char *pathname = NULL;	/* Non-null when saving the nonce path */
 
   int opt;
-  while ((opt = getopt(argc, argv, "r:p:hv")) != -1) {
+  while ((opt = getopt(argc, argv, "r:s:p:a:blhv")) != -1) {
     switch (opt) {
     case 'r':
 #if defined HAVE_ICONV_H
@@ -74,9 +173,21 @@ int main(int argc, char **argv)
       fprintf(stderr, "Remote requests not supported on this platform.\n");
       return 1;
 #endif
+    case 's':
+      daemon = optarg;
+      break;
     case 'p':
       pcrvals = optarg;
       break;
+    case 'a':
+      pathname = optarg;
+      break;
+    case 'b':
+      bundled = 1;
+      break;
+    case 'l':
+      legacy = 1;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -88,9 +199,12 @@ int main(int argc, char **argv)
     }
   }
 
-  if (argc < optind + 4)
+  if (argc < optind + 4 || (daemon && (host || legacy)))
     return usage(argv[0]);
 
+  if (trace_init(argv[0]))
+    return 1;
+
   const char *uuidname = argv[optind];
   const char *noncename = argv[optind + 1];
   const char *quotename = argv[optind + 2];
@@ -99,92 +213,72 @@ int main(int argc, char **argv)
   if (pcr_mask(pcrs, npcrs, argv + optind + 3))
     return 1;
 
-  FILE *in = fopen(uuidname, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", uuidname);
-    return 1;
-  }
-
   TSS_UUID uuid;
-  if (sizeof uuid != fread((void *)&uuid, 1, sizeof uuid, in)) {
+  UINT32 uuidLen;
+  if (file_read(uuidname, (BYTE *)&uuid, sizeof uuid, &uuidLen))
+    return 1;
+  if (uuidLen != sizeof uuid) {
     fprintf(stderr, "Expecting a uuid of %zd bytes in %s\n",
 	    sizeof uuid, uuidname);
     return 1;
   }
-  fclose(in);
 
-  in = fopen(noncename, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", noncename);
+  struct file_data nonce;
+  if (file_load(noncename, &nonce))
     return 1;
-  }
-  BYTE nonce[NONCESIZE];
-  UINT32 nonceLen;
-  nonceLen = fread(nonce, 1, NONCESIZE, in);
-  fclose(in);
+
+  if (daemon)
+    return daemon_quote(daemon, uuid, nonce.data, nonce.len,
+			pcrs, npcrs, quotename, bundled, pathname, pcrvals);
 
   /* Create context */
   TSS_HCONTEXT hContext;	/* Context handle */
-  TSS_RESULT rc = Tspi_Context_Create(&hContext);
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, host);
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
+  int remote = host != NULL;	/* PCRs are cached only locally */
   free(host);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
 
   TSS_VALIDATION valid;
-  valid.ulExternalDataLength = nonceLen;
-  valid.rgbExternalData = nonce;
+  valid.ulExternalDataLength = nonce.len;
+  valid.rgbExternalData = nonce.data;
 
-  if (quote(hContext, uuid, pcrs, npcrs, &valid))
+  struct quote_session *session =
+    quote_session_open(hContext, 0, uuid, pcrs, npcrs);
+  if (!session)
+    return tidy(hContext, 1);
+  if (legacy)
+    quote_session_set_mode(session, QUOTE_MODE_LEGACY);
+  struct pcr_cache *cache = remote ? NULL : pcr_cache_default();
+  quote_session_set_pcr_cache(session, cache);
+  if (quote_session_quote(session, &valid)) {
+    quote_session_close(session);
+    pcr_cache_close(cache);
     return tidy(hContext, 1);
+  }
 
-  FILE *out = fopen(quotename, "wb");
-  if (!out) {
-    fprintf(stderr, "Cannot open %s\n", quotename);
+  if (write_quote(quotename, bundled, &uuid, nonce.data, nonce.len,
+		  valid.rgbData, valid.ulDataLength,
+		  valid.rgbValidationData, valid.ulValidationDataLength,
+		  NULL, 0, session)
+      || (pathname && file_write(pathname, NULL, 0))) {
+    quote_session_close(session);
+    pcr_cache_close(cache);
     return tidy(hContext, 1);
   }
-  fwrite(valid.rgbValidationData, 1, valid.ulValidationDataLength, out);
-  fclose(out);
 
   Tspi_Context_FreeMemory(hContext, valid.rgbData);
   Tspi_Context_FreeMemory(hContext, valid.rgbValidationData);
 
-  if (!pcrvals)
-    return tidy(hContext, 0);
-
   /* Save the selected PCR values in a file. */
 
-  /* Get TPM handle */
-  TSS_HTPM hTPM;		/* TPM handle */
-  rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "getting TPM object"));
-
-  out = fopen(pcrvals, "wb");
-  if (!out) {
-    fprintf(stderr, "Cannot open %s\n", pcrvals);
-    return tidy(hContext, 1);
-  }
-
-  qsort(pcrs, npcrs, sizeof pcrs[0], uint32_compar);
-
-  UINT32 i;
-  for (i = 0; i < npcrs; i++) {
-    UINT32 len;
-    BYTE *value;
-    rc = Tspi_TPM_PcrRead(hTPM, pcrs[i], &len, &value);
-    if (rc != TSS_SUCCESS)
-      return tidy(hContext, tss_err(rc, "reading PCR"));
-    fprintf(out, "%u=", pcrs[i]);
-    UINT32 j;
-    for (j = 0; j < len; j++)
-      fprintf(out, "%02X", value[j]);
-    fprintf(out, "\n");
-  }
-  fclose(out);
+  int failed = pcrvals && quote_session_save_pcrvals(session, pcrvals);
+  quote_session_close(session);
+  failed |= pcr_cache_close(cache);
 
-  return tidy(hContext, 0);
+  return tidy(hContext, failed);
 }
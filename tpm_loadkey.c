@@ -13,6 +13,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
@@ -20,13 +21,42 @@
 #define BLOBSIZE (1 << 10)
 #define NONCESIZE (1 << 10)
 
+/* Has tpm_quoted load the key as a background request, so that the
+   daemon drops the AIK it holds under the UUID. */
+static int daemon_loadkey(const char *path, BYTE *blob, UINT32 blobLen,
+			  TSS_UUID uuid)
+{
+  static struct quoted_request req;
+  if (blobLen > sizeof req.data) {
+    fprintf(stderr, "Request too large for the quote daemon\n");
+    return 1;
+  }
+  req.type = QUOTE_JOB_LOADKEY;
+  req.priority = QUOTE_PRIORITY_BACKGROUND;
+  req.uuid = uuid;
+  memcpy(req.data, blob, blobLen);
+  req.dataLen = blobLen;
+
+  struct quoted_reply rep;
+  if (quoted_call(path, &req, &rep))
+    return 1;
+  int rc = rep.status != 0;
+  if (rc)
+    fprintf(stderr, "Quote daemon failed to load the key\n");
+  free(rep.data);
+  free(rep.sig);
+  return rc;
+}
+
 static int usage(const char *prog)
 {
   const char text[] =
-    "Usage: %s [-r host] [-hv] blob uuid\n"
+    "Usage: %s [-r host | -s socket] [-hv] blob uuid\n"
     "Options:\n"
     "\t-r host\n"
     "\t     Perform operation on remote host\n"
+    "\t-s socket\n"
+    "\t     Load the key with the quote daemon on socket\n"
     "\t-h   Display command usage info\n"
     "\t-v   Display command version info\n"
     "\n"
@@ -38,8 +68,9 @@ static int usage(const char *prog)
 int main(int argc, char **argv)
 {
   TSS_UNICODE *host = NULL;
+  const char *daemon = NULL;	/* Non-null when using tpm_quoted */
   int opt;
-  while ((opt = getopt(argc, argv, "r:hv")) != -1) {
+  while ((opt = getopt(argc, argv, "r:s:hv")) != -1) {
     switch (opt) {
     case 'r':
 #if defined HAVE_ICONV_H
@@ -53,6 +84,9 @@ int main(int argc, char **argv)
       fprintf(stderr, "Remote requests not supported on this platform.\n");
       return 1;
 #endif
+    case 's':
+      daemon = optarg;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -64,43 +98,40 @@ int main(int argc, char **argv)
     }
   }
 
-  if (argc != optind + 2)
+  if (argc != optind + 2 || (daemon && host))
     return usage(argv[0]);
 
+  if (trace_init(argv[0]))
+    return 1;
+
   const char *blobname = argv[optind];
   const char *uuidname = argv[optind + 1];
 
-  FILE *in = fopen(blobname, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", blobname);
-    return 1;
-  }
   BYTE blob[BLOBSIZE];
   UINT32 blobLen;
-  blobLen = fread(blob, 1, BLOBSIZE, in);
-  fclose(in);
-
-  in = fopen(uuidname, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", uuidname);
+  if (file_read(blobname, blob, BLOBSIZE, &blobLen))
     return 1;
-  }
 
   TSS_UUID uuid;
-  if (sizeof uuid != fread((void *)&uuid, 1, sizeof uuid, in)) {
+  UINT32 uuidLen;
+  if (file_read(uuidname, (BYTE *)&uuid, sizeof uuid, &uuidLen))
+    return 1;
+  if (uuidLen != sizeof uuid) {
     fprintf(stderr, "Expecting a uuid of %zd bytes in %s\n",
 	    sizeof uuid, uuidname);
     return 1;
   }
-  fclose(in);
+
+  if (daemon)
+    return daemon_loadkey(daemon, blob, blobLen, uuid);
 
   /* Create context */
   TSS_HCONTEXT hContext;	/* Context handle */
-  TSS_RESULT rc = Tspi_Context_Create(&hContext);
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, host);
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
   free(host);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
@@ -96,6 +96,9 @@ int main (int argc, char **argv)
   if (argc != optind + 2)
     return usage(argv[0]);
 
+  if (trace_init(argv[0]))
+    return 1;
+
 #if !defined HAVE_ICONV_H
   if (utf16le) {
     fprintf(stderr, "TSS UNICODE passwords not supported on this platform.\n");
@@ -108,52 +111,52 @@ int main (int argc, char **argv)
 
   /* Create context */
   TSS_HCONTEXT hContext;
-  int rc = Tspi_Context_Create(&hContext);
+  int rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, NULL);
+  rc = TRACE(Tspi_Context_Connect, hContext, NULL);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
 
   /* Get SRK */
   TSS_UUID SRK_UUID = TSS_UUID_SRK;
   TSS_HKEY hSRK;
-  rc = Tspi_Context_LoadKeyByUUID(hContext, TSS_PS_TYPE_SYSTEM,
-				  SRK_UUID, &hSRK);
+  rc = TRACE(Tspi_Context_LoadKeyByUUID, hContext, TSS_PS_TYPE_SYSTEM,
+	     SRK_UUID, &hSRK);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "loading SRK"));
 
   TSS_HPOLICY hSrkPolicy;
-  rc = Tspi_GetPolicyObject(hSRK, TSS_POLICY_USAGE, &hSrkPolicy);
+  rc = TRACE(Tspi_GetPolicyObject, hSRK, TSS_POLICY_USAGE, &hSrkPolicy);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting SRK policy"));
 
   BYTE srkSecret[] = TSS_WELL_KNOWN_SECRET;
-  rc = Tspi_Policy_SetSecret(hSrkPolicy, TSS_SECRET_MODE_SHA1,
-			     sizeof srkSecret, srkSecret);
+  rc = TRACE(Tspi_Policy_SetSecret, hSrkPolicy, TSS_SECRET_MODE_SHA1,
+	     sizeof srkSecret, srkSecret);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "setting SRK secret"));
 
   /* Get TPM handle */
   TSS_HTPM hTPM;
-  rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
+  rc = TRACE(Tspi_Context_GetTpmObject, hContext, &hTPM);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting TPM object"));
 
   TSS_HPOLICY hTPMPolicy;
-  rc = Tspi_Context_CreateObject(hContext, TSS_OBJECT_TYPE_POLICY,
-				 TSS_POLICY_USAGE, &hTPMPolicy);
+  rc = TRACE(Tspi_Context_CreateObject, hContext, TSS_OBJECT_TYPE_POLICY,
+	     TSS_POLICY_USAGE, &hTPMPolicy);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting TPM policy"));
 
-  rc = Tspi_Policy_AssignToObject(hTPMPolicy, hTPM);
+  rc = TRACE(Tspi_Policy_AssignToObject, hTPMPolicy, hTPM);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "assigning TPM policy"));
 
   if (well_known)
-    rc = Tspi_Policy_SetSecret(hTPMPolicy, TSS_SECRET_MODE_SHA1,
-			       sizeof srkSecret, srkSecret);
+    rc = TRACE(Tspi_Policy_SetSecret, hTPMPolicy, TSS_SECRET_MODE_SHA1,
+	       sizeof srkSecret, srkSecret);
   else
 #if defined USE_OPENSSL_UI
     {
@@ -168,45 +171,46 @@ int main (int argc, char **argv)
 	  return tidy(hContext, 
 		      tss_err(TSS_E_FAIL, "converting password to UTF16LE"));
 	size_t passwdLen = utf16lelen(passwd);
-	rc = Tspi_Policy_SetSecret(hTPMPolicy, TSS_SECRET_MODE_PLAIN,
-				   passwdLen, (BYTE *)passwd);
+	rc = TRACE(Tspi_Policy_SetSecret, hTPMPolicy, TSS_SECRET_MODE_PLAIN,
+		   passwdLen, (BYTE *)passwd);
 	free(passwd);
       }
       else
-	rc = Tspi_Policy_SetSecret(hTPMPolicy, TSS_SECRET_MODE_PLAIN,
-				   strlen(buf), (BYTE *)buf);
+	rc = TRACE(Tspi_Policy_SetSecret, hTPMPolicy, TSS_SECRET_MODE_PLAIN,
+		   strlen(buf), (BYTE *)buf);
 #else
-      rc = Tspi_Policy_SetSecret(hTPMPolicy, TSS_SECRET_MODE_PLAIN,
-				 strlen(buf), (BYTE *)buf);
+      rc = TRACE(Tspi_Policy_SetSecret, hTPMPolicy, TSS_SECRET_MODE_PLAIN,
+		 strlen(buf), (BYTE *)buf);
 #endif
       memset(buf, 0, bufSize);
     }
 #else
-    rc = Tspi_Policy_SetSecret(hTPMPolicy, TSS_SECRET_MODE_POPUP, 0, NULL);
+    rc = TRACE(Tspi_Policy_SetSecret, hTPMPolicy, TSS_SECRET_MODE_POPUP,
+	       0, NULL);
 #endif
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "setting TPM policy secret"));
 
   /* Create dummy PCA key */
   TSS_HKEY hPCA;
-  rc = Tspi_Context_CreateObject(hContext,
-				 TSS_OBJECT_TYPE_RSAKEY,
-				 TSS_KEY_TYPE_LEGACY|TSS_KEY_SIZE_2048,
-				 &hPCA);
+  rc = TRACE(Tspi_Context_CreateObject, hContext,
+	     TSS_OBJECT_TYPE_RSAKEY,
+	     TSS_KEY_TYPE_LEGACY|TSS_KEY_SIZE_2048,
+	     &hPCA);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "creating PCA object"));
 
   /* Create the PCA key in the TPM, it is not user supplied */
-  rc = Tspi_Key_CreateKey(hPCA, hSRK, 0);
+  rc = TRACE(Tspi_Key_CreateKey, hPCA, hSRK, 0);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "creating PCA key in TPM"));
 
   /* Create AIK object */
   int initFlags = TSS_KEY_TYPE_IDENTITY | TSS_KEY_SIZE_2048;
   TSS_HKEY hAIK;
-  rc = Tspi_Context_CreateObject(hContext,
-				 TSS_OBJECT_TYPE_RSAKEY,
-				 initFlags, &hAIK);
+  rc = TRACE(Tspi_Context_CreateObject, hContext,
+	     TSS_OBJECT_TYPE_RSAKEY,
+	     initFlags, &hAIK);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "creating AIK object"));
 
@@ -214,34 +218,29 @@ int main (int argc, char **argv)
   BYTE lab[] = {};
   BYTE *blob;
   UINT32 blobLen;
-  rc = Tspi_TPM_CollateIdentityRequest(hTPM, hSRK, hPCA, 0, lab,
-				       hAIK, TSS_ALG_AES,
-				       &blobLen, &blob);
+  rc = TRACE(Tspi_TPM_CollateIdentityRequest, hTPM, hSRK, hPCA, 0, lab,
+	     hAIK, TSS_ALG_AES,
+	     &blobLen, &blob);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "generating new key"));
   Tspi_Context_FreeMemory(hContext, blob);
 
   /* Get key blob */
-  rc = Tspi_GetAttribData(hAIK, TSS_TSPATTRIB_KEY_BLOB,
-			  TSS_TSPATTRIB_KEYBLOB_BLOB,
-			  &blobLen, &blob);
+  rc = TRACE(Tspi_GetAttribData, hAIK, TSS_TSPATTRIB_KEY_BLOB,
+	     TSS_TSPATTRIB_KEYBLOB_BLOB,
+	     &blobLen, &blob);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting key blob"));
 
   /* Write key blob */
-  FILE *out = fopen(blobname, "wb");
-  if (out == NULL) {
-    fprintf(stderr, "Cannot open %s\n", blobname);
+  if (file_write(blobname, blob, blobLen))
     return tidy(hContext, 1);
-  }
-  fwrite(blob, 1, blobLen, out);
-  fclose(out);
   Tspi_Context_FreeMemory(hContext, blob);
 
   /* Get public key blob */
-  rc = Tspi_GetAttribData(hAIK, TSS_TSPATTRIB_KEY_BLOB,
-			  TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
-			  &blobLen, &blob);
+  rc = TRACE(Tspi_GetAttribData, hAIK, TSS_TSPATTRIB_KEY_BLOB,
+	     TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
+	     &blobLen, &blob);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting public key blob"));
 
@@ -249,8 +248,8 @@ int main (int argc, char **argv)
 #if defined WIN32
   // Handle NTRU tsp1.dll bug.  One must compute the size first.
   UINT32 derBlobLen = 0;
-  rc = Tspi_EncodeDER_TssBlob(blobLen, blob, TSS_BLOB_TYPE_PUBKEY,
-			      &derBlobLen, derBlob);
+  rc = TRACE(Tspi_EncodeDER_TssBlob, blobLen, blob, TSS_BLOB_TYPE_PUBKEY,
+	     &derBlobLen, derBlob);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting DER encoding public key size"));
   if (derBlobLen > sizeof derBlob) {
@@ -261,20 +260,15 @@ int main (int argc, char **argv)
 #else
   UINT32 derBlobLen = sizeof derBlob;
 #endif
-  rc = Tspi_EncodeDER_TssBlob(blobLen, blob, TSS_BLOB_TYPE_PUBKEY,
-			      &derBlobLen, derBlob);
+  rc = TRACE(Tspi_EncodeDER_TssBlob, blobLen, blob, TSS_BLOB_TYPE_PUBKEY,
+	     &derBlobLen, derBlob);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "DER encoding public key blob"));
   Tspi_Context_FreeMemory(hContext, blob);
 
   /* Write DER-encoded public key */
-  out = fopen(pubkeyname, "wb");
-  if (out == NULL) {
-    fprintf(stderr, "Cannot open %s\n", pubkeyname);
+  if (file_write(pubkeyname, derBlob, derBlobLen))
     return tidy(hContext, 1);
-  }
-  fwrite(derBlob, 1, derBlobLen, out);
-  fclose(out);
 
   return tidy(hContext, 0);
 }
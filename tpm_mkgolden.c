@@ -0,0 +1,164 @@
+/*
+ * Make a golden database of expected quote info.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define BUFSIZE (1 << 10)
+
+/* Reads a manifest with one entry per line.  An entry is either
+   aik pubkey hash, or class name hash, where pubkey and hash are
+   files as given to tpm_verifyquote.  Blank lines and lines that
+   start with # are ignored. */
+static struct golden_entry *read_manifest(FILE *in, size_t *nentries)
+{
+  size_t n = 0, size = 64;
+  struct golden_entry *entries = malloc(size * sizeof *entries);
+  char line[3 * FILENAME_MAX];
+  unsigned long lineno = 0;
+  int bad = !entries;
+  while (!bad && fgets(line, sizeof line, in)) {
+    lineno++;
+    char *save;
+    char *kind = strtok_r(line, " \t\r\n", &save);
+    if (!kind || *kind == '#')
+      continue;
+    char *name = strtok_r(NULL, " \t\r\n", &save);
+    char *hashname = strtok_r(NULL, " \t\r\n", &save);
+    if (!hashname || strtok_r(NULL, " \t\r\n", &save)
+	|| (strcmp(kind, "aik") && strcmp(kind, "class"))) {
+      fprintf(stderr, "Ill-formed manifest entry on line %lu\n", lineno);
+      bad = 1;
+      break;
+    }
+    if (n == size) {
+      struct golden_entry *more =
+	realloc(entries, 2 * size * sizeof *entries);
+      if (!more) {
+	bad = 1;
+	break;
+      }
+      entries = more;
+      size *= 2;
+    }
+
+    struct golden_entry *e = &entries[n];
+    BYTE buf[BUFSIZE];
+    UINT32 len;
+    if (!strcmp(kind, "aik")) {
+      if (file_read(name, buf, BUFSIZE, &len)) {
+	bad = 1;
+	break;
+      }
+      golden_key(buf, len, e->key);
+    }
+    else
+      golden_key((BYTE *)name, strlen(name), e->key);
+    if (file_read(hashname, buf, BUFSIZE, &len)) {
+      bad = 1;
+      break;
+    }
+    UINT16 selectSize;		/* Checks the whole layout */
+    if (len > GOLDEN_INFOSIZE
+	|| quote_info_select_size(buf, len, &selectSize)) {
+      fprintf(stderr, "%s does not contain quote info\n", hashname);
+      bad = 1;
+      break;
+    }
+    e->info = malloc(len);
+    if (!e->info) {
+      bad = 1;
+      break;
+    }
+    memcpy(e->info, buf, len);
+    e->infoLen = len;
+    n++;
+  }
+  if (ferror(in)) {
+    fprintf(stderr, "Error on manifest read\n");
+    bad = 1;
+  }
+  if (bad) {
+    while (n > 0)
+      free(entries[--n].info);
+    free(entries);
+    return NULL;
+  }
+  *nentries = n;
+  return entries;
+}
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-hv] database manifest\n"
+    "\tdatabase\tGolden database to create\n"
+    "\tmanifest\tFile with one entry per line, or -\n"
+    "Options:\n"
+    "\t-h   Display command usage info\n"
+    "\t-v   Display command version info\n"
+    "\n"
+    "Each manifest entry is either\n"
+    "\taik pubkey hash\n"
+    "or\n"
+    "\tclass name hash\n"
+    "where pubkey is a file containing the public part of an AIK, and\n"
+    "hash is a file containing the expected PCR composite hash.\n";
+  fprintf(stderr, text, prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "hv")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (argc != optind + 2)
+    return usage(argv[0]);
+
+  const char *dbname = argv[optind];
+  const char *manifest = argv[optind + 1];
+
+  FILE *in = stdin;
+  if (strcmp(manifest, "-") && !(in = fopen(manifest, "r"))) {
+    fprintf(stderr, "Cannot open %s\n", manifest);
+    return 1;
+  }
+  size_t n;
+  struct golden_entry *entries = read_manifest(in, &n);
+  if (in != stdin)
+    fclose(in);
+  if (!entries)
+    return 1;
+
+  int rc = golden_write(dbname, entries, n);
+  size_t i;
+  for (i = 0; i < n; i++)
+    free(entries[i].info);
+  free(entries);
+  return rc;
+}
@@ -47,27 +47,30 @@ int main (int argc, char **argv)
   if (argc != optind + 1)
     return usage(argv[0]);
 
+  if (trace_init(argv[0]))
+    return 1;
+
   const char *uuidname = argv[optind];
 
   /* Create context */
   TSS_HCONTEXT hContext;
-  int rc = Tspi_Context_Create(&hContext);
+  int rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, NULL);
+  rc = TRACE(Tspi_Context_Connect, hContext, NULL);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
 
   /* Get TPM handle */
   TSS_HTPM hTPM;		/* TPM handle */
-  rc = Tspi_Context_GetTpmObject(hContext, &hTPM);
+  rc = TRACE(Tspi_Context_GetTpmObject, hContext, &hTPM);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "getting TPM object"));
 
   TSS_UUID *uuid;
   /* Generate a UUID for the key */
-  rc = Tspi_TPM_GetRandom(hTPM, sizeof(TSS_UUID), (BYTE **)&uuid);
+  rc = TRACE(Tspi_TPM_GetRandom, hTPM, sizeof(TSS_UUID), (BYTE **)&uuid);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "generating a key UUID"));
 
@@ -78,13 +81,8 @@ int main (int argc, char **argv)
   uuid->bClockSeqHigh |= 0x80;
 
   /* Write uuid */
-  FILE *out = fopen(uuidname, "wb");
-  if (out == NULL) {
-    fprintf(stderr, "Cannot open %s\n", uuidname);
+  if (file_write(uuidname, uuid, sizeof *uuid))
     return tidy(hContext, 1);
-  }
-  fwrite(uuid, 1, sizeof *uuid, out);
-  fclose(out);
   Tspi_Context_FreeMemory(hContext, (BYTE *)uuid);
 
   return tidy(hContext, 0);
@@ -10,18 +10,433 @@
 #if !defined _TPM_QUOTE_H
 #define  _TPM_QUOTE_H
 
+/* A quote verification request for a verify_pool.  The inputs are
+   the contents of the files given to tpm_verifyquote. */
+struct verify_job {
+  BYTE *pubkey;			/* DER encoded public AIK */
+  UINT32 pubkeyLen;
+  BYTE *hash;			/* Expected signed data, updated in place */
+  UINT32 hashLen;
+  BYTE *nonce;
+  UINT32 nonceLen;
+  BYTE *quote;			/* Signature to verify */
+  UINT32 quoteLen;
+  void *arg;			/* For use by the caller */
+  int result;			/* Zero when the quote is verified */
+};
+
+typedef void verify_done(struct verify_job *job);
+
+/* Counters kept by an aik_cache. */
+struct aik_cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  size_t entries;		/* Keys currently cached */
+};
+
+/* The quote command used by a quote session. */
+enum quote_mode {
+  QUOTE_MODE_UNKNOWN,		/* Not yet probed */
+  QUOTE_MODE_QUOTE2,		/* TPM_Quote2, on version 1.2 TPMs */
+  QUOTE_MODE_LEGACY		/* TPM_Quote */
+};
+
+/* The TPM commands a quote_worker schedules. */
+enum quote_job_type {
+  QUOTE_JOB_QUOTE,		/* Quote PCRs with the AIK under uuid */
+  QUOTE_JOB_PCRREAD,		/* Read the values of PCRs */
+  QUOTE_JOB_LOADKEY,		/* Load a key blob and register it */
+  QUOTE_JOB_RANDOM		/* Get random bytes from the TPM */
+};
+
+/* Scheduling classes, most urgent first. */
+enum quote_priority {
+  QUOTE_PRIORITY_INTERACTIVE,	/* A verifier is waiting */
+  QUOTE_PRIORITY_BACKGROUND,	/* Provisioning and maintenance */
+  QUOTE_NPRIORITIES
+};
+
+/* A request for a quote_worker.  The outputs are set before the job
+   is handed back.  The signed data of a quote, the PCR values read
+   one after another, or the random bytes are returned as data. */
+struct quote_job {
+  enum quote_job_type type;
+  enum quote_priority priority;
+  TSS_UUID uuid;		/* UUID of the AIK or the key loaded */
+  UINT32 *pcrs;
+  UINT32 npcrs;
+  BYTE *nonce;
+  UINT32 nonceLen;
+  BYTE *blob;			/* Key blob to load */
+  UINT32 blobLen;
+  UINT32 randomLen;		/* Random bytes wanted */
+  void *arg;			/* For use by the caller */
+  int result;			/* Zero when the command succeeded */
+  BYTE *data;			/* Malloc'd */
+  UINT32 dataLen;
+  BYTE *sig;			/* Signature of a quote, malloc'd */
+  UINT32 sigLen;
+  enum quote_mode mode;		/* Quote command used */
+  UINT32 waitUsec;		/* Time spent queued */
+  UINT32 setupUsec;		/* Time spent opening a session */
+  UINT32 tpmUsec;		/* Time spent in the command */
+  UINT64 queued;		/* Used by the worker */
+  struct quote_job *twins;	/* Used by the worker */
+  struct quote_job *next;	/* Used by the worker */
+};
+
+typedef void quote_done(struct quote_job *job);
+
+/* Histograms kept by a quote_worker.  Bucket 0 counts zeros, and
+   bucket i counts values from 2^(i-1) up to 2^i, the last bucket
+   counting larger values too. */
+#define QUOTE_HISTSIZE 24
+struct quote_worker_stats {
+  unsigned long jobs[QUOTE_NPRIORITIES];
+  unsigned long coalesced;	/* Jobs answered by a twin's command */
+  unsigned long aikLoads;	/* AIKs loaded by UUID */
+  unsigned long aikShared;	/* Quotes whose AIK was already loaded */
+  unsigned long depth[QUOTE_HISTSIZE]; /* Jobs queued at submission */
+  unsigned long wait[QUOTE_NPRIORITIES][QUOTE_HISTSIZE]; /* In usec */
+};
+
+/* The outcome of quoting one host with fanquote. */
+enum fanquote_status {
+  FANQUOTE_OK,
+  FANQUOTE_FAILED,
+  FANQUOTE_TIMEOUT
+};
+
+struct fanquote_result {
+  const char *host;
+  enum fanquote_status status;
+  UINT32 usec;			/* Time spent on the host */
+  BYTE *data;			/* Signed data, or NULL */
+  UINT32 dataLen;
+  BYTE *sig;			/* Signature, or NULL */
+  UINT32 sigLen;
+  void *arg;			/* As passed to fanquote */
+};
+
+typedef void fanquote_done(struct fanquote_result *result);
+
+/* Counters kept by a conn_pool. */
+struct conn_pool_stats {
+  unsigned long hits;		/* Idle contexts reused */
+  unsigned long misses;		/* New connections */
+  unsigned long reconnects;	/* Lost connections replaced */
+  unsigned long evictions;	/* Idle contexts closed */
+  size_t live;			/* Contexts idle or in use */
+};
+
+/* An entry of a golden database: the quote info expected from the
+   AIK or machine class whose key is given. */
+#define GOLDEN_KEYSIZE 20	/* SHA-1 of a DER public key or class */
+#define GOLDEN_INFOSIZE 60	/* Largest quote info kept */
+
+struct golden_entry {
+  BYTE key[GOLDEN_KEYSIZE];
+  BYTE *info;
+  UINT32 infoLen;
+};
+
+/* PCR values read from index=value lines. */
+#define PCRVALS_SELECTSIZE 3
+#define PCRVALS_NPCRS (8 * PCRVALS_SELECTSIZE)
+#define PCRVALS_VALUESIZE 20
+
+struct pcrvals {
+  BYTE select[PCRVALS_SELECTSIZE];
+  UINT32 npcrs;			/* Number of bits set in select */
+  BYTE value[PCRVALS_NPCRS][PCRVALS_VALUESIZE];
+};
+
+/* A message hashed by sha1_multi. */
+#define SHA1_LANES 16		/* Most messages hashed at once */
+
+struct sha1_msg {
+  const BYTE *data;
+  UINT32 len;
+  BYTE *digest;			/* Where the 20 byte digest goes */
+};
+
+struct composite_stats {
+  unsigned long hashes;		/* Composite hashes computed */
+  unsigned long values;		/* PCR values hashed */
+  unsigned long resumed;	/* PCR values skipped by resuming */
+};
+
+/* Counters kept by a pcr_cache. */
+struct pcr_cache_stats {
+  unsigned long hits;		/* Values read from the cache */
+  unsigned long misses;		/* Values read from the TPM */
+  unsigned long invalidations;	/* Logs changed and PCRs dropped */
+};
+
+/* Formats of the measurement logs read by an eventlog_reader. */
+enum eventlog_format {
+  EVENTLOG_BIOS,		/* Firmware, binary_bios_measurements */
+  EVENTLOG_IMA			/* IMA, binary_runtime_measurements */
+};
+
+/* An event read from a measurement log. */
+struct eventlog_event {
+  UINT32 pcr;
+  UINT32 type;			/* Event type, for firmware events */
+  int extends;			/* Zero when the event extends no PCR */
+  BYTE digest[PCRVALS_VALUESIZE]; /* Digest extended into the PCR */
+  const char *template;		/* Template name, for IMA events */
+  const BYTE *data;		/* Event or template data */
+  UINT32 dataLen;
+};
+
+/* Counters kept by a replay. */
+struct replay_stats {
+  unsigned long extends;	/* Digests extended */
+  unsigned long rounds;		/* Calls to sha1_multi */
+};
+
+/* Paths from a nonce to the root of aggregated nonces. */
+#define NONCE_STEPSIZE (1 + sizeof(TPM_NONCE)) /* Side and sibling */
+#define NONCE_MAXSTEPS 24
+#define NONCE_MAXPATH (NONCE_MAXSTEPS * NONCE_STEPSIZE)
+
+/* A whole file in memory, as loaded by file_load. */
+struct file_data {
+  BYTE *data;
+  size_t len;
+  int mapped;			/* Non-zero when data is mapped */
+};
+
+struct frame_reader;
+struct frame_writer;
+struct pcr_cache;
+struct eventlog_reader;
+struct replay;
+
+/* The sections of a quote bundle. */
+enum bundle_section {
+  BUNDLE_UUID = 1,		/* TSS_UUID of the AIK */
+  BUNDLE_NONCE,			/* Nonce in the quote request */
+  BUNDLE_INFO,			/* Signed quote info, as in a hash file */
+  BUNDLE_QUOTE,			/* Signature */
+  BUNDLE_PCRVALS,		/* PCR values as index=value lines */
+  BUNDLE_PATH,			/* Path from the nonce to the quoted root */
+  BUNDLE_NSECTIONS
+};
+
+struct bundle {
+  BYTE *data[BUNDLE_NSECTIONS];	/* NULL when absent */
+  UINT32 len[BUNDLE_NSECTIONS];
+};
+
+/* Messages exchanged with tpm_quoted over a Unix domain socket. */
+#define QUOTED_SOCKET "/var/run/tpm_quoted.sock"
+#define QUOTED_DATASIZE (1 << 10)
+#define QUOTED_MAXPCRS 256
+#define QUOTED_MAXDATA (1 << 16)
+#define QUOTED_MAXREQUEST \
+  (sizeof(TSS_UUID) + 16 + QUOTED_DATASIZE + 4 * QUOTED_MAXPCRS)
+
+/* A quote, PCR read or key load, as scheduled by the daemon's
+   quote_worker. */
+struct quoted_request {
+  UINT32 type;			/* A quote_job_type other than random */
+  UINT32 priority;		/* A quote_priority */
+  TSS_UUID uuid;		/* UUID of the AIK or the key loaded */
+  BYTE data[QUOTED_DATASIZE];	/* Nonce of a quote, or key blob */
+  UINT32 dataLen;
+  UINT32 pcrs[QUOTED_MAXPCRS];	/* PCRs quoted or read */
+  UINT32 npcrs;
+};
+
+struct quoted_reply {
+  UINT32 status;		/* Zero on success */
+  UINT32 setupUsec;		/* Time spent opening a session */
+  UINT32 tpmUsec;		/* Time spent quoting */
+  BYTE *data;			/* Signed data, or PCR values read */
+  UINT32 dataLen;
+  BYTE *sig;			/* Signature of a quote */
+  UINT32 sigLen;
+  BYTE path[NONCE_MAXPATH];	/* From the nonce to the quoted root */
+  UINT32 pathLen;		/* Zero unless nonces were aggregated */
+};
+
 const char *tss_result(TSS_RESULT result);
 int tss_err(TSS_RESULT rc, const char *msg);
+int tss_connection_lost(TSS_RESULT rc);
 int tidy(TSS_HCONTEXT hContext, int code);
 int pcr_mask(UINT32 *pcrs, UINT32 npcrs, char **mask);
+int load_srk(TSS_HCONTEXT hContext, TSS_HKEY *hSRK);
 int loadkey(TSS_HCONTEXT hContext,
 	    BYTE *blob, UINT32 blobLen,
 	    TSS_UUID uuid);
 int quote(TSS_HCONTEXT hContext, TSS_UUID uuid,
 	  UINT32 *pcrs, UINT32 npcrs,
 	  TSS_VALIDATION *valid);
+int quote_load_aik(TSS_HCONTEXT hContext, TSS_UUID uuid, TSS_HKEY *hAIK);
+struct quote_session *quote_session_open(TSS_HCONTEXT hContext,
+					 TSS_HKEY hSRK, TSS_UUID uuid,
+					 UINT32 *pcrs, UINT32 npcrs);
+struct quote_session *quote_session_open_aik(TSS_HCONTEXT hContext,
+					     TSS_HKEY hAIK,
+					     UINT32 *pcrs, UINT32 npcrs);
+int quote_session_quote(struct quote_session *session,
+			TSS_VALIDATION *valid);
+enum quote_mode quote_session_mode(struct quote_session *session);
+void quote_session_set_mode(struct quote_session *session,
+			    enum quote_mode mode);
+void quote_session_set_pcr_cache(struct quote_session *session,
+				 struct pcr_cache *cache);
+int quote_session_pcrvals(struct quote_session *session, FILE *out);
+int quote_session_get_pcrvals(struct quote_session *session,
+			      char **buf, size_t *len);
+int quote_session_save_pcrvals(struct quote_session *session,
+			       const char *name);
+const char *quote_mode_name(enum quote_mode mode);
+void quote_session_close(struct quote_session *session);
 TPM_NONCE *quote_nonce(BYTE *info);
+int quote_set_nonce(BYTE *info, UINT32 infoLen,
+		    BYTE *nonce, UINT32 nonceLen);
+int nonce_tree(const BYTE *nonces, size_t n, BYTE *root,
+	       BYTE *paths, UINT32 *pathLens);
+int nonce_path_root(const BYTE *nonce, UINT32 nonceLen,
+		    const BYTE *path, UINT32 pathLen, BYTE *root);
 char *toutf16le(char *src);
 size_t utf16lelen(const char *src);
+int pubkey_decode(BYTE *der, UINT32 derLen, BYTE *blob, UINT32 *blobLen);
+struct conn_pool *conn_pool_new(unsigned idle, unsigned check);
+struct conn *conn_pool_get(struct conn_pool *pool, const char *name);
+TSS_HCONTEXT conn_context(struct conn *conn);
+void conn_pool_put(struct conn_pool *pool, struct conn *conn, int failed);
+void conn_pool_evict(struct conn_pool *pool);
+void conn_pool_get_stats(struct conn_pool *pool,
+			 struct conn_pool_stats *stats);
+void conn_pool_hold(struct conn_pool *pool);
+void conn_pool_release(struct conn_pool *pool);
+void conn_pool_free(struct conn_pool *pool);
+size_t fanquote(const char **hosts, size_t nhosts, TSS_UUID uuid,
+		BYTE *nonce, UINT32 nonceLen, UINT32 *pcrs, UINT32 npcrs,
+		unsigned parallel, unsigned timeout, struct conn_pool *pool,
+		fanquote_done *done, void *arg);
+struct quote_worker *quote_worker_new(TSS_HCONTEXT hContext,
+				      TSS_HKEY hSRK, quote_done *done);
+int quote_worker_submit(struct quote_worker *w, struct quote_job *job);
+int quote_worker_fd(struct quote_worker *w);
+size_t quote_worker_complete(struct quote_worker *w);
+void quote_worker_get_stats(struct quote_worker *w,
+			    struct quote_worker_stats *stats);
+void quote_worker_free(struct quote_worker *w);
+int quoted_connect(const char *path);
+int quoted_write_request(int fd, struct quoted_request *req);
+int quoted_parse_request(const BYTE *buf, size_t len,
+			 struct quoted_request *req, size_t *used);
+BYTE *quoted_encode_reply(struct quoted_reply *rep, size_t *len);
+int quoted_read_reply(int fd, struct quoted_reply *rep);
+int quoted_call(const char *path, struct quoted_request *req,
+		struct quoted_reply *rep);
+int quoted_save_pcrvals(const char *path, enum quote_priority priority,
+			const UINT32 *pcrs, UINT32 npcrs, const char *name);
+struct pubkey *pubkey_new(BYTE *blob, UINT32 blobLen);
+void pubkey_free(struct pubkey *key);
+int pubkey_verify(struct pubkey *key, BYTE *data, UINT32 dataLen,
+		  BYTE *sig, UINT32 sigLen);
+int pubkey_verify_digest(struct pubkey *key, BYTE *digest,
+			 BYTE *sig, UINT32 sigLen);
+struct aik_cache *aik_cache_new(size_t limit);
+void aik_cache_free(struct aik_cache *cache);
+struct pubkey *aik_cache_lookup(struct aik_cache *cache,
+				BYTE *der, UINT32 derLen,
+				BYTE **blob, UINT32 *blobLen);
+int aik_cache_preload(struct aik_cache *cache, const char *dirname);
+void aik_cache_get_stats(struct aik_cache *cache,
+			 struct aik_cache_stats *stats);
+struct verify_pool *verify_pool_new(unsigned nworkers, size_t qsize,
+				    verify_done *done);
+int verify_pool_submit(struct verify_pool *pool, struct verify_job *job);
+void verify_pool_wait(struct verify_pool *pool);
+int verify_pool_preload(struct verify_pool *pool, const char *dirname);
+void verify_pool_get_stats(struct verify_pool *pool,
+			   struct aik_cache_stats *stats);
+void verify_pool_free(struct verify_pool *pool);
+void golden_key(const BYTE *data, UINT32 len, BYTE *key);
+struct golden *golden_open(const char *name);
+void golden_close(struct golden *db);
+int golden_lookup(struct golden *db, const BYTE *key,
+		  const BYTE **info, UINT32 *infoLen);
+int golden_write(const char *name, struct golden_entry *entries, size_t n);
+int hex_decode(BYTE *dst, const char *src, size_t n);
+void hex_encode(char *dst, const BYTE *src, size_t n);
+int pcrvals_write(FILE *out, UINT32 pcr, const BYTE *value, UINT32 len);
+int pcrvals_read(FILE *in, const char *name, struct pcrvals *pv);
+int pcrvals_parse(const char *buf, size_t len, const char *name,
+		  struct pcrvals *pv);
+struct pcrvals_reader *pcrvals_reader_new(FILE *in, const char *name,
+					  int multi);
+int pcrvals_next(struct pcrvals_reader *r, struct pcrvals *pv);
+void pcrvals_reader_free(struct pcrvals_reader *r);
+void sha1_multi(struct sha1_msg *msgs, size_t n);
+const char *sha1_multi_kernel(void);
+int sha1_multi_set_kernel(const char *name);
+struct pcr_cache *pcr_cache_open(const char *name);
+struct pcr_cache *pcr_cache_default(void);
+void pcr_cache_validate(struct pcr_cache *c);
+int pcr_cache_read(struct pcr_cache *c, TSS_HCONTEXT hContext,
+		   TSS_HTPM hTPM, UINT32 pcr, BYTE *value);
+void pcr_cache_invalidate(struct pcr_cache *c, UINT32 pcr);
+enum quote_mode pcr_cache_mode(struct pcr_cache *c);
+void pcr_cache_set_mode(struct pcr_cache *c, enum quote_mode mode);
+void pcr_cache_get_stats(struct pcr_cache *c, struct pcr_cache_stats *stats);
+int pcr_cache_close(struct pcr_cache *c);
+struct eventlog_reader *eventlog_reader_new(FILE *in, const char *name,
+					    enum eventlog_format format);
+int eventlog_next(struct eventlog_reader *r, struct eventlog_event *ev);
+void eventlog_reader_free(struct eventlog_reader *r);
+struct replay *replay_new(void);
+void replay_free(struct replay *rp);
+int replay_extend(struct replay *rp, UINT32 pcr, const BYTE *digest);
+int replay_event(struct replay *rp, const struct eventlog_event *ev);
+int replay_values(struct replay *rp, const UINT32 *pcrs, UINT32 npcrs,
+		  struct pcrvals *pv);
+void replay_get_stats(struct replay *rp, struct replay_stats *stats);
+struct composite *composite_new(void);
+void composite_free(struct composite *c);
+int composite_hash(struct composite *c, const struct pcrvals *pv,
+		   UINT16 selectSize, BYTE *digest);
+void composite_get_stats(struct composite *c, struct composite_stats *stats);
+int quote_info_select_size(const BYTE *info, UINT32 infoLen,
+			   UINT16 *selectSize);
+int quote_info_update(BYTE *info, UINT32 infoLen, struct composite *c,
+		      const struct pcrvals *pv);
+int quote_info_update_multi(BYTE **info, UINT32 infoLen,
+			    const struct pcrvals **pv, size_t n, int *result);
+int file_load(const char *name, struct file_data *f);
+void file_unload(struct file_data *f);
+int file_read(const char *name, BYTE *buf, UINT32 size, UINT32 *len);
+int file_write(const char *name, const void *data, size_t len);
+struct frame_reader *frame_reader_new(int fd);
+void frame_reader_free(struct frame_reader *r);
+int frame_read(struct frame_reader *r, unsigned n,
+	       BYTE **field, UINT32 *len);
+struct frame_writer *frame_writer_open(const char *name);
+int frame_write(struct frame_writer *w, unsigned n,
+		const BYTE **field, const UINT32 *len);
+int frame_writer_close(struct frame_writer *w);
+BYTE *bundle_encode(const struct bundle *b, UINT32 *len);
+int bundle_parse(BYTE *buf, size_t len, struct bundle *b, size_t *used);
+int trace_init(const char *prog);
+int trace_dump(void);
+void trace_begin(void);
+TSS_RESULT trace_end(const char *name, const char *caller, TSS_RESULT rc);
+void trace_error(TSS_RESULT rc, const char *msg);
+
+/* Calls a TSS function, and records the time it takes when tracing
+   is on, as in rc = TRACE(Tspi_TPM_Quote2, hTPM, ...). */
+extern int trace_on;
+#define TRACE(fn, ...)						\
+  (trace_on								\
+   ? (trace_begin(), trace_end(#fn, __func__, fn(__VA_ARGS__)))		\
+   : fn(__VA_ARGS__))
 
 #endif /* _TPM_QUOTE_H */
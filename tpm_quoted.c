@@ -0,0 +1,579 @@
+/*
+ * Serve quote requests from a process that keeps its keys loaded.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+
+#if defined HAVE_SYS_UN_H
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define MAXCONNS 256		/* Most connections served at once */
+#define CONN_TIMEOUT 10000	/* Milliseconds to send a request or
+				   take a reply */
+
+static volatile sig_atomic_t done;
+
+static void stop(int sig)
+{
+  done = 1;
+}
+
+static UINT32 usec_since(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000
+    + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* The states of a connection.  A connection is read only when idle,
+   so it has at most one request pending or being quoted, and written
+   only while replying.  Connections are non-blocking, and a client
+   that takes longer than CONN_TIMEOUT to send the rest of a request,
+   or to take its reply, is dropped, so a slow client holds up no
+   other. */
+enum conn_state {
+  CONN_FREE, CONN_IDLE, CONN_PENDING, CONN_QUOTING, CONN_REPLYING
+};
+
+static struct conn {
+  int fd;
+  enum conn_state state;
+  struct quoted_request req;
+  BYTE in[QUOTED_MAXREQUEST];	/* Read but not yet parsed */
+  size_t inLen;
+  BYTE *out;			/* Reply being written */
+  size_t outLen;
+  size_t outPos;		/* Bytes of the reply written */
+  struct timespec since;	/* Start of a partial request or reply */
+} conns[MAXCONNS];
+static unsigned npending;	/* Connections with a pending request */
+static unsigned nquoting;	/* Quotes submitted but not answered */
+static struct timespec first;	/* Arrival of the first pending request */
+
+static void close_conn(struct conn *c)
+{
+  close(c->fd);
+  free(c->out);
+  c->out = NULL;
+  c->state = CONN_FREE;
+}
+
+/* Makes the next request buffered on an idle connection pending,
+   once all of it has been read.  Returns nonzero when it is
+   malformed. */
+static int take_request(struct conn *c)
+{
+  size_t used;
+  int rc = quoted_parse_request(c->in, c->inLen, &c->req, &used);
+  if (rc < 0)
+    return 0;
+  if (rc > 0)
+    return 1;
+  c->inLen -= used;
+  memmove(c->in, c->in + used, c->inLen);
+  if (c->inLen > 0)		/* The next request starts now */
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+  c->state = CONN_PENDING;
+  if (npending++ == 0)
+    clock_gettime(CLOCK_MONOTONIC, &first);
+  return 0;
+}
+
+/* Reads what an idle connection has sent.  Returns -1 when the client
+   closes the connection between requests. */
+static int read_request(struct conn *c)
+{
+  ssize_t n = read(c->fd, c->in + c->inLen, sizeof c->in - c->inLen);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (n == 0 && c->inLen == 0)
+    return -1;
+  if (n <= 0)
+    return 1;
+  if (c->inLen == 0)
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+  c->inLen += n;
+  return take_request(c);
+}
+
+/* Writes as much of a reply as the client takes.  Once all of it is
+   written, the connection is idle again, and a request the client
+   sent meanwhile is taken.  Returns nonzero when the connection
+   fails. */
+static int write_reply(struct conn *c)
+{
+  while (c->outPos < c->outLen) {
+    ssize_t n = write(c->fd, c->out + c->outPos, c->outLen - c->outPos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0)
+      return 1;
+    c->outPos += n;
+  }
+  free(c->out);
+  c->out = NULL;
+  c->state = CONN_IDLE;
+  if (c->inLen > 0)
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+  return take_request(c);
+}
+
+/* Drops the connections of clients too slow to send a request or take
+   a reply.  Returns the milliseconds until the next might be dropped,
+   or -1 when none can be. */
+static int drop_slow(void)
+{
+  int timeout = -1;
+  unsigned i;
+  for (i = 0; i < MAXCONNS; i++) {
+    struct conn *c = &conns[i];
+    if (!(c->state == CONN_IDLE && c->inLen > 0)
+	&& c->state != CONN_REPLYING)
+      continue;
+    int left = CONN_TIMEOUT - (int)(usec_since(&c->since) / 1000);
+    if (left <= 0) {
+      fprintf(stderr, "Dropping a client too slow to %s\n",
+	      c->state == CONN_REPLYING ? "take its reply" : "send a request");
+      close_conn(c);
+    }
+    else if (timeout < 0 || left < timeout)
+      timeout = left;
+  }
+  return timeout;
+}
+
+/* Requests answered by one TPM command.  Only quote requests are
+   batched.  When there are several, their nonces are aggregated, and
+   each reply holds the path from its nonce to the quoted root. */
+struct batch {
+  struct quote_job job;
+  int log;
+  unsigned n;
+  struct conn *conn[MAXCONNS];
+  BYTE nonces[MAXCONNS][sizeof(TPM_NONCE)];
+  BYTE paths[MAXCONNS][NONCE_MAXPATH];
+  UINT32 pathLens[MAXCONNS];
+  BYTE root[sizeof(TPM_NONCE)];
+};
+
+/* Replies to the requests of a batch once its command is made.
+   Called on the main thread by quote_worker_complete. */
+static void answered(struct quote_job *job)
+{
+  struct batch *b = job->arg;
+  struct quoted_reply rep;
+  memset(&rep, 0, sizeof rep);
+  rep.status = job->result;
+  rep.setupUsec = job->setupUsec;
+  rep.tpmUsec = job->tpmUsec;
+  rep.data = job->data;
+  rep.dataLen = job->dataLen;
+  rep.sig = job->sig;
+  rep.sigLen = job->sigLen;
+  const char *result = rep.status ? "failed" : "made";
+  const char *priority = job->priority == QUOTE_PRIORITY_INTERACTIVE
+    ? "interactive" : "background";
+  if (b->log && job->type == QUOTE_JOB_QUOTE)
+    fprintf(stderr, "quote %s, %s, %s mode, %u nonces, setup %u us, "
+	    "TPM %u us\n", result, priority, quote_mode_name(job->mode),
+	    b->n, rep.setupUsec, rep.tpmUsec);
+  else if (b->log)
+    fprintf(stderr, "%s %s, %s, TPM %u us\n",
+	    job->type == QUOTE_JOB_PCRREAD ? "PCR read" : "key load",
+	    result, priority, rep.tpmUsec);
+  unsigned j;
+  for (j = 0; j < b->n; j++) {
+    struct conn *c = b->conn[j];
+    if (b->n > 1) {
+      rep.pathLen = b->pathLens[j];
+      memcpy(rep.path, b->paths[j], b->pathLens[j]);
+    }
+    if (!(c->out = quoted_encode_reply(&rep, &c->outLen))) {
+      close_conn(c);
+      continue;
+    }
+    c->outPos = 0;
+    c->state = CONN_REPLYING;
+    clock_gettime(CLOCK_MONOTONIC, &c->since);
+    if (write_reply(c)) {
+      fprintf(stderr, "Error while serving quote request\n");
+      close_conn(c);
+    }
+  }
+  free(job->data);
+  free(job->sig);
+  free(b);
+  nquoting--;
+}
+
+/* Submits one command for the n connections in group.  Several
+   connections have quote requests of the same priority for the same
+   key and PCRs. */
+static void submit(struct quote_worker *w, struct conn **group, unsigned n,
+		   int log)
+{
+  struct quoted_request *req = &group[0]->req;
+  struct batch *b = malloc(sizeof *b);
+  if (!b) {
+    fprintf(stderr, "Out of memory\n");
+    unsigned j;
+    for (j = 0; j < n; j++)
+      close_conn(group[j]);
+    return;
+  }
+  memset(&b->job, 0, sizeof b->job);
+  b->job.type = req->type;
+  b->job.priority = req->priority;
+  b->job.uuid = req->uuid;
+  b->job.pcrs = req->pcrs;
+  b->job.npcrs = req->npcrs;
+  if (req->type == QUOTE_JOB_LOADKEY) {
+    b->job.blob = req->data;
+    b->job.blobLen = req->dataLen;
+  }
+  else {
+    b->job.nonce = req->data;
+    b->job.nonceLen = req->dataLen;
+  }
+  b->job.arg = b;
+  b->log = log;
+  b->n = n;
+  memcpy(b->conn, group, n * sizeof *group);
+  unsigned j;
+  for (j = 0; j < n; j++)
+    group[j]->state = CONN_QUOTING;
+  nquoting++;
+
+  int failed = 0;
+  if (n > 1) {
+    for (j = 0; j < n; j++)
+      memcpy(b->nonces[j], group[j]->req.data, sizeof b->nonces[j]);
+    failed = nonce_tree(&b->nonces[0][0], n, b->root,
+			&b->paths[0][0], b->pathLens);
+    b->job.nonce = b->root;
+    b->job.nonceLen = sizeof b->root;
+  }
+  if (failed || quote_worker_submit(w, &b->job)) {
+    b->job.result = 1;
+    answered(&b->job);
+  }
+}
+
+/* Submits every pending request.  When aggregate is set, quote
+   requests of the same priority for the same key and PCRs are
+   grouped, and their nonces are aggregated.  Otherwise, and for
+   nonces that are not the size of a TPM nonce, each request is quoted
+   alone, so that its client need not store a path.  PCR reads and key
+   loads are submitted one by one, and the worker answers identical
+   ones with one command. */
+static void submit_pending(struct quote_worker *w, int aggregate, int log)
+{
+  unsigned i, j;
+  for (i = 0; i < MAXCONNS; i++) {
+    struct quoted_request *req = &conns[i].req;
+    if (conns[i].state != CONN_PENDING)
+      continue;
+    struct conn *group[MAXCONNS];
+    unsigned n = 0;
+    group[n++] = &conns[i];
+    for (j = i + 1; aggregate && j < MAXCONNS
+	   && req->type == QUOTE_JOB_QUOTE
+	   && req->dataLen == sizeof(TPM_NONCE); j++) {
+      struct quoted_request *other = &conns[j].req;
+      if (conns[j].state == CONN_PENDING && other->type == req->type
+	  && other->priority == req->priority
+	  && other->dataLen == req->dataLen && other->npcrs == req->npcrs
+	  && !memcmp(&other->uuid, &req->uuid, sizeof req->uuid)
+	  && !memcmp(other->pcrs, req->pcrs, req->npcrs * sizeof *req->pcrs))
+	group[n++] = &conns[j];
+    }
+    submit(w, group, n, log);
+  }
+  npending = 0;
+}
+
+/* Prints a histogram kept by the worker, skipping empty buckets. */
+static void print_hist(const char *name, const unsigned long *hist)
+{
+  fprintf(stderr, "%s:", name);
+  unsigned i;
+  for (i = 0; i < QUOTE_HISTSIZE; i++)
+    if (hist[i])
+      fprintf(stderr, " <%lu:%lu", 1UL << i, hist[i]);
+  fprintf(stderr, "\n");
+}
+
+static void print_stats(struct quote_worker *w)
+{
+  struct quote_worker_stats stats;
+  quote_worker_get_stats(w, &stats);
+  fprintf(stderr, "%lu interactive and %lu background commands, "
+	  "%lu coalesced\n", stats.jobs[QUOTE_PRIORITY_INTERACTIVE],
+	  stats.jobs[QUOTE_PRIORITY_BACKGROUND], stats.coalesced);
+  fprintf(stderr, "%lu AIKs loaded, %lu quotes with an AIK already "
+	  "loaded\n", stats.aikLoads, stats.aikShared);
+  print_hist("queue depth", stats.depth);
+  print_hist("interactive wait us", stats.wait[QUOTE_PRIORITY_INTERACTIVE]);
+  print_hist("background wait us", stats.wait[QUOTE_PRIORITY_BACKGROUND]);
+}
+
+/* Serves connections until terminated.  The worker makes the quotes,
+   so requests are read while the TPM is busy.  A request is submitted
+   once window milliseconds have passed since the first request
+   pending, together with the others that came in meanwhile, and
+   when aggregate is set, their nonces are aggregated.  With a window,
+   requests are also held while a quote is being made, since the TPM
+   could not start on them any sooner. */
+static void serve(struct quote_worker *w, int sock, int window,
+		  int aggregate, int log)
+{
+  unsigned i;
+  for (i = 0; i < MAXCONNS; i++)
+    conns[i].state = CONN_FREE;
+  while (!done) {
+    int timeout = drop_slow();
+    struct pollfd fds[2 + MAXCONNS];
+    struct conn *conn[2 + MAXCONNS];
+    nfds_t nfds = 0;
+    unsigned nfree = 0;
+    fds[nfds].fd = quote_worker_fd(w); /* Always first */
+    fds[nfds].events = POLLIN;
+    conn[nfds++] = NULL;
+    for (i = 0; i < MAXCONNS; i++)
+      if (conns[i].state == CONN_FREE)
+	nfree++;
+      else if (conns[i].state == CONN_IDLE
+	       || conns[i].state == CONN_REPLYING) {
+	fds[nfds].fd = conns[i].fd;
+	fds[nfds].events = conns[i].state == CONN_IDLE ? POLLIN : POLLOUT;
+	conn[nfds++] = &conns[i];
+      }
+    if (nfree > 0) {
+      fds[nfds].fd = sock;
+      fds[nfds].events = POLLIN;
+      conn[nfds++] = NULL;
+    }
+    if (npending && !(window && nquoting)) {
+      int left = window - (int)(usec_since(&first) / 1000);
+      if (left <= 0) {
+	submit_pending(w, aggregate, log);
+	continue;
+      }
+      if (timeout < 0 || left < timeout)
+	timeout = left;
+    }
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr, "Cannot wait for requests\n");
+      break;
+    }
+    /* Answer made quotes last, as that frees connections */
+    for (i = 1; i < nfds; i++) {
+      if (!fds[i].revents)
+	continue;
+      if (fds[i].fd == sock) {
+	int fd = accept(sock, NULL, NULL);
+	if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK)) {
+	  close(fd);
+	  fd = -1;
+	}
+	unsigned j;
+	for (j = 0; fd >= 0 && j < MAXCONNS; j++)
+	  if (conns[j].state == CONN_FREE) {
+	    conns[j].fd = fd;
+	    conns[j].state = CONN_IDLE;
+	    conns[j].inLen = 0;
+	    break;
+	  }
+	if (fd < 0 && errno != EINTR)
+	  fprintf(stderr, "Cannot accept connection\n");
+	continue;
+      }
+      struct conn *c = conn[i];
+      int rc = c->state == CONN_IDLE ? read_request(c) : write_reply(c);
+      if (rc) {
+	if (rc > 0)
+	  fprintf(stderr, "Error while serving quote request\n");
+	close_conn(c);
+      }
+    }
+    if (fds[0].revents)
+      quote_worker_complete(w);
+    if (npending && window == 0)
+      submit_pending(w, aggregate, log);
+  }
+}
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-r host] [-s socket] [-w milliseconds] [-lhv]\n"
+    "Options:\n"
+    "\t-r host\n"
+    "\t     Perform operations on remote host\n"
+    "\t-s socket\n"
+    "\t     Listen on Unix domain socket (default %s)\n"
+    "\t-w milliseconds\n"
+    "\t     Wait up to milliseconds for more requests, and answer\n"
+    "\t     those for the same key and PCRs with one quote of\n"
+    "\t     their aggregated nonces.  Without -w, each request is\n"
+    "\t     quoted with its own nonce\n"
+    "\t-l   Log the latency of each request\n"
+    "\t-h   Display command usage info\n"
+    "\t-v   Display command version info\n"
+    "\n"
+    "Serves quote, PCR read and key load requests until terminated,\n"
+    "keeping the TSS context, the SRK, its AIKs and recently used\n"
+    "quote sessions open.  Interactive requests go ahead of\n"
+    "background ones.\n";
+  fprintf(stderr, text, prog, QUOTED_SOCKET);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  TSS_UNICODE *host = NULL; /* Non-null when connecting to a remote host */
+  const char *path = QUOTED_SOCKET;
+  int log = 0;
+  int window = 0;		/* Milliseconds to gather requests */
+  int aggregate = 0;		/* Non-zero when nonces are aggregated */
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:w:lhv")) != -1) {
+    switch (opt) {
+    case 'r':
+#if defined HAVE_ICONV_H
+      host = (TSS_UNICODE *)toutf16le(optarg);
+      if (!host) {
+	fprintf(stderr, "Cannot convert %s to UTF-16LE\n", optarg);
+	return 1;
+      }
+      break;
+#else
+      fprintf(stderr, "Remote requests not supported on this platform.\n");
+      return 1;
+#endif
+    case 's':
+      path = optarg;
+      break;
+    case 'w':
+      window = atoi(optarg);
+      aggregate = 1;
+      if (window < 0) {
+	fprintf(stderr, "Bad window %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'l':
+      log = 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (argc != optind)
+    return usage(argv[0]);
+
+  if (trace_init(argv[0]))
+    return 1;
+
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "Socket name %s too long\n", path);
+    return 1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* Create context */
+  TSS_HCONTEXT hContext;	/* Context handle */
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
+  free(host);
+  if (rc != TSS_SUCCESS)
+    return tidy(hContext, tss_err(rc, "connecting"));
+
+  TSS_HKEY hSRK;
+  if (load_srk(hContext, &hSRK))
+    return tidy(hContext, 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    fprintf(stderr, "Cannot create socket\n");
+    return tidy(hContext, 1);
+  }
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof addr)
+      || listen(sock, SOMAXCONN)) {
+    fprintf(stderr, "Cannot listen on %s\n", path);
+    return tidy(hContext, 1);
+  }
+
+  /* Interrupt poll on termination, so the socket is removed */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct quote_worker *w = quote_worker_new(hContext, hSRK, answered);
+  if (!w) {
+    close(sock);
+    unlink(path);
+    return tidy(hContext, 1);
+  }
+  serve(w, sock, window, aggregate, log);
+  if (log)
+    print_stats(w);
+  quote_worker_free(w);		/* Answers quotes being made */
+  unsigned i;
+  for (i = 0; i < MAXCONNS; i++)
+    if (conns[i].state != CONN_FREE)
+      close_conn(&conns[i]);
+
+  close(sock);
+  unlink(path);
+  return tidy(hContext, !done);
+}
+#else
+int main(void)
+{
+  fprintf(stderr, "Quote daemon not available on this platform.\n");
+  return 1;
+}
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Compute a PCR hash by replaying measurement logs
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+
+#if defined HAVE_OPENSSL_RSA_LIB
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define BUFSIZE (1 << 10)
+#define MAXLOGS 2
+
+/* A log being replayed. */
+struct log {
+  const char *name;
+  FILE *in;
+  struct eventlog_reader *r;
+  int done;
+};
+
+static int open_log(struct log *l, const char *name,
+		    enum eventlog_format format)
+{
+  l->name = name;
+  l->done = 0;
+  l->in = strcmp(name, "-") ? fopen(name, "rb") : stdin;
+  if (!l->in) {
+    fprintf(stderr, "Cannot open %s\n", name);
+    return 1;
+  }
+  l->r = eventlog_reader_new(l->in, name, format);
+  return !l->r;
+}
+
+static void close_log(struct log *l)
+{
+  eventlog_reader_free(l->r);
+  if (l->in && l->in != stdin)
+    fclose(l->in);
+}
+
+/* Replays the logs an event from each at a time, so that the PCRs of
+   both have extends waiting in each round of the replay. */
+static int replay_logs(struct replay *rp, struct log *logs, unsigned nlogs)
+{
+  unsigned left = nlogs;
+  while (left > 0) {
+    unsigned i;
+    for (i = 0; i < nlogs; i++) {
+      if (logs[i].done)
+	continue;
+      struct eventlog_event ev;
+      int rc = eventlog_next(logs[i].r, &ev);
+      if (rc > 0 || (rc == 0 && replay_event(rp, &ev)))
+	return 1;
+      if (rc < 0) {
+	logs[i].done = 1;
+	left--;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Writes the replayed values as index=value lines. */
+static int save_pcrvals(const char *name, const struct pcrvals *pv)
+{
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  int bad = 0;
+  UINT32 i;
+  for (i = 0; i < PCRVALS_NPCRS; i++)
+    if (pv->select[i / 8] & 1 << (i % 8))
+      bad |= pcrvals_write(out, i, pv->value[i], PCRVALS_VALUESIZE);
+  bad |= fclose(out) != 0;
+  if (!bad)
+    bad = file_write(name, buf, len);
+  else
+    fprintf(stderr, "Error writing %s\n", name);
+  free(buf);
+  return bad;
+}
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-hv] [-b bioslog] [-i imalog] [-p pcrvals] oldhash "
+    "newhash [PCRS...]\n"
+    "\toldhash:   file containing a PCR hash made by tpm_getpcrhash\n"
+    "\tnewhash:   output file\n"
+    "\tPCRS:      PCR indices to hash; by default the PCRs the logs\n"
+    "\t           extend\n"
+    "On success, writes the PCR hash the logs lead to to newhash\n"
+    "Options:\n"
+    "\t-b bioslog  Replay a firmware log, as in binary_bios_measurements\n"
+    "\t-i imalog   Replay an IMA log, as in binary_runtime_measurements\n"
+    "\t-p pcrvals  Also write the replayed PCR values to pcrvals\n"
+    "\t-h          Display command usage info\n"
+    "\t-v          Display command version info\n";
+  fprintf(stderr, text, prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  UINT32 pcrs[argc];
+  const char *biosname = NULL;
+  const char *imaname = NULL;
+  const char *pcrvalsname = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:i:p:hv")) != -1) {
+    switch (opt) {
+    case 'b':
+      biosname = optarg;
+      break;
+    case 'i':
+      imaname = optarg;
+      break;
+    case 'p':
+      pcrvalsname = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if ((!biosname && !imaname) || argc < optind + 2)
+    return usage(argv[0]);
+
+  const char *oldhashname = argv[optind];
+  const char *newhashname = argv[optind + 1];
+  UINT32 npcrs = argc - optind - 2;
+  if (pcr_mask(pcrs, npcrs, argv + optind + 2))
+    return 1;
+
+  BYTE hash[BUFSIZE];
+  UINT32 hashLen;
+  if (file_read(oldhashname, hash, sizeof hash, &hashLen))
+    return 1;
+  UINT16 selectSize;
+  if (quote_info_select_size(hash, hashLen, &selectSize)) {
+    fprintf(stderr, "%s is not a valid quote!\n", oldhashname);
+    return 1;
+  }
+
+  struct log logs[MAXLOGS];
+  unsigned nlogs = 0;
+  int bad = 0;
+  memset(logs, 0, sizeof logs);
+  if (biosname)
+    bad |= open_log(&logs[nlogs++], biosname, EVENTLOG_BIOS);
+  if (imaname && !bad)
+    bad |= open_log(&logs[nlogs++], imaname, EVENTLOG_IMA);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct replay *rp = bad ? NULL : replay_new();
+  struct pcrvals pv;
+  bad = !rp || replay_logs(rp, logs, nlogs)
+    || replay_values(rp, pcrs, npcrs, &pv);
+  unsigned i;
+  for (i = 0; i < nlogs; i++)
+    close_log(&logs[i]);
+  if (rp && !bad) {
+    struct replay_stats stats;
+    replay_get_stats(rp, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec)
+      + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu extends, %.3f s, %.1f extends/s\n",
+	    stats.extends, secs, secs > 0 ? stats.extends / secs : 0.0);
+  }
+  replay_free(rp);
+  if (bad)
+    return 1;
+  if (pv.npcrs == 0) {
+    fprintf(stderr, "The logs extend no PCRs\n");
+    return 1;
+  }
+
+  struct composite *c = composite_new();
+  if (!c)
+    return 1;
+  bad = quote_info_update(hash, hashLen, c, &pv);
+  composite_free(c);
+  if (bad)
+    return 1;
+  if (pcrvalsname && save_pcrvals(pcrvalsname, &pv))
+    return 1;
+  return file_write(newhashname, hash, hashLen);
+}
+#else
+int main(void)
+{
+  fprintf(stderr, "Replay measurement log not available on this platform.\n");
+  return 1;
+}
+#endif
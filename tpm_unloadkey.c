@@ -67,35 +67,35 @@ int main(int argc, char **argv)
   if (argc != optind + 1)
     return usage(argv[0]);
 
-  /* Read UUID */
-  const char *uuidname = argv[optind];
-  FILE *in = fopen(uuidname, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", uuidname);
+  if (trace_init(argv[0]))
     return 1;
-  }
 
+  /* Read UUID */
+  const char *uuidname = argv[optind];
   TSS_UUID uuid;
-  if (sizeof uuid != fread((void *)&uuid, 1, sizeof uuid, in)) {
+  UINT32 uuidLen;
+  if (file_read(uuidname, (BYTE *)&uuid, sizeof uuid, &uuidLen))
+    return 1;
+  if (uuidLen != sizeof uuid) {
     fprintf(stderr, "Expecting a uuid of %zd bytes in %s\n",
 	    sizeof uuid, uuidname);
     return 1;
   }
-  fclose(in);
 
   /* Create context */
   TSS_HCONTEXT hContext;	/* Context handle */
-  TSS_RESULT rc = Tspi_Context_Create(&hContext);
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &hContext);
   if (rc != TSS_SUCCESS)
     return tss_err(rc, "creating context");
 
-  rc = Tspi_Context_Connect(hContext, host);
+  rc = TRACE(Tspi_Context_Connect, hContext, host);
   free(host);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "connecting"));
 
   TSS_HKEY hKey;
-  rc = Tspi_Context_UnregisterKey(hContext, TSS_PS_TYPE_SYSTEM, uuid, &hKey);
+  rc = TRACE(Tspi_Context_UnregisterKey, hContext, TSS_PS_TYPE_SYSTEM,
+	     uuid, &hKey);
   if (rc != TSS_SUCCESS)
     return tidy(hContext, tss_err(rc, "unregistering key"));
 
@@ -12,63 +12,420 @@
 #endif
 #include <stdio.h>
 
-#if defined HAVE_TROUSERS_TROUSERS_H
+#if defined HAVE_OPENSSL_RSA_LIB
 #include <stddef.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <tss/tspi.h>
-#include <trousers/trousers.h>
 #include "tpm_quote.h"
 
-#define PCRSELSIZE 3
-#define NPCRVALS (8 * PCRSELSIZE)
-#define PCRVALSIZE 20
+#if defined HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #define BUFSIZE (1 << 10)
+#define MAXJOBS 1024
+
+/* An old hash, read once and updated with many sets of PCR
+   values. */
+struct template {
+  BYTE hash[BUFSIZE];
+  UINT32 hashLen;
+};
 
-static int trousers_err(TSS_RESULT rc, const char *msg)
+static int read_template(const char *name, struct template *t)
 {
-  const char *result = Trspi_Error_String(rc);
-  if (result)
-    fprintf(stderr, "Error while %s. Error code: %s\n", msg, result);
-  else
-    fprintf(stderr, "Error while %s. Error code: 0x%x\n", msg, rc);
-  return 1;
+  if (file_read(name, t->hash, BUFSIZE, &t->hashLen))
+    return 1;
+  if (t->hashLen < sizeof(TPM_QUOTE_INFO)) {
+    fprintf(stderr, "Hash too small\n");
+    return 1;
+  }
+  UINT16 selectSize;
+  if (quote_info_select_size(t->hash, t->hashLen, &selectSize)) {
+    fprintf(stderr, "%s is not a valid quote!\n", name);
+    return 1;
+  }
+  if (selectSize > PCRVALS_SELECTSIZE) {
+    fprintf(stderr, "Cannot handle the selection size of %u in %s\n",
+	    selectSize, name);
+    return 1;
+  }
+  return 0;
+}
+
+/* Puts the template updated with the given PCR values into hash,
+   which holds t->hashLen bytes.  The composite hash builder resumes
+   from the values shared with its previous hash. */
+static int update(const struct template *t, struct composite *c,
+		  const struct pcrvals *pv, BYTE *hash)
+{
+  memcpy(hash, t->hash, t->hashLen);
+  return quote_info_update(hash, t->hashLen, c, pv);
+}
+
+/* Batch mode */
+
+struct batch {
+  const struct template *t;
+  char **inputs;
+  size_t ninputs;
+  int multi;			/* Inputs hold several documents */
+  const char *dir;		/* Output directory, or */
+  struct frame_writer *packed;	/* output file of records */
+  size_t next;			/* Next input to update */
+  unsigned long count;		/* Hashes written */
+  int failed;
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+};
+
+static void lock(struct batch *b)
+{
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_lock(&b->lock);
+#endif
+}
+
+static void unlock(struct batch *b)
+{
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+/* Writes the hash for one document, either to a file in the output
+   directory or as a record of the packed output. */
+static int put_hash(struct batch *b, const char *name, BYTE *hash)
+{
+  UINT32 hashLen = b->t->hashLen;
+  if (b->dir) {
+    char path[2 * FILENAME_MAX];
+    snprintf(path, sizeof path, "%s/%s", b->dir, name);
+    if (file_write(path, hash, hashLen))
+      return 1;
+    lock(b);
+    b->count++;
+    unlock(b);
+    return 0;
+  }
+  const BYTE *field[2] = { (const BYTE *)name, hash };
+  UINT32 len[2] = { strlen(name), hashLen };
+  lock(b);
+  int bad = frame_write(b->packed, 2, field, len);
+  if (!bad)
+    b->count++;
+  unlock(b);
+  if (bad)
+    fprintf(stderr, "Cannot write hash for %s\n", name);
+  return bad;
 }
 
-static int read_data(BYTE *buf, const char *name, UINT32 *len)
+/* The name outputs for an input are named after. */
+static const char *base_name(const char *input)
 {
-  FILE *in = fopen(name, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", name);
+  if (!strcmp(input, "-"))
+    return "stdin";
+  const char *slash = strrchr(input, '/');
+  return slash ? slash + 1 : input;
+}
+
+static FILE *open_input(const char *input, const char **base)
+{
+  *base = base_name(input);
+  if (!strcmp(input, "-"))
+    return stdin;
+  FILE *in = fopen(input, "r");
+  if (!in)
+    fprintf(stderr, "Cannot open %s\n", input);
+  return in;
+}
+
+/* Updates the template with each document in one input.  Documents
+   in a file often differ only in their last few values, which are
+   all the composite hash builder rehashes.  A bad document fails the
+   batch, but the remaining documents are still updated when the
+   input can be read. */
+static int update_input(struct batch *b, struct composite *c,
+			const char *input)
+{
+  const char *base;
+  FILE *in = open_input(input, &base);
+  if (!in)
     return 1;
+  struct pcrvals_reader *r = pcrvals_reader_new(in, input, b->multi);
+  int bad = !r;
+  unsigned long ndocs = 0;
+  struct pcrvals pv;
+  int rc;
+  while (r && (rc = pcrvals_next(r, &pv)) == 0) {
+    char name[FILENAME_MAX];
+    if (b->multi)
+      snprintf(name, sizeof name, "%s.%lu", base, ++ndocs);
+    else
+      snprintf(name, sizeof name, "%s", base);
+    BYTE hash[BUFSIZE];
+    if (update(b->t, c, &pv, hash) || put_hash(b, name, hash))
+      bad = 1;
+  }
+  if (r && rc > 0)
+    bad = 1;
+  pcrvals_reader_free(r);
+  if (in != stdin)
+    fclose(in);
+  return bad;
+}
+
+/* Updates the template with a group of inputs that hold one
+   document each.  Separate inputs rarely share values a composite
+   hash builder could resume from, so their composite hashes are
+   instead computed together by sha1_multi. */
+static int update_group(struct batch *b, char **inputs, size_t n)
+{
+  struct pcrvals pv[SHA1_LANES];
+  const struct pcrvals *pvs[SHA1_LANES];
+  BYTE hash[SHA1_LANES][BUFSIZE];
+  BYTE *info[SHA1_LANES];
+  const char *base[SHA1_LANES];
+  int result[SHA1_LANES];
+  size_t i, m = 0;
+  int bad = 0;
+  for (i = 0; i < n; i++) {
+    struct file_data f;
+    if (file_load(inputs[i], &f)) {
+      bad = 1;
+      continue;
+    }
+    int rc = pcrvals_parse((char *)f.data, f.len, inputs[i], &pv[m]);
+    file_unload(&f);
+    if (rc) {
+      bad = 1;
+      continue;
+    }
+    base[m] = base_name(inputs[i]);
+    pvs[m] = &pv[m];
+    memcpy(hash[m], b->t->hash, b->t->hashLen);
+    info[m] = hash[m];
+    m++;
+  }
+  if (m > 0)
+    quote_info_update_multi(info, b->t->hashLen, pvs, m, result);
+  for (i = 0; i < m; i++)
+    if (result[i] || put_hash(b, base[i], hash[i]))
+      bad = 1;
+  return bad;
+}
+
+/* With -m, each worker has its own composite hash builder and takes
+   a whole input at a time.  Otherwise it takes a group of up to
+   SHA1_LANES inputs. */
+static void *worker(void *arg)
+{
+  struct batch *b = arg;
+  struct composite *c = NULL;
+  if (b->multi && !(c = composite_new())) {
+    lock(b);
+    b->failed = 1;
+    unlock(b);
+    return NULL;
+  }
+  size_t group = b->multi ? 1 : SHA1_LANES;
+  for (;;) {
+    lock(b);
+    size_t i = b->next;
+    b->next += group;
+    unlock(b);
+    if (i >= b->ninputs)
+      break;
+    size_t n = b->ninputs - i < group ? b->ninputs - i : group;
+    if (b->multi ? update_input(b, c, b->inputs[i])
+	: update_group(b, b->inputs + i, n)) {
+      lock(b);
+      b->failed = 1;
+      unlock(b);
+    }
   }
-  *len = fread(buf, 1, BUFSIZE, in);
-  if (ferror(in))
+  composite_free(c);
+  return NULL;
+}
+
+/* Adds the names in a list file, one per line, to the inputs. */
+static int read_list(const char *listname, char ***inputs, size_t *n)
+{
+  FILE *in = stdin;
+  if (strcmp(listname, "-") && !(in = fopen(listname, "r"))) {
+    fprintf(stderr, "Cannot open %s\n", listname);
     return 1;
-  fclose(in);
-  return 0;
+  }
+  size_t size = *n;
+  char line[FILENAME_MAX];
+  int bad = 0;
+  while (!bad && fgets(line, sizeof line, in)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line)
+      continue;
+    if (*n == size) {
+      size = 2 * size + 64;
+      char **more = realloc(*inputs, size * sizeof *more);
+      if (!more) {
+	fprintf(stderr, "Out of memory\n");
+	bad = 1;
+	break;
+      }
+      *inputs = more;
+    }
+    if (!((*inputs)[*n] = strdup(line))) {
+      fprintf(stderr, "Out of memory\n");
+      bad = 1;
+      break;
+    }
+    ++*n;
+  }
+  if (ferror(in)) {
+    fprintf(stderr, "Error on list read\n");
+    bad = 1;
+  }
+  if (in != stdin)
+    fclose(in);
+  return bad;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* Outputs are named after their inputs without the directory, so
+   inputs such as a/x and b/x would write the same output.  Such
+   inputs are refused before any output is written. */
+static int check_names(char **inputs, size_t ninputs)
+{
+  const char **names = malloc((ninputs + 1) * sizeof *names);
+  if (!names) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  size_t i;
+  for (i = 0; i < ninputs; i++)
+    names[i] = base_name(inputs[i]);
+  qsort(names, ninputs, sizeof *names, compare_names);
+  int bad = 0;
+  for (i = 1; i < ninputs; i++)
+    if (!strcmp(names[i - 1], names[i])
+	&& (i < 2 || strcmp(names[i - 2], names[i]))) {
+      fprintf(stderr, "Several inputs are named %s\n", names[i]);
+      bad = 1;
+    }
+  free(names);
+  return bad;
+}
+
+/* Updates the template with every document of every input, using
+   njobs threads. */
+static int batch(const struct template *t, char **inputs, size_t ninputs,
+		 int multi, const char *dir, const char *packedname,
+		 unsigned njobs)
+{
+  struct batch b;
+  memset(&b, 0, sizeof b);
+  b.t = t;
+  b.inputs = inputs;
+  b.ninputs = ninputs;
+  b.multi = multi;
+  b.dir = dir;
+  if (dir && check_names(inputs, ninputs))
+    return 1;
+  if (packedname && !(b.packed = frame_writer_open(packedname)))
+    return 1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_init(&b.lock, NULL);
+  if (njobs > ninputs)
+    njobs = ninputs;
+  pthread_t threads[njobs > 0 ? njobs : 1];
+  unsigned i, started = 0;
+  for (i = 1; i < njobs; i++, started++)
+    if (pthread_create(&threads[i], NULL, worker, &b))
+      break;
+  worker(&b);			/* This thread works too */
+  for (i = 1; i <= started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&b.lock);
+#else
+  worker(&b);
+#endif
+
+  if (b.packed && frame_writer_close(b.packed))
+    b.failed = 1;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%lu hashes, %.3f s, %.1f hashes/s\n",
+	  b.count, secs, secs > 0 ? b.count / secs : 0.0);
+  return b.failed;
 }
 
 static int usage(const char *prog)
 {
   const char text[] =
     "Usage: %s [-hv] oldhash newpcrvals newhash\n"
+    "       %s [-m] [-j jobs] [-f list] -d dir|-o packed oldhash "
+    "[newpcrvals...]\n"
     "\toldhash:      file containing old PCR hash\n"
     "\tnewpcrvals:   file containing list of PCR index=value pairs\n"
-    "\t              to use in creating new hash\n"
+    "\t              to use in creating new hash, or - for stdin\n"
     "\tnewhash:      output file\n"
-    "On success, writes the new PCR hash to newhash\n";
-    fprintf(stderr, text, prog);
+    "On success, writes the new PCR hash to newhash\n"
+    "Options:\n"
+    "\t-d dir     Write a hash for each newpcrvals to dir\n"
+    "\t-o packed  Write length prefixed name and hash records to packed\n"
+    "\t-m         Each newpcrvals holds many sets of values, separated\n"
+    "\t           by blank lines\n"
+    "\t-f list    Also read newpcrvals names from list, one per line\n"
+    "\t-j jobs    Number of inputs updated at once\n"
+    "\t-h         Display command usage info\n"
+    "\t-v         Display command version info\n";
+    fprintf(stderr, text, prog, prog);
     return 1;
 }
 
 int main(int argc, char **argv)
 {
+  const char *dir = NULL;
+  const char *packedname = NULL;
+  const char *listname = NULL;
+  int multi = 0;
+  long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (njobs < 1)
+    njobs = 1;
+
   int opt;
-  while ((opt = getopt(argc, argv, "hv")) != -1) {
+  while ((opt = getopt(argc, argv, "d:f:j:mo:hv")) != -1) {
     switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'f':
+      listname = optarg;
+      break;
+    case 'j':
+      njobs = atol(optarg);
+      if (njobs < 1 || njobs > MAXJOBS) {
+	fprintf(stderr, "Bad number of jobs %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'm':
+      multi = 1;
+      break;
+    case 'o':
+      packedname = optarg;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -79,200 +436,69 @@ int main(int argc, char **argv)
       return usage(argv[0]);
     }
   }
-  if (argc != optind + 3)
+
+  if (dir || packedname) {
+    if ((dir && packedname) || argc < optind + 1
+	|| (argc == optind + 1 && !listname))
+      return usage(argv[0]);
+    struct template t;
+    if (read_template(argv[optind], &t))
+      return 1;
+    size_t n = argc - optind - 1;
+    char **inputs = malloc((n + 1) * sizeof *inputs);
+    if (!inputs) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    size_t i;
+    int rc = 0;
+    for (i = 0; i < n; i++)
+      if (!(inputs[i] = strdup(argv[optind + 1 + i]))) {
+	fprintf(stderr, "Out of memory\n");
+	rc = 1;
+      }
+    if (!rc && listname)
+      rc = read_list(listname, &inputs, &n);
+    if (!rc)
+      rc = batch(&t, inputs, n, multi, dir, packedname, njobs);
+    for (i = 0; i < n; i++)
+      free(inputs[i]);
+    free(inputs);
+    return rc;
+  }
+
+  if (listname || multi || argc != optind + 3)
     return usage(argv[0]);
 
   const char *oldhashname = argv[optind];
   const char *newpcrvalsname = argv[optind + 1];
   const char *newhashname = argv[optind + 2];
 
-  FILE *in = fopen(newpcrvalsname, "r");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", newpcrvalsname);
+  struct file_data f;
+  if (file_load(newpcrvalsname, &f))
+    return 1;
+  struct pcrvals pv;
+  int bad = pcrvals_parse((char *)f.data, f.len, newpcrvalsname, &pv);
+  file_unload(&f);
+  if (bad)
     return 1;
-  }
-
-  BYTE pcrSelect[PCRSELSIZE];
-  BYTE pcrValue[NPCRVALS][PCRVALSIZE];
-  memset(pcrSelect, 0, sizeof pcrSelect);
-  memset(pcrValue, 0, sizeof pcrValue);
-  UINT32 npcrs = 0;	      /* Number of bits set in pcrSelect */
-  unsigned int pcrind;	      /* Type matches "%u" format specifier */
-  UINT32 i, j;
-
-  while (1) {
-    char line[BUFSIZE];		/* Read a line of input */
-    if (!fgets(line, BUFSIZE, in)) {
-      if (ferror(in)) {
-	fprintf(stderr, "Error on file read\n");
-	exit(1);
-      }
-      else
-	break;			/* EOF found, exit loop */
-    }
-
-    npcrs++;			/* Found a line of input */
-
-    char *endp;			/* Parse PCR index */
-    pcrind = (unsigned int)strtoul(line, &endp, 10);
-    if (endp == line) {
-      fprintf(stderr, "(%s:  cannot read PCR index\n", newpcrvalsname);
-      exit(1);
-    }
-
-    if (pcrind >= NPCRVALS) {
-      fprintf(stderr, "%s:  out of range PCR %u\n",
-	      newpcrvalsname, pcrind);
-      exit(1);
-    }
-
-    /* Ensure there are no duplicate PCR specifications, as it would
-       cause npcrs to be too large, and corrupt the hash
-       computation. */
-    if (pcrSelect[pcrind / 8] & 1 << (pcrind % 8)) {
-      fprintf(stderr, "%s:  PCR %u already specified\n",
-	      newpcrvalsname, pcrind);
-      exit(1);
-    }
-
-    /* Set bit associated with pcrind */
-    pcrSelect[pcrind / 8] |= 1 << (pcrind % 8);
-
-    char *val = strchr(endp, '='); /* Find equal sign */
-    if (!val) {
-      fprintf(stderr, "%s:  ill-formed entry for PCR %u\n",
-	      newpcrvalsname, pcrind);
-      exit(1);
-    }
-
-    for (val++; isspace(*val); val++); /* Skip leading white space */
-
-    for (endp = val; isxdigit(*endp); endp++); /* Find end of value */
-
-    if (endp - val != 2 * PCRVALSIZE) {
-      fprintf(stderr, "%s:  ill-formed entry for PCR %u\n",
-	      newpcrvalsname, pcrind);
-      exit(1);
-    }
-
-    for(j = 0; val < endp; val += 2, j++) { /* Parse PCR value */
-      unsigned int byte;
-      if (sscanf(val, "%2x", &byte) != 1) {
-	fprintf(stderr, "%s:  error reading PCR value byte for PCR %u\n",
-		newpcrvalsname, pcrind);
-	exit(1);
-      }
-      pcrValue[pcrind][j] = (BYTE)byte;
-    }
-  }
 
   /* Read the old hash */
-  BYTE hash[BUFSIZE];
-  UINT32 hashLen;
-  if (read_data(hash, oldhashname, &hashLen))
-    return 1;
-  if (hashLen < sizeof(TPM_QUOTE_INFO)) {
-    fprintf(stderr, "Hash too small\n");
+  struct template t;
+  if (read_template(oldhashname, &t))
     return 1;
-  }
 
-  TPM_QUOTE_INFO2 *qi2 = (TPM_QUOTE_INFO2 *)hash;
-  TPM_QUOTE_INFO *qi = (TPM_QUOTE_INFO *)hash;
-  TPM_PCR_INFO_SHORT info;	/* This is set only for quote 2 */
-  UINT16 selectSize;
-  TSS_RESULT rc;
-  if (qi2->fixed[0] == 'Q' && qi2->fixed[1] == 'U' &&
-      qi2->fixed[2] == 'T' && qi2->fixed[3] == '2') {
-    qi = NULL;			/* Get select size and info */
-    UINT64 offset = (UINT64)offsetof(TPM_QUOTE_INFO2, externalData);
-    Trspi_UnloadBlob_NONCE(&offset, hash, 0);
-    rc = Trspi_UnloadBlob_PCR_INFO_SHORT(&offset, hash, &info);
-    if (rc != TSS_SUCCESS)
-      return trousers_err(rc, "extracting PCR info from hash");
-    selectSize = info.pcrSelection.sizeOfSelect;
-  } else if (qi->fixed[0] == 'Q' && qi->fixed[1] == 'U' &&
-	     qi->fixed[2] == 'O' && qi->fixed[3] == 'T') {
-    qi2 = NULL;			/* Set only select size */
-    selectSize = 2;
-  } else {
-    fprintf(stderr, "%s is not a valid quote!\n", oldhashname);
+  struct composite *c = composite_new();
+  if (!c)
     return 1;
-  }
-
-  if (selectSize > PCRSELSIZE) {
-    fprintf(stderr, "Cannot handle the selection size of %u in %s\n",
-	    selectSize, oldhashname);
+  BYTE hash[BUFSIZE];
+  bad = update(&t, c, &pv, hash);
+  composite_free(c);
+  if (bad)
     return 1;
-  }
-
-  for (i = selectSize; i < PCRSELSIZE; i++)
-    if (pcrSelect[i]) {
-      fprintf(stderr, "Specified PCRs exceed supported PCRs in hash\n");
-      return 1;
-    }
-
-  /* Construct a hash of a PCR composite */
-
-  /* The TSS data structure that holds a PCR composite hash is
-     TPM_PCR_COMPOSITE.  It contains a TPM_PCR_SELECTION, and a list
-     of PCR values.  There is no direct support for updating a hash
-     with a TPM_PCR_COMPOSITE.  To compute a hash, one must hash the
-     selection, and then hash the values in pieces. */
-
-  Trspi_HashCtx hctx;
-  rc = Trspi_HashInit(&hctx, TSS_HASH_SHA1);
-  if (rc != TSS_SUCCESS)
-    return trousers_err(rc, "initing hash");
-
-  /* Selection */
-  /* free(info.pcrSelection.pcrSelect); for pedantics */
-  info.pcrSelection.pcrSelect = pcrSelect;
-  rc = Trspi_Hash_PCR_SELECTION(&hctx, &info.pcrSelection);
-  if (rc != TSS_SUCCESS)
-    return trousers_err(rc, "updating hash with PCR selection");
-
-  /* Size of values */
-  rc = Trspi_Hash_UINT32(&hctx, npcrs * PCRVALSIZE);
-  if (rc != TSS_SUCCESS)
-    return trousers_err(rc, "updating hash with value size");
-
-  /* Values */
-  for (i = 0, pcrind = 0; i < selectSize; i++) {
-    for (j = 1; j != (1 << 8); j <<= 1, pcrind++) {
-      if (pcrSelect[i] & j) {
-	rc = Trspi_HashUpdate(&hctx, PCRVALSIZE, pcrValue[pcrind]);
-	if (rc != TSS_SUCCESS)
-	  return trousers_err(rc, "updating hash with a value");
-      }
-    }
-  }
-
-  /* Put composite hash into info even when using old quotes */
-  BYTE *digest = (BYTE *)&info.digestAtRelease;
-  rc = Trspi_HashFinal(&hctx, digest);
-  if (rc != TSS_SUCCESS)
-    return trousers_err(rc, "finalizing hash");
-
-  /* Update the hash */
-  if (qi2) {
-    UINT64 offset = (UINT64)offsetof(TPM_QUOTE_INFO2, externalData);
-    Trspi_UnloadBlob_NONCE(&offset, hash, 0);
-    Trspi_LoadBlob_PCR_INFO_SHORT(&offset, hash, &info);
-  } else {
-    size_t digestLen = sizeof info.digestAtRelease;
-    memcpy(hash+hashLen-digestLen-sizeof(TPM_NONCE), digest, digestLen);
-  }
 
   /* Write the new hash */
-  FILE *out = fopen(newhashname, "wb");
-  if (!out) {
-    fprintf(stderr, "Cannot open %s\n", newhashname);
-    return 1;
-  }
-  fwrite(hash, 1, hashLen, out);
-  fclose(out);
-
-  return 0;
+  return file_write(newhashname, hash, t.hashLen);
 }
 #else
 int main(void)
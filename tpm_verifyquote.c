@@ -14,48 +14,632 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <tss/tspi.h>
 #include "tpm_quote.h"
 
-#define BUFSIZE (1 << 10)
+#define BUFSIZE (1 << 11)	/* Holds the values of every PCR */
+#define NFIELDS 4		/* Fields in a batch record */
 
-static int read_data(BYTE *buf, const char *name, UINT32 *len)
+#define AIKCACHESIZE 4096	/* Public keys cached by the verifier */
+
+/* The verifier state that survives between quotes.  When OpenSSL
+   is used to check signatures, no TSS context is created, and
+   decoded keys are cached.  Otherwise, the public key is reinstalled
+   only when the DER encoded key changes. */
+struct verifier {
+  int tss;			/* Non-zero when the TSS checks signatures */
+  TSS_HCONTEXT hContext;
+  TSS_HKEY hPubAIK;
+  struct aik_cache *cache;	/* OpenSSL public keys */
+  struct pubkey *key;		/* Key for the current quote */
+  BYTE pubkey[BUFSIZE];		/* DER of the installed public key */
+  UINT32 pubkeyLen;		/* Zero when no key is installed */
+};
+
+static int verifier_init(struct verifier *v, int tss)
 {
-  FILE *in = fopen(name, "rb");
-  if (!in) {
-    fprintf(stderr, "Cannot open %s\n", name);
+  v->tss = tss;
+  v->cache = NULL;
+  v->key = NULL;
+  v->pubkeyLen = 0;
+  if (!tss) {
+    v->cache = aik_cache_new(AIKCACHESIZE);
+    return !v->cache;
+  }
+
+  /* Create context */
+  TSS_RESULT rc = TRACE(Tspi_Context_Create, &v->hContext);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating context");
+
+  /* Create Public AIK object */
+  int initFlags = TSS_KEY_TYPE_IDENTITY | TSS_KEY_SIZE_2048;
+  rc = TRACE(Tspi_Context_CreateObject, v->hContext,
+	     TSS_OBJECT_TYPE_RSAKEY,
+	     initFlags, &v->hPubAIK);
+  if (rc != TSS_SUCCESS)
+    return tidy(v->hContext, tss_err(rc, "creating public AIK object"));
+
+  return 0;
+}
+
+static int verifier_close(struct verifier *v, int code)
+{
+  aik_cache_free(v->cache);
+  if (v->tss)
+    return tidy(v->hContext, code);
+  return code;
+}
+
+static int install_pubkey(struct verifier *v, BYTE *pubkey, UINT32 pubkeyLen)
+{
+  if (!v->tss) {
+    v->key = aik_cache_lookup(v->cache, pubkey, pubkeyLen, NULL, NULL);
+    return !v->key;
+  }
+
+  if (v->pubkeyLen == pubkeyLen && !memcmp(v->pubkey, pubkey, pubkeyLen))
+    return 0;			/* Key already installed */
+  v->pubkeyLen = 0;
+
+  /* Decode public key */
+  BYTE blob[BUFSIZE];
+  UINT32 blobLen = BUFSIZE;
+  if (pubkey_decode(pubkey, pubkeyLen, blob, &blobLen))
+    return 1;
+
+  /* Install public key */
+  TSS_RESULT rc = TRACE(Tspi_SetAttribData, v->hPubAIK,
+			TSS_TSPATTRIB_KEY_BLOB,
+			TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
+			blobLen, blob);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "installing public key");
+
+  memcpy(v->pubkey, pubkey, pubkeyLen);
+  v->pubkeyLen = pubkeyLen;
+  return 0;
+}
+
+/* Verifies one quote.  The hash is modified in place to hold the
+   nonce. */
+static int verify(struct verifier *v,
+		  BYTE *pubkey, UINT32 pubkeyLen,
+		  BYTE *hash, UINT32 hashLen,
+		  BYTE *nonce, UINT32 nonceLen,
+		  BYTE *quote, UINT32 quoteLen)
+{
+  /* Insert nonce into provisioned signed data */
+  if (quote_set_nonce(hash, hashLen, nonce, nonceLen))
+    return 1;
+
+  if (install_pubkey(v, pubkey, pubkeyLen))
     return 1;
+
+  if (!v->tss)
+    return pubkey_verify(v->key, hash, hashLen, quote, quoteLen);
+
+  /* Hash quote for signature checking */
+  TSS_HHASH hHash;
+  TSS_RESULT rc;
+  rc = TRACE(Tspi_Context_CreateObject, v->hContext, TSS_OBJECT_TYPE_HASH,
+	     TSS_HASH_SHA1, &hHash);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "creating hash object");
+
+  rc = TRACE(Tspi_Hash_UpdateHashValue, hHash, hashLen, hash);
+  if (rc == TSS_SUCCESS) {
+    /* Verify the signature on the quote */
+    rc = TRACE(Tspi_Hash_VerifySignature, hHash, v->hPubAIK, quoteLen, quote);
+    if (rc != TSS_SUCCESS)
+      tss_err(rc, "verifying signature");
   }
-  *len = fread(buf, 1, BUFSIZE, in);
-  if (ferror(in))
+  else
+    tss_err(rc, "setting hash to quote");
+
+  TRACE(Tspi_Context_CloseObject, v->hContext, hHash);
+  return rc != TSS_SUCCESS;
+}
+
+/* Replaces the hash by the quote info expected in a golden
+   database.  On entry, the hash holds the name of a machine class,
+   and the info is looked up by class.  When it holds - or nothing,
+   the info is looked up by the AIK. */
+static int golden_hash(struct golden *db, BYTE *pubkey, UINT32 pubkeyLen,
+		       BYTE *hash, UINT32 *hashLen)
+{
+  BYTE key[GOLDEN_KEYSIZE];
+  int byaik = *hashLen == 0 || (*hashLen == 1 && *hash == '-');
+  if (byaik)
+    golden_key(pubkey, pubkeyLen, key);
+  else
+    golden_key(hash, *hashLen, key);
+  const BYTE *info;
+  UINT32 infoLen;
+  if (golden_lookup(db, key, &info, &infoLen)) {
+    if (byaik)
+      fprintf(stderr, "AIK not in golden database\n");
+    else
+      fprintf(stderr, "Class %.*s not in golden database\n",
+	      (int)*hashLen, (char *)hash);
+    return 1;
+  }
+  memcpy(hash, info, infoLen);
+  *hashLen = infoLen;
+  return 0;
+}
+
+/* An old hash that is updated with the PCR values of each quote to
+   give the expected quote info. */
+struct template {
+  BYTE info[BUFSIZE];
+  UINT32 infoLen;
+  struct composite *c;		/* Resumes from shared values */
+};
+
+static int template_open(const char *name, struct template *t)
+{
+  if (file_read(name, t->info, BUFSIZE, &t->infoLen))
+    return 1;
+  t->c = composite_new();
+  return !t->c;
+}
+
+/* Replaces the hash by the template updated with PCR values.  On
+   entry, the hash holds the PCR values as index=value lines. */
+static int template_hash(struct template *t, BYTE *hash, UINT32 *hashLen)
+{
+  struct pcrvals pv;
+  if (pcrvals_parse((char *)hash, *hashLen, "PCR values", &pv))
+    return 1;
+  memcpy(hash, t->info, t->infoLen);
+  *hashLen = t->infoLen;
+  return quote_info_update(hash, *hashLen, t->c, &pv);
+}
+
+static double elapsed(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec)
+    + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* One record of a batch.  When a pool of threads is used, each
+   record is allocated, and freed once its quote is verified.  The
+   fields are held in the record, except that those of a bundle point
+   into the file of bundles. */
+struct record {
+  struct verify_job job;
+  unsigned long count;		/* Record number */
+  char name[FILENAME_MAX];	/* Quote file name, if any */
+  BYTE *field[NFIELDS];
+  UINT32 len[NFIELDS];
+  BYTE buf[NFIELDS][BUFSIZE];
+};
+
+/* A file of concatenated bundles made by tpm_getquote -b, verified
+   with one public key against the nonces the verifier issued, one
+   for each bundle in turn. */
+struct bundles {
+  struct file_data f;
+  size_t next;			/* Offset of the next bundle */
+  struct file_data nonces;
+  size_t nonce;			/* Offset of the next nonce */
+  BYTE *pubkey;
+  UINT32 pubkeyLen;
+  BYTE *hash;			/* Expected quote info, or NULL */
+  UINT32 hashLen;
+};
+
+static int bundles_open(const char *name, const char *pubkeyname,
+			const char *hashname, const char *noncesname,
+			struct bundles *src)
+{
+  memset(src, 0, sizeof *src);
+  static BYTE pubkey[BUFSIZE];
+  static BYTE hash[BUFSIZE];
+  if (file_read(pubkeyname, pubkey, BUFSIZE, &src->pubkeyLen))
+    return 1;
+  src->pubkey = pubkey;
+  if (hashname) {
+    if (file_read(hashname, hash, BUFSIZE, &src->hashLen))
+      return 1;
+    src->hash = hash;
+  }
+  if (file_load(noncesname, &src->nonces))
+    return 1;
+  if (file_load(name, &src->f)) {
+    file_unload(&src->nonces);
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns nonzero when nonces were issued for more bundles than were
+   verified. */
+static int bundles_close(struct bundles *src)
+{
+  int bad = src->nonce < src->nonces.len;
+  if (bad)
+    fprintf(stderr, "Not every nonce has a bundle\n");
+  file_unload(&src->f);
+  file_unload(&src->nonces);
+  return bad;
+}
+
+/* Takes the next bundle as a record.  Returns 2 when the bundle
+   cannot be verified, and 1 when the rest of the file cannot be read
+   either.  The nonce is the next one the verifier issued, which the
+   bundle must have been made for.  With a golden database, the hash
+   is left empty, to look up the AIK, with a template, the hash is
+   the PCR values, and otherwise it is the expected quote info.  The
+   quote info in the bundle is never used, since the attester could
+   send any info its AIK ever signed. */
+static int read_bundle(struct bundles *src, struct golden *db,
+		       struct template *tmpl, struct record *r)
+{
+  if (src->next == src->f.len)
+    return -1;
+  *r->name = 0;
+  struct bundle b;
+  size_t used;
+  if (bundle_parse(src->f.data + src->next, src->f.len - src->next,
+		   &b, &used))
+    return 1;
+  src->next += used;
+  if (src->nonces.len - src->nonce < sizeof(TPM_NONCE)) {
+    fprintf(stderr, "No nonce for bundle %lu\n", r->count);
     return 1;
-  fclose(in);
+  }
+  BYTE *nonce = src->nonces.data + src->nonce;
+  src->nonce += sizeof(TPM_NONCE);
+
+  r->field[0] = src->pubkey;
+  r->len[0] = src->pubkeyLen;
+  r->field[2] = nonce;
+  r->len[2] = sizeof(TPM_NONCE);
+  r->field[3] = b.data[BUNDLE_QUOTE];
+  r->len[3] = b.len[BUNDLE_QUOTE];
+  r->field[1] = r->buf[1];
+  r->len[1] = 0;
+  BYTE *pcrvals = b.data[BUNDLE_PCRVALS];
+  UINT32 pcrvalsLen = b.len[BUNDLE_PCRVALS];
+  if (!b.data[BUNDLE_NONCE] || !r->field[3] || (tmpl && !pcrvals)) {
+    fprintf(stderr, "Bundle %lu lacks a section\n", r->count);
+    return 2;
+  }
+  if (b.len[BUNDLE_NONCE] != sizeof(TPM_NONCE)
+      || memcmp(b.data[BUNDLE_NONCE], nonce, sizeof(TPM_NONCE))) {
+    fprintf(stderr, "Bundle %lu is not for the nonce issued\n", r->count);
+    return 2;
+  }
+  if (b.data[BUNDLE_PATH]) {	/* The quote is for a root of nonces */
+    if (nonce_path_root(r->field[2], r->len[2], b.data[BUNDLE_PATH],
+			b.len[BUNDLE_PATH], r->buf[2]))
+      return 2;
+    r->field[2] = r->buf[2];
+    r->len[2] = sizeof(TPM_NONCE);
+  }
+  if (db)
+    return 0;
+  const BYTE *from = tmpl ? pcrvals : src->hash;
+  UINT32 len = tmpl ? pcrvalsLen : src->hashLen;
+  if (len > BUFSIZE) {
+    fprintf(stderr, "Bundle %lu section too large\n", r->count);
+    return 2;
+  }
+  memcpy(r->buf[1], from, len);	/* The nonce is set in the copy */
+  r->len[1] = len;
   return 0;
 }
 
+static unsigned long failed;	/* Number of records not verified */
+
+static void report(struct record *r, int bad)
+{
+  if (bad)
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+  if (*r->name)
+    printf("%lu %s %s\n", r->count, r->name, bad ? "FAILED" : "OK");
+  else
+    printf("%lu %s\n", r->count, bad ? "FAILED" : "OK");
+}
+
+static void record_done(struct verify_job *job)
+{
+  struct record *r = job->arg;
+  report(r, job->result);
+  free(r);
+}
+
+/* Reads the next record.  Returns -1 at the end of input.  With a
+   golden database, the hash field of a manifest entry is a class
+   name rather than a file. */
+static int read_record(FILE *in, struct frame_reader *frames,
+		       struct bundles *bundles, struct golden *db,
+		       struct template *tmpl, struct record *r)
+{
+  int i, rc = 0;
+  if (bundles)
+    return read_bundle(bundles, db, tmpl, r);
+  for (i = 0; i < NFIELDS; i++)
+    r->field[i] = r->buf[i];
+  if (frames) {
+    BYTE *field[NFIELDS];
+    if ((rc = frame_read(frames, NFIELDS, field, r->len)))
+      return rc;
+    for (i = 0; i < NFIELDS; i++) {
+      if (r->len[i] > BUFSIZE) {
+	fprintf(stderr, "Record field of %u bytes too large\n", r->len[i]);
+	return 1;
+      }
+      memcpy(r->field[i], field[i], r->len[i]);
+    }
+    *r->name = 0;
+    return 0;
+  }
+
+  for (;;) {
+    char line[4 * FILENAME_MAX];
+    char *name[NFIELDS];
+    if (!fgets(line, sizeof line, in)) {
+      if (ferror(in)) {
+	fprintf(stderr, "Error on manifest read\n");
+	return 1;
+      }
+      return -1;
+    }
+    char *save;
+    name[0] = strtok_r(line, " \t\r\n", &save);
+    if (!name[0] || *name[0] == '#')
+      continue;			/* Skip blank lines and comments */
+    for (i = 1; i < NFIELDS; i++)
+      name[i] = strtok_r(NULL, " \t\r\n", &save);
+    if (!name[NFIELDS - 1]) {
+      fprintf(stderr, "Ill-formed manifest entry %lu\n", r->count);
+      return 1;
+    }
+    snprintf(r->name, sizeof r->name, "%s", name[NFIELDS - 1]);
+    /* A file that cannot be read fails only its own record */
+    for (i = 0; i < NFIELDS && !rc; i++)
+      if (db && i == 1) {
+	r->len[i] = strlen(name[i]);
+	if (r->len[i] > BUFSIZE) {
+	  fprintf(stderr, "Class name of %u bytes too large\n", r->len[i]);
+	  rc = 1;
+	}
+	else
+	  memcpy(r->field[i], name[i], r->len[i]);
+      }
+      else
+	rc = file_read(name[i], r->field[i], BUFSIZE, &r->len[i]);
+    return rc ? 2 : 0;
+  }
+}
+
+/* Verifies a sequence of quotes using one context.  Records come
+   from a manifest of file names, from length prefixed fields on
+   standard input when framed is set, or from a file of bundles.
+   Prints one result line per record on standard output.  When
+   nthreads is non-zero, the quotes are verified by a pool of
+   threads, and the result lines appear in order of completion.  With
+   a golden database, the expected quote info comes from the
+   database, and with a template, from updating the template with
+   the PCR values in the hash field. */
+static int batch(const char *manifest, int framed, struct bundles *bundles,
+		 int tss, unsigned nthreads, const char *keydir,
+		 struct golden *db, struct template *tmpl)
+{
+  FILE *in = stdin;
+  struct frame_reader *frames = NULL;
+  if (manifest && strcmp(manifest, "-") && !(in = fopen(manifest, "r"))) {
+    fprintf(stderr, "Cannot open %s\n", manifest);
+    return 1;
+  }
+  if (framed && !(frames = frame_reader_new(STDIN_FILENO)))
+    return 1;
+
+  struct verifier v;
+  struct verify_pool *pool = NULL;
+  if (nthreads)
+    pool = verify_pool_new(nthreads, 4 * nthreads, record_done);
+  if (nthreads ? !pool : verifier_init(&v, tss))
+    return 1;
+  if (keydir && pool)		/* Keys that fail to load are reported, */
+    verify_pool_preload(pool, keydir); /* but are not fatal */
+  else if (keydir)
+    aik_cache_preload(v.cache, keydir);
+
+  static struct record record;
+  struct record *r = &record;
+  unsigned long count = 0;
+  int rc = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (;;) {
+    if (pool && !(r = malloc(sizeof *r))) {
+      fprintf(stderr, "Out of memory\n");
+      rc = 1;
+      break;
+    }
+    r->count = count + 1;
+    rc = read_record(in, frames, bundles, db, tmpl, r);
+    if (rc == 1 || rc < 0) {
+      if (pool)
+	free(r);
+      rc = rc > 0;
+      break;
+    }
+
+    count++;
+    if (!rc && db
+	&& golden_hash(db, r->field[0], r->len[0], r->field[1], &r->len[1]))
+      rc = 2;
+    if (!rc && tmpl && template_hash(tmpl, r->field[1], &r->len[1]))
+      rc = 2;
+    if (rc) {			/* Unreadable file or unknown key */
+      rc = 0;
+      report(r, 1);
+      if (pool)
+	free(r);
+    }
+    else if (pool) {
+      struct verify_job *job = &r->job;
+      job->pubkey = r->field[0];
+      job->pubkeyLen = r->len[0];
+      job->hash = r->field[1];
+      job->hashLen = r->len[1];
+      job->nonce = r->field[2];
+      job->nonceLen = r->len[2];
+      job->quote = r->field[3];
+      job->quoteLen = r->len[3];
+      job->arg = r;
+      verify_pool_submit(pool, job);
+    }
+    else
+      report(r, verify(&v, r->field[0], r->len[0], r->field[1], r->len[1],
+		       r->field[2], r->len[2], r->field[3], r->len[3]));
+  }
+
+  struct aik_cache_stats stats;
+  if (pool) {
+    verify_pool_wait(pool);
+    verify_pool_get_stats(pool, &stats);
+    verify_pool_free(pool);
+  }
+  else if (!tss)
+    aik_cache_get_stats(v.cache, &stats);
+  double secs = elapsed(&start);
+  if (in != stdin)
+    fclose(in);
+  frame_reader_free(frames);
+  fflush(stdout);
+  fprintf(stderr, "%lu quotes, %lu failed, %.3f s, %.1f quotes/s\n",
+	  count, failed, secs, secs > 0 ? count / secs : 0.0);
+  if (!tss)
+    fprintf(stderr, "Key cache: %lu hits, %lu misses, %lu evictions, "
+	    "%lu keys\n", stats.hits, stats.misses, stats.evictions,
+	    (unsigned long)stats.entries);
+  if (pool)
+    return rc || failed;
+  return verifier_close(&v, rc || failed);
+}
+
 static int usage(const char *prog)
 {
   const char text[] =
-    "Usage: %s [-hv] pubkey hash nonce [quote]\n"
+    "Usage: %s [-thv] [-a path] pubkey hash nonce [quote]\n"
+    "       %s [-thv] [-a path] -g database [-c class] pubkey nonce"
+    " [quote]\n"
+    "       %s [-thv] [-a path] -p template pubkey pcrvals nonce"
+    " [quote]\n"
+    "       %s [-thv] [-j threads] [-k keydir] [-g database|-p template]"
+    " -b manifest\n"
+    "       %s [-thv] [-j threads] [-k keydir] [-g database|-p template]"
+    " -f\n"
+    "       %s [-thv] [-j threads] -g database|-p template"
+    " -q bundles pubkey nonces\n"
+    "       %s [-thv] [-j threads] -q bundles pubkey hash nonces\n"
     "\tpubkey\tFile containing public part of the AIK\n"
     "\thash\tFile containing the expected PCR composite hash\n"
     "\tnonce\tFile containing nonce in quote request\n"
     "\tquote\tFile with signature to verify\n"
+    "\tpcrvals\tFile containing list of PCR index=value pairs\n"
+    "\tnonces\tFile containing the nonce issued for each bundle\n"
     "Options:\n"
+    "\t-a path\n"
+    "\t     The quote is for the root of several nonces, and file\n"
+    "\t     path holds the path to it from nonce, as stored by\n"
+    "\t     tpm_getquote -a\n"
+    "\t-b manifest\n"
+    "\t     Verify each pubkey hash nonce quote line in manifest,\n"
+    "\t     or standard input when manifest is -\n"
+    "\t-f   Verify framed records read from standard input\n"
+    "\t-q bundles\n"
+    "\t     Verify each bundle made by tpm_getquote -b in the file\n"
+    "\t     bundles, or standard input when bundles is -.  Each\n"
+    "\t     bundle must be for the next nonce in nonces.  When the\n"
+    "\t     bundle holds a nonce path, the quote is for its root\n"
+    "\t-g database\n"
+    "\t     Take the expected hash from a golden database made by\n"
+    "\t     tpm_mkgolden, looked up by AIK, or by the class given\n"
+    "\t     with -c.  In batch mode, the hash of a record is a class\n"
+    "\t     name, or - to look up the AIK\n"
+    "\t-c class\n"
+    "\t     Look up the expected hash of a machine class\n"
+    "\t-p template\n"
+    "\t     Make the expected hash by updating the hash in template\n"
+    "\t     with PCR values.  In batch mode, the hash of a record\n"
+    "\t     holds PCR values\n"
+#if defined HAVE_OPENSSL_RSA_LIB
+    "\t-j threads\n"
+    "\t     Verify batch records using a pool of threads\n"
+    "\t-k keydir\n"
+    "\t     Preload the public keys in directory keydir\n"
+    "\t-t   Check signatures with the TSS instead of OpenSSL\n"
+#endif
     "\t-h   Display command usage info\n"
     "\t-v   Display command version info\n"
     "\n"
     "On success, verifies quote.\n";
-    fprintf(stderr, text, prog);
+    fprintf(stderr, text, prog, prog, prog, prog, prog, prog, prog);
     return 1;
 }
 
 int main(int argc, char **argv)
 {
+  const char *manifest = NULL;	/* Non-null in manifest batch mode */
+  int framed = 0;		/* Non-zero in framed batch mode */
+  const char *bundlesname = NULL; /* Non-null in bundle batch mode */
+  unsigned nthreads = 0;	/* Non-zero when using a thread pool */
+  const char *keydir = NULL;	/* Directory of keys to preload */
+  const char *dbname = NULL;	/* Golden database, if any */
+  const char *class = NULL;	/* Machine class to look up */
+  const char *tmplname = NULL;	/* Template updated with PCR values */
+  const char *pathname = NULL;	/* Path from the nonce to the root */
+#if defined HAVE_OPENSSL_RSA_LIB
+  int tss = 0;			/* Non-zero when the TSS checks signatures */
+#else
+  int tss = 1;
+#endif
+
   int opt;
-  while ((opt = getopt(argc, argv, "hv")) != -1) {
+  while ((opt = getopt(argc, argv, "a:b:c:fg:j:k:p:q:thv")) != -1) {
     switch (opt) {
+    case 'a':
+      pathname = optarg;
+      break;
+    case 'b':
+      manifest = optarg;
+      break;
+    case 'c':
+      class = optarg;
+      break;
+    case 'f':
+      framed = 1;
+      break;
+    case 'g':
+      dbname = optarg;
+      break;
+    case 'j':
+      nthreads = (unsigned)strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      keydir = optarg;
+      break;
+    case 'p':
+      tmplname = optarg;
+      break;
+    case 'q':
+      bundlesname = optarg;
+      break;
+    case 't':
+      tss = 1;
+      break;
     case 'h':
       usage(argv[0]);
       return 0;
@@ -67,108 +651,106 @@ int main(int argc, char **argv)
     }
   }
 
-  switch (argc - optind) {
-  case 3:			/* Take quote from standard input */
-    break;
-  case 4:			/* Take quote from file */
-    if (!freopen(argv[optind + 3], "rb", stdin)) {
-      fprintf(stderr, "Cannot open %s\n", argv[optind + 3]);
-      return 1;
-    }
-    break;
-  default:
+  if (trace_init(argv[0]))
+    return 1;
+
+  if ((class && !dbname) || (dbname && tmplname))
     return usage(argv[0]);
+
+  static struct template tmpl;
+  if (tmplname && template_open(tmplname, &tmpl))
+    return 1;
+
+  struct golden *db = NULL;
+  if (manifest || framed || bundlesname) {
+    int nbundleargs = dbname || tmplname ? 2 : 3;
+    if (argc != optind + (bundlesname ? nbundleargs : 0)
+	|| !!manifest + framed + !!bundlesname > 1 || class || pathname
+	|| (tss && (nthreads || keydir)))
+      return usage(argv[0]);
+    static struct bundles bundles;
+    if (bundlesname
+	&& bundles_open(bundlesname, argv[optind],
+			nbundleargs == 3 ? argv[optind + 1] : NULL,
+			argv[optind + nbundleargs - 1], &bundles))
+      return 1;
+    if (dbname && !(db = golden_open(dbname)))
+      return 1;
+    int rc = batch(manifest, framed, bundlesname ? &bundles : NULL,
+		   tss, nthreads, keydir, db, tmplname ? &tmpl : NULL);
+    golden_close(db);
+    composite_free(tmpl.c);
+    if (bundlesname && bundles_close(&bundles))
+      rc = 1;
+    return rc;
   }
 
+  int nargs = dbname ? 2 : 3;	/* Arguments before the quote */
+  const char *quotename = "-";	/* Take quote from standard input */
+  if (argc - optind == nargs + 1) /* or from a file */
+    quotename = argv[optind + nargs];
+  else if (argc - optind != nargs)
+    return usage(argv[0]);
+
   const char *pubkeyname = argv[optind];
-  const char *hashname = argv[optind + 1];
-  const char *noncename = argv[optind + 2];
+  const char *hashname = dbname ? NULL : argv[optind + 1];
+  const char *noncename = argv[optind + nargs - 1];
 
   BYTE pubkey[BUFSIZE];
   UINT32 pubkeyLen;
-  if (read_data(pubkey, pubkeyname, &pubkeyLen))
+  if (file_read(pubkeyname, pubkey, BUFSIZE, &pubkeyLen))
     return 1;
 
   BYTE hash[BUFSIZE];
   UINT32 hashLen;
-  if (read_data(hash, hashname, &hashLen))
-    return 1;
-  if (hashLen < sizeof(TPM_NONCE)) {
-    fprintf(stderr, "Hash wrong size\n");
-    return 1;
+  if (dbname) {
+    hashLen = class ? strlen(class) : 0;
+    if (hashLen > BUFSIZE) {
+      fprintf(stderr, "Class name too long\n");
+      return 1;
+    }
+    if (class)
+      memcpy(hash, class, hashLen);
+    if (!(db = golden_open(dbname)))
+      return 1;
+    int rc = golden_hash(db, pubkey, pubkeyLen, hash, &hashLen);
+    golden_close(db);
+    if (rc)
+      return 1;
   }
-  TPM_NONCE *hashNonce = quote_nonce(hash);
-  if (!hashNonce) {
-    fprintf(stderr, "Hash format error\n");
+  else if (file_read(hashname, hash, BUFSIZE, &hashLen))
     return 1;
+
+  if (tmplname) {		/* The hash holds PCR values */
+    int rc = template_hash(&tmpl, hash, &hashLen);
+    composite_free(tmpl.c);
+    if (rc)
+      return 1;
   }
 
   BYTE nonce[BUFSIZE];
   UINT32 nonceLen;
-  if (read_data(nonce, noncename, &nonceLen))
-    return 1;
-  if (nonceLen != sizeof(TPM_NONCE)) {
-    fprintf(stderr, "Nonce wrong size\n");
+  if (file_read(noncename, nonce, BUFSIZE, &nonceLen))
     return 1;
+
+  if (pathname) {		/* Verify the quote of the root instead */
+    BYTE path[NONCE_MAXPATH];
+    UINT32 pathLen;
+    if (file_read(pathname, path, sizeof path, &pathLen)
+	|| nonce_path_root(nonce, nonceLen, path, pathLen, nonce))
+      return 1;
+    nonceLen = sizeof(TPM_NONCE);
   }
-  /* Insert nonce into provisioned signed data */
-  memcpy(hashNonce, nonce, sizeof(TPM_NONCE));
 
   BYTE quote[BUFSIZE];
   UINT32 quoteLen;
-  quoteLen = fread(quote, 1, BUFSIZE, stdin);
-  fclose(stdin);
-
-  /* Decode public key */
-  UINT32 blobType;
-  BYTE blob[BUFSIZE];
-  UINT32 blobLen = BUFSIZE;
-  TSS_RESULT rc =
-    Tspi_DecodeBER_TssBlob(pubkeyLen, pubkey, &blobType, &blobLen, blob);
-  if (rc != TSS_SUCCESS)
-    return tss_err(rc, "decoding public key");
-  if (blobType !=  TSS_BLOB_TYPE_PUBKEY) {
-    fprintf(stderr, "Error while decoding public key, got wrong blob type");
+  if (file_read(quotename, quote, BUFSIZE, &quoteLen))
     return 1;
-  }
-
-  /* Create context */
-  TSS_HCONTEXT hContext;	/* Context handle */
-  rc = Tspi_Context_Create(&hContext);
-  if (rc != TSS_SUCCESS)
-    return tss_err(rc, "creating context");
-
-  /* Create Public AIK object */
-  TSS_HKEY hPubAIK;
-  int initFlags = TSS_KEY_TYPE_IDENTITY | TSS_KEY_SIZE_2048;
-  rc = Tspi_Context_CreateObject(hContext,
-				 TSS_OBJECT_TYPE_RSAKEY,
-				 initFlags, &hPubAIK);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "creating public AIK object"));
 
-  /* Install public key */
-  rc = Tspi_SetAttribData(hPubAIK, TSS_TSPATTRIB_KEY_BLOB,
-			  TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
-			  blobLen, blob);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "installing public key"));
-
-  /* Hash quote for signature checking */
-  TSS_HHASH hHash;
-  rc = Tspi_Context_CreateObject(hContext, TSS_OBJECT_TYPE_HASH,
-				 TSS_HASH_SHA1, &hHash);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "creating hash object"));
-
-  rc = Tspi_Hash_UpdateHashValue(hHash, hashLen, hash);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "setting hash to quote"));
-
-  /* Verify the signature on the quote */
-  rc = Tspi_Hash_VerifySignature(hHash, hPubAIK, quoteLen, quote);
-  if (rc != TSS_SUCCESS)
-    return tidy(hContext, tss_err(rc, "verifying signature"));
+  struct verifier v;
+  if (verifier_init(&v, tss))
+    return 1;
 
-  return tidy(hContext, 0);
+  return verifier_close(&v, verify(&v, pubkey, pubkeyLen, hash, hashLen,
+				   nonce, nonceLen, quote, quoteLen));
 }
@@ -0,0 +1,285 @@
+/*
+ * Record the time taken by TSS calls, and write it as a trace.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define TRACE_ENV "TPM_QUOTE_TRACE"
+#define NEVENTS (1 << 14)	/* Events kept in the ring */
+#define MSGSIZE 64		/* Longest error message kept */
+
+/* Nonzero when calls are being traced.  Set only by trace_init,
+   before any threads are started. */
+int trace_on;
+
+/* A TSS call, or an error reported by tss_err. */
+struct event {
+  const char *name;		/* Function called, or NULL for an error */
+  const char *caller;		/* Function making the call */
+  unsigned long long start;	/* Nanoseconds since trace_init */
+  unsigned long long dur;
+  unsigned tid;
+  TSS_RESULT rc;
+  char msg[MSGSIZE];		/* For errors */
+};
+
+static struct event *ring;
+static unsigned long long nevents;	/* Events ever recorded */
+static unsigned long long origin;	/* When tracing began */
+static char *path;			/* Where the trace goes */
+static const char *process;
+
+/* Each thread remembers the start of its current call. */
+struct thread {
+  unsigned tid;
+  unsigned long long start;
+};
+
+#if defined HAVE_PTHREAD_H
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;
+#else
+static struct thread main_thread = { 1, 0 };
+#endif
+static unsigned ntids;
+
+static unsigned long long clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct thread *self(void)
+{
+#if defined HAVE_PTHREAD_H
+  struct thread *t = pthread_getspecific(key);
+  if (!t) {
+    t = calloc(1, sizeof *t);
+    if (!t)
+      return NULL;
+    pthread_mutex_lock(&lock);
+    t->tid = ++ntids;
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(key, t);
+  }
+  return t;
+#else
+  return &main_thread;
+#endif
+}
+
+/* Takes the next slot in the ring, overwriting the oldest event
+   once it is full. */
+static void record(struct event *e)
+{
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_lock(&lock);
+#endif
+  ring[nevents++ % NEVENTS] = *e;
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_unlock(&lock);
+#endif
+}
+
+void trace_begin(void)
+{
+  struct thread *t = self();
+  if (t)
+    t->start = clock_ns();
+}
+
+TSS_RESULT trace_end(const char *name, const char *caller, TSS_RESULT rc)
+{
+  unsigned long long end = clock_ns();
+  struct thread *t = self();
+  if (!t)
+    return rc;
+  struct event e;
+  e.name = name;
+  e.caller = caller;
+  e.start = t->start - origin;
+  e.dur = end - t->start;
+  e.tid = t->tid;
+  e.rc = rc;
+  e.msg[0] = 0;
+  record(&e);
+  return rc;
+}
+
+/* Records an error reported by tss_err as an instant event. */
+void trace_error(TSS_RESULT rc, const char *msg)
+{
+  if (!trace_on)
+    return;
+  struct thread *t = self();
+  if (!t)
+    return;
+  struct event e;
+  e.name = NULL;
+  e.caller = NULL;
+  e.start = clock_ns() - origin;
+  e.dur = 0;
+  e.tid = t->tid;
+  e.rc = rc;
+  snprintf(e.msg, sizeof e.msg, "%s", msg);
+  record(&e);
+}
+
+/* Writes a string as JSON, escaping what must be escaped. */
+static void put_string(FILE *out, const char *s)
+{
+  putc('"', out);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < ' ')
+      fprintf(out, "\\u%04x", c);
+    else
+      putc(c, out);
+  }
+  putc('"', out);
+}
+
+static void put_result(FILE *out, TSS_RESULT rc)
+{
+  const char *result = tss_result(rc);
+  if (result)
+    put_string(out, result);
+  else
+    fprintf(out, "\"0x%x\"", rc);
+}
+
+/* Writes the events in the ring in the Chrome trace event format,
+   oldest first.  Timestamps are in microseconds. */
+int trace_dump(void)
+{
+  if (!trace_on)
+    return 0;
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    fprintf(stderr, "Cannot write trace to %s\n", path);
+    return 1;
+  }
+  int pid = getpid();
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_lock(&lock);
+#endif
+  unsigned long long first = nevents > NEVENTS ? nevents - NEVENTS : 0;
+  fprintf(out, "{\"traceEvents\": [\n"
+	  "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+	  "\"args\": {\"name\": ", pid);
+  put_string(out, process);
+  fprintf(out, "}}");
+  unsigned long long i;
+  for (i = first; i < nevents; i++) {
+    struct event *e = &ring[i % NEVENTS];
+    if (e->name) {
+      fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+	      "\"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+	      "\"args\": {\"result\": ", e->name, e->caller, pid, e->tid,
+	      e->start / 1e3, e->dur / 1e3);
+      put_result(out, e->rc);
+      fprintf(out, "}}");
+    }
+    else {
+      fprintf(out, ",\n{\"name\": \"error\", \"ph\": \"i\", \"s\": \"t\", "
+	      "\"pid\": %d, \"tid\": %u, \"ts\": %.3f, "
+	      "\"args\": {\"message\": ", pid, e->tid, e->start / 1e3);
+      put_string(out, e->msg);
+      fprintf(out, ", \"result\": ");
+      put_result(out, e->rc);
+      fprintf(out, "}}");
+    }
+  }
+  fprintf(out, "\n],\n\"otherData\": {\"dropped\": %llu}}\n", first);
+#if defined HAVE_PTHREAD_H
+  pthread_mutex_unlock(&lock);
+#endif
+  if (fclose(out)) {
+    fprintf(stderr, "Cannot write trace to %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+static void trace_exit(void)
+{
+  trace_dump();
+}
+
+/* Makes a copy of the trace file name with each %p replaced by the
+   process ID, so that concurrent programs write separate traces. */
+static char *expand(const char *name)
+{
+  char pid[32];
+  snprintf(pid, sizeof pid, "%d", (int)getpid());
+  size_t len = 1;
+  const char *s;
+  for (s = name; *s; s++)
+    len += s[0] == '%' && s[1] == 'p' ? strlen(pid) : 1;
+  char *result = malloc(len);
+  if (!result)
+    return NULL;
+  char *d = result;
+  for (s = name; *s; s++)
+    if (s[0] == '%' && s[1] == 'p') {
+      strcpy(d, pid);
+      d += strlen(pid);
+      s++;
+    }
+    else
+      *d++ = *s;
+  *d = 0;
+  return result;
+}
+
+/* Starts tracing when the TPM_QUOTE_TRACE environment variable names
+   a file, to which the trace is written when the program exits.
+   Call before starting threads. */
+int trace_init(const char *prog)
+{
+  const char *name = getenv(TRACE_ENV);
+  if (!name || !*name || trace_on)
+    return 0;
+  ring = malloc(NEVENTS * sizeof *ring);
+  path = expand(name);
+  if (!ring || !path) {
+    free(ring);
+    free(path);
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+#if defined HAVE_PTHREAD_H
+  if (pthread_key_create(&key, free)) {
+    fprintf(stderr, "Cannot create trace key\n");
+    return 1;
+  }
+#endif
+  const char *slash = strrchr(prog, '/');
+  process = slash ? slash + 1 : prog;
+  origin = clock_ns();
+  trace_on = 1;
+  atexit(trace_exit);
+  return 0;
+}
@@ -0,0 +1,1995 @@
+/*
+ * A software TPM behind the TSS service provider interface.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+/* This file takes the place of the TSS library when the package is
+   configured with --with-simulator, so that the tools and
+   libtpm_quote.a can be exercised and benchmarked on machines
+   without a TPM or tcsd.  It implements the Tspi_* calls made by the
+   tools, and no others.
+
+   Each host name given to Tspi_Context_Connect names a separate
+   version 1.2 TPM, whose PCRs start with known values.  Commands to
+   one TPM are performed one at a time, as on the device.  Keys are
+   real RSA keys, and quotes are real signatures, but a key blob
+   holds its private key in the clear, so keys made by the simulator
+   must never be trusted.
+
+   The simulation is controlled by the environment.
+
+   TPM_SIM_LATENCY
+       Microseconds added to each TPM command, given either as one
+       number, or as a list such as quote=300000,pcrread=2000,default=1000.
+       The commands are quote, quote2, pcrread, pcrextend, getrandom,
+       loadkey, createkey, and capability.
+   TPM_SIM_CONNECT_LATENCY
+       Microseconds added to each connection to a TPM.
+   TPM_SIM_VERSION
+       When 1.1, TPMs have 16 PCRs, and lack TPM_Quote2 and
+       TPM_CAP_VERSION_VAL.
+   TPM_SIM_KEYBITS
+       The size of generated keys, overriding the size requested.
+   TPM_SIM_DIR
+       A directory in which registered keys are kept, so that they
+       outlive the process.  Otherwise, keys are registered in memory
+       only.  All simulated hosts share one key registry. */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <tss/tspi.h>
+
+#if !defined HAVE_OPENSSL_RSA_LIB || !defined HAVE_PTHREAD_H
+#error "The TPM simulator requires OpenSSL and POSIX threads"
+#endif
+
+#include <pthread.h>
+/* The RSA_* interface is deprecated in OpenSSL 3.0, but it is the
+   only one shared by all the versions in use. */
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/bn.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#define MAXPCRS 24		/* PCRs in a version 1.2 TPM */
+#define SELECTSIZE (MAXPCRS / 8)
+#define DIGESTSIZE SHA_DIGEST_LENGTH
+#define KEYBITS 2048		/* Size of keys of default size */
+#define NAMESIZE 256		/* Longest host name kept */
+
+/* Commands with a latency of their own. */
+enum command {
+  CMD_QUOTE, CMD_QUOTE2, CMD_PCRREAD, CMD_PCREXTEND, CMD_GETRANDOM,
+  CMD_LOADKEY, CMD_CREATEKEY, CMD_CAPABILITY, NCOMMANDS
+};
+
+static const char *const command_names[NCOMMANDS] = {
+  "quote", "quote2", "pcrread", "pcrextend", "getrandom",
+  "loadkey", "createkey", "capability"
+};
+
+/* Settings read from the environment. */
+static struct {
+  unsigned long latency[NCOMMANDS]; /* Microseconds */
+  unsigned long connect;	/* Microseconds */
+  int v11;			/* Simulate version 1.1 TPMs */
+  int keybits;			/* Zero unless overridden */
+  const char *dir;		/* Key registry, or NULL */
+  UINT32 npcrs;
+} sim;
+
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+
+/* One simulated TPM.  TPMs are never freed. */
+struct tpm {
+  char *name;
+  pthread_mutex_t lock;		/* Held while performing a command */
+  BYTE pcrs[MAXPCRS][DIGESTSIZE];
+  struct tpm *next;
+};
+
+enum kind {
+  KIND_CONTEXT, KIND_TPM, KIND_POLICY, KIND_KEY, KIND_PCRS, KIND_HASH
+};
+
+/* Memory given to a caller, to be freed by Tspi_Context_FreeMemory. */
+struct block {
+  struct block *next;
+  struct block *prev;
+  union {
+    BYTE data[1];
+    double align;
+  } u;
+};
+
+struct context {
+  struct tpm *tpm;		/* NULL until connected */
+  TSS_HTPM hTPM;		/* Zero until asked for */
+  struct block *mem;
+};
+
+struct key {
+  UINT32 flags;			/* As given to Tspi_Context_CreateObject */
+  int srk;
+  RSA *rsa;			/* NULL until created or loaded */
+};
+
+struct pcrs {
+  UINT32 type;			/* TSS_PCRS_STRUCT_* */
+  UINT16 selectSize;
+  BYTE select[SELECTSIZE];
+  BYTE known[SELECTSIZE];	/* PCRs whose values are set */
+  BYTE values[MAXPCRS][DIGESTSIZE];
+};
+
+struct object {
+  enum kind kind;
+  TSS_HCONTEXT hContext;	/* The owner, or itself for a context */
+  TSS_HPOLICY hPolicy;		/* Usage policy of a key or TPM */
+  int ownPolicy;		/* hPolicy was made for this object */
+  union {
+    struct context context;
+    struct key key;
+    struct pcrs pcrs;
+    SHA_CTX sha;
+  } u;
+};
+
+/* A key registered under a UUID. */
+struct regkey {
+  TSS_UUID uuid;
+  BYTE *blob;
+  UINT32 blobLen;
+  struct regkey *next;
+};
+
+/* The lock guards everything but the state of each TPM. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct object **objects;	/* Indexed by handle - 1 */
+static UINT32 nobjects;
+static UINT32 first_free;	/* No free slot below this one */
+static struct tpm *tpms;
+static struct regkey *registry;
+
+/* Parses one latency setting, returning nonzero on error. */
+static int parse_latency(const char *s, unsigned long *usec)
+{
+  char *end;
+  errno = 0;
+  *usec = strtoul(s, &end, 10);
+  return errno || end == s || (*end && *end != ',');
+}
+
+static void read_latency(const char *value)
+{
+  unsigned long def = 0;
+  int set[NCOMMANDS] = { 0 };
+  const char *s = value;
+  while (s && *s) {
+    const char *eq = strchr(s, '=');
+    const char *comma = strchr(s, ',');
+    unsigned long usec;
+    if (!eq || (comma && comma < eq)) { /* A bare number */
+      if (parse_latency(s, &def))
+	goto bad;
+    }
+    else {
+      size_t len = eq - s;
+      if (parse_latency(eq + 1, &usec))
+	goto bad;
+      if (len == 7 && !strncmp(s, "default", len))
+	def = usec;
+      else {
+	int i;
+	for (i = 0; i < NCOMMANDS; i++)
+	  if (strlen(command_names[i]) == len
+	      && !strncmp(s, command_names[i], len))
+	    break;
+	if (i == NCOMMANDS)
+	  goto bad;
+	sim.latency[i] = usec;
+	set[i] = 1;
+      }
+    }
+    s = strchr(s, ',');
+    if (s)
+      s++;
+  }
+  int i;
+  for (i = 0; i < NCOMMANDS; i++)
+    if (!set[i])
+      sim.latency[i] = def;
+  return;
+
+ bad:
+  fprintf(stderr, "Ignoring bad TPM_SIM_LATENCY %s\n", value);
+  memset(sim.latency, 0, sizeof sim.latency);
+}
+
+static void sim_init(void)
+{
+  const char *value = getenv("TPM_SIM_LATENCY");
+  if (value)
+    read_latency(value);
+  value = getenv("TPM_SIM_CONNECT_LATENCY");
+  if (value && parse_latency(value, &sim.connect)) {
+    fprintf(stderr, "Ignoring bad TPM_SIM_CONNECT_LATENCY %s\n", value);
+    sim.connect = 0;
+  }
+  value = getenv("TPM_SIM_VERSION");
+  sim.v11 = value && !strcmp(value, "1.1");
+  sim.npcrs = sim.v11 ? 16 : MAXPCRS;
+  value = getenv("TPM_SIM_KEYBITS");
+  if (value)
+    sim.keybits = atoi(value);
+  value = getenv("TPM_SIM_DIR");
+  if (value && *value)
+    sim.dir = value;
+}
+
+static void delay(unsigned long usec)
+{
+  if (usec == 0)
+    return;
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = usec % 1000000 * 1000;
+  while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/* Starts a command, waiting for the TPM to finish the ones before
+   it, and then for the command's latency. */
+static void tpm_begin(struct tpm *tpm, enum command cmd)
+{
+  pthread_mutex_lock(&tpm->lock);
+  delay(sim.latency[cmd]);
+}
+
+static void tpm_end(struct tpm *tpm)
+{
+  pthread_mutex_unlock(&tpm->lock);
+}
+
+/* Finds or makes the TPM of a host.  Call with the lock held. */
+static struct tpm *find_tpm(const char *name)
+{
+  struct tpm *tpm;
+  for (tpm = tpms; tpm; tpm = tpm->next)
+    if (!strcmp(tpm->name, name))
+      return tpm;
+  tpm = calloc(1, sizeof *tpm);
+  if (!tpm || !(tpm->name = strdup(name))) {
+    free(tpm);
+    return NULL;
+  }
+  pthread_mutex_init(&tpm->lock, NULL);
+  /* PCRs 0 to 15 hold values a BIOS might have left.  The others
+     are reset to zero, as they are after a reboot. */
+  UINT32 i;
+  for (i = 0; i < sim.npcrs && i < 16; i++) {
+    char text[32];
+    snprintf(text, sizeof text, "simulated PCR %u", i);
+    SHA1((unsigned char *)text, strlen(text), tpm->pcrs[i]);
+  }
+  tpm->next = tpms;
+  tpms = tpm;
+  return tpm;
+}
+
+/* Handles */
+
+static struct object *get(TSS_HOBJECT h, enum kind kind)
+{
+  if (h == 0 || h > nobjects)
+    return NULL;
+  struct object *obj = objects[h - 1];
+  return obj && obj->kind == kind ? obj : NULL;
+}
+
+/* Makes an object owned by a context.  Call with the lock held. */
+static TSS_HOBJECT new_object(TSS_HCONTEXT hContext, enum kind kind)
+{
+  UINT32 i;
+  for (i = first_free; i < nobjects && objects[i]; i++);
+  if (i == nobjects) {
+    UINT32 n = nobjects ? 2 * nobjects : 64;
+    struct object **more = realloc(objects, n * sizeof *objects);
+    if (!more)
+      return 0;
+    memset(more + nobjects, 0, (n - nobjects) * sizeof *more);
+    objects = more;
+    nobjects = n;
+  }
+  struct object *obj = calloc(1, sizeof *obj);
+  if (!obj)
+    return 0;
+  obj->kind = kind;
+  obj->hContext = kind == KIND_CONTEXT ? i + 1 : hContext;
+  objects[i] = obj;
+  first_free = i + 1;
+  return i + 1;
+}
+
+/* Frees an object, and the policy made for it.  Call with the lock
+   held. */
+static void free_object(TSS_HOBJECT h)
+{
+  struct object *obj = objects[h - 1];
+  if (obj->ownPolicy && get(obj->hPolicy, KIND_POLICY))
+    free_object(obj->hPolicy);
+  if (obj->kind == KIND_KEY)
+    RSA_free(obj->u.key.rsa);
+  free(obj);
+  objects[h - 1] = NULL;
+  if (h - 1 < first_free)
+    first_free = h - 1;
+}
+
+/* Returns the connected context that owns an object.  Call with the
+   lock held. */
+static struct context *owner(struct object *obj)
+{
+  struct object *ctx = get(obj->hContext, KIND_CONTEXT);
+  return ctx && ctx->u.context.tpm ? &ctx->u.context : NULL;
+}
+
+/* Allocates memory to be freed with Tspi_Context_FreeMemory.  Call
+   with the lock held. */
+static BYTE *give(struct context *ctx, size_t size)
+{
+  struct block *b = malloc(offsetof(struct block, u) + (size ? size : 1));
+  if (!b)
+    return NULL;
+  b->prev = NULL;
+  b->next = ctx->mem;
+  if (b->next)
+    b->next->prev = b;
+  ctx->mem = b;
+  return b->u.data;
+}
+
+static void take_back(struct context *ctx, struct block *b)
+{
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    ctx->mem = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  free(b);
+}
+
+/* Blob encoding */
+
+static void load_uint16(BYTE **p, UINT16 v)
+{
+  (*p)[0] = v >> 8;
+  (*p)[1] = v;
+  *p += 2;
+}
+
+static void load_uint32(BYTE **p, UINT32 v)
+{
+  (*p)[0] = v >> 24;
+  (*p)[1] = v >> 16;
+  (*p)[2] = v >> 8;
+  (*p)[3] = v;
+  *p += 4;
+}
+
+static void load_bytes(BYTE **p, const BYTE *data, UINT32 len)
+{
+  memcpy(*p, data, len);
+  *p += len;
+}
+
+/* A bounded reader of blobs. */
+struct reader {
+  const BYTE *p;
+  UINT32 left;
+  int bad;			/* Set when reading past the end */
+};
+
+static const BYTE *unload(struct reader *r, UINT32 len)
+{
+  if (r->bad || r->left < len) {
+    r->bad = 1;
+    return NULL;
+  }
+  const BYTE *p = r->p;
+  r->p += len;
+  r->left -= len;
+  return p;
+}
+
+static UINT32 unload_uint32(struct reader *r)
+{
+  const BYTE *p = unload(r, 4);
+  return p ? (UINT32)p[0] << 24 | (UINT32)p[1] << 16
+    | (UINT32)p[2] << 8 | (UINT32)p[3] : 0;
+}
+
+static UINT16 unload_uint16(struct reader *r)
+{
+  const BYTE *p = unload(r, 2);
+  return p ? (UINT16)(p[0] << 8 | p[1]) : 0;
+}
+
+/* Keys */
+
+static const BIGNUM *rsa_n(RSA *rsa)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  return rsa->n;
+#else
+  const BIGNUM *n;
+  RSA_get0_key(rsa, &n, NULL, NULL);
+  return n;
+#endif
+}
+
+static TPM_KEY_USAGE key_usage(struct key *key)
+{
+  if (key->srk)
+    return TPM_KEY_STORAGE;
+  switch (key->flags & TSS_KEY_TYPE_BITMASK) {
+  case TSS_KEY_TYPE_SIGNING:
+    return TPM_KEY_SIGNING;
+  case TSS_KEY_TYPE_STORAGE:
+    return TPM_KEY_STORAGE;
+  case TSS_KEY_TYPE_IDENTITY:
+    return TPM_KEY_IDENTITY;
+  case TSS_KEY_TYPE_BIND:
+    return TPM_KEY_BIND;
+  default:
+    return TPM_KEY_LEGACY;
+  }
+}
+
+static UINT32 usage_flags(TPM_KEY_USAGE usage)
+{
+  switch (usage) {
+  case TPM_KEY_SIGNING:
+    return TSS_KEY_TYPE_SIGNING;
+  case TPM_KEY_STORAGE:
+    return TSS_KEY_TYPE_STORAGE;
+  case TPM_KEY_IDENTITY:
+    return TSS_KEY_TYPE_IDENTITY;
+  case TPM_KEY_BIND:
+    return TSS_KEY_TYPE_BIND;
+  default:
+    return TSS_KEY_TYPE_LEGACY;
+  }
+}
+
+static int can_sign(struct key *key)
+{
+  TPM_KEY_USAGE usage = key_usage(key);
+  return usage == TPM_KEY_SIGNING || usage == TPM_KEY_IDENTITY
+    || usage == TPM_KEY_LEGACY;
+}
+
+static int key_bits(struct key *key)
+{
+  if (sim.keybits > 0)
+    return sim.keybits;
+  switch (key->flags & TSS_KEY_SIZE_BITMASK) {
+  case TSS_KEY_SIZE_512:
+    return 512;
+  case TSS_KEY_SIZE_1024:
+    return 1024;
+  case TSS_KEY_SIZE_4096:
+    return 4096;
+  case TSS_KEY_SIZE_8192:
+    return 8192;
+  case TSS_KEY_SIZE_16384:
+    return 16384;
+  default:
+    return KEYBITS;
+  }
+}
+
+static RSA *generate(int bits)
+{
+  RSA *rsa = RSA_new();
+  BIGNUM *e = BN_new();
+  if (!rsa || !e || !BN_set_word(e, RSA_F4)
+      || !RSA_generate_key_ex(rsa, bits, e, NULL)) {
+    RSA_free(rsa);
+    rsa = NULL;
+  }
+  BN_free(e);
+  return rsa;
+}
+
+/* Serializes a key as a TPM_KEY, or when pub is set, as a
+   TPM_PUBKEY.  The encData of a TPM_KEY holds the DER encoded
+   private key, unencrypted.  The blob is malloc'd. */
+static BYTE *key_blob(struct key *key, int pub, UINT32 *len)
+{
+  TPM_KEY_USAGE usage = key_usage(key);
+  UINT16 encScheme = TPM_ES_NONE, sigScheme = TPM_SS_NONE;
+  if (usage == TPM_KEY_STORAGE || usage == TPM_KEY_BIND
+      || usage == TPM_KEY_LEGACY)
+    encScheme = TPM_ES_RSAESOAEP_SHA1_MGF1;
+  if (can_sign(key))
+    sigScheme = TPM_SS_RSASSAPKCS1v15_SHA1;
+
+  UINT32 modLen = RSA_size(key->rsa);
+  int encLen = pub ? 0 : i2d_RSAPrivateKey(key->rsa, NULL);
+  if (encLen < 0)
+    return NULL;
+  UINT32 size = 24 + 4 + modLen;
+  if (!pub)
+    size += 4 + 2 + 4 + 1 + 4 + 4 + encLen;
+  BYTE *blob = malloc(size);
+  if (!blob)
+    return NULL;
+
+  BYTE *p = blob;
+  if (!pub) {
+    static const BYTE version[] = { 1, 1, 0, 0 };
+    load_bytes(&p, version, sizeof version);
+    load_uint16(&p, usage);
+    load_uint32(&p, 0);		/* keyFlags */
+    load_bytes(&p, (BYTE[]){ key->flags & TSS_KEY_AUTHORIZATION
+	  ? TPM_AUTH_ALWAYS : TPM_AUTH_NEVER }, 1);
+  }
+  /* TPM_KEY_PARMS */
+  load_uint32(&p, TPM_ALG_RSA);
+  load_uint16(&p, encScheme);
+  load_uint16(&p, sigScheme);
+  load_uint32(&p, 12);		/* TPM_RSA_KEY_PARMS */
+  load_uint32(&p, modLen * 8);
+  load_uint32(&p, 2);		/* numPrimes */
+  load_uint32(&p, 0);		/* exponentSize, for 2^16 + 1 */
+  if (!pub)
+    load_uint32(&p, 0);		/* PCRInfoSize */
+  /* TPM_STORE_PUBKEY */
+  load_uint32(&p, modLen);
+  BN_bn2bin(rsa_n(key->rsa), p + modLen - BN_num_bytes(rsa_n(key->rsa)));
+  memset(p, 0, modLen - BN_num_bytes(rsa_n(key->rsa)));
+  p += modLen;
+  if (!pub) {
+    load_uint32(&p, encLen);
+    i2d_RSAPrivateKey(key->rsa, &p);
+  }
+  *len = size;
+  return blob;
+}
+
+/* Parses a TPM_KEY, or when pub is set, a TPM_PUBKEY, into a key.
+   Returns nonzero on error. */
+static int parse_key(struct key *key, int pub, const BYTE *blob, UINT32 len)
+{
+  struct reader r = { blob, len, 0 };
+  TPM_KEY_USAGE usage = TPM_KEY_LEGACY;
+  BYTE authDataUsage = TPM_AUTH_NEVER;
+  if (!pub) {
+    unload(&r, 4);		/* version */
+    usage = unload_uint16(&r);
+    unload_uint32(&r);		/* keyFlags */
+    const BYTE *auth = unload(&r, 1);
+    if (auth)
+      authDataUsage = *auth;
+  }
+  UINT32 alg = unload_uint32(&r);
+  unload(&r, 4);		/* Schemes */
+  UINT32 parmSize = unload_uint32(&r);
+  struct reader parms = { NULL, parmSize, 0 };
+  parms.p = unload(&r, parmSize);
+  parms.bad = r.bad;
+  unload_uint32(&parms);	/* keyLength */
+  unload_uint32(&parms);	/* numPrimes */
+  UINT32 exponentSize = unload_uint32(&parms);
+  const BYTE *exponent = unload(&parms, exponentSize);
+  if (!pub)
+    unload(&r, unload_uint32(&r)); /* PCRInfo */
+  UINT32 modLen = unload_uint32(&r);
+  const BYTE *modulus = unload(&r, modLen);
+  UINT32 encLen = pub ? 0 : unload_uint32(&r);
+  const BYTE *enc = unload(&r, encLen);
+  if (r.bad || parms.bad || alg != TPM_ALG_RSA || modLen == 0)
+    return 1;
+
+  RSA *rsa;
+  if (encLen > 0)
+    rsa = d2i_RSAPrivateKey(NULL, &enc, encLen);
+  else {
+    static const BYTE defaultExponent[] = { 0x01, 0x00, 0x01 };
+    if (exponentSize == 0) {
+      exponent = defaultExponent;
+      exponentSize = sizeof defaultExponent;
+    }
+    BIGNUM *n = BN_bin2bn(modulus, modLen, NULL);
+    BIGNUM *e = BN_bin2bn(exponent, exponentSize, NULL);
+    rsa = RSA_new();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (rsa && n && e) {
+      rsa->n = n;
+      rsa->e = e;
+      n = e = NULL;
+    }
+#else
+    if (rsa && n && e && RSA_set0_key(rsa, n, e, NULL))
+      n = e = NULL;
+#endif
+    if (n || e) {
+      BN_free(n);
+      BN_free(e);
+      RSA_free(rsa);
+      rsa = NULL;
+    }
+  }
+  if (!rsa)
+    return 1;
+  RSA_free(key->rsa);
+  key->rsa = rsa;
+  key->flags = usage_flags(usage)
+    | (authDataUsage != TPM_AUTH_NEVER ? TSS_KEY_AUTHORIZATION : 0);
+  return 0;
+}
+
+/* Makes a key object from a TPM_KEY blob.  Call with the lock
+   held. */
+static TSS_RESULT load_blob(TSS_HCONTEXT hContext, const BYTE *blob,
+			    UINT32 blobLen, TSS_HKEY *phKey)
+{
+  TSS_HKEY hKey = new_object(hContext, KIND_KEY);
+  if (!hKey)
+    return TSS_E_OUTOFMEMORY;
+  if (parse_key(&objects[hKey - 1]->u.key, 0, blob, blobLen)) {
+    free_object(hKey);
+    return TSS_E_BAD_PARAMETER;
+  }
+  *phKey = hKey;
+  return TSS_SUCCESS;
+}
+
+/* Key registry */
+
+static int is_srk(TSS_UUID *uuid)
+{
+  TSS_UUID srk = TSS_UUID_SRK;
+  return !memcmp(uuid, &srk, sizeof srk);
+}
+
+static void registry_file(TSS_UUID *uuid, char *name, size_t size)
+{
+  int n = snprintf(name, size, "%s/", sim.dir);
+  const BYTE *p = (const BYTE *)uuid;
+  size_t i;
+  for (i = 0; i < sizeof *uuid && n + 3 < (int)size; i++)
+    n += snprintf(name + n, size - n, "%02x", p[i]);
+}
+
+/* Finds a registered key, looking in the registry directory when
+   the key is not in memory.  Call with the lock held. */
+static struct regkey *find_key(TSS_UUID *uuid)
+{
+  struct regkey *k;
+  for (k = registry; k; k = k->next)
+    if (!memcmp(&k->uuid, uuid, sizeof *uuid))
+      return k;
+  if (!sim.dir)
+    return NULL;
+
+  char name[FILENAME_MAX];
+  registry_file(uuid, name, sizeof name);
+  FILE *in = fopen(name, "rb");
+  if (!in)
+    return NULL;
+  BYTE buf[1 << 14];
+  size_t len = fread(buf, 1, sizeof buf, in);
+  int bad = ferror(in) || !feof(in);
+  fclose(in);
+  if (bad || !(k = malloc(sizeof *k)))
+    return NULL;
+  if (!(k->blob = malloc(len))) {
+    free(k);
+    return NULL;
+  }
+  memcpy(k->blob, buf, len);
+  k->blobLen = len;
+  k->uuid = *uuid;
+  k->next = registry;
+  registry = k;
+  return k;
+}
+
+/* Contexts */
+
+TSS_RESULT Tspi_Context_Create(TSS_HCONTEXT *phContext)
+{
+  pthread_once(&sim_once, sim_init);
+  pthread_mutex_lock(&lock);
+  *phContext = new_object(0, KIND_CONTEXT);
+  pthread_mutex_unlock(&lock);
+  return *phContext ? TSS_SUCCESS : TSS_E_OUTOFMEMORY;
+}
+
+TSS_RESULT Tspi_Context_Close(TSS_HCONTEXT hContext)
+{
+  pthread_mutex_lock(&lock);
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  if (!ctx) {
+    pthread_mutex_unlock(&lock);
+    return TSS_E_INVALID_HANDLE;
+  }
+  UINT32 h;
+  for (h = 1; h <= nobjects; h++)
+    if (h != hContext && objects[h - 1]
+	&& objects[h - 1]->hContext == hContext)
+      free_object(h);
+  while (ctx->u.context.mem)
+    take_back(&ctx->u.context, ctx->u.context.mem);
+  free_object(hContext);
+  pthread_mutex_unlock(&lock);
+  return TSS_SUCCESS;
+}
+
+TSS_RESULT Tspi_Context_Connect(TSS_HCONTEXT hContext,
+				TSS_UNICODE *wszDestination)
+{
+  /* Host names are UTF-16LE.  Only their ASCII is kept. */
+  char name[NAMESIZE];
+  size_t i = 0;
+  if (wszDestination) {
+    const BYTE *p = (const BYTE *)wszDestination;
+    for (; i + 1 < sizeof name && (p[0] || p[1]); i++, p += 2)
+      name[i] = p[1] || p[0] > 0x7f ? '?' : p[0];
+  }
+  name[i] = 0;
+
+  delay(sim.connect);
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  if (!ctx)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!ctx->u.context.tpm && !(ctx->u.context.tpm = find_tpm(name)))
+    rc = TSS_E_OUTOFMEMORY;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_FreeMemory(TSS_HCONTEXT hContext, BYTE *rgbMemory)
+{
+  pthread_mutex_lock(&lock);
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  TSS_RESULT rc = TSS_SUCCESS;
+  if (!ctx)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!rgbMemory)
+    while (ctx->u.context.mem)
+      take_back(&ctx->u.context, ctx->u.context.mem);
+  else {
+    struct block *b;
+    for (b = ctx->u.context.mem; b && b->u.data != rgbMemory; b = b->next);
+    if (b)
+      take_back(&ctx->u.context, b);
+    else
+      rc = TSS_E_BAD_PARAMETER;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_CreateObject(TSS_HCONTEXT hContext,
+				     TSS_FLAG objectType,
+				     TSS_FLAG initFlags,
+				     TSS_HOBJECT *phObject)
+{
+  enum kind kind;
+  switch (objectType) {
+  case TSS_OBJECT_TYPE_POLICY:
+    kind = KIND_POLICY;
+    break;
+  case TSS_OBJECT_TYPE_RSAKEY:
+    kind = KIND_KEY;
+    break;
+  case TSS_OBJECT_TYPE_PCRS:
+    kind = KIND_PCRS;
+    if (initFlags != TSS_PCRS_STRUCT_DEFAULT
+	&& initFlags != TSS_PCRS_STRUCT_INFO
+	&& initFlags != TSS_PCRS_STRUCT_INFO_LONG
+	&& initFlags != TSS_PCRS_STRUCT_INFO_SHORT)
+      return TSS_E_INVALID_OBJECT_INITFLAG;
+    break;
+  case TSS_OBJECT_TYPE_HASH:
+    kind = KIND_HASH;
+    if (initFlags != TSS_HASH_DEFAULT && initFlags != TSS_HASH_SHA1)
+      return TSS_E_INVALID_OBJECT_INITFLAG;
+    break;
+  default:
+    return TSS_E_INVALID_OBJECT_TYPE;
+  }
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  TSS_HOBJECT h = 0;
+  if (!get(hContext, KIND_CONTEXT))
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!(h = new_object(hContext, kind)))
+    rc = TSS_E_OUTOFMEMORY;
+  else {
+    struct object *obj = objects[h - 1];
+    switch (kind) {
+    case KIND_KEY:
+      obj->u.key.flags = initFlags;
+      obj->u.key.srk = (initFlags & TSS_KEY_TSP_SRK) != 0;
+      break;
+    case KIND_PCRS:
+      obj->u.pcrs.type = initFlags == TSS_PCRS_STRUCT_DEFAULT
+	? TSS_PCRS_STRUCT_INFO : initFlags;
+      /* TPM_Quote selections cover the PCRs of a version 1.1 TPM
+	 until a higher PCR is selected. */
+      obj->u.pcrs.selectSize = obj->u.pcrs.type == TSS_PCRS_STRUCT_INFO
+	? 2 : SELECTSIZE;
+      break;
+    case KIND_HASH:
+      SHA1_Init(&obj->u.sha);
+      break;
+    default:
+      break;
+    }
+    *phObject = h;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_CloseObject(TSS_HCONTEXT hContext,
+				    TSS_HOBJECT hObject)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  if (!get(hContext, KIND_CONTEXT) || hObject == hContext
+      || hObject == 0 || hObject > nobjects || !objects[hObject - 1]
+      || objects[hObject - 1]->hContext != hContext)
+    rc = TSS_E_INVALID_HANDLE;
+  else {
+    struct context *ctx = &objects[hContext - 1]->u.context;
+    if (ctx->hTPM == hObject)
+      ctx->hTPM = 0;
+    free_object(hObject);
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_GetTpmObject(TSS_HCONTEXT hContext, TSS_HTPM *phTPM)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  if (!ctx)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!ctx->u.context.tpm)
+    rc = TSS_E_NO_CONNECTION;
+  else if (!ctx->u.context.hTPM
+	   && !(ctx->u.context.hTPM = new_object(hContext, KIND_TPM)))
+    rc = TSS_E_OUTOFMEMORY;
+  else
+    *phTPM = ctx->u.context.hTPM;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Makes the SRK object, which has no key material, as key blobs are
+   not encrypted. */
+static TSS_RESULT load_srk(TSS_HCONTEXT hContext, TSS_HKEY *phKey)
+{
+  TSS_HKEY hKey = new_object(hContext, KIND_KEY);
+  if (!hKey)
+    return TSS_E_OUTOFMEMORY;
+  objects[hKey - 1]->u.key.srk = 1;
+  objects[hKey - 1]->u.key.flags = TSS_KEY_TYPE_STORAGE;
+  *phKey = hKey;
+  return TSS_SUCCESS;
+}
+
+TSS_RESULT Tspi_Context_LoadKeyByUUID(TSS_HCONTEXT hContext,
+				      TSS_FLAG persistentStorageType,
+				      TSS_UUID uuidData,
+				      TSS_HKEY *phKey)
+{
+  pthread_mutex_lock(&lock);
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  struct tpm *tpm = ctx ? ctx->u.context.tpm : NULL;
+  pthread_mutex_unlock(&lock);
+  if (!ctx)
+    return TSS_E_INVALID_HANDLE;
+  if (!tpm)
+    return TSS_E_NO_CONNECTION;
+
+  tpm_begin(tpm, CMD_LOADKEY);
+  tpm_end(tpm);
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc;
+  struct regkey *k;
+  if (!get(hContext, KIND_CONTEXT))
+    rc = TSS_E_INVALID_HANDLE;
+  else if (is_srk(&uuidData))
+    rc = load_srk(hContext, phKey);
+  else if (!(k = find_key(&uuidData)))
+    rc = TSS_E_PS_KEY_NOTFOUND;
+  else
+    rc = load_blob(hContext, k->blob, k->blobLen, phKey);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_LoadKeyByBlob(TSS_HCONTEXT hContext,
+				      TSS_HKEY hUnwrappingKey,
+				      UINT32 ulBlobLength,
+				      BYTE *rgbBlobData,
+				      TSS_HKEY *phKey)
+{
+  pthread_mutex_lock(&lock);
+  struct object *ctx = get(hContext, KIND_CONTEXT);
+  struct tpm *tpm = ctx ? ctx->u.context.tpm : NULL;
+  int bad = !get(hUnwrappingKey, KIND_KEY);
+  pthread_mutex_unlock(&lock);
+  if (!ctx || bad)
+    return TSS_E_INVALID_HANDLE;
+  if (!tpm)
+    return TSS_E_NO_CONNECTION;
+
+  tpm_begin(tpm, CMD_LOADKEY);
+  tpm_end(tpm);
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = get(hContext, KIND_CONTEXT)
+    ? load_blob(hContext, rgbBlobData, ulBlobLength, phKey)
+    : TSS_E_INVALID_HANDLE;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_RegisterKey(TSS_HCONTEXT hContext,
+				    TSS_HKEY hKey,
+				    TSS_FLAG persistentStorageType,
+				    TSS_UUID uuidKey,
+				    TSS_FLAG persistentStorageTypeParent,
+				    TSS_UUID uuidParentKey)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *key = get(hKey, KIND_KEY);
+  struct regkey *k = NULL;
+  if (!get(hContext, KIND_CONTEXT) || !key)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!key->u.key.rsa || is_srk(&uuidKey))
+    rc = TSS_E_BAD_PARAMETER;
+  else if (find_key(&uuidKey))
+    rc = TSS_E_KEY_ALREADY_REGISTERED;
+  else if (!(k = calloc(1, sizeof *k))
+	   || !(k->blob = key_blob(&key->u.key, 0, &k->blobLen))) {
+    free(k);
+    rc = TSS_E_OUTOFMEMORY;
+  }
+  else {
+    k->uuid = uuidKey;
+    if (sim.dir) {
+      char name[FILENAME_MAX];
+      registry_file(&uuidKey, name, sizeof name);
+      FILE *out = fopen(name, "wb");
+      if (!out || fwrite(k->blob, 1, k->blobLen, out) != k->blobLen)
+	rc = TSS_E_PS_KEY_NOTFOUND; /* No better code for a write error */
+      if (out && fclose(out))
+	rc = TSS_E_PS_KEY_NOTFOUND;
+    }
+    if (rc == TSS_SUCCESS) {
+      k->next = registry;
+      registry = k;
+    }
+    else {
+      free(k->blob);
+      free(k);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_Context_UnregisterKey(TSS_HCONTEXT hContext,
+				      TSS_FLAG persistentStorageType,
+				      TSS_UUID uuidKey,
+				      TSS_HKEY *phkey)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc;
+  struct regkey *k = NULL;
+  if (!get(hContext, KIND_CONTEXT))
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!(k = find_key(&uuidKey)))
+    rc = TSS_E_PS_KEY_NOTFOUND;
+  else if ((rc = load_blob(hContext, k->blob, k->blobLen, phkey))
+	   == TSS_SUCCESS) {
+    struct regkey **p;
+    for (p = &registry; *p != k; p = &(*p)->next);
+    *p = k->next;
+    free(k->blob);
+    free(k);
+    if (sim.dir) {
+      char name[FILENAME_MAX];
+      registry_file(&uuidKey, name, sizeof name);
+      remove(name);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Policies */
+
+TSS_RESULT Tspi_GetPolicyObject(TSS_HOBJECT hObject,
+				TSS_FLAG policyType,
+				TSS_HPOLICY *phPolicy)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *obj = get(hObject, KIND_KEY);
+  if (!obj)
+    obj = get(hObject, KIND_TPM);
+  if (!obj)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!obj->hPolicy || !get(obj->hPolicy, KIND_POLICY)) {
+    obj->hPolicy = new_object(obj->hContext, KIND_POLICY);
+    obj->ownPolicy = 1;
+    if (!obj->hPolicy)
+      rc = TSS_E_OUTOFMEMORY;
+  }
+  if (rc == TSS_SUCCESS)
+    *phPolicy = obj->hPolicy;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Secrets are accepted, but never checked. */
+TSS_RESULT Tspi_Policy_SetSecret(TSS_HPOLICY hPolicy,
+				 TSS_FLAG secretMode,
+				 UINT32 ulSecretLength,
+				 BYTE *rgbSecret)
+{
+  pthread_mutex_lock(&lock);
+  int bad = !get(hPolicy, KIND_POLICY);
+  pthread_mutex_unlock(&lock);
+  return bad ? TSS_E_INVALID_HANDLE : TSS_SUCCESS;
+}
+
+TSS_RESULT Tspi_Policy_AssignToObject(TSS_HPOLICY hPolicy,
+				      TSS_HOBJECT hObject)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *obj = get(hObject, KIND_KEY);
+  if (!obj)
+    obj = get(hObject, KIND_TPM);
+  if (!obj || !get(hPolicy, KIND_POLICY))
+    rc = TSS_E_INVALID_HANDLE;
+  else {
+    if (obj->ownPolicy && obj->hPolicy != hPolicy
+	&& get(obj->hPolicy, KIND_POLICY))
+      free_object(obj->hPolicy);
+    obj->hPolicy = hPolicy;
+    obj->ownPolicy = 0;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Key attributes */
+
+TSS_RESULT Tspi_SetAttribData(TSS_HOBJECT hObject,
+			      TSS_FLAG attribFlag,
+			      TSS_FLAG subFlag,
+			      UINT32 ulAttribDataSize,
+			      BYTE *rgbAttribData)
+{
+  if (attribFlag != TSS_TSPATTRIB_KEY_BLOB)
+    return TSS_E_INVALID_ATTRIB_FLAG;
+  if (subFlag != TSS_TSPATTRIB_KEYBLOB_BLOB
+      && subFlag != TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY)
+    return TSS_E_INVALID_ATTRIB_SUBFLAG;
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *key = get(hObject, KIND_KEY);
+  if (!key)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (parse_key(&key->u.key, subFlag == TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
+		     rgbAttribData, ulAttribDataSize))
+    rc = TSS_E_INVALID_ATTRIB_DATA;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_GetAttribData(TSS_HOBJECT hObject,
+			      TSS_FLAG attribFlag,
+			      TSS_FLAG subFlag,
+			      UINT32 *pulAttribDataSize,
+			      BYTE **prgbAttribData)
+{
+  if (attribFlag != TSS_TSPATTRIB_KEY_BLOB)
+    return TSS_E_INVALID_ATTRIB_FLAG;
+  if (subFlag != TSS_TSPATTRIB_KEYBLOB_BLOB
+      && subFlag != TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY)
+    return TSS_E_INVALID_ATTRIB_SUBFLAG;
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *key = get(hObject, KIND_KEY);
+  struct context *ctx = key ? owner(key) : NULL;
+  BYTE *blob = NULL;
+  UINT32 blobLen;
+  if (!key || !ctx)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!key->u.key.rsa)
+    rc = TSS_E_KEY_NOT_LOADED;
+  else if (!(blob = key_blob(&key->u.key,
+			     subFlag == TSS_TSPATTRIB_KEYBLOB_PUBLIC_KEY,
+			     &blobLen))
+	   || !(*prgbAttribData = give(ctx, blobLen)))
+    rc = TSS_E_OUTOFMEMORY;
+  else {
+    memcpy(*prgbAttribData, blob, blobLen);
+    *pulAttribDataSize = blobLen;
+  }
+  free(blob);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Generates the RSA key of a key object. */
+static TSS_RESULT create_key(TSS_HKEY hKey, struct tpm *tpm)
+{
+  pthread_mutex_lock(&lock);
+  struct object *key = get(hKey, KIND_KEY);
+  int bits = key ? key_bits(&key->u.key) : 0;
+  pthread_mutex_unlock(&lock);
+  if (!key)
+    return TSS_E_INVALID_HANDLE;
+
+  tpm_begin(tpm, CMD_CREATEKEY);
+  RSA *rsa = generate(bits);
+  tpm_end(tpm);
+  if (!rsa)
+    return TSS_E_INTERNAL_ERROR;
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  if (!(key = get(hKey, KIND_KEY))) {
+    RSA_free(rsa);
+    rc = TSS_E_INVALID_HANDLE;
+  }
+  else {
+    RSA_free(key->u.key.rsa);
+    key->u.key.rsa = rsa;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Returns the TPM of a connected object.  Call with the lock held. */
+static struct tpm *object_tpm(TSS_HOBJECT h, enum kind kind)
+{
+  struct object *obj = get(h, kind);
+  struct context *ctx = obj ? owner(obj) : NULL;
+  return ctx ? ctx->tpm : NULL;
+}
+
+TSS_RESULT Tspi_Key_CreateKey(TSS_HKEY hKey,
+			      TSS_HKEY hWrappingKey,
+			      TSS_HPCRS hPcrComposite)
+{
+  pthread_mutex_lock(&lock);
+  struct tpm *tpm = object_tpm(hKey, KIND_KEY);
+  int bad = !get(hWrappingKey, KIND_KEY);
+  pthread_mutex_unlock(&lock);
+  if (!tpm || bad)
+    return TSS_E_INVALID_HANDLE;
+  return create_key(hKey, tpm);
+}
+
+/* Hashes */
+
+TSS_RESULT Tspi_Hash_UpdateHashValue(TSS_HHASH hHash,
+				     UINT32 ulDataLength,
+				     BYTE *rgbData)
+{
+  pthread_mutex_lock(&lock);
+  struct object *hash = get(hHash, KIND_HASH);
+  if (hash)
+    SHA1_Update(&hash->u.sha, rgbData, ulDataLength);
+  pthread_mutex_unlock(&lock);
+  return hash ? TSS_SUCCESS : TSS_E_INVALID_HANDLE;
+}
+
+TSS_RESULT Tspi_Hash_VerifySignature(TSS_HHASH hHash,
+				     TSS_HKEY hKey,
+				     UINT32 ulSignatureLength,
+				     BYTE *rgbSignature)
+{
+  pthread_mutex_lock(&lock);
+  struct object *hash = get(hHash, KIND_HASH);
+  struct object *key = get(hKey, KIND_KEY);
+  RSA *rsa = NULL;
+  SHA_CTX sha;
+  if (hash && key && key->u.key.rsa) {
+    sha = hash->u.sha;
+    rsa = key->u.key.rsa;
+    RSA_up_ref(rsa);
+  }
+  pthread_mutex_unlock(&lock);
+  if (!hash || !key)
+    return TSS_E_INVALID_HANDLE;
+  if (!rsa)
+    return TSS_E_KEY_NOT_LOADED;
+
+  BYTE digest[DIGESTSIZE];
+  SHA1_Final(digest, &sha);
+  int ok = RSA_verify(NID_sha1, digest, sizeof digest,
+		      rgbSignature, ulSignatureLength, rsa);
+  RSA_free(rsa);
+  return ok == 1 ? TSS_SUCCESS : TSS_E_FAIL;
+}
+
+/* PCR composites */
+
+static TSS_RESULT select_pcr(TSS_HPCRS hPcrComposite, UINT32 ulPcrIndex)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *obj = get(hPcrComposite, KIND_PCRS);
+  if (!obj)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (ulPcrIndex >= sim.npcrs)
+    rc = TSS_E_BAD_PARAMETER;
+  else {
+    struct pcrs *pcrs = &obj->u.pcrs;
+    pcrs->select[ulPcrIndex / 8] |= 1 << ulPcrIndex % 8;
+    if (pcrs->selectSize <= ulPcrIndex / 8)
+      pcrs->selectSize = ulPcrIndex / 8 + 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_PcrComposite_SelectPcrIndex(TSS_HPCRS hPcrComposite,
+					    UINT32 ulPcrIndex)
+{
+  return select_pcr(hPcrComposite, ulPcrIndex);
+}
+
+TSS_RESULT Tspi_PcrComposite_SelectPcrIndexEx(TSS_HPCRS hPcrComposite,
+					      UINT32 ulPcrIndex,
+					      UINT32 direction)
+{
+  return select_pcr(hPcrComposite, ulPcrIndex);
+}
+
+TSS_RESULT Tspi_PcrComposite_GetPcrValue(TSS_HPCRS hPcrComposite,
+					 UINT32 ulPcrIndex,
+					 UINT32 *pulPcrValueLength,
+					 BYTE **prgbPcrValue)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *obj = get(hPcrComposite, KIND_PCRS);
+  struct context *ctx = obj ? owner(obj) : NULL;
+  if (!obj || !ctx)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (ulPcrIndex >= MAXPCRS
+	   || !(obj->u.pcrs.known[ulPcrIndex / 8] & 1 << ulPcrIndex % 8))
+    rc = TSS_E_BAD_PARAMETER;
+  else if (!(*prgbPcrValue = give(ctx, DIGESTSIZE)))
+    rc = TSS_E_OUTOFMEMORY;
+  else {
+    memcpy(*prgbPcrValue, obj->u.pcrs.values[ulPcrIndex], DIGESTSIZE);
+    *pulPcrValueLength = DIGESTSIZE;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* TPM commands */
+
+/* Looks up the TPM of a TPM object.  Call with the lock held. */
+static struct tpm *get_tpm(TSS_HTPM hTPM, struct context **ctx)
+{
+  struct object *obj = get(hTPM, KIND_TPM);
+  *ctx = obj ? owner(obj) : NULL;
+  return *ctx ? (*ctx)->tpm : NULL;
+}
+
+/* Copies a block of memory to be freed by the caller with
+   Tspi_Context_FreeMemory.  Call with the lock held. */
+static TSS_RESULT give_copy(TSS_HOBJECT hObject, enum kind kind,
+			    const BYTE *data, UINT32 len,
+			    UINT32 *pLen, BYTE **pData)
+{
+  struct object *obj = get(hObject, kind);
+  struct context *ctx = obj ? owner(obj) : NULL;
+  if (!ctx)
+    return TSS_E_INVALID_HANDLE;
+  if (!(*pData = give(ctx, len)))
+    return TSS_E_OUTOFMEMORY;
+  memcpy(*pData, data, len);
+  if (pLen)
+    *pLen = len;
+  return TSS_SUCCESS;
+}
+
+/* Writes a TPM_CAP_VERSION_INFO, returning its length. */
+static UINT32 version_info(BYTE *buf)
+{
+  static const BYTE version[] = { 1, 2, 0, 0 };
+  BYTE *p = buf;
+  load_uint16(&p, TPM_TAG_CAP_VERSION_INFO);
+  load_bytes(&p, version, sizeof version);
+  load_uint16(&p, 2);		/* specLevel */
+  load_bytes(&p, (const BYTE *)"\3SIM ", 5); /* errataRev and vendor */
+  load_uint16(&p, 0);		/* vendorSpecificSize */
+  return p - buf;
+}
+
+TSS_RESULT Tspi_TPM_GetCapability(TSS_HTPM hTPM,
+				  TSS_FLAG capArea,
+				  UINT32 ulSubCapLength,
+				  BYTE *rgbSubCap,
+				  UINT32 *pulRespDataLength,
+				  BYTE **prgbRespData)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  struct tpm *tpm = get_tpm(hTPM, &ctx);
+  pthread_mutex_unlock(&lock);
+  if (!tpm)
+    return TSS_E_INVALID_HANDLE;
+
+  BYTE buf[64];
+  UINT32 len;
+  TSS_RESULT rc = TSS_SUCCESS;
+  tpm_begin(tpm, CMD_CAPABILITY);
+  switch (capArea) {
+  case TSS_TPMCAP_VERSION:
+    memcpy(buf, (BYTE[]){ 1, 1, 0, 0 }, 4);
+    len = 4;
+    break;
+  case TSS_TPMCAP_VERSION_VAL:
+    if (sim.v11)
+      rc = TPM_E_BAD_MODE;
+    else
+      len = version_info(buf);
+    break;
+  case TSS_TPMCAP_PROPERTY:
+    if (ulSubCapLength != sizeof(UINT32)
+	|| *(UINT32 *)rgbSubCap != TSS_TPMCAP_PROP_PCR)
+      rc = TSS_E_BAD_PARAMETER;
+    else {
+      memcpy(buf, &sim.npcrs, sizeof sim.npcrs);
+      len = sizeof sim.npcrs;
+    }
+    break;
+  default:
+    rc = TSS_E_BAD_PARAMETER;
+    break;
+  }
+  tpm_end(tpm);
+  if (rc != TSS_SUCCESS)
+    return rc;
+
+  pthread_mutex_lock(&lock);
+  rc = give_copy(hTPM, KIND_TPM, buf, len, pulRespDataLength, prgbRespData);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* The parts of a quote request that outlive the lock. */
+struct quote_args {
+  struct tpm *tpm;
+  RSA *rsa;
+  UINT16 selectSize;
+  BYTE select[SELECTSIZE];
+};
+
+/* Collects the arguments of a quote, taking a reference to the key.
+   Call with the lock held. */
+static TSS_RESULT quote_args(TSS_HTPM hTPM, TSS_HKEY hIdentKey,
+			     TSS_HPCRS hPcrComposite, TSS_VALIDATION *valid,
+			     struct quote_args *args)
+{
+  struct context *ctx;
+  struct object *key = get(hIdentKey, KIND_KEY);
+  struct object *pcrs = get(hPcrComposite, KIND_PCRS);
+  if (!(args->tpm = get_tpm(hTPM, &ctx)) || !key || !pcrs)
+    return TSS_E_INVALID_HANDLE;
+  if (!valid || valid->ulExternalDataLength != sizeof(TPM_NONCE)
+      || !valid->rgbExternalData)
+    return TSS_E_BAD_PARAMETER;
+  if (!key->u.key.rsa)
+    return TSS_E_KEY_NOT_LOADED;
+  if (!can_sign(&key->u.key))
+    return TPM_E_INVALID_KEYUSAGE;
+  args->rsa = key->u.key.rsa;
+  RSA_up_ref(args->rsa);
+  args->selectSize = pcrs->u.pcrs.selectSize;
+  memcpy(args->select, pcrs->u.pcrs.select, sizeof args->select);
+  return TSS_SUCCESS;
+}
+
+/* Hashes the TPM_PCR_COMPOSITE of the selected PCRs.  Call while
+   performing a command. */
+static void composite_hash(struct tpm *tpm, struct quote_args *args,
+			   BYTE *digest)
+{
+  BYTE header[2 + SELECTSIZE + 4];
+  BYTE *p = header;
+  UINT32 i, n = 0;
+  for (i = 0; i < MAXPCRS; i++)
+    if (args->select[i / 8] & 1 << i % 8)
+      n++;
+  load_uint16(&p, args->selectSize);
+  load_bytes(&p, args->select, args->selectSize);
+  load_uint32(&p, n * DIGESTSIZE);
+  SHA_CTX sha;
+  SHA1_Init(&sha);
+  SHA1_Update(&sha, header, p - header);
+  for (i = 0; i < MAXPCRS; i++)
+    if (args->select[i / 8] & 1 << i % 8)
+      SHA1_Update(&sha, tpm->pcrs[i], DIGESTSIZE);
+  SHA1_Final(digest, &sha);
+}
+
+/* Signs the data of a quote, and hands it and the signature to the
+   caller. */
+static TSS_RESULT finish_quote(TSS_HTPM hTPM, struct quote_args *args,
+			       BYTE *data, UINT32 dataLen,
+			       TSS_VALIDATION *valid)
+{
+  BYTE digest[DIGESTSIZE];
+  SHA1(data, dataLen, digest);
+  UINT32 sigLen = RSA_size(args->rsa);
+  BYTE sig[sigLen];
+  int ok = RSA_sign(NID_sha1, digest, sizeof digest, sig, &sigLen,
+		    args->rsa);
+  RSA_free(args->rsa);
+  if (ok != 1)
+    return TSS_E_INTERNAL_ERROR;
+
+  pthread_mutex_lock(&lock);
+  BYTE *rgbData;
+  TSS_RESULT rc = give_copy(hTPM, KIND_TPM, data, dataLen, NULL, &rgbData);
+  if (rc == TSS_SUCCESS) {
+    rc = give_copy(hTPM, KIND_TPM, sig, sigLen, NULL,
+		   &valid->rgbValidationData);
+    if (rc == TSS_SUCCESS) {
+      valid->rgbData = rgbData;
+      valid->ulDataLength = dataLen;
+      valid->ulValidationDataLength = sigLen;
+      valid->versionInfo.bMajor = 1;
+      valid->versionInfo.bMinor = 1;
+      valid->versionInfo.bRevMajor = 0;
+      valid->versionInfo.bRevMinor = 0;
+    }
+    else
+      take_back(owner(get(hTPM, KIND_TPM)),
+		(struct block *)(rgbData - offsetof(struct block, u)));
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_TPM_Quote(TSS_HTPM hTPM,
+			  TSS_HKEY hIdentKey,
+			  TSS_HPCRS hPcrComposite,
+			  TSS_VALIDATION *pValidationData)
+{
+  struct quote_args args;
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = quote_args(hTPM, hIdentKey, hPcrComposite,
+			     pValidationData, &args);
+  pthread_mutex_unlock(&lock);
+  if (rc != TSS_SUCCESS)
+    return rc;
+
+  /* TPM_QUOTE_INFO */
+  BYTE info[48];
+  BYTE *p = info;
+  BYTE values[MAXPCRS][DIGESTSIZE];
+  load_bytes(&p, (const BYTE *)"\1\1\0\0QUOT", 8);
+  tpm_begin(args.tpm, CMD_QUOTE);
+  composite_hash(args.tpm, &args, p);
+  memcpy(values, args.tpm->pcrs, sizeof values);
+  tpm_end(args.tpm);
+  p += DIGESTSIZE;
+  load_bytes(&p, pValidationData->rgbExternalData, sizeof(TPM_NONCE));
+
+  /* The TSS keeps the quoted values in the composite object */
+  pthread_mutex_lock(&lock);
+  struct object *obj = get(hPcrComposite, KIND_PCRS);
+  if (obj) {
+    UINT32 i;
+    for (i = 0; i < MAXPCRS; i++)
+      if (args.select[i / 8] & 1 << i % 8)
+	memcpy(obj->u.pcrs.values[i], values[i], DIGESTSIZE);
+    memcpy(obj->u.pcrs.known, args.select, sizeof args.select);
+  }
+  pthread_mutex_unlock(&lock);
+
+  return finish_quote(hTPM, &args, info, sizeof info, pValidationData);
+}
+
+TSS_RESULT Tspi_TPM_Quote2(TSS_HTPM hTPM,
+			   TSS_HKEY hIdentKey,
+			   TSS_BOOL fAddVersion,
+			   TSS_HPCRS hPcrComposite,
+			   TSS_VALIDATION *pValidationData,
+			   UINT32 *versionInfoSize,
+			   BYTE **versionInfo)
+{
+  if (sim.v11)
+    return TPM_E_BAD_ORDINAL;
+  struct quote_args args;
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = quote_args(hTPM, hIdentKey, hPcrComposite,
+			     pValidationData, &args);
+  pthread_mutex_unlock(&lock);
+  if (rc != TSS_SUCCESS)
+    return rc;
+  args.selectSize = SELECTSIZE;	/* Always all of the PCRs */
+
+  /* TPM_QUOTE_INFO2, followed by the version when asked for */
+  BYTE info[52 + 64];
+  BYTE *p = info;
+  load_uint16(&p, TPM_TAG_QUOTE_INFO2);
+  load_bytes(&p, (const BYTE *)"QUT2", 4);
+  load_bytes(&p, pValidationData->rgbExternalData, sizeof(TPM_NONCE));
+  load_uint16(&p, args.selectSize);
+  load_bytes(&p, args.select, args.selectSize);
+  load_bytes(&p, (const BYTE *)"\1", 1); /* localityAtRelease, locality 0 */
+  tpm_begin(args.tpm, CMD_QUOTE2);
+  composite_hash(args.tpm, &args, p);
+  tpm_end(args.tpm);
+  p += DIGESTSIZE;
+
+  UINT32 infoLen = p - info;
+  UINT32 versionLen = 0;
+  if (fAddVersion)
+    versionLen = version_info(p);
+  rc = finish_quote(hTPM, &args, info, infoLen + versionLen,
+		    pValidationData);
+  if (rc != TSS_SUCCESS || !versionInfoSize || !versionInfo)
+    return rc;
+
+  *versionInfoSize = 0;
+  *versionInfo = NULL;
+  if (fAddVersion) {
+    pthread_mutex_lock(&lock);
+    rc = give_copy(hTPM, KIND_TPM, p, versionLen,
+		   versionInfoSize, versionInfo);
+    pthread_mutex_unlock(&lock);
+  }
+  return rc;
+}
+
+TSS_RESULT Tspi_TPM_PcrRead(TSS_HTPM hTPM,
+			    UINT32 ulPcrIndex,
+			    UINT32 *pulPcrValueLength,
+			    BYTE **prgbPcrValue)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  struct tpm *tpm = get_tpm(hTPM, &ctx);
+  pthread_mutex_unlock(&lock);
+  if (!tpm)
+    return TSS_E_INVALID_HANDLE;
+  if (ulPcrIndex >= sim.npcrs)
+    return TPM_E_BADINDEX;
+
+  BYTE value[DIGESTSIZE];
+  tpm_begin(tpm, CMD_PCRREAD);
+  memcpy(value, tpm->pcrs[ulPcrIndex], sizeof value);
+  tpm_end(tpm);
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = give_copy(hTPM, KIND_TPM, value, sizeof value,
+			    pulPcrValueLength, prgbPcrValue);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* Extends a PCR with the SHA-1 hash of the data.  The event, when
+   given, is not logged. */
+TSS_RESULT Tspi_TPM_PcrExtend(TSS_HTPM hTPM,
+			      UINT32 ulPcrIndex,
+			      UINT32 ulPcrDataLength,
+			      BYTE *pbPcrData,
+			      TSS_PCR_EVENT *pPcrEvent,
+			      UINT32 *pulPcrValueLength,
+			      BYTE **prgbPcrValue)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  struct tpm *tpm = get_tpm(hTPM, &ctx);
+  pthread_mutex_unlock(&lock);
+  if (!tpm)
+    return TSS_E_INVALID_HANDLE;
+  if (ulPcrIndex >= sim.npcrs)
+    return TPM_E_BADINDEX;
+
+  BYTE buf[2 * DIGESTSIZE];
+  SHA1(pbPcrData, ulPcrDataLength, buf + DIGESTSIZE);
+  BYTE value[DIGESTSIZE];
+  tpm_begin(tpm, CMD_PCREXTEND);
+  memcpy(buf, tpm->pcrs[ulPcrIndex], DIGESTSIZE);
+  SHA1(buf, sizeof buf, tpm->pcrs[ulPcrIndex]);
+  memcpy(value, tpm->pcrs[ulPcrIndex], sizeof value);
+  tpm_end(tpm);
+
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = give_copy(hTPM, KIND_TPM, value, sizeof value,
+			    pulPcrValueLength, prgbPcrValue);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_TPM_GetRandom(TSS_HTPM hTPM,
+			      UINT32 ulRandomDataLength,
+			      BYTE **prgbRandomData)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  struct tpm *tpm = get_tpm(hTPM, &ctx);
+  pthread_mutex_unlock(&lock);
+  if (!tpm)
+    return TSS_E_INVALID_HANDLE;
+
+  BYTE *data = malloc(ulRandomDataLength ? ulRandomDataLength : 1);
+  if (!data)
+    return TSS_E_OUTOFMEMORY;
+  tpm_begin(tpm, CMD_GETRANDOM);
+  int ok = RAND_bytes(data, ulRandomDataLength);
+  tpm_end(tpm);
+
+  TSS_RESULT rc = TSS_E_INTERNAL_ERROR;
+  if (ok == 1) {
+    pthread_mutex_lock(&lock);
+    rc = give_copy(hTPM, KIND_TPM, data, ulRandomDataLength,
+		   NULL, prgbRandomData);
+    pthread_mutex_unlock(&lock);
+  }
+  free(data);
+  return rc;
+}
+
+/* Ownership is not simulated, so the owner's commands just check
+   their handles. */
+
+static TSS_RESULT check_tpm(TSS_HTPM hTPM, TSS_HKEY hKey)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  int bad = !get_tpm(hTPM, &ctx) || (hKey && !get(hKey, KIND_KEY));
+  pthread_mutex_unlock(&lock);
+  return bad ? TSS_E_INVALID_HANDLE : TSS_SUCCESS;
+}
+
+TSS_RESULT Tspi_TPM_CreateEndorsementKey(TSS_HTPM hTPM,
+					 TSS_HKEY hKey,
+					 TSS_VALIDATION *pValidationData)
+{
+  return check_tpm(hTPM, hKey);
+}
+
+TSS_RESULT Tspi_TPM_GetPubEndorsementKey(TSS_HTPM hTPM,
+					 TSS_BOOL fOwnerAuthorized,
+					 TSS_VALIDATION *pValidationData,
+					 TSS_HKEY *phEndorsementPubKey)
+{
+  pthread_mutex_lock(&lock);
+  TSS_RESULT rc = TSS_SUCCESS;
+  struct object *obj = get(hTPM, KIND_TPM);
+  if (!obj)
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!(*phEndorsementPubKey = new_object(obj->hContext, KIND_KEY)))
+    rc = TSS_E_OUTOFMEMORY;
+  else
+    objects[*phEndorsementPubKey - 1]->u.key.flags = TSS_KEY_TYPE_LEGACY;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+TSS_RESULT Tspi_TPM_TakeOwnership(TSS_HTPM hTPM,
+				  TSS_HKEY hKeySRK,
+				  TSS_HKEY hEndorsementPubKey)
+{
+  return check_tpm(hTPM, hKeySRK);
+}
+
+/* Makes the identity key.  As there is no privacy CA, the request
+   returned is just the TPM_PUBKEY of the new key. */
+TSS_RESULT Tspi_TPM_CollateIdentityRequest(TSS_HTPM hTPM,
+					   TSS_HKEY hKeySRK,
+					   TSS_HKEY hCAPubKey,
+					   UINT32 ulIdentityLabelLength,
+					   BYTE *rgbIdentityLabelData,
+					   TSS_HKEY hIdentityKey,
+					   TSS_ALGORITHM_ID algID,
+					   UINT32 *pulTCPAIdentityReqLength,
+					   BYTE **prgbTCPAIdentityReq)
+{
+  pthread_mutex_lock(&lock);
+  struct context *ctx;
+  struct tpm *tpm = get_tpm(hTPM, &ctx);
+  struct object *key = get(hIdentityKey, KIND_KEY);
+  if (key)
+    key->u.key.flags = (key->u.key.flags & ~TSS_KEY_TYPE_BITMASK)
+      | TSS_KEY_TYPE_IDENTITY;
+  pthread_mutex_unlock(&lock);
+  if (!tpm || !key)
+    return TSS_E_INVALID_HANDLE;
+
+  TSS_RESULT rc = create_key(hIdentityKey, tpm);
+  if (rc != TSS_SUCCESS)
+    return rc;
+
+  pthread_mutex_lock(&lock);
+  BYTE *blob = NULL;
+  UINT32 blobLen;
+  if (!(key = get(hIdentityKey, KIND_KEY)))
+    rc = TSS_E_INVALID_HANDLE;
+  else if (!(blob = key_blob(&key->u.key, 1, &blobLen)))
+    rc = TSS_E_OUTOFMEMORY;
+  else
+    rc = give_copy(hTPM, KIND_TPM, blob, blobLen,
+		   pulTCPAIdentityReqLength, prgbTCPAIdentityReq);
+  free(blob);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/* DER encoding of TSS blobs, as a sequence of the structure version,
+   the blob type, the blob length, and the blob as an octet string. */
+
+static UINT32 der_length(BYTE *p, UINT32 len)
+{
+  if (len < 0x80) {
+    if (p)
+      p[0] = len;
+    return 1;
+  }
+  UINT32 n = len < 0x100 ? 1 : len < 0x10000 ? 2 : len < 0x1000000 ? 3 : 4;
+  if (p) {
+    UINT32 i;
+    p[0] = 0x80 | n;
+    for (i = 0; i < n; i++)
+      p[n - i] = len >> 8 * i;
+  }
+  return n + 1;
+}
+
+static UINT32 der_integer(BYTE *p, UINT32 v)
+{
+  BYTE bytes[5];
+  UINT32 n = 0;
+  do {
+    bytes[n++] = v;
+    v >>= 8;
+  } while (v);
+  if (bytes[n - 1] & 0x80)
+    bytes[n++] = 0;
+  if (p) {
+    UINT32 i;
+    p[0] = 0x02;
+    p[1] = n;
+    for (i = 0; i < n; i++)
+      p[2 + i] = bytes[n - 1 - i];
+  }
+  return 2 + n;
+}
+
+static UINT32 der_blob(BYTE *p, UINT32 rawBlobSize, BYTE *rawBlob,
+		       UINT32 blobType)
+{
+  UINT32 body = der_integer(NULL, TSS_BLOB_STRUCT_VERSION)
+    + der_integer(NULL, blobType) + der_integer(NULL, rawBlobSize)
+    + 1 + der_length(NULL, rawBlobSize) + rawBlobSize;
+  UINT32 n = 1 + der_length(NULL, body) + body;
+  if (p) {
+    *p++ = 0x30;
+    p += der_length(p, body);
+    p += der_integer(p, TSS_BLOB_STRUCT_VERSION);
+    p += der_integer(p, blobType);
+    p += der_integer(p, rawBlobSize);
+    *p++ = 0x04;
+    p += der_length(p, rawBlobSize);
+    memcpy(p, rawBlob, rawBlobSize);
+  }
+  return n;
+}
+
+TSS_RESULT Tspi_EncodeDER_TssBlob(UINT32 rawBlobSize,
+				  BYTE *rawBlob,
+				  UINT32 blobType,
+				  UINT32 *derBlobSize,
+				  BYTE *derBlob)
+{
+  UINT32 n = der_blob(NULL, rawBlobSize, rawBlob, blobType);
+  if (*derBlobSize == 0) {	/* Just the size */
+    *derBlobSize = n;
+    return TSS_SUCCESS;
+  }
+  if (*derBlobSize < n)
+    return TSS_E_BAD_PARAMETER;
+  der_blob(derBlob, rawBlobSize, rawBlob, blobType);
+  *derBlobSize = n;
+  return TSS_SUCCESS;
+}
+
+static int ber_length(struct reader *r, UINT32 *len)
+{
+  const BYTE *p = unload(r, 1);
+  if (!p)
+    return 1;
+  if (*p < 0x80) {
+    *len = *p;
+    return 0;
+  }
+  UINT32 n = *p & 0x7f;
+  if (n == 0 || n > 4 || !(p = unload(r, n)))
+    return 1;
+  *len = 0;
+  while (n--)
+    *len = *len << 8 | *p++;
+  return 0;
+}
+
+static int ber_integer(struct reader *r, UINT32 *v)
+{
+  const BYTE *p = unload(r, 1);
+  UINT32 len;
+  if (!p || *p != 0x02 || ber_length(r, &len) || len == 0 || len > 5
+      || !(p = unload(r, len)))
+    return 1;
+  *v = 0;
+  while (len--)
+    *v = *v << 8 | *p++;
+  return 0;
+}
+
+TSS_RESULT Tspi_DecodeBER_TssBlob(UINT32 berBlobSize,
+				  BYTE *berBlob,
+				  UINT32 *blobType,
+				  UINT32 *rawBlobSize,
+				  BYTE *rawBlob)
+{
+  struct reader r = { berBlob, berBlobSize, 0 };
+  const BYTE *p = unload(&r, 1);
+  UINT32 len, version, size;
+  if (!p || *p != 0x30 || ber_length(&r, &len) || len > r.left
+      || ber_integer(&r, &version) || ber_integer(&r, blobType)
+      || ber_integer(&r, &size) || !(p = unload(&r, 1)) || *p != 0x04
+      || ber_length(&r, &len) || len != size || !(p = unload(&r, len)))
+    return TSS_E_BAD_PARAMETER;
+  if (*rawBlobSize < len)
+    return TSS_E_BAD_PARAMETER;
+  memcpy(rawBlob, p, len);
+  *rawBlobSize = len;
+  return TSS_SUCCESS;
+}
+
+#if defined HAVE_TROUSERS_TROUSERS_H
+
+/* The TrouSerS extensions used by tpm_updatepcrhash. */
+
+#include <trousers/trousers.h>
+
+char *Trspi_Error_String(TSS_RESULT rc)
+{
+  return NULL;
+}
+
+TSS_RESULT Trspi_HashInit(Trspi_HashCtx *ctx, UINT32 HashType)
+{
+  if (HashType != TSS_HASH_SHA1)
+    return TSS_E_HASH_INVALID_ALG;
+  if (!(ctx->ctx = malloc(sizeof(SHA_CTX))))
+    return TSS_E_OUTOFMEMORY;
+  SHA1_Init(ctx->ctx);
+  return TSS_SUCCESS;
+}
+
+TSS_RESULT Trspi_HashUpdate(Trspi_HashCtx *ctx, UINT32 size, BYTE *data)
+{
+  if (!ctx->ctx)
+    return TSS_E_INTERNAL_ERROR;
+  SHA1_Update(ctx->ctx, data, size);
+  return TSS_SUCCESS;
+}
+
+TSS_RESULT Trspi_HashFinal(Trspi_HashCtx *ctx, BYTE *digest)
+{
+  if (!ctx->ctx)
+    return TSS_E_INTERNAL_ERROR;
+  SHA1_Final(digest, ctx->ctx);
+  free(ctx->ctx);
+  ctx->ctx = NULL;
+  return TSS_SUCCESS;
+}
+
+TSS_RESULT Trspi_Hash_UINT32(Trspi_HashCtx *ctx, UINT32 i)
+{
+  BYTE buf[4];
+  BYTE *p = buf;
+  load_uint32(&p, i);
+  return Trspi_HashUpdate(ctx, sizeof buf, buf);
+}
+
+TSS_RESULT Trspi_Hash_PCR_SELECTION(Trspi_HashCtx *ctx,
+				    TPM_PCR_SELECTION *pcr)
+{
+  BYTE buf[2];
+  BYTE *p = buf;
+  load_uint16(&p, pcr->sizeOfSelect);
+  TSS_RESULT rc = Trspi_HashUpdate(ctx, sizeof buf, buf);
+  if (rc == TSS_SUCCESS)
+    rc = Trspi_HashUpdate(ctx, pcr->sizeOfSelect, pcr->pcrSelect);
+  return rc;
+}
+
+void Trspi_UnloadBlob_NONCE(UINT64 *offset, BYTE *blob, TPM_NONCE *n)
+{
+  if (n)
+    memcpy(n->nonce, blob + *offset, sizeof n->nonce);
+  *offset += sizeof(TPM_NONCE);
+}
+
+TSS_RESULT Trspi_UnloadBlob_PCR_INFO_SHORT(UINT64 *offset, BYTE *blob,
+					   TPM_PCR_INFO_SHORT *pcr)
+{
+  BYTE *p = blob + *offset;
+  UINT16 size = p[0] << 8 | p[1];
+  p += 2;
+  if (pcr) {
+    pcr->pcrSelection.sizeOfSelect = size;
+    pcr->pcrSelection.pcrSelect = malloc(size ? size : 1);
+    if (!pcr->pcrSelection.pcrSelect)
+      return TSS_E_OUTOFMEMORY;
+    memcpy(pcr->pcrSelection.pcrSelect, p, size);
+    pcr->localityAtRelease = p[size];
+    memcpy(&pcr->digestAtRelease, p + size + 1,
+	   sizeof pcr->digestAtRelease);
+  }
+  *offset += 2 + size + 1 + sizeof pcr->digestAtRelease;
+  return TSS_SUCCESS;
+}
+
+void Trspi_LoadBlob_PCR_INFO_SHORT(UINT64 *offset, BYTE *blob,
+				   TPM_PCR_INFO_SHORT *pcr)
+{
+  BYTE *p = blob + *offset;
+  load_uint16(&p, pcr->pcrSelection.sizeOfSelect);
+  load_bytes(&p, pcr->pcrSelection.pcrSelect,
+	     pcr->pcrSelection.sizeOfSelect);
+  load_bytes(&p, &pcr->localityAtRelease, 1);
+  load_bytes(&p, (BYTE *)&pcr->digestAtRelease,
+	     sizeof pcr->digestAtRelease);
+  *offset = p - blob;
+}
+
+#endif
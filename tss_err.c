@@ -161,6 +161,7 @@ const char *tss_result(TSS_RESULT result)
 
 int tss_err(TSS_RESULT rc, const char *msg)
 {
+  trace_error(rc, msg);
   const char *result = tss_result(rc);
   if (result)
     fprintf(stderr, "Error while %s. Error code: %s\n", msg, result);
@@ -168,3 +169,16 @@ int tss_err(TSS_RESULT rc, const char *msg)
     fprintf(stderr, "Error while %s. Error code: 0x%x\n", msg, rc);
   return 1;
 }
+
+/* Says whether a result means the connection to the TSS core
+   services was lost, so that reconnecting may help. */
+int tss_connection_lost(TSS_RESULT rc)
+{
+  switch (ERROR_CODE(rc)) {
+  case TSS_E_COMM_FAILURE:
+  case TSS_E_CONNECTION_BROKEN:
+    return 1;
+  default:
+    return 0;
+  }
+}
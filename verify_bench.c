@@ -0,0 +1,229 @@
+/*
+ * Measure the throughput of a verification pool.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+
+#if defined HAVE_OPENSSL_RSA_LIB && defined HAVE_PTHREAD_H
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/bn.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#define NQUOTES 64		/* Distinct signed quotes */
+#define INFOSIZE 52		/* TPM_QUOTE_INFO2 with three select bytes */
+#define SIGSIZE 256
+#define BUFSIZE (1 << 10)
+
+static BYTE *load_uint32(BYTE *p, UINT32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+/* Makes a DER encoded public key as tpm_mkaik would. */
+static int make_pubkey(RSA *rsa, BYTE *der, UINT32 *derLen)
+{
+  const BIGNUM *n;
+  RSA_get0_key(rsa, &n, NULL, NULL);
+  BYTE blob[BUFSIZE];
+  BYTE *p = load_uint32(blob, TPM_ALG_RSA);
+  *p++ = 0;			/* encScheme */
+  *p++ = TPM_ES_NONE;
+  *p++ = 0;			/* sigScheme */
+  *p++ = TPM_SS_RSASSAPKCS1v15_SHA1;
+  p = load_uint32(p, 12);	/* parmSize */
+  p = load_uint32(p, 2048);	/* keyLength */
+  p = load_uint32(p, 2);	/* numPrimes */
+  p = load_uint32(p, 0);	/* exponentSize */
+  p = load_uint32(p, BN_num_bytes(n));
+  p += BN_bn2bin(n, p);
+  TSS_RESULT rc = Tspi_EncodeDER_TssBlob(p - blob, blob,
+					 TSS_BLOB_TYPE_PUBKEY, derLen, der);
+  if (rc != TSS_SUCCESS)
+    return tss_err(rc, "encoding public key");
+  return 0;
+}
+
+/* Makes signed quote info as TPM_Quote2 would. */
+static void make_quote(RSA *rsa, BYTE *info, BYTE *nonce, BYTE *sig)
+{
+  memset(info, 0, INFOSIZE);
+  info[1] = TPM_TAG_QUOTE_INFO2;
+  memcpy(info + 2, "QUT2", 4);
+  RAND_bytes(nonce, sizeof(TPM_NONCE));
+  memcpy(info + 6, nonce, sizeof(TPM_NONCE));
+  info[27] = 3;			/* sizeOfSelect */
+  info[28] = 0xff;		/* PCRs 0-7 */
+  info[31] = TPM_LOC_ZERO;
+  RAND_bytes(info + 32, TPM_SHA1_160_HASH_LEN);
+  BYTE digest[SHA_DIGEST_LENGTH];
+  SHA1(info, INFOSIZE, digest);
+  unsigned int sigLen;
+  RSA_sign(NID_sha1, digest, sizeof digest, sig, &sigLen, rsa);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long failed;
+
+static void done(struct verify_job *job)
+{
+  if (job->result)
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static int usage(const char *prog)
+{
+  const char text[] =
+    "Usage: %s [-n count] [-t threads] [-hv]\n"
+    "Options:\n"
+    "\t-n count\n"
+    "\t     Verify count quotes for each thread count\n"
+    "\t-t threads\n"
+    "\t     Largest number of threads to measure\n"
+    "\t-h   Display command usage info\n"
+    "\t-v   Display command version info\n"
+    "\n"
+    "Prints quotes verified per second by thread count.\n";
+  fprintf(stderr, text, prog);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long count = 20000;
+  long maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:hv")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      maxthreads = strtol(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'v':
+      fprintf(stderr, "%s\n", PACKAGE_STRING);
+      return 0;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (argc != optind || count == 0)
+    return usage(argv[0]);
+  if (maxthreads < 1)
+    maxthreads = 1;
+
+  RSA *rsa = RSA_new();
+  BIGNUM *e = BN_new();
+  if (!rsa || !e || !BN_set_word(e, RSA_F4)
+      || !RSA_generate_key_ex(rsa, 2048, e, NULL)) {
+    fprintf(stderr, "Cannot generate an RSA key\n");
+    return 1;
+  }
+  BN_free(e);
+
+  BYTE pubkey[BUFSIZE];
+  UINT32 pubkeyLen = sizeof pubkey;
+  if (make_pubkey(rsa, pubkey, &pubkeyLen))
+    return 1;
+
+  static BYTE info[NQUOTES][INFOSIZE];
+  static BYTE nonce[NQUOTES][sizeof(TPM_NONCE)];
+  static BYTE sig[NQUOTES][SIGSIZE];
+  unsigned long i;
+  for (i = 0; i < NQUOTES; i++)
+    make_quote(rsa, info[i], nonce[i], sig[i]);
+  RSA_free(rsa);
+
+  struct verify_job *jobs = malloc(count * sizeof *jobs);
+  BYTE (*hash)[INFOSIZE] = malloc(count * INFOSIZE);
+  if (!jobs || !hash) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("threads\tquotes/s\tspeedup\n");
+  double base = 0;
+  long nthreads = 1;
+  while (nthreads <= maxthreads) {
+    for (i = 0; i < count; i++) {
+      memcpy(hash[i], info[i % NQUOTES], INFOSIZE);
+      memset(hash[i] + 6, 0, sizeof(TPM_NONCE)); /* As provisioned */
+      jobs[i].pubkey = pubkey;
+      jobs[i].pubkeyLen = pubkeyLen;
+      jobs[i].hash = hash[i];
+      jobs[i].hashLen = INFOSIZE;
+      jobs[i].nonce = nonce[i % NQUOTES];
+      jobs[i].nonceLen = sizeof(TPM_NONCE);
+      jobs[i].quote = sig[i % NQUOTES];
+      jobs[i].quoteLen = SIGSIZE;
+    }
+
+    struct verify_pool *pool =
+      verify_pool_new(nthreads, 4 * nthreads, done);
+    if (!pool)
+      return 1;
+    double start = now();
+    for (i = 0; i < count; i++)
+      verify_pool_submit(pool, &jobs[i]);
+    verify_pool_wait(pool);
+    double rate = count / (now() - start);
+    verify_pool_free(pool);
+
+    if (nthreads == 1)
+      base = rate;
+    printf("%ld\t%.0f\t%.2f\n", nthreads, rate, rate / base);
+    fflush(stdout);
+    if (nthreads < maxthreads && 2 * nthreads > maxthreads)
+      nthreads = maxthreads;	/* Always measure maxthreads */
+    else
+      nthreads *= 2;
+  }
+
+  free(jobs);
+  free(hash);
+  if (failed) {
+    fprintf(stderr, "%lu quotes failed to verify\n", failed);
+    return 1;
+  }
+  return 0;
+}
+#else
+int main(void)
+{
+  fprintf(stderr, "Verification benchmark not available.\n");
+  return 1;
+}
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Verify quotes using a pool of worker threads.
+ * Copyright (C) 2010 The MITRE Corporation
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the BSD License as published by the
+ * University of California.
+ */
+
+#if defined HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tss/tspi.h>
+#include "tpm_quote.h"
+
+#if defined HAVE_OPENSSL_RSA_LIB && defined HAVE_PTHREAD_H
+#include <pthread.h>
+#include <semaphore.h>
+#include <openssl/sha.h>
+
+#define AIKCACHESIZE 4096	/* Public keys cached by each worker */
+
+/* A cell in the submission queue.  The sequence number says whether
+   the cell is ready for a producer or a consumer, as in Dmitry
+   Vyukov's bounded multi-producer multi-consumer queue. */
+struct cell {
+  size_t seq;
+  struct verify_job *job;
+};
+
+/* Each worker has its own key cache, so that workers never contend
+   for keys. */
+struct worker {
+  struct verify_pool *pool;
+  pthread_t thread;
+  struct aik_cache *cache;
+};
+
+struct verify_pool {
+  struct cell *cells;
+  size_t mask;			/* Number of cells less one */
+  size_t head;			/* Next cell to dequeue */
+  size_t tail;			/* Next cell to enqueue */
+  sem_t slots;			/* Free cells */
+  sem_t items;			/* Filled cells */
+  verify_done *done;
+  unsigned nworkers;
+  struct worker *workers;
+  size_t pending;		/* Jobs submitted but not completed */
+  pthread_mutex_t lock;		/* Used only to wait for pending jobs */
+  pthread_cond_t idle;
+};
+
+static void enqueue(struct verify_pool *pool, struct verify_job *job)
+{
+  size_t pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    struct cell *cell = &pool->cells[pos & pool->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&pool->tail, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	cell->job = job;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return;
+      }
+    }
+    else			/* Another producer got the cell */
+      pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+  }
+}
+
+static struct verify_job *dequeue(struct verify_pool *pool)
+{
+  size_t pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+  for (;;) {
+    struct cell *cell = &pool->cells[pos & pool->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos + 1) {
+      if (__atomic_compare_exchange_n(&pool->head, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	struct verify_job *job = cell->job;
+	__atomic_store_n(&cell->seq, pos + pool->mask + 1,
+			 __ATOMIC_RELEASE);
+	return job;
+      }
+    }
+    else			/* Another consumer got the cell, or
+				   its producer has yet to fill it */
+      pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+  }
+}
+
+/* Takes the jobs waiting in the queue, up to SHA1_LANES of them, so
+   that their quote info is hashed at once.  Sets stop when a
+   shutdown request is taken, which ends the group. */
+static size_t take(struct verify_pool *pool, struct verify_job **jobs,
+		   int *stop)
+{
+  size_t n = 0;
+  while (sem_wait(&pool->items));
+  do {
+    jobs[n] = dequeue(pool);
+    sem_post(&pool->slots);
+    if (!jobs[n]) {		/* Shutdown request */
+      *stop = 1;
+      break;
+    }
+    n++;
+  } while (n < SHA1_LANES && sem_trywait(&pool->items) == 0);
+  return n;
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct verify_pool *pool = w->pool;
+  int stop = 0;
+  while (!stop) {
+    struct verify_job *jobs[SHA1_LANES];
+    size_t i, n = take(pool, jobs, &stop);
+    struct sha1_msg msgs[SHA1_LANES];
+    BYTE digests[SHA1_LANES][SHA_DIGEST_LENGTH];
+    size_t m = 0;
+    for (i = 0; i < n; i++) {
+      struct verify_job *job = jobs[i];
+      job->result =
+	quote_set_nonce(job->hash, job->hashLen, job->nonce, job->nonceLen);
+      if (!job->result) {
+	msgs[m].data = job->hash;
+	msgs[m].len = job->hashLen;
+	msgs[m].digest = digests[i];
+	m++;
+      }
+    }
+    sha1_multi(msgs, m);
+    for (i = 0; i < n; i++) {
+      struct verify_job *job = jobs[i];
+      struct pubkey *key;
+      if (!job->result)
+	job->result =
+	  !(key = aik_cache_lookup(w->cache, job->pubkey, job->pubkeyLen,
+				   NULL, NULL))
+	  || pubkey_verify_digest(key, digests[i], job->quote, job->quoteLen);
+      if (pool->done)
+	pool->done(job);
+      if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Creates a pool of nworkers threads with a submission queue of at
+   least qsize jobs.  The done function, when not NULL, is called by
+   a worker thread as each job completes. */
+struct verify_pool *verify_pool_new(unsigned nworkers, size_t qsize,
+				    verify_done *done)
+{
+  if (nworkers == 0)
+    nworkers = 1;
+  size_t ncells = 2;		/* Round up to a power of two */
+  while (ncells < qsize || ncells < nworkers)
+    ncells <<= 1;
+
+  struct verify_pool *pool = calloc(1, sizeof *pool);
+  if (!pool)
+    return NULL;
+  pool->cells = calloc(ncells, sizeof *pool->cells);
+  pool->workers = calloc(nworkers, sizeof *pool->workers);
+  if (!pool->cells || !pool->workers) {
+    free(pool->cells);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+  }
+  size_t i;
+  for (i = 0; i < ncells; i++)
+    pool->cells[i].seq = i;
+  pool->mask = ncells - 1;
+  pool->done = done;
+  sem_init(&pool->slots, 0, ncells);
+  sem_init(&pool->items, 0, 0);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  for (i = 0; i < nworkers; i++) {
+    struct worker *w = &pool->workers[i];
+    w->pool = pool;
+    w->cache = aik_cache_new(AIKCACHESIZE);
+    if (!w->cache) {
+      fprintf(stderr, "Out of memory\n");
+      break;
+    }
+    if (pthread_create(&w->thread, NULL, worker_main, w)) {
+      fprintf(stderr, "Cannot create verification thread\n");
+      aik_cache_free(w->cache);
+      break;
+    }
+  }
+  pool->nworkers = i;
+  if (i == 0) {
+    verify_pool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* Queues a job, blocking while the queue is full.  The job's hash is
+   modified in place, and its result is zero when the quote is
+   verified. */
+int verify_pool_submit(struct verify_pool *pool, struct verify_job *job)
+{
+  if (!job)
+    return 1;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  while (sem_wait(&pool->slots));
+  enqueue(pool, job);
+  sem_post(&pool->items);
+  return 0;
+}
+
+/* Waits until every submitted job has completed. */
+void verify_pool_wait(struct verify_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE))
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Loads a directory of public keys into the cache of every worker.
+   Call only while no jobs are pending. */
+int verify_pool_preload(struct verify_pool *pool, const char *dirname)
+{
+  unsigned i;
+  int failed = 0;
+  for (i = 0; i < pool->nworkers && !failed; i++)
+    failed = aik_cache_preload(pool->workers[i].cache, dirname);
+  return failed;
+}
+
+/* Sums the key cache counters of the workers.  Call only while no
+   jobs are pending. */
+void verify_pool_get_stats(struct verify_pool *pool,
+			   struct aik_cache_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+  unsigned i;
+  for (i = 0; i < pool->nworkers; i++) {
+    struct aik_cache_stats s;
+    aik_cache_get_stats(pool->workers[i].cache, &s);
+    stats->hits += s.hits;
+    stats->misses += s.misses;
+    stats->evictions += s.evictions;
+    stats->entries += s.entries;
+  }
+}
+
+/* Completes queued jobs, and then stops the workers. */
+void verify_pool_free(struct verify_pool *pool)
+{
+  if (!pool)
+    return;
+  unsigned i;
+  for (i = 0; i < pool->nworkers; i++) {
+    while (sem_wait(&pool->slots));
+    enqueue(pool, NULL);
+    sem_post(&pool->items);
+  }
+  for (i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    aik_cache_free(pool->workers[i].cache);
+  }
+  sem_destroy(&pool->slots);
+  sem_destroy(&pool->items);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->workers);
+  free(pool->cells);
+  free(pool);
+}
+
+#else
+
+struct verify_pool *verify_pool_new(unsigned nworkers, size_t qsize,
+				    verify_done *done)
+{
+  fprintf(stderr, "Verification threads not available\n");
+  return NULL;			/* Always fail without threads */
+}
+
+int verify_pool_submit(struct verify_pool *pool, struct verify_job *job)
+{
+  return 1;
+}
+
+void verify_pool_wait(struct verify_pool *pool)
+{
+}
+
+int verify_pool_preload(struct verify_pool *pool, const char *dirname)
+{
+  return 1;
+}
+
+void verify_pool_get_stats(struct verify_pool *pool,
+			   struct aik_cache_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+}
+
+void verify_pool_free(struct verify_pool *pool)
+{
+}
+
+#endif